@@ -54,10 +54,10 @@ void madt_init(void)
         log(PANIC, "No MADT was found on this computer!\n");
     }
 
-    madt_lapics	    = malloc(256);
-    madt_ioapics    = malloc(256);
-    madt_isos	    = malloc(256);
-    madt_lapic_nmis = malloc(256);
+    madt_lapics	    = kmalloc(256);
+    madt_ioapics    = kmalloc(256);
+    madt_isos	    = kmalloc(256);
+    madt_lapic_nmis = kmalloc(256);
 
     uint8_t *start = (uint8_t *)&madt->entries;
     size_t end = (size_t)&madt->header + madt->header.length;
@@ -37,9 +37,11 @@
 #include <libk/serial/log.h>
 #include <libk/string/string.h>
 #include <memory/mem.h>
+#include <memory/virtual/ioremap.h>
 #include <tables/isr.h>
 
 static uintptr_t lapic_address;
+static uintptr_t *ioapic_addresses;	// mapped registers of each IOAPIC
 static uint32_t lapic_timer_freq = 0; // TODO: remove
 
 /* utility function prototypes */
@@ -66,15 +68,31 @@ void apic_init(void)
         log(PANIC, "No APIC was found on this computer!\n");
     }
 
-    lapic_address = PHYS_TO_HIGHER_HALF_DATA(madt->lapic_address);
+    lapic_address = (uintptr_t)ioremap(madt->lapic_address, PAGE_SIZE, PAT_UNCACHEABLE);
+    ioapic_addresses = kmalloc(madt_ioapics_i * sizeof(uintptr_t));
+
+    if (!lapic_address || !ioapic_addresses)
+    {
+        log(PANIC, "Failed to map the APIC registers\n");
+    }
+
+    for (size_t i = 0; i < madt_ioapics_i; i++)
+    {
+        ioapic_addresses[i] = (uintptr_t)ioremap(madt_ioapics[i]->ioapic_address, IOWIN + sizeof(uint32_t),
+                              PAT_UNCACHEABLE);
+
+        if (!ioapic_addresses[i])
+        {
+            log(PANIC, "Failed to map the registers of IOAPIC %ld\n", i);
+        }
+    }
 
     pic_disable();
     lapic_enable();
 
     bitmap_t irq_bitmap;
     irq_bitmap.size = 16;
-    irq_bitmap.map = (uint8_t *)malloc(irq_bitmap.size);
-    memset((void *)irq_bitmap.map, 0, irq_bitmap.size);
+    irq_bitmap.map = (uint8_t *)calloc(1, irq_bitmap.size);
 
     for (uint32_t i = 0; i < 16; i++)
     {
@@ -111,8 +129,14 @@ void lapic_signal_eoi(void)
 }
 
 // send an interrupt to another LAPIC by using interprocessor interrupts
-void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) // TODO: test this
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector)
 {
+    // wait until the previous IPI was delivered
+    while (lapic_read_reg(LAPIC_ICR0_REG) & LAPIC_ICR_PENDING_BIT)
+    {
+        asm volatile("pause");
+    }
+
     lapic_write_reg(LAPIC_ICR1_REG, lapic_id << 24);
     lapic_write_reg(LAPIC_ICR0_REG, vector);
 }
@@ -217,7 +241,7 @@ uint32_t lapic_timer_calibrate(uint32_t us)
 // read data from a IOAPIC register - IOAPIC is custom
 uint32_t ioapic_read_reg(size_t ioapic_i, uint8_t reg)
 {
-    size_t ioapic_i_addr = PHYS_TO_HIGHER_HALF_DATA(madt_ioapics[ioapic_i]->ioapic_address);
+    uintptr_t ioapic_i_addr = ioapic_addresses[ioapic_i];
 
     *((volatile uint32_t *)(ioapic_i_addr + IOREGSEL)) = reg;
     return *((volatile uint32_t *)(ioapic_i_addr + IOWIN));
@@ -226,7 +250,7 @@ uint32_t ioapic_read_reg(size_t ioapic_i, uint8_t reg)
 // write data to a IOAPIC register - IOAPIC is custom
 void ioapic_write_reg(size_t ioapic_i, uint8_t reg, uint32_t data)
 {
-    size_t ioapic_i_addr = PHYS_TO_HIGHER_HALF_DATA(madt_ioapics[ioapic_i]->ioapic_address);
+    uintptr_t ioapic_i_addr = ioapic_addresses[ioapic_i];
 
     *((volatile uint32_t *)(ioapic_i_addr + IOREGSEL)) = reg;
     *((volatile uint32_t *)(ioapic_i_addr + IOWIN)) = data;
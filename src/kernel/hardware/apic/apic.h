@@ -33,6 +33,7 @@
 #define LAPIC_TIMER_DIV_REG	0x3E0
 
 #define LAPIC_ENABLE_BIT	(1 << 8)
+#define LAPIC_ICR_PENDING_BIT	(1 << 12)
 #define LAPIC_TIMER_DISABLE_BIT	(1 << 16)
 
 #define IOREGSEL    0
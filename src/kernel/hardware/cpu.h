@@ -33,14 +33,28 @@
 #include <libk/lock/spinlock.h>
 #include <libk/malloc/malloc.h>
 #include <libk/printf/printf.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/tlb.h>
 #include <utility/utils.h>
 
 typedef struct
 {
-    uint64_t	cpu_number;
+    uint64_t	cpu_number; // must stay first, this_cpu() reads it through GS
     uint32_t	lapic_id;
     uint32_t	lapic_timer_freq;
     tss_t	tss;
+
+    void	(*volatile call_function)(void *argument); // see smp_call()
+    void	*call_argument;
+
+    int64_t	mem_tag_pages[MEM_TAG_COUNT]; // see mem_tag_account()
+    int64_t	heap_profile_countdown; // see heap_profile_account()
+
+    struct vmm_space	*space;		// loaded address space, see vmm_switch_space()
+    tlb_shootdown_t	tlb_shootdown;	// request of this CPU to the others
+    uint64_t		tlb_requests;	// CPUs with a request for this CPU (bit = cpu_number)
+    uint16_t		next_pcid;	// see vmm_switch_space()
+    uint64_t		pcid_generation;
 } cpu_local_t;
 
 typedef struct
@@ -85,7 +99,8 @@ typedef struct
 enum
 {
     CPUID_GET_VENDOR_STRING,
-    CPUID_GET_FEATURES
+    CPUID_GET_FEATURES,
+    CPUID_GET_EXTENDED_FEATURES = 0x80000001
 };
 
 enum
@@ -151,7 +166,9 @@ enum
     CPUID_FEAT_EDX_HTT		= 1 << 28, 
     CPUID_FEAT_EDX_TM		= 1 << 29, 
     CPUID_FEAT_EDX_IA64		= 1 << 30,
-    CPUID_FEAT_EDX_PBE		= 1 << 31
+    CPUID_FEAT_EDX_PBE		= 1 << 31,
+
+    CPUID_FEAT_EXT_EDX_PDPE1GB	= 1 << 26
 };
 
 typedef enum
@@ -200,7 +217,7 @@ static inline char *cpu_get_vendor_id_string(void)
 
     cpuid(regs);
 
-    char *vendor_string = malloc(13);
+    char *vendor_string = kmalloc(13);
     snprintf(vendor_string, 13, "%.4s%.4s%.4s",
 	    (char *)&regs->ebx, (char *)&regs->edx, (char *)&regs->ecx);
 
@@ -225,6 +242,37 @@ static inline void enable_pat(void)
     asm_wrmsr(0x277, custom_pat_config);
 }
 
+// check whether process-context identifiers are supported
+static inline bool cpu_supports_pcid(void)
+{
+    cpuid_registers_t regs = { .leaf = CPUID_GET_FEATURES };
+
+    return cpuid(&regs) && (regs.ecx & CPUID_FEAT_ECX_PCID);
+}
+
+// check whether global pages are supported
+static inline bool cpu_supports_global_pages(void)
+{
+    cpuid_registers_t regs = { .leaf = CPUID_GET_FEATURES };
+
+    return cpuid(&regs) && (regs.edx & CPUID_FEAT_EDX_PGE);
+}
+
+// enable process-context identifiers, so that TLB entries are tagged with the
+// PCID in CR3 and survive address space switches - CR3 must hold PCID 0 at
+// this point
+static inline void enable_pcid(void)
+{
+    asm_write_cr(4, asm_read_cr(4) | (1 << 17));
+}
+
+// enable global pages, whose TLB entries survive CR3 loads and are shared by
+// all PCIDs
+static inline void enable_global_pages(void)
+{
+    asm_write_cr(4, asm_read_cr(4) | (1 << 7));
+}
+
 // enable SSE/SSE2 (streaming SIMD (single instruction multiple data) extenstion)
 // to add additional 128-bit registers and instructions to work with 16 byte data
 static inline void enable_sse(void)
@@ -29,6 +29,7 @@
 #include <hardware/acpi/acpi.h>
 #include <libk/serial/log.h>
 #include <memory/mem.h>
+#include <memory/virtual/ioremap.h>
 
 static volatile hpet_t *hpet;
 static volatile hpet_regs_t *hpet_regs;
@@ -39,7 +40,12 @@ static volatile hpet_regs_t *hpet_regs;
 void hpet_init(void)
 {
     hpet = (hpet_t *)(uintptr_t)acpi_find_sdt("HPET");
-    hpet_regs = (hpet_regs_t *)(PHYS_TO_HIGHER_HALF_DATA(hpet->address));
+    hpet_regs = ioremap(hpet->address, sizeof(hpet_regs_t), PAT_UNCACHEABLE);
+
+    if (!hpet_regs)
+    {
+        log(PANIC, "Failed to map the HPET registers\n");
+    }
 
     hpet_regs->counter_value = 0;
     hpet_regs->general_config = 1;
@@ -0,0 +1,164 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    Access to the PCI configuration space through the legacy IO ports
+    (configuration mechanism #1). The buses are enumerated once and the
+    functions found are kept, so drivers can look their device up by its
+    vendor and device id.
+
+*/
+
+#include <hardware/pci/pci.h>
+#include <libk/serial/log.h>
+#include <utility/utils.h>
+
+static pci_device_t devices[PCI_MAX_DEVICES];
+static size_t device_count = 0;
+
+/* utility function prototypes */
+
+uint32_t pci_read_config_address(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset);
+void pci_add_function(uint8_t bus, uint8_t slot, uint8_t function);
+
+/* core functions */
+
+// look at every slot of every bus and keep the functions which exist
+void pci_init(void)
+{
+    for (size_t bus = 0; bus < 256; bus++)
+    {
+        for (uint8_t slot = 0; slot < 32; slot++)
+        {
+            if ((pci_read_config_address(bus, slot, 0, PCI_VENDOR_ID_REG) & 0xFFFF) == 0xFFFF)
+            {
+                continue;
+            }
+
+            pci_add_function(bus, slot, 0);
+
+            // the other functions only exist on multi-function devices
+            if (!((pci_read_config_address(bus, slot, 0, PCI_HEADER_TYPE_REG) >> 16) & PCI_HEADER_MULTI_FUNCTION))
+            {
+                continue;
+            }
+
+            for (uint8_t function = 1; function < 8; function++)
+            {
+                if ((pci_read_config_address(bus, slot, function, PCI_VENDOR_ID_REG) & 0xFFFF) != 0xFFFF)
+                {
+                    pci_add_function(bus, slot, function);
+                }
+            }
+        }
+    }
+
+    log(INFO, "PCI initialized with %llu functions\n", device_count);
+}
+
+// return the first function with the ids, NULL if there is none
+pci_device_t *pci_find_device(uint16_t vendor_id, uint16_t device_id)
+{
+    for (size_t i = 0; i < device_count; i++)
+    {
+        if (devices[i].vendor_id == vendor_id && devices[i].device_id == device_id)
+        {
+            return &devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+// read the double word of the configuration space at offset (aligned down)
+uint32_t pci_read_config(pci_device_t *device, uint8_t offset)
+{
+    return pci_read_config_address(device->bus, device->slot, device->function, offset);
+}
+
+// write the double word of the configuration space at offset (aligned down)
+void pci_write_config(pci_device_t *device, uint8_t offset, uint32_t value)
+{
+    asm_io_outl(PCI_CONFIG_ADDRESS, (1U << 31) | ((uint32_t)device->bus << 16) | ((uint32_t)device->slot << 11)
+                | ((uint32_t)device->function << 8) | (offset & 0xFC));
+    asm_io_outl(PCI_CONFIG_DATA, value);
+}
+
+// return the port base of an IO space BAR, 0 if the BAR maps memory
+uint16_t pci_get_io_bar(pci_device_t *device, size_t index)
+{
+    uint32_t bar = pci_read_config(device, PCI_BAR0_REG + index * 4);
+
+    if (!(bar & PCI_BAR_IO_SPACE))
+    {
+        return 0;
+    }
+
+    return bar & 0xFFFC;
+}
+
+// let the function decode its IO ports and access memory on its own (DMA)
+void pci_enable_device(pci_device_t *device)
+{
+    uint32_t command = pci_read_config(device, PCI_COMMAND_REG);
+
+    // the upper half is the status register, its bits are cleared by writing ones
+    command = (command & 0xFFFF) | PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER;
+
+    pci_write_config(device, PCI_COMMAND_REG, command);
+}
+
+/* utility functions */
+
+// read a double word of the configuration space of a function
+uint32_t pci_read_config_address(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset)
+{
+    asm_io_outl(PCI_CONFIG_ADDRESS, (1U << 31) | ((uint32_t)bus << 16) | ((uint32_t)slot << 11)
+                | ((uint32_t)function << 8) | (offset & 0xFC));
+
+    return asm_io_inl(PCI_CONFIG_DATA);
+}
+
+// remember a function which exists
+void pci_add_function(uint8_t bus, uint8_t slot, uint8_t function)
+{
+    if (device_count == PCI_MAX_DEVICES)
+    {
+        log(WARNING, "PCI function %.2x:%.2x.%x ignored, only %d are kept\n", bus, slot, function,
+            PCI_MAX_DEVICES);
+
+        return;
+    }
+
+    pci_device_t *device = &devices[device_count++];
+    uint32_t ids = pci_read_config_address(bus, slot, function, PCI_VENDOR_ID_REG);
+    uint32_t class = pci_read_config_address(bus, slot, function, PCI_CLASS_REG);
+
+    device->bus = bus;
+    device->slot = slot;
+    device->function = function;
+    device->vendor_id = ids & 0xFFFF;
+    device->device_id = ids >> 16;
+    device->class_code = class >> 24;
+    device->subclass = (class >> 16) & 0xFF;
+
+    log(INFO, "PCI %.2x:%.2x.%x vendor=0x%.4x device=0x%.4x class=0x%.2x:0x%.2x\n", bus, slot, function,
+        device->vendor_id, device->device_id, device->class_code, device->subclass);
+}
@@ -0,0 +1,60 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA	    0xCFC
+
+#define PCI_VENDOR_ID_REG   0x00
+#define PCI_COMMAND_REG	    0x04
+#define PCI_CLASS_REG	    0x08
+#define PCI_HEADER_TYPE_REG 0x0C
+#define PCI_BAR0_REG	    0x10
+
+#define PCI_COMMAND_IO_SPACE	(1 << 0)
+#define PCI_COMMAND_BUS_MASTER	(1 << 2)
+#define PCI_HEADER_MULTI_FUNCTION (1 << 7)
+#define PCI_BAR_IO_SPACE	(1 << 0)
+
+#define PCI_MAX_DEVICES	    64
+
+typedef struct
+{
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint16_t vendor_id;
+    uint16_t device_id;
+} pci_device_t;
+
+void pci_init(void);
+pci_device_t *pci_find_device(uint16_t vendor_id, uint16_t device_id);
+uint32_t pci_read_config(pci_device_t *device, uint8_t offset);
+void pci_write_config(pci_device_t *device, uint8_t offset, uint32_t value);
+uint16_t pci_get_io_bar(pci_device_t *device, size_t index);
+void pci_enable_device(pci_device_t *device);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    Driver for a virtio block device through the legacy PCI interface (what
+    QEMU offers with disable-modern=on). There is one request queue, a
+    request is a chain of descriptors: the header, one descriptor for every
+    frame which is transferred and the status byte the device writes.
+    Requests are synchronous: the device is notified and the used ring is
+    polled until the request comes back, so no interrupt is needed (they
+    are turned off for the queue). One request is in flight at a time, the
+    device lock serializes them.
+    Frames are physical addresses, the device reads and writes them directly.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/pci/pci.h>
+#include <hardware/virtio/virtio_blk.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <utility/utils.h>
+
+static spinlock_t device_lock;
+static uint16_t io_base = 0;
+static uint64_t capacity = 0;
+static size_t max_segments = 0;
+
+static uint16_t queue_size;
+static vring_desc_t *descs;
+static vring_avail_t *avail;
+static volatile vring_used_t *used;
+static uint16_t last_used_index = 0;
+
+// the header and the status byte of the request in flight
+static virtio_blk_request_header_t *request_header;
+static volatile uint8_t *request_status;
+static uint64_t request_page;
+
+/* utility function prototypes */
+
+bool virtio_blk_setup_queue(void);
+bool virtio_blk_transfer(uint32_t type, uint64_t sector, const uint64_t *frames, size_t count);
+
+/* core functions */
+
+// find the device, negotiate the features and set its queue up - false if
+// there is no (usable) device
+bool virtio_blk_init(void)
+{
+    pci_device_t *device = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_DEVICE_ID);
+
+    if (!device)
+    {
+        log(INFO, "No virtio block device found\n");
+
+        return false;
+    }
+
+    io_base = pci_get_io_bar(device, 0);
+
+    if (!io_base)
+    {
+        log(WARNING, "Virtio block device has no legacy IO BAR\n");
+
+        return false;
+    }
+
+    pci_enable_device(device);
+
+    // reset, then tell the device it was found and there is a driver
+    asm_io_outb(io_base + VIRTIO_PCI_STATUS, 0);
+    asm_io_outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    asm_io_outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = asm_io_inl(io_base + VIRTIO_PCI_DEVICE_FEATURES);
+
+    if (features & VIRTIO_BLK_F_RO)
+    {
+        log(WARNING, "Virtio block device is read-only\n");
+        asm_io_outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+
+        return false;
+    }
+
+    asm_io_outl(io_base + VIRTIO_PCI_GUEST_FEATURES, features & VIRTIO_BLK_F_SEG_MAX);
+
+    capacity = asm_io_inl(io_base + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY)
+               | (uint64_t)asm_io_inl(io_base + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32;
+
+    if (!virtio_blk_setup_queue())
+    {
+        asm_io_outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        capacity = 0;
+
+        return false;
+    }
+
+    // the header and the status byte take two descriptors
+    max_segments = queue_size - 2 < VIRTIO_BLK_MAX_SEGMENTS ? queue_size - 2 : VIRTIO_BLK_MAX_SEGMENTS;
+
+    if (features & VIRTIO_BLK_F_SEG_MAX)
+    {
+        size_t seg_max = asm_io_inl(io_base + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_SEG_MAX);
+
+        if (seg_max && seg_max < max_segments)
+        {
+            max_segments = seg_max;
+        }
+    }
+
+    asm_io_outb(io_base + VIRTIO_PCI_STATUS,
+                VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    log(INFO, "Virtio block device initialized: %llu MiB, queue size %d, %llu segments per request\n",
+        capacity * VIRTIO_BLK_SECTOR_SIZE / (1024 * 1024), queue_size, max_segments);
+
+    return true;
+}
+
+// return the size of the device in sectors, 0 if there is none
+uint64_t virtio_blk_get_capacity(void)
+{
+    return capacity;
+}
+
+// return how many pages one read or write transfers at most
+size_t virtio_blk_get_max_segments(void)
+{
+    return max_segments;
+}
+
+// read count pages from sector on into the frames (with one request) - false
+// on an IO error
+bool virtio_blk_read(uint64_t sector, const uint64_t *frames, size_t count)
+{
+    return virtio_blk_transfer(VIRTIO_BLK_T_IN, sector, frames, count);
+}
+
+// write the frames to count pages from sector on (with one request) - false
+// on an IO error
+bool virtio_blk_write(uint64_t sector, const uint64_t *frames, size_t count)
+{
+    return virtio_blk_transfer(VIRTIO_BLK_T_OUT, sector, frames, count);
+}
+
+/* utility functions */
+
+// allocate the ring of queue 0 in the legacy layout (descriptors, available
+// ring, used ring on the next aligned page) and hand it to the device
+bool virtio_blk_setup_queue(void)
+{
+    asm_io_outw(io_base + VIRTIO_PCI_QUEUE_SELECT, 0);
+    queue_size = asm_io_inw(io_base + VIRTIO_PCI_QUEUE_SIZE);
+
+    if (queue_size < 3)
+    {
+        log(WARNING, "Virtio block device has no usable queue (size %d)\n", queue_size);
+
+        return false;
+    }
+
+    size_t used_offset = ALIGN_UP(sizeof(vring_desc_t) * queue_size + sizeof(vring_avail_t)
+                                  + sizeof(uint16_t) * (queue_size + 1), VRING_ALIGN);
+    size_t ring_size = used_offset + sizeof(vring_used_t) + sizeof(vring_used_elem_t) * queue_size
+                       + sizeof(uint16_t);
+    void *ring = pmm_allocz(ALIGN_UP(ring_size, PAGE_SIZE) / PAGE_SIZE, MEM_TAG_KERNEL);
+    void *page = pmm_allocz(1, MEM_TAG_KERNEL);
+
+    if (!ring || !page)
+    {
+        log(WARNING, "Out of memory for the virtio block queue\n");
+
+        return false;
+    }
+
+    uint8_t *ring_virt = (uint8_t *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)ring);
+
+    descs = (vring_desc_t *)ring_virt;
+    avail = (vring_avail_t *)(ring_virt + sizeof(vring_desc_t) * queue_size);
+    used = (vring_used_t *)(ring_virt + used_offset);
+
+    // completions are polled
+    avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+
+    request_page = (uint64_t)page;
+    request_header = (virtio_blk_request_header_t *)PHYS_TO_HIGHER_HALF_DATA(request_page);
+    request_status = (volatile uint8_t *)(PHYS_TO_HIGHER_HALF_DATA(request_page)
+                                          + sizeof(virtio_blk_request_header_t));
+
+    asm_io_outl(io_base + VIRTIO_PCI_QUEUE_PFN, (uint64_t)ring / PAGE_SIZE);
+
+    return true;
+}
+
+// build the descriptor chain of a request, pass it to the device and wait
+// until it is done
+bool virtio_blk_transfer(uint32_t type, uint64_t sector, const uint64_t *frames, size_t count)
+{
+    if (count == 0 || count > max_segments || sector + count * (PAGE_SIZE / VIRTIO_BLK_SECTOR_SIZE) > capacity)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&device_lock);
+
+    request_header->type = type;
+    request_header->reserved = 0;
+    request_header->sector = sector;
+    *request_status = 0xFF;
+
+    descs[0].address = request_page;
+    descs[0].length = sizeof(virtio_blk_request_header_t);
+    descs[0].flags = VRING_DESC_F_NEXT;
+    descs[0].next = 1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        descs[i + 1].address = frames[i];
+        descs[i + 1].length = PAGE_SIZE;
+        descs[i + 1].flags = VRING_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0);
+        descs[i + 1].next = i + 2;
+    }
+
+    descs[count + 1].address = request_page + sizeof(virtio_blk_request_header_t);
+    descs[count + 1].length = 1;
+    descs[count + 1].flags = VRING_DESC_F_WRITE;
+    descs[count + 1].next = 0;
+
+    // the chain has to be visible before the index which publishes it
+    avail->ring[avail->index % queue_size] = 0;
+    __atomic_store_n(&avail->index, avail->index + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    asm_io_outw(io_base + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+
+    while (__atomic_load_n(&used->index, __ATOMIC_ACQUIRE) == last_used_index)
+    {
+        asm volatile("pause");
+    }
+
+    last_used_index++;
+
+    bool success = *request_status == VIRTIO_BLK_S_OK;
+
+    spinlock_release(&device_lock);
+
+    if (!success)
+    {
+        log(WARNING, "Virtio block %s of %llu pages at sector %llu failed (status %d)\n",
+            type == VIRTIO_BLK_T_IN ? "read" : "write", count, sector, *request_status);
+    }
+
+    return success;
+}
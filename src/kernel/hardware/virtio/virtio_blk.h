@@ -0,0 +1,104 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VIRTIO_VENDOR_ID	    0x1AF4
+#define VIRTIO_BLK_LEGACY_DEVICE_ID 0x1001
+
+// registers of the legacy interface, relative to the IO BAR
+#define VIRTIO_PCI_DEVICE_FEATURES  0x00
+#define VIRTIO_PCI_GUEST_FEATURES   0x04
+#define VIRTIO_PCI_QUEUE_PFN	    0x08
+#define VIRTIO_PCI_QUEUE_SIZE	    0x0C
+#define VIRTIO_PCI_QUEUE_SELECT	    0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY	    0x10
+#define VIRTIO_PCI_STATUS	    0x12
+#define VIRTIO_PCI_ISR		    0x13
+#define VIRTIO_PCI_CONFIG	    0x14    // device specific, as long as MSI-X is off
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   (1 << 0)
+#define VIRTIO_STATUS_DRIVER	    (1 << 1)
+#define VIRTIO_STATUS_DRIVER_OK	    (1 << 2)
+#define VIRTIO_STATUS_FAILED	    (1 << 7)
+
+#define VIRTIO_BLK_F_SEG_MAX	    (1 << 2)
+#define VIRTIO_BLK_F_RO		    (1 << 5)
+
+#define VIRTIO_BLK_CONFIG_CAPACITY  0x00    // in sectors
+#define VIRTIO_BLK_CONFIG_SEG_MAX   0x0C
+
+#define VIRTIO_BLK_T_IN		    0
+#define VIRTIO_BLK_T_OUT	    1
+#define VIRTIO_BLK_S_OK		    0
+
+#define VRING_DESC_F_NEXT	    (1 << 0)
+#define VRING_DESC_F_WRITE	    (1 << 1)   // written by the device
+#define VRING_AVAIL_F_NO_INTERRUPT  (1 << 0)
+#define VRING_ALIGN		    4096
+
+#define VIRTIO_BLK_SECTOR_SIZE	    512
+#define VIRTIO_BLK_MAX_SEGMENTS	    32	    // pages one request transfers at most
+
+typedef struct __attribute__((packed))
+{
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+} vring_desc_t;
+
+typedef struct __attribute__((packed))
+{
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];
+} vring_avail_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t id;
+    uint32_t length;
+} vring_used_elem_t;
+
+typedef struct __attribute__((packed))
+{
+    uint16_t flags;
+    uint16_t index;
+    vring_used_elem_t ring[];
+} vring_used_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} virtio_blk_request_header_t;
+
+bool virtio_blk_init(void);
+uint64_t virtio_blk_get_capacity(void);
+size_t virtio_blk_get_max_segments(void);
+bool virtio_blk_read(uint64_t sector, const uint64_t *frames, size_t count);
+bool virtio_blk_write(uint64_t sector, const uint64_t *frames, size_t count);
+
+#endif
@@ -31,26 +31,29 @@
 #include <hardware/acpi/acpi.h>
 #include <hardware/apic/apic.h>
 #include <hardware/cpu.h>
+#include <hardware/pci/pci.h>
+#include <hardware/virtio/virtio_blk.h>
 #include <libk/malloc/malloc.h>
 #include <libk/serial/log.h>
 #include <libk/testing/assert.h>
+#include <libk/testing/benchmark.h>
 #include <memory/mem.h>
+#include <memory/mem_tag.h>
 #include <memory/dynamic/slab.h>
 #include <memory/physical/pmm.h>
+#include <memory/virtual/ioremap.h>
+#include <memory/virtual/ksm.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/swap.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/vmalloc.h>
 #include <memory/virtual/vmm.h>
+#include <memory/virtual/zero_page.h>
+#include <memory/virtual/zstore.h>
 #include <proc/smp/smp.h>
 #include <tables/gdt.h>
 #include <tables/idt.h>
 
-
-
-
-
-#include <libk/serial/debug.h>
-
-
-
-
 /* utility function prototypes */
 
 void kinit_all(struct stivale2_struct *stivale2_struct);
@@ -77,6 +80,9 @@ void kmain(struct stivale2_struct *stivale2_struct)
 // initialize all kernel parts
 void kinit_all(struct stivale2_struct *stivale2_struct)
 {
+    // every allocation is accounted through GS (see mem_tag_account())
+    smp_early_init();
+
     struct stivale2_struct_tag_hhdm *hhdm = stivale2_get_tag(stivale2_struct,
                                             STIVALE2_STRUCT_TAG_HHDM_ID);
     log(INFO, "Verified HHDM address 0x%.16llx\n", hhdm->addr);
@@ -88,60 +94,30 @@ void kinit_all(struct stivale2_struct *stivale2_struct)
     gdt_init();
     idt_init();
 
+    vmalloc_init();
+    ioremap_init();
+    vmm_region_init();
+    zero_page_init();
+    thp_init();
+    ksm_init();
+    zstore_init();
     malloc_heap_init();
 
     // log(INFO, "CPU vendor id string: '%s'\n", cpu_get_vendor_id_string());
 
-    // acpi_init(stivale2_struct);
-    // apic_init();
-
-    /* realloc (and helpers) test start */
-
-    debug("sizeof(int): %d\n", sizeof(int));
+    acpi_init(stivale2_struct);
+    apic_init();
 
-    int *ptr;
+    pci_init();
+    virtio_blk_init();
+    swap_init();
 
-    ptr = malloc(10 * sizeof(int));
-
-    debug("ptr at  0x%p\n", ptr);
-
-    ptr = realloc(ptr, 40 * sizeof(int));
-    if(ptr == NULL) {
-    	log(WARNING, "returned NULL\n"); 
-    }
-
-    ptr[100] = -120;
-
-    debug("%d at 0x%p\n", ptr[100], &ptr[3]);
-
-
-    int *ptr1;
-
-    ptr1 = malloc(10 * sizeof(int));
-    debug("ptr1 at 0x%p\n", ptr1);
-
-    ptr1[3] = -120;
-
-    ptr1 = realloc(ptr1, 4 * sizeof(int));
-    if(ptr1 == NULL) {
-	log(WARNING, "returned NULL too\n");
-    }
-    debug("%d at 0x%p\n", ptr1[3], &ptr1[3]);
-
-
-    int *ptr2;
-
-    ptr2 = malloc(10 * sizeof(int));
-    debug("ptr2 at 0x%p\n", ptr2);
-    ptr2[3] = -120;
-
-    ptr2 = realloc(ptr2, 10 * sizeof(int));
-    if(ptr2 == NULL) {
-	log(WARNING, "returned NULL too\n");
-    }
-    debug("%d at 0x%p\n", ptr2[3], &ptr2[3]);
+    smp_init(stivale2_struct);
 
-    /* realloc (and helpers) test end */
+    mem_tag_dump();
+    vmm_dump_page_tables();
 
-    // smp_init(stivale2_struct);
+#ifdef KERNEL_BENCHMARK
+    benchmark_run_all();
+#endif
 }
@@ -0,0 +1,312 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+
+    Brief file description:
+    Compression in the LZ4 block format: a block is a list of sequences,
+    each made of a token byte (literal length in the upper, match length
+    minus 4 in the lower nibble, 15 meaning more length bytes follow), the
+    literals, and a 16 bit little endian offset back to the match. The last
+    sequence only has literals - the last 5 bytes are always literals, and
+    no match starts in the last 12 bytes.
+    The compressor is the greedy single pass one: a hash of the next 4
+    bytes finds the last position which had the same hash, a match is
+    extended in both directions. Without a match it skips ahead faster the
+    longer nothing matched, so incompressible data is given up on quickly.
+    The decompressor checks every length and offset against both buffers,
+    so a corrupted block can't make it write outside of dest.
+
+*/
+
+#include <libk/compress/lz4.h>
+#include <libk/string/string.h>
+#include <libk/testing/assert.h>
+
+#define LZ4_MIN_MATCH	    4
+#define LZ4_LAST_LITERALS   5	// bytes at the end which are always literals
+#define LZ4_MATCH_LIMIT	    12	// no match starts in the last bytes
+#define LZ4_MAX_OFFSET	    0xFFFF
+#define LZ4_SKIP_SHIFT	    6	// skip one more byte per 64 bytes without a match
+
+/* utility function prototypes */
+
+uint32_t lz4_read32(const uint8_t *pointer);
+uint32_t lz4_hash(uint32_t value);
+uint8_t *lz4_write_length(uint8_t *op, size_t length);
+uint8_t *lz4_write_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t literal_length,
+                            size_t offset, size_t match_length);
+const uint8_t *lz4_read_length(const uint8_t *ip, const uint8_t *iend, size_t *length);
+
+/* core functions */
+
+// compress source_size bytes (up to LZ4_MAX_INPUT_SIZE) into dest - returns the
+// size of the block, or 0 if it doesn't fit into dest_capacity; workspace has
+// to be LZ4_WORKSPACE_SIZE bytes
+size_t lz4_compress(const void *source, size_t source_size, void *dest, size_t dest_capacity, void *workspace)
+{
+    assert(source_size <= LZ4_MAX_INPUT_SIZE);
+
+    const uint8_t *in = source;
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *iend = in + source_size;
+    uint8_t *op = dest;
+    uint8_t *oend = op + dest_capacity;
+
+    uint16_t *table = workspace;
+
+    // stale positions are fine, every candidate is compared anyway
+    memset(table, 0, LZ4_WORKSPACE_SIZE);
+
+    if (source_size > LZ4_MATCH_LIMIT)
+    {
+        const uint8_t *match_limit = iend - LZ4_MATCH_LIMIT;
+        const uint8_t *extend_limit = iend - LZ4_LAST_LITERALS;
+
+        while (ip < match_limit)
+        {
+            uint32_t value = lz4_read32(ip);
+            uint32_t hash = lz4_hash(value);
+            const uint8_t *match = in + table[hash];
+
+            table[hash] = (uint16_t)(ip - in);
+
+            if (match >= ip || (size_t)(ip - match) > LZ4_MAX_OFFSET || lz4_read32(match) != value)
+            {
+                ip += 1 + ((size_t)(ip - anchor) >> LZ4_SKIP_SHIFT);
+
+                continue;
+            }
+
+            // the bytes before might match as well
+            while (ip > anchor && match > in && ip[-1] == match[-1])
+            {
+                ip--;
+                match--;
+            }
+
+            size_t match_length = LZ4_MIN_MATCH;
+
+            while (ip + match_length < extend_limit && ip[match_length] == match[match_length])
+            {
+                match_length++;
+            }
+
+            op = lz4_write_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - match), match_length);
+
+            if (!op)
+            {
+                return 0;
+            }
+
+            ip += match_length;
+            anchor = ip;
+
+            // positions inside the match weren't hashed, one of them helps
+            // finding the next match
+            if (ip < match_limit)
+            {
+                table[lz4_hash(lz4_read32(ip - 2))] = (uint16_t)(ip - 2 - in);
+            }
+        }
+    }
+
+    op = lz4_write_sequence(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+
+    return op ? (size_t)(op - (uint8_t *)dest) : 0;
+}
+
+// decompress a block of source_size bytes into dest - returns the size of the
+// data, or 0 if the block is corrupted or doesn't fit into dest_capacity
+size_t lz4_decompress(const void *source, size_t source_size, void *dest, size_t dest_capacity)
+{
+    const uint8_t *ip = source;
+    const uint8_t *iend = ip + source_size;
+    uint8_t *op = dest;
+    uint8_t *oend = op + dest_capacity;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t literal_length = token >> 4;
+
+        if (literal_length == 15 && !(ip = lz4_read_length(ip, iend, &literal_length)))
+        {
+            return 0;
+        }
+
+        if (literal_length > (size_t)(iend - ip) || literal_length > (size_t)(oend - op))
+        {
+            return 0;
+        }
+
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // the last sequence has no match
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return 0;
+        }
+
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dest))
+        {
+            return 0;
+        }
+
+        size_t match_length = token & 0xF;
+
+        if (match_length == 15 && !(ip = lz4_read_length(ip, iend, &match_length)))
+        {
+            return 0;
+        }
+
+        match_length += LZ4_MIN_MATCH;
+
+        if (match_length > (size_t)(oend - op))
+        {
+            return 0;
+        }
+
+        const uint8_t *match = op - offset;
+
+        // a match may overlap the bytes it produces (repeating a pattern),
+        // then it has to be copied front to back
+        if (offset >= match_length)
+        {
+            memcpy(op, match, match_length);
+            op += match_length;
+        }
+        else
+        {
+            for (size_t i = 0; i < match_length; i++)
+            {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return (size_t)(op - (uint8_t *)dest);
+}
+
+/* utility functions */
+
+// unaligned little endian load
+uint32_t lz4_read32(const uint8_t *pointer)
+{
+    uint32_t value;
+
+    __builtin_memcpy(&value, pointer, sizeof(value));
+
+    return value;
+}
+
+// Knuth's multiplicative hash, reduced to LZ4_HASH_LOG bits
+uint32_t lz4_hash(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// the bytes which extend a length nibble of 15
+uint8_t *lz4_write_length(uint8_t *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *op++ = 255;
+    }
+
+    *op++ = (uint8_t)length;
+
+    return op;
+}
+
+// append a sequence (without a match if match_length is 0) - NULL if it
+// doesn't fit anymore
+uint8_t *lz4_write_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t literal_length,
+                            size_t offset, size_t match_length)
+{
+    // token, both lengths and the offset at most
+    size_t worst_size = 1 + literal_length + literal_length / 255 + 1 + 2 + match_length / 255 + 1;
+
+    if (worst_size > (size_t)(oend - op))
+    {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+
+    *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+
+    if (literal_length >= 15)
+    {
+        op = lz4_write_length(op, literal_length - 15);
+    }
+
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length == 0)
+    {
+        return op;
+    }
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    match_length -= LZ4_MIN_MATCH;
+    *token |= (uint8_t)(match_length < 15 ? match_length : 15);
+
+    if (match_length >= 15)
+    {
+        op = lz4_write_length(op, match_length - 15);
+    }
+
+    return op;
+}
+
+// add the length bytes following a nibble of 15 - NULL if the block ends first
+const uint8_t *lz4_read_length(const uint8_t *ip, const uint8_t *iend, size_t *length)
+{
+    uint8_t byte;
+
+    do
+    {
+        if (ip >= iend)
+        {
+            return NULL;
+        }
+
+        byte = *ip++;
+        *length += byte;
+    }
+    while (byte == 255);
+
+    return ip;
+}
@@ -0,0 +1,33 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4_HASH_LOG	    12
+#define LZ4_WORKSPACE_SIZE  (sizeof(uint16_t) << LZ4_HASH_LOG) // hash table of lz4_compress()
+#define LZ4_MAX_INPUT_SIZE  0xFFFF // positions in the hash table are 16 bits
+
+size_t lz4_compress(const void *source, size_t source_size, void *dest, size_t dest_capacity, void *workspace);
+size_t lz4_decompress(const void *source, size_t source_size, void *dest, size_t dest_capacity);
+
+#endif
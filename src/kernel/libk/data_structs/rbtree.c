@@ -0,0 +1,425 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Intrusive red-black tree: the nodes are embedded into the structures that
+    are kept in the tree, so it never allocates. Searching is done by the user,
+    who knows how to compare the structures - insertion gets the parent and the
+    link (left or right of it) where the search ended:
+
+	rbtree_node_t **link = &tree->root, *parent = NULL;
+
+	while (*link)
+	{
+	    parent = *link;
+	    link = key < RBTREE_ENTRY(parent, foo_t, node)->key ? &parent->left : &parent->right;
+	}
+
+	rbtree_insert(tree, &foo->node, parent, link);
+
+    Insertion and removal rebalance with O(1) rotations, so the height stays
+    below 2 * log2(n + 1).
+
+*/
+
+#include <stdbool.h>
+
+#include <libk/data_structs/rbtree.h>
+
+#define RBTREE_RED	0
+#define RBTREE_BLACK	1
+
+/* utility function prototypes */
+
+bool rbtree_is_black(rbtree_node_t *node);
+void rbtree_set_color(rbtree_node_t *node, uintptr_t color);
+void rbtree_set_parent(rbtree_node_t *node, rbtree_node_t *parent);
+void rbtree_replace_child(rbtree_t *tree, rbtree_node_t *parent, rbtree_node_t *old, rbtree_node_t *new);
+void rbtree_rotate_left(rbtree_t *tree, rbtree_node_t *node);
+void rbtree_rotate_right(rbtree_t *tree, rbtree_node_t *node);
+void rbtree_remove_fixup(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent);
+
+/* core functions */
+
+// link a node where a search ended and rebalance the tree
+void rbtree_insert(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent, rbtree_node_t **link)
+{
+    node->parent_color = (uintptr_t)parent | RBTREE_RED;
+    node->left = NULL;
+    node->right = NULL;
+    *link = node;
+
+    // a red node mustn't have a red parent
+    while ((parent = rbtree_parent(node)) && !rbtree_is_black(parent))
+    {
+        // the root is black, so a red parent has a parent
+        rbtree_node_t *grandparent = rbtree_parent(parent);
+
+        if (parent == grandparent->left)
+        {
+            rbtree_node_t *uncle = grandparent->right;
+
+            if (!rbtree_is_black(uncle))
+            {
+                rbtree_set_color(parent, RBTREE_BLACK);
+                rbtree_set_color(uncle, RBTREE_BLACK);
+                rbtree_set_color(grandparent, RBTREE_RED);
+                node = grandparent;
+
+                continue;
+            }
+
+            if (node == parent->right)
+            {
+                rbtree_rotate_left(tree, parent);
+                node = parent;
+                parent = rbtree_parent(node);
+            }
+
+            rbtree_set_color(parent, RBTREE_BLACK);
+            rbtree_set_color(grandparent, RBTREE_RED);
+            rbtree_rotate_right(tree, grandparent);
+        }
+        else
+        {
+            rbtree_node_t *uncle = grandparent->left;
+
+            if (!rbtree_is_black(uncle))
+            {
+                rbtree_set_color(parent, RBTREE_BLACK);
+                rbtree_set_color(uncle, RBTREE_BLACK);
+                rbtree_set_color(grandparent, RBTREE_RED);
+                node = grandparent;
+
+                continue;
+            }
+
+            if (node == parent->left)
+            {
+                rbtree_rotate_right(tree, parent);
+                node = parent;
+                parent = rbtree_parent(node);
+            }
+
+            rbtree_set_color(parent, RBTREE_BLACK);
+            rbtree_set_color(grandparent, RBTREE_RED);
+            rbtree_rotate_left(tree, grandparent);
+        }
+    }
+
+    rbtree_set_color(tree->root, RBTREE_BLACK);
+}
+
+// unlink a node and rebalance the tree
+void rbtree_remove(rbtree_t *tree, rbtree_node_t *node)
+{
+    rbtree_node_t *child;
+    rbtree_node_t *parent;
+    uintptr_t removed_color;
+
+    if (!node->left || !node->right)
+    {
+        // the only child (if any) takes the place of the node
+        child = node->left ? node->left : node->right;
+        parent = rbtree_parent(node);
+        removed_color = node->parent_color & 1;
+
+        rbtree_replace_child(tree, parent, node, child);
+
+        if (child)
+        {
+            rbtree_set_parent(child, parent);
+        }
+    }
+    else
+    {
+        // the successor (which has no left child) takes the place of the node
+        rbtree_node_t *successor = node->right;
+
+        while (successor->left)
+        {
+            successor = successor->left;
+        }
+
+        child = successor->right;
+        removed_color = successor->parent_color & 1;
+
+        if (rbtree_parent(successor) == node)
+        {
+            parent = successor;
+        }
+        else
+        {
+            parent = rbtree_parent(successor);
+            parent->left = child;
+
+            if (child)
+            {
+                rbtree_set_parent(child, parent);
+            }
+
+            successor->right = node->right;
+            rbtree_set_parent(node->right, successor);
+        }
+
+        successor->left = node->left;
+        rbtree_set_parent(node->left, successor);
+
+        rbtree_replace_child(tree, rbtree_parent(node), node, successor);
+        successor->parent_color = node->parent_color;
+    }
+
+    // a black node is missing on the paths through child
+    if (removed_color == RBTREE_BLACK)
+    {
+        rbtree_remove_fixup(tree, child, parent);
+    }
+}
+
+// return the smallest node - NULL if the tree is empty
+rbtree_node_t *rbtree_first(rbtree_t *tree)
+{
+    rbtree_node_t *node = tree->root;
+
+    while (node && node->left)
+    {
+        node = node->left;
+    }
+
+    return node;
+}
+
+// return the next bigger node - NULL for the biggest one
+rbtree_node_t *rbtree_next(rbtree_node_t *node)
+{
+    if (node->right)
+    {
+        node = node->right;
+
+        while (node->left)
+        {
+            node = node->left;
+        }
+
+        return node;
+    }
+
+    rbtree_node_t *parent;
+
+    while ((parent = rbtree_parent(node)) && node == parent->right)
+    {
+        node = parent;
+    }
+
+    return parent;
+}
+
+// return the next smaller node - NULL for the smallest one
+rbtree_node_t *rbtree_prev(rbtree_node_t *node)
+{
+    if (node->left)
+    {
+        node = node->left;
+
+        while (node->right)
+        {
+            node = node->right;
+        }
+
+        return node;
+    }
+
+    rbtree_node_t *parent;
+
+    while ((parent = rbtree_parent(node)) && node == parent->left)
+    {
+        node = parent;
+    }
+
+    return parent;
+}
+
+// return the parent of a node - NULL for the root
+rbtree_node_t *rbtree_parent(rbtree_node_t *node)
+{
+    return (rbtree_node_t *)(node->parent_color & ~(uintptr_t)1);
+}
+
+/* utility functions */
+
+// missing children (NULL) count as black
+bool rbtree_is_black(rbtree_node_t *node)
+{
+    return !node || (node->parent_color & 1) == RBTREE_BLACK;
+}
+
+// keep the parent, change the color
+void rbtree_set_color(rbtree_node_t *node, uintptr_t color)
+{
+    node->parent_color = (node->parent_color & ~(uintptr_t)1) | color;
+}
+
+// keep the color, change the parent
+void rbtree_set_parent(rbtree_node_t *node, rbtree_node_t *parent)
+{
+    node->parent_color = (uintptr_t)parent | (node->parent_color & 1);
+}
+
+// let the link of parent (or the root) which pointed to old point to new
+void rbtree_replace_child(rbtree_t *tree, rbtree_node_t *parent, rbtree_node_t *old, rbtree_node_t *new)
+{
+    if (!parent)
+    {
+        tree->root = new;
+    }
+    else if (parent->left == old)
+    {
+        parent->left = new;
+    }
+    else
+    {
+        parent->right = new;
+    }
+}
+
+// the right child of node becomes its parent
+void rbtree_rotate_left(rbtree_t *tree, rbtree_node_t *node)
+{
+    rbtree_node_t *pivot = node->right;
+    rbtree_node_t *parent = rbtree_parent(node);
+
+    node->right = pivot->left;
+
+    if (pivot->left)
+    {
+        rbtree_set_parent(pivot->left, node);
+    }
+
+    rbtree_set_parent(pivot, parent);
+    rbtree_replace_child(tree, parent, node, pivot);
+
+    pivot->left = node;
+    rbtree_set_parent(node, pivot);
+}
+
+// the left child of node becomes its parent
+void rbtree_rotate_right(rbtree_t *tree, rbtree_node_t *node)
+{
+    rbtree_node_t *pivot = node->left;
+    rbtree_node_t *parent = rbtree_parent(node);
+
+    node->left = pivot->right;
+
+    if (pivot->right)
+    {
+        rbtree_set_parent(pivot->right, node);
+    }
+
+    rbtree_set_parent(pivot, parent);
+    rbtree_replace_child(tree, parent, node, pivot);
+
+    pivot->right = node;
+    rbtree_set_parent(node, pivot);
+}
+
+// restore the black height after a black node was removed - node (which can
+// be NULL) is where a black node is missing, parent its parent
+void rbtree_remove_fixup(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent)
+{
+    while (node != tree->root && rbtree_is_black(node))
+    {
+        if (node == parent->left)
+        {
+            rbtree_node_t *sibling = parent->right;
+
+            if (!rbtree_is_black(sibling))
+            {
+                rbtree_set_color(sibling, RBTREE_BLACK);
+                rbtree_set_color(parent, RBTREE_RED);
+                rbtree_rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+
+            if (rbtree_is_black(sibling->left) && rbtree_is_black(sibling->right))
+            {
+                rbtree_set_color(sibling, RBTREE_RED);
+                node = parent;
+                parent = rbtree_parent(node);
+
+                continue;
+            }
+
+            if (rbtree_is_black(sibling->right))
+            {
+                rbtree_set_color(sibling->left, RBTREE_BLACK);
+                rbtree_set_color(sibling, RBTREE_RED);
+                rbtree_rotate_right(tree, sibling);
+                sibling = parent->right;
+            }
+
+            rbtree_set_color(sibling, parent->parent_color & 1);
+            rbtree_set_color(parent, RBTREE_BLACK);
+            rbtree_set_color(sibling->right, RBTREE_BLACK);
+            rbtree_rotate_left(tree, parent);
+        }
+        else
+        {
+            rbtree_node_t *sibling = parent->left;
+
+            if (!rbtree_is_black(sibling))
+            {
+                rbtree_set_color(sibling, RBTREE_BLACK);
+                rbtree_set_color(parent, RBTREE_RED);
+                rbtree_rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+
+            if (rbtree_is_black(sibling->left) && rbtree_is_black(sibling->right))
+            {
+                rbtree_set_color(sibling, RBTREE_RED);
+                node = parent;
+                parent = rbtree_parent(node);
+
+                continue;
+            }
+
+            if (rbtree_is_black(sibling->left))
+            {
+                rbtree_set_color(sibling->right, RBTREE_BLACK);
+                rbtree_set_color(sibling, RBTREE_RED);
+                rbtree_rotate_left(tree, sibling);
+                sibling = parent->left;
+            }
+
+            rbtree_set_color(sibling, parent->parent_color & 1);
+            rbtree_set_color(parent, RBTREE_BLACK);
+            rbtree_set_color(sibling->left, RBTREE_BLACK);
+            rbtree_rotate_right(tree, parent);
+        }
+
+        node = tree->root;
+    }
+
+    if (node)
+    {
+        rbtree_set_color(node, RBTREE_BLACK);
+    }
+}
@@ -0,0 +1,49 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// get the structure a node is embedded in
+#define RBTREE_ENTRY(node, type, member) ((type *)((uint8_t *)(node) - offsetof(type, member)))
+
+// embedded into the structures of a tree, which do the comparisons themselves
+typedef struct rbtree_node
+{
+    uintptr_t parent_color; // parent pointer - nodes are aligned, so bit 0 holds the color
+    struct rbtree_node *left;
+    struct rbtree_node *right;
+} rbtree_node_t;
+
+typedef struct
+{
+    rbtree_node_t *root;
+} rbtree_t;
+
+void rbtree_insert(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent, rbtree_node_t **link);
+void rbtree_remove(rbtree_t *tree, rbtree_node_t *node);
+rbtree_node_t *rbtree_first(rbtree_t *tree);
+rbtree_node_t *rbtree_next(rbtree_node_t *node);
+rbtree_node_t *rbtree_prev(rbtree_node_t *node);
+rbtree_node_t *rbtree_parent(rbtree_node_t *node);
+
+#endif
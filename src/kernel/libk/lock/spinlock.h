@@ -27,6 +27,10 @@
     could also try to access foo, thus creating a deadlock. To prevent this, interrupts are disabled
     for locked code parts (and must not be changed!), but after the code is released, the old interrupt
     state is restored.
+
+    A CPU spinning with interrupts disabled would never see a TLB shootdown IPI, while the holder of
+    the lock might be waiting for exactly that shootdown. So the spin loop handles the shootdowns
+    meant for this CPU itself (see tlb_shootdown()).
 */
 
 
@@ -37,6 +41,7 @@
 
 #include <stdbool.h>
 
+#include <memory/virtual/tlb.h>
 #include <utility/utils.h>
 
 typedef struct
@@ -49,6 +54,8 @@ static inline void spinlock_acquire(spinlock_t *spinlock)
 {
     while (__atomic_test_and_set(&spinlock->lock, __ATOMIC_ACQUIRE))
     {
+	tlb_shootdown_handle();
+
 	asm volatile("pause");
     }
 
@@ -57,6 +64,21 @@ static inline void spinlock_acquire(spinlock_t *spinlock)
     asm volatile("cli");
 }
 
+// acquire the lock only if it's free - false otherwise
+static inline bool spinlock_try_acquire(spinlock_t *spinlock)
+{
+    if (__atomic_test_and_set(&spinlock->lock, __ATOMIC_ACQUIRE))
+    {
+	return false;
+    }
+
+    spinlock->interrupts = asm_get_interrupt_flag();
+
+    asm volatile("cli");
+
+    return true;
+}
+
 static inline void spinlock_release(spinlock_t *spinlock)
 {
     if (spinlock->interrupts)
@@ -0,0 +1,311 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    Sampling heap profiler. While running, on average every sample_interval
+    allocated bytes one allocation is sampled: its call site (return address)
+    and an estimated weight in bytes are added to a fixed size site table, and
+    the pointer is remembered so a later free() can subtract the weight from
+    the live bytes of its site again.
+    The gap between two samples is uniformly distributed in [0, 2 * interval),
+    so that allocation patterns with a fixed period can't hide from it. Each
+    CPU counts the bytes down in its CPU local structure, so the allocations
+    of different CPUs don't write to the same cache line.
+    heap_profile_dump() prints the table over serial, one 'HEAPPROF' line per
+    site. The addresses can be symbolized on the host, e.g. with:
+	grep '^HEAPPROF site' log | cut -d' ' -f2 | cut -d= -f2 | addr2line -f -e src/kernel/kernel.elf
+
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/lock/spinlock.h>
+#include <libk/malloc/heap_profile.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <proc/smp/smp.h>
+
+// marks a sample slot whose allocation was freed (keeps probe chains intact)
+#define HEAP_PROFILE_TOMBSTONE ((void *)1)
+
+bool heap_profile_enabled = false;
+size_t heap_profile_live_count = 0;
+
+static spinlock_t heap_profile_lock;
+
+static size_t sample_interval = 0;
+static uint64_t random_state = 0x2545F4914F6CDD1DUL;
+static uint64_t dropped_count = 0;
+
+static heap_profile_site_t sites[HEAP_PROFILE_SITE_COUNT];
+static heap_profile_sample_t samples[HEAP_PROFILE_SAMPLE_COUNT];
+
+/* utility function prototypes */
+
+uint64_t heap_profile_random(void);
+int64_t heap_profile_next_countdown(void);
+int64_t heap_profile_find_site(void *site);
+size_t heap_profile_hash(void *pointer);
+
+/* core functions */
+
+// start sampling roughly every sample_interval allocated bytes
+void heap_profile_start(size_t interval)
+{
+    spinlock_acquire(&heap_profile_lock);
+
+    sample_interval = interval ? interval : 1;
+
+    // a CPU allocating right now might lose this, it only moves its first sample
+    for (uint64_t i = 0; i < smp_get_cpu_count(); i++)
+    {
+        __atomic_store_n(&cpu_locals[i].heap_profile_countdown, heap_profile_next_countdown(), __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&heap_profile_enabled, true, __ATOMIC_RELEASE);
+
+    spinlock_release(&heap_profile_lock);
+
+    log(INFO, "Heap profiler started - sampling every ~%ld bytes\n", sample_interval);
+}
+
+// stop taking new samples (frees of already sampled allocations are still tracked)
+void heap_profile_stop(void)
+{
+    spinlock_acquire(&heap_profile_lock);
+
+    __atomic_store_n(&heap_profile_enabled, false, __ATOMIC_RELAXED);
+
+    spinlock_release(&heap_profile_lock);
+}
+
+// forget all sites and samples
+void heap_profile_reset(void)
+{
+    spinlock_acquire(&heap_profile_lock);
+
+    memset(sites, 0, sizeof(sites));
+    memset(samples, 0, sizeof(samples));
+    heap_profile_live_count = 0;
+    dropped_count = 0;
+
+    spinlock_release(&heap_profile_lock);
+}
+
+// print the site table over serial
+void heap_profile_dump(void)
+{
+    spinlock_acquire(&heap_profile_lock);
+
+    debug("HEAPPROF interval=%ld live_samples=%ld dropped=%ld\n",
+          sample_interval, heap_profile_live_count, dropped_count);
+
+    for (size_t i = 0; i < HEAP_PROFILE_SITE_COUNT; i++)
+    {
+        if (!sites[i].site)
+        {
+            continue;
+        }
+
+        debug("HEAPPROF site=0x%p samples=%ld bytes=%ld live_bytes=%ld\n",
+              sites[i].site, sites[i].sample_count, sites[i].sampled_bytes, sites[i].live_bytes);
+    }
+
+    spinlock_release(&heap_profile_lock);
+}
+
+// count an allocation down on the calling CPU, take a sample once one is due
+void heap_profile_account(void *pointer, size_t size, void *site)
+{
+    size_t offset = offsetof(cpu_local_t, heap_profile_countdown);
+    int64_t countdown = -(int64_t)size;
+
+    // a single xadd relative to GS can't be torn by an interrupt and doesn't
+    // need a lock prefix, as no other CPU writes this counter (see mem_tag_account())
+    asm volatile("xaddq %0, %%gs:(%1)" : "+r"(countdown) : "r"(offset) : "memory");
+
+    if (__builtin_expect(countdown - (int64_t)size < 0, 0))
+    {
+        heap_profile_record_alloc(pointer, size, site);
+    }
+}
+
+// slow path of heap_profile_account() - take a sample and set up the next one
+void heap_profile_record_alloc(void *pointer, size_t size, void *site)
+{
+    spinlock_acquire(&heap_profile_lock);
+
+    // might have been stopped in the meantime
+    if (!heap_profile_enabled)
+    {
+        spinlock_release(&heap_profile_lock);
+
+        return;
+    }
+
+    this_cpu()->heap_profile_countdown = heap_profile_next_countdown();
+
+    if (!pointer)
+    {
+        spinlock_release(&heap_profile_lock);
+
+        return;
+    }
+
+    // small allocations are sampled with a probability of about size / interval,
+    // so each of them stands for interval bytes, big ones for themselves
+    uint64_t weight = size > sample_interval ? size : sample_interval;
+
+    int64_t site_index = heap_profile_find_site(site);
+
+    if (site_index == -1)
+    {
+        dropped_count++;
+        spinlock_release(&heap_profile_lock);
+
+        return;
+    }
+
+    size_t hash = heap_profile_hash(pointer);
+
+    for (size_t i = 0; i < HEAP_PROFILE_SAMPLE_COUNT; i++)
+    {
+        heap_profile_sample_t *sample = &samples[(hash + i) % HEAP_PROFILE_SAMPLE_COUNT];
+
+        if (sample->pointer && sample->pointer != HEAP_PROFILE_TOMBSTONE)
+        {
+            continue;
+        }
+
+        sample->pointer = pointer;
+        sample->weight = weight;
+        sample->site_index = site_index;
+
+        sites[site_index].sample_count++;
+        sites[site_index].sampled_bytes += weight;
+        sites[site_index].live_bytes += weight;
+
+        heap_profile_live_count++;
+
+        spinlock_release(&heap_profile_lock);
+
+        return;
+    }
+
+    dropped_count++;
+
+    spinlock_release(&heap_profile_lock);
+}
+
+// slow path of heap_profile_free() - if the pointer was sampled, it isn't live anymore
+void heap_profile_record_free(void *pointer)
+{
+    if (!pointer)
+    {
+        return;
+    }
+
+    spinlock_acquire(&heap_profile_lock);
+
+    size_t hash = heap_profile_hash(pointer);
+
+    for (size_t i = 0; i < HEAP_PROFILE_SAMPLE_COUNT; i++)
+    {
+        heap_profile_sample_t *sample = &samples[(hash + i) % HEAP_PROFILE_SAMPLE_COUNT];
+
+        if (!sample->pointer)
+        {
+            break;
+        }
+
+        if (sample->pointer != pointer)
+        {
+            continue;
+        }
+
+        sites[sample->site_index].live_bytes -= sample->weight;
+
+        sample->pointer = HEAP_PROFILE_TOMBSTONE;
+        heap_profile_live_count--;
+
+        break;
+    }
+
+    spinlock_release(&heap_profile_lock);
+}
+
+/* utility functions */
+
+// xorshift64 pseudo random number generator
+uint64_t heap_profile_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+
+    return random_state;
+}
+
+// bytes until the next sample - uniform in [0, 2 * interval), so interval on average
+int64_t heap_profile_next_countdown(void)
+{
+    return heap_profile_random() % (2 * sample_interval);
+}
+
+// find the slot of a site or claim a new one - -1 if the table is full
+int64_t heap_profile_find_site(void *site)
+{
+    size_t hash = heap_profile_hash(site);
+
+    for (size_t i = 0; i < HEAP_PROFILE_SITE_COUNT; i++)
+    {
+        size_t index = (hash + i) % HEAP_PROFILE_SITE_COUNT;
+
+        if (sites[index].site == site)
+        {
+            return index;
+        }
+
+        if (!sites[index].site)
+        {
+            sites[index].site = site;
+
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+// mix the bits of a pointer to use it as hash table index
+size_t heap_profile_hash(void *pointer)
+{
+    uint64_t value = (uint64_t)pointer;
+
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDUL;
+    value ^= value >> 33;
+
+    return value;
+}
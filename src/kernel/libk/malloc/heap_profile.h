@@ -0,0 +1,78 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HEAP_PROFILE_SITE_COUNT	    256
+#define HEAP_PROFILE_SAMPLE_COUNT   2048
+
+typedef struct
+{
+    void *site;		    // return address of the allocating call
+
+    uint64_t sample_count;
+    uint64_t sampled_bytes; // estimated bytes allocated from this site
+    int64_t live_bytes;	    // estimated bytes from this site that weren't freed yet
+} heap_profile_site_t;
+
+typedef struct
+{
+    void *pointer;
+    uint64_t weight;
+    uint16_t site_index;
+} heap_profile_sample_t;
+
+// only written by heap_profile_start() and heap_profile_stop(), so that the
+// allocation hook of every CPU reads it from its own cache
+extern bool heap_profile_enabled;
+// count of sampled allocations that weren't freed yet
+extern size_t heap_profile_live_count;
+
+void heap_profile_start(size_t sample_interval);
+void heap_profile_stop(void);
+void heap_profile_reset(void);
+void heap_profile_dump(void);
+void heap_profile_account(void *pointer, size_t size, void *site);
+void heap_profile_record_alloc(void *pointer, size_t size, void *site);
+void heap_profile_record_free(void *pointer);
+
+// allocation hook - costs one load and one (well predicted) branch while the
+// profiler is off, the countdown is per CPU (see heap_profile_account())
+static inline void heap_profile_alloc(void *pointer, size_t size, void *site)
+{
+    if (__builtin_expect(heap_profile_enabled, 0))
+    {
+        heap_profile_account(pointer, size, site);
+    }
+}
+
+// free hook - only has to look the pointer up while sampled allocations are alive
+static inline void heap_profile_free(void *pointer)
+{
+    if (__builtin_expect(heap_profile_live_count != 0, 0))
+    {
+        heap_profile_record_free(pointer);
+    }
+}
+
+#endif
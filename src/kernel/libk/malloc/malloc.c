@@ -19,9 +19,11 @@
 /*
 
     Brief file description:
-    Combine slab allocator with pmm allocator for custom sized allocations, making them
-    optimized. There are 6 caches for sizes ranging from 16 to 512. Note that it might
-    be better for specific tasks to use the neccessary allocators by hand.
+    Combine slab allocator with vmalloc for custom sized allocations, making them
+    optimized. There are 6 caches for sizes ranging from 16 to 512, everything bigger
+    is backed by (not necessarily contiguous) frames mapped into the vmalloc range.
+    Slab objects are naturally aligned to their size class and carry no header.
+    Note that it might be better for specific tasks to use the neccessary allocators by hand.
 
 */
 
@@ -30,191 +32,274 @@
 #include <libk/serial/log.h>
 #include <libk/string/string.h>
 #include <memory/dynamic/slab.h>
-#include <memory/physical/pmm.h>
 #include <memory/mem.h>
+#include <memory/virtual/vmalloc.h>
 
-static slab_cache_t *slab_caches[6];
+slab_cache_t *malloc_slab_caches[MALLOC_SLAB_CACHE_COUNT];
 
 /* utility function prototypes */
 
+void *malloc_aligned_impl(size_t size, size_t alignment, malloc_flags_t flags);
+void *realloc_impl(void *old_pointer, size_t new_size);
+void free_impl(void *pointer);
+void *malloc_small(size_t size, malloc_flags_t flags);
 size_t round_alloc_size(size_t size);
 uint32_t next_power_of_two(uint32_t n);
 int64_t size_to_slab_cache_index(size_t size);
-int64_t slab_cache_index_to_size(size_t index);
 
 /* core functions */
 
 // create caches that malloc will be able to use
 void malloc_heap_init(void)
 {
-    slab_caches[0] = slab_cache_create("heap slab size 16", 16, SLAB_PANIC | SLAB_AUTO_GROW | SLAB_NO_ALIGN);
-    slab_caches[1] = slab_cache_create("heap slab size 32", 32, SLAB_PANIC | SLAB_AUTO_GROW | SLAB_NO_ALIGN);
-    slab_caches[2] = slab_cache_create("heap slab size 64", 64, SLAB_PANIC | SLAB_AUTO_GROW | SLAB_NO_ALIGN);
-    slab_caches[3] = slab_cache_create("heap slab size 128", 128, SLAB_PANIC | SLAB_AUTO_GROW | SLAB_NO_ALIGN);
-    slab_caches[4] = slab_cache_create("heap slab size 256", 256, SLAB_PANIC | SLAB_AUTO_GROW | SLAB_NO_ALIGN);
-    slab_caches[5] = slab_cache_create("heap slab size 512", 512, SLAB_PANIC | SLAB_AUTO_GROW | SLAB_NO_ALIGN);
+    malloc_slab_caches[0] = slab_cache_create("heap slab size 16", 16, MEM_TAG_HEAP, SLAB_PANIC | SLAB_AUTO_GROW);
+    malloc_slab_caches[1] = slab_cache_create("heap slab size 32", 32, MEM_TAG_HEAP, SLAB_PANIC | SLAB_AUTO_GROW);
+    malloc_slab_caches[2] = slab_cache_create("heap slab size 64", 64, MEM_TAG_HEAP, SLAB_PANIC | SLAB_AUTO_GROW);
+    malloc_slab_caches[3] = slab_cache_create("heap slab size 128", 128, MEM_TAG_HEAP, SLAB_PANIC | SLAB_AUTO_GROW);
+    malloc_slab_caches[4] = slab_cache_create("heap slab size 256", 256, MEM_TAG_HEAP, SLAB_PANIC | SLAB_AUTO_GROW);
+    malloc_slab_caches[5] = slab_cache_create("heap slab size 512", 512, MEM_TAG_HEAP, SLAB_PANIC | SLAB_AUTO_GROW);
 
     log(INFO, "Slab caches for heap initialized\n");
     log(INFO, "Heap fully initialized\n");
 }
 
-// allocate memory depending on the size, store metadata for realloc() and free()
+// allocate memory depending on the size, the size class is found again through
+// the address for realloc() and free()
 // return a vmm address - not guaranteed that everything set to zero
 void *malloc(size_t size)
 {
-    size_t new_size = round_alloc_size(size + sizeof(malloc_metadata_t));
-    void *pointer;
+    void *pointer = malloc_aligned_impl(size, 0, 0);
+    heap_profile_alloc(pointer, size, __builtin_return_address(0));
 
-    if (new_size <= 512)
+    return pointer;
+}
+
+// allocate memory with extra requirements:
+// MALLOC_ZERO:		    memory is set to zero (only done by hand if the backing memory
+//			    isn't already known to be clean)
+// MALLOC_CACHE_ALIGN:	    address is aligned to a cache line
+// MALLOC_PAGE_ALIGN:	    address is aligned to a page
+// MALLOC_TAG(tag):	    memory is accounted to tag instead of MEM_TAG_HEAP
+void *malloc_flags(size_t size, malloc_flags_t flags)
+{
+    size_t alignment = 0;
+
+    if (flags & MALLOC_PAGE_ALIGN)
     {
-        int64_t index = size_to_slab_cache_index(new_size);
+        alignment = PAGE_SIZE;
+    }
+    else if (flags & MALLOC_CACHE_ALIGN)
+    {
+        alignment = CACHE_LINE_SIZE;
+    }
 
-        if (index == -1)
-        {
-            return NULL;
-        }
+    void *pointer = malloc_aligned_impl(size, alignment, flags);
+    heap_profile_alloc(pointer, size, __builtin_return_address(0));
 
-        pointer = slab_cache_alloc(slab_caches[index], SLAB_PANIC);
+    return pointer;
+}
 
-        if (!pointer)
-        {
-            return NULL;
-        }
+// allocate count elements of size bytes, all set to zero
+void *calloc(size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    void *pointer = malloc_aligned_impl(count * size, 0, MALLOC_ZERO);
+    heap_profile_alloc(pointer, count * size, __builtin_return_address(0));
 
-        malloc_metadata_t *metadata = pointer;
-        metadata->size = index;
+    return pointer;
+}
+
+// allocate memory which is aligned to alignment (power of two)
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!alignment || (alignment & (alignment - 1)))
+    {
+        return NULL;
     }
-    else
+
+    void *pointer = malloc_aligned_impl(size, alignment, 0);
+    heap_profile_alloc(pointer, size, __builtin_return_address(0));
+
+    return pointer;
+}
+
+// same as aligned_alloc()
+void *memalign(size_t alignment, size_t size)
+{
+    if (!alignment || (alignment & (alignment - 1)))
     {
-        int64_t page_count = new_size / PAGE_SIZE;
+        return NULL;
+    }
 
-        if (page_count == -1)
-        {
-            return NULL;
-        }
+    void *pointer = malloc_aligned_impl(size, alignment, 0);
+    heap_profile_alloc(pointer, size, __builtin_return_address(0));
 
-        pointer = pmm_allocz(page_count);
+    return pointer;
+}
 
-        if (!pointer)
-        {
-            return NULL;
-        }
+// try to reallocate memory - vmalloc backed allocations are resized without
+// copying (see vrealloc()), slab backed ones only stay if the size class fits
+void *realloc(void *old_pointer, size_t new_size)
+{
+    void *new_pointer = realloc_impl(old_pointer, new_size);
 
-        malloc_metadata_t *metadata = pointer;
-        metadata->size = page_count;
+    // on failure the old allocation stays alive
+    if (new_pointer || !new_size)
+    {
+        heap_profile_free(old_pointer);
     }
 
-    log(WARNING, "malloc initially at 0x%llx\n", (pointer + sizeof(malloc_metadata_t) + HEAP_START_ADDR)); 
+    heap_profile_alloc(new_pointer, new_size, __builtin_return_address(0));
+
+    return new_pointer;
+}
 
-    return pointer + sizeof(malloc_metadata_t) + HEAP_START_ADDR;
+// free memory depending on the address, slab objects find their cache through
+// the slab structure of their page
+void free(void *pointer)
+{
+    heap_profile_free(pointer);
+    free_impl(pointer);
 }
 
-// try to reallocate memory (although the address won't be the same unless
-// no change of size)
-void *realloc(void *old_pointer, size_t new_size)
+/* utility functions */
+
+// route an allocation to a slab cache or vmalloc
+void *malloc_aligned_impl(size_t size, size_t alignment, malloc_flags_t flags)
+{
+    if (!size)
+    {
+        return NULL;
+    }
+
+    // slab objects are aligned to their (power of two) size class, so the size
+    // class simply has to be at least as big as the alignment
+    if (alignment <= MALLOC_SLAB_MAX_SIZE && size <= MALLOC_SLAB_MAX_SIZE)
+    {
+        size_t class_size = size > alignment ? size : alignment;
+
+        return malloc_small(class_size, flags);
+    }
+
+    mem_tag_t tag = (flags >> MALLOC_TAG_SHIFT) ? (flags >> MALLOC_TAG_SHIFT) - 1 : MEM_TAG_HEAP;
+
+    // vmalloc frames come zeroed from the PMM when asked for
+    return vmalloc_aligned(size, alignment, tag, (flags & MALLOC_ZERO) ? VMALLOC_ZERO : 0);
+}
+
+// realloc() without the heap profiler hooks
+void *realloc_impl(void *old_pointer, size_t new_size)
 {
     if (!old_pointer)
     {
-        return malloc(new_size);
+        return malloc_aligned_impl(new_size, 0, 0);
     }
 
     if (!new_size)
     {
-        free(old_pointer);
+        free_impl(old_pointer);
 
         return NULL;
     }
 
-    old_pointer = old_pointer - HEAP_START_ADDR - sizeof(malloc_metadata_t);
-
     size_t rounded_new_size = round_alloc_size(new_size);
     size_t old_size = 0;
 
-    if (((uint64_t)old_pointer & 0xFFF) != 0)
+    if (is_vmalloc_address(old_pointer))
     {
-        malloc_metadata_t *metadata = old_pointer;
-        size_t index = metadata->size;
-
-        int64_t old_size_temp = slab_cache_index_to_size(index);
-
-        if (old_size_temp == -1)
+        if (rounded_new_size > MALLOC_SLAB_MAX_SIZE)
         {
-            return NULL;
+            return vrealloc(old_pointer, new_size);
         }
 
-        old_size = (size_t)old_size_temp;
+        old_size = vmalloc_size(old_pointer);
     }
     else
     {
-        malloc_metadata_t *metadata = old_pointer;
-        size_t page_count = metadata->size;
-
-        old_size = page_count / PAGE_SIZE;
-    }
-
-    old_pointer = old_pointer + sizeof(malloc_metadata_t) + HEAP_START_ADDR;
+        old_size = slab_pointer_to_cache(old_pointer - HEAP_START_ADDR)->slab_size;
 
-    if (old_size == rounded_new_size)
-    {
-        return old_pointer;
+        if (old_size == rounded_new_size)
+        {
+            return old_pointer;
+        }
     }
 
-    void *new_pointer = malloc(new_size);
-
-    log(WARNING, "malloc new pointer at 0x%p\n", new_pointer);
+    void *new_pointer = malloc_aligned_impl(new_size, 0, 0);
 
     if (!new_pointer)
     {
         return NULL;
     }
 
-    if (old_size > rounded_new_size)
+    if (old_size > new_size)
     {
-        memcpy(new_pointer, old_pointer, rounded_new_size);
+        memcpy(new_pointer, old_pointer, new_size);
     }
     else
     {
         memcpy(new_pointer, old_pointer, old_size);
     }
 
-    free(old_pointer);
+    free_impl(old_pointer);
 
     return new_pointer;
 }
 
-// free memory depending on the address, extract size from metadata
-void free(void *pointer)
+// free() without the heap profiler hooks
+void free_impl(void *pointer)
 {
     if (!pointer)
     {
         return;
     }
 
-    pointer = pointer - HEAP_START_ADDR - sizeof(malloc_metadata_t);
-
-    if (((uint64_t)pointer & 0xFFF) != 0)
+    if (is_vmalloc_address(pointer))
     {
-        malloc_metadata_t *metadata = pointer;
-        size_t index = metadata->size;
+        vfree(pointer);
 
-        slab_cache_free(slab_caches[index], metadata, SLAB_PANIC);
+        return;
     }
-    else
+
+    pointer -= HEAP_START_ADDR;
+
+    slab_cache_free(slab_pointer_to_cache(pointer), pointer, SLAB_PANIC);
+}
+
+// allocate from the size class that fits, zero it if requested (slab objects
+// are recycled, so they are never known to be clean)
+void *malloc_small(size_t size, malloc_flags_t flags)
+{
+    int64_t index = size_to_slab_cache_index(round_alloc_size(size));
+
+    if (index == -1)
     {
-        malloc_metadata_t *metadata = pointer;
-        size_t page_count = metadata->size;
+        return NULL;
+    }
 
-        pmm_free(metadata, page_count);
+    void *pointer = slab_cache_alloc_fast(malloc_slab_caches[index]);
+
+    if (!pointer)
+    {
+        return NULL;
     }
-}
 
-/* utility functions */
+    if (flags & MALLOC_ZERO)
+    {
+        memset(pointer, 0, malloc_slab_caches[index]->slab_size);
+    }
+
+    return pointer + HEAP_START_ADDR;
+}
 
 // round size so that it can be used properly without
 // having to care about rounding
 size_t round_alloc_size(size_t size)
 {
-    if (size <= 512)
+    if (size <= MALLOC_SLAB_MAX_SIZE)
     {
         return next_power_of_two(size);
     }
@@ -270,31 +355,3 @@ int64_t size_to_slab_cache_index(size_t size)
             return -1;
     }
 }
-
-// math cache index to specific size
-int64_t slab_cache_index_to_size(size_t index)
-{
-    switch (index)
-    {
-        case 0:
-            return 16;
-
-        case 1:
-            return 32;
-
-        case 2:
-            return 64;
-
-        case 3:
-            return 128;
-
-        case 4:
-            return 256;
-
-        case 5:
-            return 512;
-
-        default:
-            return -1;
-    }
-}
@@ -20,14 +20,66 @@
 #define MALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
 
-typedef struct
+#include <libk/malloc/heap_profile.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+
+#define MALLOC_SLAB_CACHE_COUNT	6
+#define MALLOC_SLAB_MAX_SIZE	512
+
+// index of the smallest size class (16, 32, ..., 512) that fits size
+#define MALLOC_SIZE_CLASS_INDEX(size)	\
+    ((size) <= 16  ? 0 :		\
+     (size) <= 32  ? 1 :		\
+     (size) <= 64  ? 2 :		\
+     (size) <= 128 ? 3 :		\
+     (size) <= 256 ? 4 : 5)
+
+typedef enum
 {
-    uint16_t size; // slab cache index or page count
-} malloc_metadata_t;
+    MALLOC_ZERO		= (1 << 0),
+    MALLOC_CACHE_ALIGN	= (1 << 1),
+    MALLOC_PAGE_ALIGN	= (1 << 2)
+} malloc_flags_t;
+
+// account an allocation to a memory tag instead of MEM_TAG_HEAP, e.g.
+// malloc_flags(size, MALLOC_TAG(MEM_TAG_STACK)) - only works for allocations
+// bigger than MALLOC_SLAB_MAX_SIZE, as smaller ones share the slabs of the heap
+#define MALLOC_TAG_SHIFT    8
+#define MALLOC_TAG(tag)	    ((malloc_flags_t)(((tag) + 1) << MALLOC_TAG_SHIFT))
 
 void malloc_heap_init(void);
 void *malloc(size_t size);
+void *malloc_flags(size_t size, malloc_flags_t flags);
+void *calloc(size_t count, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size);
+
+extern slab_cache_t *malloc_slab_caches[MALLOC_SLAB_CACHE_COUNT];
+
+// malloc() front end for the common malloc(sizeof(foo)) case - if the size is a
+// compile time constant that fits a slab, the size class is resolved by the
+// compiler and the allocation goes straight to the slab fast path (heap caches
+// panic instead of returning NULL, so no check is needed) - all other sizes
+// take the normal runtime path
+static inline __attribute__((always_inline)) void *kmalloc(size_t size)
+{
+    if (__builtin_constant_p(size) && size > 0 && size <= MALLOC_SLAB_MAX_SIZE)
+    {
+        void *pointer = slab_cache_alloc_fast(malloc_slab_caches[MALLOC_SIZE_CLASS_INDEX(size)]) + HEAP_START_ADDR;
+
+        // kmalloc() is inlined, so the allocation site is the current instruction
+        void *site;
+        asm volatile("lea 0(%%rip), %0" : "=r"(site));
+        heap_profile_alloc(pointer, size, site);
+
+        return pointer;
+    }
+
+    return malloc(size);
+}
 void *realloc(void *old_pointer, size_t new_size);
 void free(void *pointer);
 
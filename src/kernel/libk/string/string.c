@@ -27,31 +27,47 @@
 
 /* core functions */
 
-// fill a block of memory with a certain value
+// fill a block of memory with a certain value - bulk of the block is filled
+// in quadwords, the remaining bytes one by one
 void *memset(void *pointer, uint32_t value, size_t size)
 {
-    uint8_t *buffer_pointer = (uint8_t *)pointer;
+    void *buffer_pointer = pointer;
+    uint64_t pattern = (uint8_t)value * 0x0101010101010101UL;
+    size_t quad_count = size / 8;
+    size_t byte_count = size % 8;
 
-    for (size_t i = 0; i < size; i++)
-    {
-        buffer_pointer[i] = value;
-    }
+    asm volatile("rep stosq"
+                 : "+D"(buffer_pointer), "+c"(quad_count)
+                 : "a"(pattern)
+                 : "memory");
+
+    asm volatile("rep stosb"
+                 : "+D"(buffer_pointer), "+c"(byte_count)
+                 : "a"(pattern)
+                 : "memory");
 
     return pointer;
 }
 
-// copy a block of memory to a certain position
+// copy a block of memory to a certain position - bulk of the data is moved
+// in quadwords, the remaining bytes one by one
 void *memcpy(void *dest, const void *src, size_t n)
 {
-    uint8_t *dest8 = (uint8_t *)dest;
-    const uint8_t *src8 = (uint8_t *)src;
+    void *dest_pointer = dest;
+    size_t quad_count = n / 8;
+    size_t byte_count = n % 8;
 
-    for (size_t i = 0; i < n; i++)
-    {
-        dest8[i] = src8[i];
-    }
+    asm volatile("rep movsq"
+                 : "+D"(dest_pointer), "+S"(src), "+c"(quad_count)
+                 :
+                 : "memory");
+
+    asm volatile("rep movsb"
+                 : "+D"(dest_pointer), "+S"(src), "+c"(byte_count)
+                 :
+                 : "memory");
 
-    return dest8;
+    return dest;
 }
 
 // compare first n bytes at pointer1 with first n bytes at pointer2
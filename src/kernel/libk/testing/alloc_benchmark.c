@@ -0,0 +1,553 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    Multi-CPU throughput benchmarks for the PMM, the slab allocator and malloc(),
+    modeled after threadtest and larson. Every AP runs one worker (handed over
+    with smp_call()), the calling CPU only coordinates. The patterns are:
+	fixed:		   allocate a batch of equally sized objects, then free the batch
+	power_law:	   free and reallocate random live objects, P(size) ~ 1 / size
+	producer_consumer: APs are paired up, one allocates, the other one frees
+    One line per allocator and pattern is printed over COM1:
+	BENCH alloc allocator=slab pattern=fixed cpus=3 ops=... failed=... cycles=...
+	    ops_per_sec=... alloc_p50=... alloc_p99=... free_p50=... free_p99=...
+    Latencies are TSC cycles per call, taken from a log-linear histogram
+    (16 buckets per power of two, so within about 6%). The TSC frequency is
+    calibrated against the HPET.
+
+*/
+
+#include <boot/stivale2.h>
+#include <libk/malloc/malloc.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/alloc_benchmark.h>
+#include <libk/testing/benchmark.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+#include <memory/physical/pmm.h>
+#include <proc/smp/smp.h>
+#include <utility/utils.h>
+
+#define ALLOC_BENCH_SLAB_CACHE_COUNT 6 // 16, 32, ..., 512 bytes
+
+static const char *allocator_names[] = { "pmm", "slab", "malloc" };
+static const char *pattern_names[] = { "fixed", "power_law", "producer_consumer" };
+
+static const char *slab_cache_names[ALLOC_BENCH_SLAB_CACHE_COUNT] =
+{
+    "alloc bench size 16",
+    "alloc bench size 32",
+    "alloc bench size 64",
+    "alloc bench size 128",
+    "alloc bench size 256",
+    "alloc bench size 512"
+};
+
+static slab_cache_t *slab_caches[ALLOC_BENCH_SLAB_CACHE_COUNT];
+static uint64_t tsc_frequency;
+
+/* utility function prototypes */
+
+void alloc_bench_run(alloc_bench_allocator_t allocator, alloc_bench_pattern_t pattern);
+void alloc_bench_report(alloc_bench_run_t *run, alloc_bench_worker_t *workers, size_t worker_count);
+void alloc_bench_worker(void *argument);
+void alloc_bench_fixed(alloc_bench_worker_t *worker);
+void alloc_bench_power_law(alloc_bench_worker_t *worker);
+void alloc_bench_produce(alloc_bench_worker_t *worker);
+void alloc_bench_consume(alloc_bench_worker_t *worker);
+void alloc_bench_alloc(alloc_bench_worker_t *worker, alloc_bench_object_t *object, size_t size);
+void alloc_bench_free(alloc_bench_worker_t *worker, alloc_bench_object_t *object);
+size_t alloc_bench_fixed_size(alloc_bench_allocator_t allocator);
+size_t alloc_bench_power_law_size(alloc_bench_worker_t *worker);
+uint64_t alloc_bench_random(alloc_bench_worker_t *worker);
+size_t alloc_bench_histogram_index(uint64_t cycles);
+uint64_t alloc_bench_histogram_value(size_t index);
+uint64_t alloc_bench_percentile(uint32_t *histogram, uint64_t percent);
+
+/* core functions */
+
+// run every allocator with every pattern on all APs
+void alloc_benchmark_run_all(void)
+{
+    if (smp_get_cpu_count() < 2)
+    {
+        log(WARNING, "Allocator benchmarks need at least one AP - skipped\n");
+
+        return;
+    }
+
+    tsc_frequency = benchmark_tsc_frequency();
+    debug("BENCH tsc frequency=%ld\n", tsc_frequency);
+
+    for (size_t i = 0; i < ALLOC_BENCH_SLAB_CACHE_COUNT; i++)
+    {
+        slab_caches[i] = slab_cache_create(slab_cache_names[i], 16 << i, MEM_TAG_BENCHMARK,
+                                           SLAB_PANIC | SLAB_AUTO_GROW);
+    }
+
+    for (alloc_bench_allocator_t allocator = ALLOC_BENCH_PMM; allocator <= ALLOC_BENCH_MALLOC; allocator++)
+    {
+        for (alloc_bench_pattern_t pattern = ALLOC_BENCH_FIXED; pattern <= ALLOC_BENCH_PRODUCER_CONSUMER; pattern++)
+        {
+            alloc_bench_run(allocator, pattern);
+        }
+    }
+
+    for (size_t i = 0; i < ALLOC_BENCH_SLAB_CACHE_COUNT; i++)
+    {
+        slab_cache_reap(slab_caches[i], 0);
+    }
+}
+
+/* utility functions */
+
+// set up one worker per AP, start them all at once, wait for them and report
+void alloc_bench_run(alloc_bench_allocator_t allocator, alloc_bench_pattern_t pattern)
+{
+    size_t worker_count = smp_get_cpu_count() - 1;
+
+    // producers and consumers come in pairs
+    if (pattern == ALLOC_BENCH_PRODUCER_CONSUMER)
+    {
+        worker_count &= ~1UL;
+    }
+
+    if (!worker_count)
+    {
+        debug("BENCH alloc allocator=%s pattern=%s skipped=1\n",
+              allocator_names[allocator], pattern_names[pattern]);
+
+        return;
+    }
+
+    alloc_bench_run_t run =
+    {
+        .allocator = allocator,
+        .pattern = pattern,
+        .ready_count = 0,
+        .start = false
+    };
+
+    alloc_bench_worker_t *workers = malloc_flags(worker_count * sizeof(alloc_bench_worker_t),
+                                    MALLOC_ZERO | MALLOC_CACHE_ALIGN);
+
+    if (!workers)
+    {
+        log(WARNING, "Allocator benchmark: couldn't allocate workers\n");
+
+        return;
+    }
+
+    uint64_t cpu_number = 0;
+
+    for (size_t i = 0; i < worker_count; i++, cpu_number++)
+    {
+        if (cpu_number == this_cpu()->cpu_number)
+        {
+            cpu_number++;
+        }
+
+        alloc_bench_worker_t *worker = &workers[i];
+
+        worker->run = &run;
+        worker->index = i;
+        worker->cpu_number = cpu_number;
+        worker->random_state = 0x9E3779B97F4A7C15UL * (i + 1);
+        worker->objects = calloc(ALLOC_BENCH_SLOT_COUNT, sizeof(alloc_bench_object_t));
+        worker->alloc_histogram = calloc(ALLOC_BENCH_HISTOGRAM_SIZE, sizeof(uint32_t));
+        worker->free_histogram = calloc(ALLOC_BENCH_HISTOGRAM_SIZE, sizeof(uint32_t));
+
+        if (pattern == ALLOC_BENCH_PRODUCER_CONSUMER)
+        {
+            worker->is_producer = !(i % 2);
+            worker->ring = worker->is_producer ?
+                           malloc_flags(sizeof(alloc_bench_ring_t), MALLOC_ZERO | MALLOC_CACHE_ALIGN) :
+                           workers[i - 1].ring;
+        }
+    }
+
+    for (size_t i = 0; i < worker_count; i++)
+    {
+        smp_call(workers[i].cpu_number, alloc_bench_worker, &workers[i]);
+    }
+
+    while (__atomic_load_n(&run.ready_count, __ATOMIC_ACQUIRE) != worker_count)
+    {
+        asm volatile("pause");
+    }
+
+    __atomic_store_n(&run.start, true, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < worker_count; i++)
+    {
+        smp_call_wait(workers[i].cpu_number);
+    }
+
+    alloc_bench_report(&run, workers, worker_count);
+
+    for (size_t i = 0; i < worker_count; i++)
+    {
+        if (workers[i].is_producer)
+        {
+            free(workers[i].ring);
+        }
+
+        free(workers[i].objects);
+        free(workers[i].alloc_histogram);
+        free(workers[i].free_histogram);
+    }
+
+    free(workers);
+}
+
+// merge the results of all workers (into the first one) and print them
+void alloc_bench_report(alloc_bench_run_t *run, alloc_bench_worker_t *workers, size_t worker_count)
+{
+    uint64_t op_count = 0;
+    uint64_t fail_count = 0;
+    uint64_t start_tsc = UINT64_MAX;
+    uint64_t end_tsc = 0;
+
+    for (size_t i = 0; i < worker_count; i++)
+    {
+        op_count += workers[i].op_count;
+        fail_count += workers[i].fail_count;
+
+        start_tsc = workers[i].start_tsc < start_tsc ? workers[i].start_tsc : start_tsc;
+        end_tsc = workers[i].end_tsc > end_tsc ? workers[i].end_tsc : end_tsc;
+
+        if (!i)
+        {
+            continue;
+        }
+
+        for (size_t j = 0; j < ALLOC_BENCH_HISTOGRAM_SIZE; j++)
+        {
+            workers[0].alloc_histogram[j] += workers[i].alloc_histogram[j];
+            workers[0].free_histogram[j] += workers[i].free_histogram[j];
+        }
+    }
+
+    uint64_t cycles = end_tsc - start_tsc;
+    uint64_t ops_per_sec = cycles ? op_count * tsc_frequency / cycles : 0;
+
+    debug("BENCH alloc allocator=%s pattern=%s cpus=%ld ops=%ld failed=%ld cycles=%ld ops_per_sec=%ld "
+          "alloc_p50=%ld alloc_p99=%ld free_p50=%ld free_p99=%ld\n",
+          allocator_names[run->allocator], pattern_names[run->pattern], worker_count,
+          op_count, fail_count, cycles, ops_per_sec,
+          alloc_bench_percentile(workers[0].alloc_histogram, 50),
+          alloc_bench_percentile(workers[0].alloc_histogram, 99),
+          alloc_bench_percentile(workers[0].free_histogram, 50),
+          alloc_bench_percentile(workers[0].free_histogram, 99));
+}
+
+// entry point of a worker on an AP - wait for all others, then run the pattern
+void alloc_bench_worker(void *argument)
+{
+    alloc_bench_worker_t *worker = (alloc_bench_worker_t *)argument;
+    alloc_bench_run_t *run = worker->run;
+
+    __atomic_add_fetch(&run->ready_count, 1, __ATOMIC_ACQ_REL);
+
+    while (!__atomic_load_n(&run->start, __ATOMIC_ACQUIRE))
+    {
+        asm volatile("pause");
+    }
+
+    worker->start_tsc = asm_rdtsc();
+
+    switch (run->pattern)
+    {
+        case ALLOC_BENCH_FIXED:
+            alloc_bench_fixed(worker);
+            break;
+
+        case ALLOC_BENCH_POWER_LAW:
+            alloc_bench_power_law(worker);
+            break;
+
+        case ALLOC_BENCH_PRODUCER_CONSUMER:
+            if (worker->is_producer)
+            {
+                alloc_bench_produce(worker);
+            }
+            else
+            {
+                alloc_bench_consume(worker);
+            }
+            break;
+    }
+
+    worker->end_tsc = asm_rdtsc();
+
+    // the final slab_cache_reap() can only free what no CPU cache keeps
+    if (run->allocator == ALLOC_BENCH_SLAB)
+    {
+        for (size_t i = 0; i < ALLOC_BENCH_SLAB_CACHE_COUNT; i++)
+        {
+            slab_cache_drain(slab_caches[i]);
+        }
+    }
+}
+
+// threadtest - allocate all slots, free all slots, repeat
+void alloc_bench_fixed(alloc_bench_worker_t *worker)
+{
+    size_t size = alloc_bench_fixed_size(worker->run->allocator);
+
+    for (size_t done = 0; done < ALLOC_BENCH_OP_COUNT; done += ALLOC_BENCH_SLOT_COUNT)
+    {
+        for (size_t i = 0; i < ALLOC_BENCH_SLOT_COUNT; i++)
+        {
+            alloc_bench_alloc(worker, &worker->objects[i], size);
+        }
+
+        for (size_t i = 0; i < ALLOC_BENCH_SLOT_COUNT; i++)
+        {
+            alloc_bench_free(worker, &worker->objects[i]);
+        }
+    }
+}
+
+// larson - keep the slots filled, replace a random one per step
+void alloc_bench_power_law(alloc_bench_worker_t *worker)
+{
+    for (size_t i = 0; i < ALLOC_BENCH_SLOT_COUNT; i++)
+    {
+        alloc_bench_alloc(worker, &worker->objects[i], alloc_bench_power_law_size(worker));
+    }
+
+    for (size_t done = ALLOC_BENCH_SLOT_COUNT; done < ALLOC_BENCH_OP_COUNT; done++)
+    {
+        alloc_bench_object_t *object = &worker->objects[alloc_bench_random(worker) % ALLOC_BENCH_SLOT_COUNT];
+
+        alloc_bench_free(worker, object);
+        alloc_bench_alloc(worker, object, alloc_bench_power_law_size(worker));
+    }
+
+    for (size_t i = 0; i < ALLOC_BENCH_SLOT_COUNT; i++)
+    {
+        alloc_bench_free(worker, &worker->objects[i]);
+    }
+}
+
+// allocate objects and pass them to the consumer through the ring
+void alloc_bench_produce(alloc_bench_worker_t *worker)
+{
+    alloc_bench_ring_t *ring = worker->ring;
+    size_t size = alloc_bench_fixed_size(worker->run->allocator);
+
+    for (size_t tail = 0; tail < ALLOC_BENCH_OP_COUNT; tail++)
+    {
+        alloc_bench_object_t object;
+        alloc_bench_alloc(worker, &object, size);
+
+        while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ALLOC_BENCH_RING_SIZE)
+        {
+            asm volatile("pause");
+        }
+
+        ring->objects[tail % ALLOC_BENCH_RING_SIZE] = object;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// free the objects of the producer - i.e. on another CPU than they were allocated
+void alloc_bench_consume(alloc_bench_worker_t *worker)
+{
+    alloc_bench_ring_t *ring = worker->ring;
+
+    for (size_t head = 0; head < ALLOC_BENCH_OP_COUNT; head++)
+    {
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+        {
+            asm volatile("pause");
+        }
+
+        alloc_bench_object_t object = ring->objects[head % ALLOC_BENCH_RING_SIZE];
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+        alloc_bench_free(worker, &object);
+    }
+}
+
+// allocate an object from the allocator of the run and record the latency
+void alloc_bench_alloc(alloc_bench_worker_t *worker, alloc_bench_object_t *object, size_t size)
+{
+    void *pointer;
+
+    uint64_t start = asm_rdtsc();
+
+    switch (worker->run->allocator)
+    {
+        case ALLOC_BENCH_PMM:
+            pointer = pmm_alloc(size, MEM_TAG_BENCHMARK);
+            break;
+
+        case ALLOC_BENCH_SLAB:
+            pointer = slab_cache_alloc_fast(slab_caches[__builtin_ctzl(size) - 4]);
+            break;
+
+        default:
+            pointer = malloc(size);
+            break;
+    }
+
+    uint64_t cycles = asm_rdtsc() - start;
+
+    object->pointer = pointer;
+    object->size = size;
+
+    if (!pointer)
+    {
+        worker->fail_count++;
+
+        return;
+    }
+
+    worker->alloc_histogram[alloc_bench_histogram_index(cycles)]++;
+    worker->op_count++;
+}
+
+// give an object back to the allocator of the run and record the latency
+void alloc_bench_free(alloc_bench_worker_t *worker, alloc_bench_object_t *object)
+{
+    if (!object->pointer)
+    {
+        return;
+    }
+
+    uint64_t start = asm_rdtsc();
+
+    switch (worker->run->allocator)
+    {
+        case ALLOC_BENCH_PMM:
+            pmm_free(object->pointer, object->size, MEM_TAG_BENCHMARK);
+            break;
+
+        case ALLOC_BENCH_SLAB:
+            slab_cache_free(slab_caches[__builtin_ctzl(object->size) - 4], object->pointer, 0);
+            break;
+
+        default:
+            free(object->pointer);
+            break;
+    }
+
+    uint64_t cycles = asm_rdtsc() - start;
+
+    object->pointer = NULL;
+
+    worker->free_histogram[alloc_bench_histogram_index(cycles)]++;
+    worker->op_count++;
+}
+
+// one page or one 64 byte object
+size_t alloc_bench_fixed_size(alloc_bench_allocator_t allocator)
+{
+    return allocator == ALLOC_BENCH_PMM ? 1 : 64;
+}
+
+// each doubling of the size halves its probability - 1 to 16 pages for the PMM,
+// 16 to 512 bytes for the slab allocator and 16 bytes to 128 KiB for malloc()
+size_t alloc_bench_power_law_size(alloc_bench_worker_t *worker)
+{
+    uint64_t random = alloc_bench_random(worker);
+
+    switch (worker->run->allocator)
+    {
+        case ALLOC_BENCH_PMM:
+            return 1UL << __builtin_ctzl(random | (1 << 4));
+
+        case ALLOC_BENCH_SLAB:
+            return 16UL << __builtin_ctzl(random | (1 << 5));
+
+        default:
+        {
+            // malloc() takes any size, so spread it over the whole power of two
+            size_t base = 16UL << __builtin_ctzl(random | (1 << 12));
+
+            return base + (random >> 32) % base;
+        }
+    }
+}
+
+// xorshift64 pseudo random number generator (state per worker)
+uint64_t alloc_bench_random(alloc_bench_worker_t *worker)
+{
+    worker->random_state ^= worker->random_state << 13;
+    worker->random_state ^= worker->random_state >> 7;
+    worker->random_state ^= worker->random_state << 17;
+
+    return worker->random_state;
+}
+
+// log-linear bucket of a latency - exact below 16 cycles, then 16 buckets per power of two
+size_t alloc_bench_histogram_index(uint64_t cycles)
+{
+    if (cycles < 16)
+    {
+        return cycles;
+    }
+
+    size_t log2 = 63 - __builtin_clzl(cycles);
+
+    return (log2 - 3) * 16 + ((cycles >> (log2 - 4)) & 15);
+}
+
+// lower bound of the latencies in a bucket
+uint64_t alloc_bench_histogram_value(size_t index)
+{
+    if (index < 16)
+    {
+        return index;
+    }
+
+    size_t log2 = index / 16 + 3;
+
+    return (16 + index % 16) << (log2 - 4);
+}
+
+// latency which percent percent of all samples don't exceed
+uint64_t alloc_bench_percentile(uint32_t *histogram, uint64_t percent)
+{
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < ALLOC_BENCH_HISTOGRAM_SIZE; i++)
+    {
+        total += histogram[i];
+    }
+
+    uint64_t rank = (total * percent + 99) / 100;
+    uint64_t count = 0;
+
+    for (size_t i = 0; i < ALLOC_BENCH_HISTOGRAM_SIZE; i++)
+    {
+        count += histogram[i];
+
+        if (count && count >= rank)
+        {
+            return alloc_bench_histogram_value(i);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ALLOC_BENCHMARK_H
+#define ALLOC_BENCHMARK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory/mem.h>
+
+#define ALLOC_BENCH_OP_COUNT	    (64 * 1024) // allocations per worker and run
+#define ALLOC_BENCH_SLOT_COUNT	    256		// live objects per worker
+#define ALLOC_BENCH_RING_SIZE	    256		// producer/consumer queue length (power of two)
+#define ALLOC_BENCH_HISTOGRAM_SIZE  1024
+
+typedef enum
+{
+    ALLOC_BENCH_PMM,
+    ALLOC_BENCH_SLAB,
+    ALLOC_BENCH_MALLOC
+} alloc_bench_allocator_t;
+
+typedef enum
+{
+    ALLOC_BENCH_FIXED,		    // threadtest: allocate a batch, free the batch
+    ALLOC_BENCH_POWER_LAW,	    // larson: replace random live objects, P(size) ~ 1 / size
+    ALLOC_BENCH_PRODUCER_CONSUMER   // one CPU allocates, another one frees
+} alloc_bench_pattern_t;
+
+typedef struct
+{
+    void *pointer;
+    size_t size; // pages for the PMM, bytes otherwise
+} alloc_bench_object_t;
+
+// single producer, single consumer queue between two workers
+typedef struct
+{
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    alloc_bench_object_t objects[ALLOC_BENCH_RING_SIZE];
+} alloc_bench_ring_t;
+
+// state shared by all workers of one run
+typedef struct
+{
+    alloc_bench_allocator_t allocator;
+    alloc_bench_pattern_t pattern;
+
+    size_t ready_count;
+    bool start;
+} alloc_bench_run_t;
+
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE)))
+{
+    alloc_bench_run_t *run;
+
+    size_t index;
+    uint64_t cpu_number;
+    uint64_t random_state;
+
+    alloc_bench_object_t *objects; // ALLOC_BENCH_SLOT_COUNT live objects
+
+    alloc_bench_ring_t *ring;	// only for producer/consumer
+    bool is_producer;
+
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    uint64_t op_count;		// allocations + frees
+    uint64_t fail_count;
+
+    uint32_t *alloc_histogram;	// latencies in TSC cycles
+    uint32_t *free_histogram;
+} alloc_bench_worker_t;
+
+void alloc_benchmark_run_all(void);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    In-kernel benchmarks. Results are printed as one line per measurement
+    over COM1 (prefixed with 'BENCH'), so they can easily be grepped and
+    parsed on the host. Timing is done in TSC cycles.
+
+*/
+
+#include <hardware/hpet/hpet.h>
+#include <libk/malloc/malloc.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <libk/testing/alloc_benchmark.h>
+#include <libk/testing/benchmark.h>
+#include <libk/testing/cow_benchmark.h>
+#include <libk/testing/fault_benchmark.h>
+#include <libk/testing/ksm_benchmark.h>
+#include <libk/testing/map_pages_benchmark.h>
+#include <libk/testing/pcid_benchmark.h>
+#include <libk/testing/pt_reclaim_benchmark.h>
+#include <libk/testing/region_benchmark.h>
+#include <libk/testing/stream_benchmark.h>
+#include <libk/testing/thp_benchmark.h>
+#include <libk/testing/tlb_benchmark.h>
+#include <libk/testing/zero_page_benchmark.h>
+#include <libk/testing/zstore_benchmark.h>
+#include <memory/mem.h>
+#include <utility/utils.h>
+
+#define REALLOC_BENCH_MIN_SIZE	(4 * 1024)
+#define REALLOC_BENCH_MAX_SIZE	(64 * 1024 * 1024)
+#define HEAP_PROFILE_BENCH_INTERVAL	(64 * 1024)
+
+// QEMU's isa-debug-exit device (see 'make run_bench') - writing to it ends QEMU
+#define BENCHMARK_EXIT_PORT	0xF4
+
+/* utility function prototypes */
+
+void benchmark_realloc_doubling(void);
+void benchmark_copy_doubling(void);
+
+/* core functions */
+
+// run every benchmark one after another
+void benchmark_run_all(void)
+{
+    log(INFO, "Running benchmarks\n");
+
+    // sample the heap while the benchmarks run, to see who allocates what
+    heap_profile_start(HEAP_PROFILE_BENCH_INTERVAL);
+
+    benchmark_realloc_doubling();
+    benchmark_copy_doubling();
+
+    heap_profile_stop();
+    heap_profile_dump();
+
+    alloc_benchmark_run_all();
+    stream_benchmark_run_all();
+    tlb_benchmark_run_all();
+    pcid_benchmark_run_all();
+    fault_benchmark_run_all();
+    cow_benchmark_run_all();
+    region_benchmark_run_all();
+    pt_reclaim_benchmark_run_all();
+    zero_page_benchmark_run_all();
+    map_pages_benchmark_run_all();
+    thp_benchmark_run_all();
+    ksm_benchmark_run_all();
+    zstore_benchmark_run_all();
+
+    log(INFO, "All benchmarks done\n");
+
+    // headless runs end here, everywhere else this is a no-op
+    asm_io_outb(BENCHMARK_EXIT_PORT, 0);
+}
+
+// count TSC ticks during 10ms of HPET time
+uint64_t benchmark_tsc_frequency(void)
+{
+    uint64_t start = asm_rdtsc();
+    hpet_usleep(10000);
+
+    return (asm_rdtsc() - start) * 100;
+}
+
+/* utility functions */
+
+// grow a buffer by repeatedly doubling it with realloc()
+void benchmark_realloc_doubling(void)
+{
+    uint64_t total_cycles = 0;
+    size_t moved_count = 0;
+
+    uint8_t *buffer = malloc(REALLOC_BENCH_MIN_SIZE);
+
+    if (!buffer)
+    {
+        log(WARNING, "realloc_doubling: initial allocation failed\n");
+
+        return;
+    }
+
+    buffer[0] = 0xAB;
+
+    for (size_t size = REALLOC_BENCH_MIN_SIZE * 2; size <= REALLOC_BENCH_MAX_SIZE; size *= 2)
+    {
+        uint64_t start = asm_rdtsc();
+        uint8_t *new_buffer = realloc(buffer, size);
+        uint64_t cycles = asm_rdtsc() - start;
+
+        if (!new_buffer)
+        {
+            log(WARNING, "realloc_doubling: realloc to %ld bytes failed\n", size);
+            free(buffer);
+
+            return;
+        }
+
+        bool moved = new_buffer != buffer;
+        moved_count += moved;
+        total_cycles += cycles;
+
+        buffer = new_buffer;
+        buffer[size - 1] = 0xCD;
+
+        debug("BENCH realloc_doubling size=%ld cycles=%ld moved=%d\n", size, cycles, moved);
+    }
+
+    if (buffer[0] != 0xAB)
+    {
+        log(WARNING, "realloc_doubling: contents were not preserved\n");
+    }
+
+    free(buffer);
+
+    debug("BENCH realloc_doubling total_cycles=%ld moved_count=%ld\n", total_cycles, moved_count);
+}
+
+// same growth pattern as benchmark_realloc_doubling(), but always allocate,
+// copy and free - this is the reference for what realloc() has to beat
+void benchmark_copy_doubling(void)
+{
+    uint64_t total_cycles = 0;
+
+    uint8_t *buffer = malloc(REALLOC_BENCH_MIN_SIZE);
+
+    if (!buffer)
+    {
+        log(WARNING, "copy_doubling: initial allocation failed\n");
+
+        return;
+    }
+
+    for (size_t size = REALLOC_BENCH_MIN_SIZE * 2; size <= REALLOC_BENCH_MAX_SIZE; size *= 2)
+    {
+        uint64_t start = asm_rdtsc();
+        uint8_t *new_buffer = malloc(size);
+
+        if (!new_buffer)
+        {
+            log(WARNING, "copy_doubling: allocation of %ld bytes failed\n", size);
+            free(buffer);
+
+            return;
+        }
+
+        memcpy(new_buffer, buffer, size / 2);
+        free(buffer);
+        uint64_t cycles = asm_rdtsc() - start;
+
+        total_cycles += cycles;
+        buffer = new_buffer;
+
+        debug("BENCH copy_doubling size=%ld cycles=%ld\n", size, cycles);
+    }
+
+    free(buffer);
+
+    debug("BENCH copy_doubling total_cycles=%ld\n", total_cycles);
+}
@@ -0,0 +1,185 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Fork plus exec: a parent space with COW_BENCH_SIZE of written anonymous
+    memory is duplicated and the copy is thrown away again right after (which
+    is what exec does with it). Afterwards the parent writes all of its pages
+    once more. This is done once with vmm_clone_space() (copy-on-write, the
+    parent's writes fault, but find the frames unshared again) and once with
+    an eager copy of every page:
+	BENCH cow mode=cow pages=65536 clone_cycles=... exec_cycles=...
+	parent_write_cycles=... total_cycles=... cow_copies=... cow_reuses=...
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <libk/testing/cow_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+vmm_space_t *cow_bench_create_space(void);
+vmm_space_t *cow_bench_copy_eager(vmm_space_t *parent);
+void cow_bench_write_all(uint8_t value);
+void cow_bench_run(vmm_space_t *parent, const char *mode, vmm_space_t *(*copy)(vmm_space_t *space));
+
+/* core functions */
+
+// clone and throw away a populated space with and without copy-on-write
+void cow_benchmark_run_all(void)
+{
+    vmm_space_t *parent = cow_bench_create_space();
+
+    if (!parent)
+    {
+        log(WARNING, "cow: address space creation failed - skipped\n");
+
+        return;
+    }
+
+    vmm_switch_space(parent);
+
+    // every page is backed by its own frame from here on
+    cow_bench_write_all(1);
+
+    cow_bench_run(parent, "cow", vmm_clone_space);
+    cow_bench_run(parent, "eager", cow_bench_copy_eager);
+
+    vmm_switch_space(vmm_get_kernel_space());
+    vmm_space_destroy(parent);
+}
+
+/* utility functions */
+
+// new space with a demand paged region at COW_BENCH_ADDR
+vmm_space_t *cow_bench_create_space(void)
+{
+    vmm_space_t *space = vmm_space_create();
+
+    if (!space)
+    {
+        return NULL;
+    }
+
+    if (!vmm_region_map(space, COW_BENCH_ADDR, COW_BENCH_SIZE, KERNEL_READ_WRITE, PAT_WRITE_BACK,
+                        MEM_TAG_BENCHMARK))
+    {
+        vmm_space_destroy(space);
+
+        return NULL;
+    }
+
+    return space;
+}
+
+// what duplicating a space costs without copy-on-write: a frame and a copy per page
+vmm_space_t *cow_bench_copy_eager(vmm_space_t *parent)
+{
+    vmm_space_t *space = cow_bench_create_space();
+
+    if (!space)
+    {
+        return NULL;
+    }
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    for (uint64_t address = COW_BENCH_ADDR; address < COW_BENCH_ADDR + COW_BENCH_SIZE; address += PAGE_SIZE)
+    {
+        uint64_t *pte = vmm_get_pte(parent, address);
+
+        if (!pte || !(*pte & PTE_PRESENT))
+        {
+            continue;
+        }
+
+        void *frame = pmm_alloc(1, MEM_TAG_BENCHMARK);
+
+        if (!frame)
+        {
+            break;
+        }
+
+        memcpy((void *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)frame),
+               (void *)PHYS_TO_HIGHER_HALF_DATA(*pte & PTE_ADDRESS_MASK), PAGE_SIZE);
+
+        vmm_map_page_gather(&gather, (uint64_t)frame, address, KERNEL_READ_WRITE, PAT_WRITE_BACK);
+    }
+
+    tlb_gather_finish(&gather);
+
+    return space;
+}
+
+// write one byte of every page of the loaded space
+void cow_bench_write_all(uint8_t value)
+{
+    for (uint64_t address = COW_BENCH_ADDR; address < COW_BENCH_ADDR + COW_BENCH_SIZE; address += PAGE_SIZE)
+    {
+        *(volatile uint8_t *)address = value;
+    }
+}
+
+// copy the parent, destroy the copy and write to the parent again
+void cow_bench_run(vmm_space_t *parent, const char *mode, vmm_space_t *(*copy)(vmm_space_t *space))
+{
+    page_fault_reset_stats();
+
+    uint64_t start = asm_rdtsc();
+    vmm_space_t *child = copy(parent);
+    uint64_t clone_cycles = asm_rdtsc() - start;
+
+    if (!child)
+    {
+        log(WARNING, "cow: %s copy failed - skipped\n", mode);
+
+        return;
+    }
+
+    start = asm_rdtsc();
+    vmm_space_destroy(child);
+    uint64_t exec_cycles = asm_rdtsc() - start;
+
+    start = asm_rdtsc();
+    cow_bench_write_all(2);
+    uint64_t write_cycles = asm_rdtsc() - start;
+
+    page_fault_stats_t stats;
+    page_fault_get_stats(&stats);
+
+    debug("BENCH cow mode=%s pages=%ld clone_cycles=%ld exec_cycles=%ld parent_write_cycles=%ld "
+          "total_cycles=%ld cow_copies=%ld cow_reuses=%ld\n",
+          mode, COW_BENCH_SIZE / PAGE_SIZE, clone_cycles, exec_cycles, write_cycles,
+          clone_cycles + exec_cycles + write_cycles, stats.cow_copies, stats.cow_reuses);
+}
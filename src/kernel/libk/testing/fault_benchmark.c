@@ -0,0 +1,107 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Cost of demand paging: a FAULT_BENCH_SIZE region of the kernel space is
+    created without any frames, one byte of it is written per page (sequential)
+    or per FAULT_BENCH_STRIDE (sparse), so every first access of a page faults.
+    Both patterns run without fault-around and with the default window. One
+    line per run is printed over COM1:
+	BENCH page_fault pattern=sequential fault_around=16 touched_pages=16384 cycles=...
+	cycles_per_touch=... faults=... avg_fault_cycles=... max_fault_cycles=...
+	fault_around_pages=... fault_around_hits=...
+    Fault-around hits are only known once the region is unmapped (the accessed
+    bits of the prefaulted pages are read then), so this is included.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/fault_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+void fault_bench_run(const char *pattern, size_t stride, size_t around_pages);
+
+/* core functions */
+
+// touch a demand paged region with and without fault-around
+void fault_benchmark_run_all(void)
+{
+    fault_bench_run("sequential", PAGE_SIZE, 1);
+    fault_bench_run("sequential", PAGE_SIZE, FAULT_AROUND_DEFAULT_PAGES);
+
+    fault_bench_run("sparse", FAULT_BENCH_STRIDE, 1);
+    fault_bench_run("sparse", FAULT_BENCH_STRIDE, FAULT_AROUND_DEFAULT_PAGES);
+
+    page_fault_set_around_pages(FAULT_AROUND_DEFAULT_PAGES);
+    page_fault_reset_stats();
+}
+
+/* utility functions */
+
+// write one byte every stride bytes of a fresh region and print the fault counters
+void fault_bench_run(const char *pattern, size_t stride, size_t around_pages)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+
+    if (!vmm_region_map(space, FAULT_BENCH_START_ADDR, FAULT_BENCH_SIZE, KERNEL_READ_WRITE,
+                        PAT_WRITE_BACK, MEM_TAG_BENCHMARK))
+    {
+        log(WARNING, "page_fault: region creation failed - skipped\n");
+
+        return;
+    }
+
+    page_fault_set_around_pages(around_pages);
+    page_fault_reset_stats();
+
+    size_t touch_count = 0;
+    uint64_t start = asm_rdtsc();
+
+    for (uint64_t offset = 0; offset < FAULT_BENCH_SIZE; offset += stride)
+    {
+        *(volatile uint8_t *)(FAULT_BENCH_START_ADDR + offset) = 1;
+        touch_count++;
+    }
+
+    uint64_t cycles = asm_rdtsc() - start;
+
+    vmm_region_unmap(space, FAULT_BENCH_START_ADDR, FAULT_BENCH_SIZE);
+
+    page_fault_stats_t stats;
+    page_fault_get_stats(&stats);
+
+    debug("BENCH page_fault pattern=%s fault_around=%ld touched_pages=%ld cycles=%ld "
+          "cycles_per_touch=%ld faults=%ld avg_fault_cycles=%ld max_fault_cycles=%ld "
+          "fault_around_pages=%ld fault_around_hits=%ld\n",
+          pattern, around_pages, touch_count, cycles, cycles / touch_count, stats.minor_faults,
+          stats.minor_faults ? stats.total_cycles / stats.minor_faults : 0, stats.max_cycles,
+          stats.fault_around_pages, stats.fault_around_hits);
+}
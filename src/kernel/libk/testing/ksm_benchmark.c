@@ -0,0 +1,248 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+
+    Brief file description:
+    Server instances with largely identical memory: KSM_BENCH_INSTANCES
+    spaces each fill KSM_BENCH_SIZE - the first half with the same tables,
+    a quarter zero-filled and a quarter with data of their own. They are
+    filled with huge pages, which the scanner splits after they opted in.
+    The background scanner (idle work of an AP) runs two passes and merges
+    what's identical. Afterwards the contents are checked, and a write to a
+    merged page must not show up in the other instances:
+	BENCH ksm instances=4 pages=16384 scanned=... huge_split=32 cycles_per_page=...
+	merged=... zeroed=... frames_shared=... frames_saved=... freed_frames=...
+    Without an AP to run the scanner, the passes run on the BSP after
+    KSM_BENCH_TIMEOUT_US.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <hardware/hpet/hpet.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/ksm_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/ksm.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+#define KSM_BENCH_PAGES		(KSM_BENCH_SIZE / PAGE_SIZE)
+#define KSM_BENCH_ZERO_START	(KSM_BENCH_PAGES / 2)
+#define KSM_BENCH_OWN_START	(KSM_BENCH_PAGES * 3 / 4)
+#define KSM_BENCH_PAGES_PER_RUN	4096
+#define KSM_BENCH_POLL_US	1000
+#define KSM_BENCH_TIMEOUT_US	10000000
+
+/* utility function prototypes */
+
+bool ksm_bench_create(vmm_space_t **spaces);
+void ksm_bench_run(vmm_space_t **spaces);
+bool ksm_bench_wait_passes(uint64_t pass_count);
+void ksm_bench_fill(size_t instance);
+uint64_t ksm_bench_expected(size_t instance, size_t page, size_t word);
+bool ksm_bench_check(size_t instance);
+
+/* core functions */
+
+// merge the pages of identical instances and check that nothing got mixed up
+void ksm_benchmark_run_all(void)
+{
+    vmm_space_t *spaces[KSM_BENCH_INSTANCES] = { NULL };
+
+    if (ksm_bench_create(spaces))
+    {
+        ksm_bench_run(spaces);
+    }
+    else
+    {
+        log(WARNING, "ksm: space creation failed - skipped\n");
+    }
+
+    vmm_switch_space(vmm_get_kernel_space());
+
+    for (size_t i = 0; i < KSM_BENCH_INSTANCES; i++)
+    {
+        if (spaces[i])
+        {
+            vmm_space_destroy(spaces[i]);
+        }
+    }
+
+    // ends the pass, which drops the stable frames nobody maps anymore
+    ksm_scan(1);
+
+    ksm_dump_stats();
+}
+
+/* utility functions */
+
+// create and fill the spaces of all instances, then let them opt in
+bool ksm_bench_create(vmm_space_t **spaces)
+{
+    for (size_t i = 0; i < KSM_BENCH_INSTANCES; i++)
+    {
+        spaces[i] = vmm_space_create();
+
+        if (!spaces[i] || !vmm_region_map(spaces[i], KSM_BENCH_ADDR, KSM_BENCH_SIZE, KERNEL_READ_WRITE,
+                                          PAT_WRITE_BACK, MEM_TAG_BENCHMARK))
+        {
+            return false;
+        }
+
+        vmm_switch_space(spaces[i]);
+        ksm_bench_fill(i);
+
+        ksm_set_mergeable(spaces[i], true);
+    }
+
+    vmm_switch_space(vmm_get_kernel_space());
+
+    return true;
+}
+
+// let the scanner do two passes, print what was merged and check the contents
+void ksm_bench_run(vmm_space_t **spaces)
+{
+    ksm_reset_stats();
+
+    size_t used_before = pmm_get_used_page_count();
+
+    ksm_set_scan_rate(KSM_BENCH_PAGES_PER_RUN, 0);
+    ksm_set_enabled(true);
+
+    bool worker_done = ksm_bench_wait_passes(2);
+
+    ksm_set_enabled(false);
+    ksm_set_scan_rate(KSM_DEFAULT_PAGES_PER_RUN, KSM_DEFAULT_SLEEP_US);
+
+    if (!worker_done)
+    {
+        log(WARNING, "ksm: the scanner didn't finish two passes, scanning on the BSP\n");
+
+        ksm_scan(2 * KSM_BENCH_INSTANCES * KSM_BENCH_PAGES);
+    }
+
+    size_t used_after = pmm_get_used_page_count();
+
+    ksm_stats_t stats;
+    ksm_get_stats(&stats);
+
+    debug("BENCH ksm instances=%d pages=%ld scanned=%ld huge_split=%ld cycles_per_page=%ld merged=%ld zeroed=%ld "
+          "frames_shared=%ld frames_saved=%ld freed_frames=%ld\n",
+          KSM_BENCH_INSTANCES, KSM_BENCH_INSTANCES * KSM_BENCH_PAGES, stats.pages_scanned, stats.huge_pages_split,
+          stats.pages_scanned ? stats.scan_cycles / stats.pages_scanned : 0, stats.pages_merged,
+          stats.pages_zeroed, stats.frames_shared, stats.frames_saved, used_before - used_after);
+
+    for (size_t i = 0; i < KSM_BENCH_INSTANCES; i++)
+    {
+        vmm_switch_space(spaces[i]);
+
+        if (!ksm_bench_check(i))
+        {
+            log(WARNING, "ksm: contents of instance %ld changed by merging\n", i);
+        }
+    }
+
+    // break up a merged table page of the first instance, the others keep it
+    vmm_switch_space(spaces[0]);
+    *(volatile uint64_t *)KSM_BENCH_ADDR = ~0UL;
+    vmm_switch_space(spaces[1]);
+
+    if (*(volatile uint64_t *)KSM_BENCH_ADDR != ksm_bench_expected(1, 0, 0))
+    {
+        log(WARNING, "ksm: a write to a merged page reached another instance\n");
+    }
+}
+
+// wait until the background scanner ended pass_count passes - false after
+// KSM_BENCH_TIMEOUT_US
+bool ksm_bench_wait_passes(uint64_t pass_count)
+{
+    ksm_stats_t stats;
+
+    for (uint64_t waited = 0; waited < KSM_BENCH_TIMEOUT_US; waited += KSM_BENCH_POLL_US)
+    {
+        ksm_get_stats(&stats);
+
+        if (stats.full_scans >= pass_count)
+        {
+            return true;
+        }
+
+        hpet_usleep(KSM_BENCH_POLL_US);
+    }
+
+    return false;
+}
+
+// write every page of the loaded instance
+void ksm_bench_fill(size_t instance)
+{
+    for (size_t page = 0; page < KSM_BENCH_PAGES; page++)
+    {
+        volatile uint64_t *words = (volatile uint64_t *)(KSM_BENCH_ADDR + page * PAGE_SIZE);
+
+        for (size_t word = 0; word < PAGE_SIZE / sizeof(uint64_t); word++)
+        {
+            words[word] = ksm_bench_expected(instance, page, word);
+        }
+    }
+}
+
+// contents of a word: shared tables, zeros or the instance's own data
+uint64_t ksm_bench_expected(size_t instance, size_t page, size_t word)
+{
+    if (page < KSM_BENCH_ZERO_START)
+    {
+        return page * 0x9E3779B97F4A7C15 + word;
+    }
+
+    if (page < KSM_BENCH_OWN_START)
+    {
+        return 0;
+    }
+
+    return (instance << 48) | (page << 16) | word;
+}
+
+// whether the loaded instance still has its contents
+bool ksm_bench_check(size_t instance)
+{
+    for (size_t page = 0; page < KSM_BENCH_PAGES; page++)
+    {
+        volatile uint64_t *words = (volatile uint64_t *)(KSM_BENCH_ADDR + page * PAGE_SIZE);
+
+        for (size_t word = 0; word < PAGE_SIZE / sizeof(uint64_t); word++)
+        {
+            if (words[word] != ksm_bench_expected(instance, page, word))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
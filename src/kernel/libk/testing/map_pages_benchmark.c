@@ -0,0 +1,157 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Mapping MAP_PAGES_BENCH_COUNT scattered frames (every other frame of the
+    ones allocated, so no two are next to each other) to a contiguous virtual
+    range of the kernel space: one vmm_map_page() per frame, one
+    vmm_map_page_gather() per frame and a single vmm_map_pages(). Every round
+    unmaps the range again, which frees the page tables, so each mode pays for
+    creating them. The fastest of MAP_PAGES_BENCH_ROUNDS rounds is printed:
+	BENCH map_pages mode=array pages=16384 cycles=... cycles_per_page=...
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/map_pages_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmalloc.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+uint64_t map_pages_bench_single(const uint64_t *frames);
+uint64_t map_pages_bench_gather(const uint64_t *frames);
+uint64_t map_pages_bench_array(const uint64_t *frames);
+void map_pages_bench_run(const char *mode, const uint64_t *frames, uint64_t (*map)(const uint64_t *frames));
+
+/* core functions */
+
+// map scattered frames page by page and as one array
+void map_pages_benchmark_run_all(void)
+{
+    uint64_t *frames = vmalloc(MAP_PAGES_BENCH_COUNT * sizeof(uint64_t), MEM_TAG_BENCHMARK, 0);
+
+    if (!frames)
+    {
+        log(WARNING, "map_pages: frame array allocation failed - skipped\n");
+
+        return;
+    }
+
+    // twice as many frames, only every other one is mapped
+    void *range = pmm_alloc(2 * MAP_PAGES_BENCH_COUNT, MEM_TAG_BENCHMARK);
+
+    if (!range)
+    {
+        log(WARNING, "map_pages: frame allocation failed - skipped\n");
+        vfree(frames);
+
+        return;
+    }
+
+    for (size_t i = 0; i < MAP_PAGES_BENCH_COUNT; i++)
+    {
+        frames[i] = (uint64_t)range + 2 * i * PAGE_SIZE;
+    }
+
+    map_pages_bench_run("single", frames, map_pages_bench_single);
+    map_pages_bench_run("gather", frames, map_pages_bench_gather);
+    map_pages_bench_run("array", frames, map_pages_bench_array);
+
+    pmm_free(range, 2 * MAP_PAGES_BENCH_COUNT, MEM_TAG_BENCHMARK);
+    vfree(frames);
+}
+
+/* utility functions */
+
+// one vmm_map_page() per frame - walks and sets up a gather every time
+uint64_t map_pages_bench_single(const uint64_t *frames)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+    uint64_t start = asm_rdtsc();
+
+    for (size_t i = 0; i < MAP_PAGES_BENCH_COUNT; i++)
+    {
+        vmm_map_page(space, frames[i], MAP_PAGES_BENCH_ADDR + i * PAGE_SIZE, KERNEL_READ_WRITE, PAT_WRITE_BACK);
+    }
+
+    return asm_rdtsc() - start;
+}
+
+// one vmm_map_page_gather() per frame - walks every time, one gather
+uint64_t map_pages_bench_gather(const uint64_t *frames)
+{
+    tlb_gather_t gather;
+    uint64_t start = asm_rdtsc();
+
+    tlb_gather_init(&gather, vmm_get_kernel_space());
+
+    for (size_t i = 0; i < MAP_PAGES_BENCH_COUNT; i++)
+    {
+        vmm_map_page_gather(&gather, frames[i], MAP_PAGES_BENCH_ADDR + i * PAGE_SIZE, KERNEL_READ_WRITE,
+                            PAT_WRITE_BACK);
+    }
+
+    tlb_gather_finish(&gather);
+
+    return asm_rdtsc() - start;
+}
+
+// all frames at once - walks once per page table
+uint64_t map_pages_bench_array(const uint64_t *frames)
+{
+    uint64_t start = asm_rdtsc();
+
+    vmm_map_pages(vmm_get_kernel_space(), MAP_PAGES_BENCH_ADDR, frames, MAP_PAGES_BENCH_COUNT, KERNEL_READ_WRITE,
+                  PAT_WRITE_BACK);
+
+    return asm_rdtsc() - start;
+}
+
+// print the fastest of some rounds of mapping and unmapping
+void map_pages_bench_run(const char *mode, const uint64_t *frames, uint64_t (*map)(const uint64_t *frames))
+{
+    uint64_t min_cycles = UINT64_MAX;
+
+    for (size_t round = 0; round < MAP_PAGES_BENCH_ROUNDS; round++)
+    {
+        uint64_t cycles = map(frames);
+
+        if (cycles < min_cycles)
+        {
+            min_cycles = cycles;
+        }
+
+        vmm_unmap_range(vmm_get_kernel_space(), MAP_PAGES_BENCH_ADDR,
+                        MAP_PAGES_BENCH_ADDR + MAP_PAGES_BENCH_COUNT * PAGE_SIZE);
+    }
+
+    debug("BENCH map_pages mode=%s pages=%d cycles=%ld cycles_per_page=%ld\n", mode, MAP_PAGES_BENCH_COUNT,
+          min_cycles, min_cycles / MAP_PAGES_BENCH_COUNT);
+}
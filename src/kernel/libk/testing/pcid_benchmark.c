@@ -0,0 +1,186 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    IPC style ping-pong between two address spaces: both map their own message
+    buffer at the same address, the CPU switches to one, reads the buffer,
+    switches to the other one, reads its buffer, and so on. This is done once
+    with a full flush after every switch (what loading CR3 without PCIDs does)
+    and once with PCIDs, where the translations survive the switches. The
+    difference is the cost of the TLB misses (page walks) that PCIDs avoid:
+	BENCH pcid mode=flush rounds=10000 pages=32 cycles_per_round=...
+	BENCH pcid mode=pcid rounds=10000 pages=32 cycles_per_round=...
+    Without PCID support both modes flush.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/pcid_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+vmm_space_t *pcid_bench_create_space(void);
+void pcid_bench_destroy_space(vmm_space_t *space);
+uint64_t pcid_bench_ping_pong(vmm_space_t *ping, vmm_space_t *pong, bool flush);
+uint64_t pcid_bench_read_message(void);
+
+/* core functions */
+
+// ping-pong between two spaces with and without flushing on every switch
+void pcid_benchmark_run_all(void)
+{
+    vmm_space_t *ping = pcid_bench_create_space();
+    vmm_space_t *pong = pcid_bench_create_space();
+
+    if (!ping || !pong)
+    {
+        log(WARNING, "pcid: address space creation failed - skipped\n");
+
+        pcid_bench_destroy_space(ping);
+        pcid_bench_destroy_space(pong);
+
+        return;
+    }
+
+    uint64_t flush_cycles = pcid_bench_ping_pong(ping, pong, true);
+    uint64_t pcid_cycles = pcid_bench_ping_pong(ping, pong, false);
+
+    debug("BENCH pcid mode=flush rounds=%d pages=%d cycles_per_round=%ld\n",
+          PCID_BENCH_ROUND_COUNT, PCID_BENCH_PAGE_COUNT, flush_cycles / PCID_BENCH_ROUND_COUNT);
+    debug("BENCH pcid mode=pcid rounds=%d pages=%d cycles_per_round=%ld\n",
+          PCID_BENCH_ROUND_COUNT, PCID_BENCH_PAGE_COUNT, pcid_cycles / PCID_BENCH_ROUND_COUNT);
+
+    pcid_bench_destroy_space(ping);
+    pcid_bench_destroy_space(pong);
+}
+
+/* utility functions */
+
+// new space with its own message buffer at PCID_BENCH_ADDR
+vmm_space_t *pcid_bench_create_space(void)
+{
+    vmm_space_t *space = vmm_space_create();
+
+    if (!space)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < PCID_BENCH_PAGE_COUNT; i++)
+    {
+        void *frame = pmm_allocz(1, MEM_TAG_BENCHMARK);
+
+        if (!frame)
+        {
+            pcid_bench_destroy_space(space);
+
+            return NULL;
+        }
+
+        vmm_map_page(space, (uint64_t)frame, PCID_BENCH_ADDR + i * PAGE_SIZE, KERNEL_READ_WRITE, PAT_WRITE_BACK);
+    }
+
+    return space;
+}
+
+// give the message buffer and the space back
+void pcid_bench_destroy_space(vmm_space_t *space)
+{
+    if (!space)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < PCID_BENCH_PAGE_COUNT; i++)
+    {
+        uint64_t *pte = vmm_get_pte(space, PCID_BENCH_ADDR + i * PAGE_SIZE);
+
+        if (pte && (*pte & PTE_PRESENT))
+        {
+            pmm_free((void *)(*pte & PTE_ADDRESS_MASK), 1, MEM_TAG_BENCHMARK);
+        }
+    }
+
+    vmm_space_destroy(space);
+}
+
+// switch back and forth PCID_BENCH_ROUND_COUNT times, reading the message after every switch
+uint64_t pcid_bench_ping_pong(vmm_space_t *ping, vmm_space_t *pong, bool flush)
+{
+    uint64_t checksum = 0;
+    uint64_t start = asm_rdtsc();
+
+    for (size_t i = 0; i < PCID_BENCH_ROUND_COUNT; i++)
+    {
+        vmm_switch_space(ping);
+
+        if (flush)
+        {
+            tlb_flush_all();
+        }
+
+        checksum += pcid_bench_read_message();
+
+        vmm_switch_space(pong);
+
+        if (flush)
+        {
+            tlb_flush_all();
+        }
+
+        checksum += pcid_bench_read_message();
+    }
+
+    uint64_t cycles = asm_rdtsc() - start;
+
+    vmm_switch_space(vmm_get_kernel_space());
+
+    // the buffers are zeroed, anything else means a wrong translation
+    if (checksum)
+    {
+        log(WARNING, "pcid: read wrong message contents\n");
+    }
+
+    return cycles;
+}
+
+// read one word of every page of the message buffer in the current space
+uint64_t pcid_bench_read_message(void)
+{
+    volatile uint64_t *message = (volatile uint64_t *)PCID_BENCH_ADDR;
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < PCID_BENCH_PAGE_COUNT; i++)
+    {
+        sum += message[i * (PAGE_SIZE / sizeof(uint64_t))];
+    }
+
+    return sum;
+}
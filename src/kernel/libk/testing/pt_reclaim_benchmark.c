@@ -0,0 +1,101 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Page table churn: every round maps PT_RECLAIM_BENCH_PAGES pages of a fresh
+    space, each in its own 2 MiB block (so each needs its own page table), and
+    unmaps them again. Every round uses another 1 GiB of the address space,
+    so without freeing empty tables the page tables would only grow:
+	BENCH pt_reclaim rounds=64 pages=512 peak_table_pages=...
+	end_table_pages=... cycles_per_round=...
+    end_table_pages is 1 (only the root is left) if nothing leaks.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/pt_reclaim_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* core functions */
+
+// map and unmap scattered pages round after round and watch the page tables
+void pt_reclaim_benchmark_run_all(void)
+{
+    vmm_space_t *space = vmm_space_create();
+    void *frame = pmm_allocz(1, MEM_TAG_BENCHMARK);
+
+    if (!space || !frame)
+    {
+        log(WARNING, "pt_reclaim: allocation failed - skipped\n");
+
+        if (space)
+        {
+            vmm_space_destroy(space);
+        }
+
+        if (frame)
+        {
+            pmm_free(frame, 1, MEM_TAG_BENCHMARK);
+        }
+
+        return;
+    }
+
+    size_t peak_table_pages = 0;
+    uint64_t start = asm_rdtsc();
+
+    for (uint64_t round = 0; round < PT_RECLAIM_BENCH_ROUNDS; round++)
+    {
+        uint64_t base = PT_RECLAIM_BENCH_ADDR + round * HUGE_PAGE_SIZE;
+
+        // every page points to the same frame, only page table pages are needed
+        for (uint64_t i = 0; i < PT_RECLAIM_BENCH_PAGES; i++)
+        {
+            vmm_map_page(space, (uint64_t)frame, base + i * LARGE_PAGE_SIZE, KERNEL_READ, PAT_WRITE_BACK);
+        }
+
+        if (vmm_get_page_table_count(space) > peak_table_pages)
+        {
+            peak_table_pages = vmm_get_page_table_count(space);
+        }
+
+        for (uint64_t i = 0; i < PT_RECLAIM_BENCH_PAGES; i++)
+        {
+            vmm_unmap_page(space, base + i * LARGE_PAGE_SIZE);
+        }
+    }
+
+    uint64_t cycles = asm_rdtsc() - start;
+
+    debug("BENCH pt_reclaim rounds=%d pages=%d peak_table_pages=%ld end_table_pages=%ld cycles_per_round=%ld\n",
+          PT_RECLAIM_BENCH_ROUNDS, PT_RECLAIM_BENCH_PAGES, peak_table_pages, vmm_get_page_table_count(space),
+          cycles / PT_RECLAIM_BENCH_ROUNDS);
+
+    vmm_space_destroy(space);
+    pmm_free(frame, 1, MEM_TAG_BENCHMARK);
+}
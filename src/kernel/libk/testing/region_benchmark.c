@@ -0,0 +1,154 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Cost of the region tree operations for a growing number of regions in the
+    kernel space (none of them is ever accessed, so no frames are involved):
+    inserting them, finding random addresses (the last-lookup cache misses),
+    finding the same address again (it hits) and protecting the middle of a
+    region and back (a split into three and a merge into one):
+	BENCH vmm_region regions=4096 insert_cycles=... find_random_cycles=...
+	find_cached_cycles=... protect_cycles=...
+    All values are averages per operation.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/region_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+void region_bench_run(size_t region_count);
+uint64_t region_bench_find(vmm_space_t *space, size_t region_count, bool random);
+uint64_t region_bench_address(size_t index);
+
+/* core functions */
+
+// tree operations with 16, 256 and 4096 regions
+void region_benchmark_run_all(void)
+{
+    region_bench_run(16);
+    region_bench_run(256);
+    region_bench_run(4096);
+}
+
+/* utility functions */
+
+// map region_count regions with gaps between them, measure, unmap them again
+void region_bench_run(size_t region_count)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+    uint64_t region_size = REGION_BENCH_PAGES * PAGE_SIZE;
+
+    uint64_t start = asm_rdtsc();
+
+    for (size_t i = 0; i < region_count; i++)
+    {
+        if (!vmm_region_map(space, region_bench_address(i), region_size, KERNEL_READ_WRITE,
+                            PAT_WRITE_BACK, MEM_TAG_BENCHMARK))
+        {
+            log(WARNING, "vmm_region: mapping failed - skipped\n");
+
+            vmm_region_unmap(space, REGION_BENCH_ADDR, region_bench_address(region_count) - REGION_BENCH_ADDR);
+
+            return;
+        }
+    }
+
+    uint64_t insert_cycles = asm_rdtsc() - start;
+
+    uint64_t find_random_cycles = region_bench_find(space, region_count, true);
+    uint64_t find_cached_cycles = region_bench_find(space, region_count, false);
+
+    // the middle page(s) of the middle region get other privileges and back
+    uint64_t middle = region_bench_address(region_count / 2) + PAGE_SIZE;
+    uint64_t middle_size = (REGION_BENCH_PAGES - 2) * PAGE_SIZE;
+
+    start = asm_rdtsc();
+
+    for (size_t i = 0; i < REGION_BENCH_PROTECTS; i++)
+    {
+        vmm_region_protect(space, middle, middle_size, KERNEL_READ);
+        vmm_region_protect(space, middle, middle_size, KERNEL_READ_WRITE);
+    }
+
+    uint64_t protect_cycles = asm_rdtsc() - start;
+
+    vmm_region_unmap(space, REGION_BENCH_ADDR, region_bench_address(region_count) - REGION_BENCH_ADDR);
+
+    debug("BENCH vmm_region regions=%ld insert_cycles=%ld find_random_cycles=%ld find_cached_cycles=%ld "
+          "protect_cycles=%ld\n",
+          region_count, insert_cycles / region_count, find_random_cycles / REGION_BENCH_LOOKUPS,
+          find_cached_cycles / REGION_BENCH_LOOKUPS, protect_cycles / (2 * REGION_BENCH_PROTECTS));
+}
+
+// look up REGION_BENCH_LOOKUPS addresses in random regions or always the same one
+uint64_t region_bench_find(vmm_space_t *space, size_t region_count, bool random)
+{
+    uint64_t random_state = 0x9E3779B97F4A7C15UL;
+    size_t found_count = 0;
+
+    spinlock_acquire(&space->region_lock);
+
+    uint64_t start = asm_rdtsc();
+
+    for (size_t i = 0; i < REGION_BENCH_LOOKUPS; i++)
+    {
+        // xorshift64
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+
+        size_t index = random ? random_state % region_count : region_count / 2;
+
+        if (vmm_region_find(space, region_bench_address(index)))
+        {
+            found_count++;
+        }
+    }
+
+    uint64_t cycles = asm_rdtsc() - start;
+
+    spinlock_release(&space->region_lock);
+
+    if (found_count != REGION_BENCH_LOOKUPS)
+    {
+        log(WARNING, "vmm_region: only %ld of %d lookups found their region\n", found_count,
+            REGION_BENCH_LOOKUPS);
+    }
+
+    return cycles;
+}
+
+// start of the region with the given index
+uint64_t region_bench_address(size_t index)
+{
+    return REGION_BENCH_ADDR + index * 2 * REGION_BENCH_PAGES * PAGE_SIZE;
+}
@@ -0,0 +1,229 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Memory bandwidth measurement in the style of STREAM (copy, scale, add and
+    triad over three arrays), once on write-back and once on uncacheable
+    mappings, to show what the caching type of a mapping costs. The kernel is
+    built without SSE, so the arrays hold 64 bit integers instead of doubles.
+    Only the calling CPU takes part. One line per caching type and kernel is
+    printed over COM1:
+	BENCH stream cache=write_back kernel=triad bytes=... cycles=... mb_per_sec=...
+    followed by the write-back / uncacheable ratio of every kernel. cycles is
+    the best of STREAM_BENCH_REPEAT_COUNT runs, the TSC frequency is calibrated
+    against the HPET.
+
+*/
+
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/benchmark.h>
+#include <libk/testing/stream_benchmark.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/vmalloc.h>
+#include <utility/utils.h>
+
+#define STREAM_BENCH_KERNEL_COUNT 4
+
+static const char *kernel_names[STREAM_BENCH_KERNEL_COUNT] = { "copy", "scale", "add", "triad" };
+
+// arrays touched per element (reads + writes)
+static const uint64_t kernel_array_counts[STREAM_BENCH_KERNEL_COUNT] = { 2, 2, 3, 3 };
+
+static uint64_t tsc_frequency;
+
+/* utility function prototypes */
+
+bool stream_bench_run(const char *cache_name, vmalloc_flags_t flags, uint64_t *best_cycles);
+uint64_t stream_bench_kernel(stream_bench_kernel_t kernel, uint64_t *a, uint64_t *b, uint64_t *c);
+bool stream_bench_check(uint64_t *a, uint64_t *b, uint64_t *c);
+uint64_t stream_bench_mb_per_sec(stream_bench_kernel_t kernel, uint64_t cycles);
+
+/* core functions */
+
+// measure all kernels on write-back and on uncacheable memory and compare them
+void stream_benchmark_run_all(void)
+{
+    uint64_t write_back_cycles[STREAM_BENCH_KERNEL_COUNT];
+    uint64_t uncacheable_cycles[STREAM_BENCH_KERNEL_COUNT];
+
+    tsc_frequency = benchmark_tsc_frequency();
+
+    if (!stream_bench_run("write_back", 0, write_back_cycles))
+    {
+        return;
+    }
+
+    // the frames might still be cached through the write-back direct map
+    asm_wbinvd();
+
+    if (!stream_bench_run("uncacheable", VMALLOC_UNCACHED, uncacheable_cycles))
+    {
+        return;
+    }
+
+    for (stream_bench_kernel_t kernel = STREAM_BENCH_COPY; kernel <= STREAM_BENCH_TRIAD; kernel++)
+    {
+        uint64_t speedup = write_back_cycles[kernel] ? uncacheable_cycles[kernel] * 100 / write_back_cycles[kernel] : 0;
+
+        debug("BENCH stream kernel=%s write_back_speedup=%ld.%.2ldx\n", kernel_names[kernel],
+              speedup / 100, speedup % 100);
+    }
+}
+
+/* utility functions */
+
+// run every kernel a few times on arrays with the given caching type and
+// report the best runs - false if the arrays couldn't be allocated
+bool stream_bench_run(const char *cache_name, vmalloc_flags_t flags, uint64_t *best_cycles)
+{
+    size_t array_bytes = STREAM_BENCH_ARRAY_SIZE * sizeof(uint64_t);
+
+    uint64_t *a = vmalloc(array_bytes, MEM_TAG_BENCHMARK, flags);
+    uint64_t *b = vmalloc(array_bytes, MEM_TAG_BENCHMARK, flags);
+    uint64_t *c = vmalloc(array_bytes, MEM_TAG_BENCHMARK, flags);
+
+    if (!a || !b || !c)
+    {
+        log(WARNING, "stream: array allocation failed - skipped\n");
+
+        vfree(a);
+        vfree(b);
+        vfree(c);
+
+        return false;
+    }
+
+    for (size_t i = 0; i < STREAM_BENCH_ARRAY_SIZE; i++)
+    {
+        a[i] = 1;
+        b[i] = 2;
+        c[i] = 0;
+    }
+
+    for (stream_bench_kernel_t kernel = STREAM_BENCH_COPY; kernel <= STREAM_BENCH_TRIAD; kernel++)
+    {
+        best_cycles[kernel] = UINT64_MAX;
+    }
+
+    // same order as STREAM, so every kernel works on the results of the previous one
+    for (size_t i = 0; i < STREAM_BENCH_REPEAT_COUNT; i++)
+    {
+        for (stream_bench_kernel_t kernel = STREAM_BENCH_COPY; kernel <= STREAM_BENCH_TRIAD; kernel++)
+        {
+            uint64_t cycles = stream_bench_kernel(kernel, a, b, c);
+
+            best_cycles[kernel] = cycles < best_cycles[kernel] ? cycles : best_cycles[kernel];
+        }
+    }
+
+    if (!stream_bench_check(a, b, c))
+    {
+        log(WARNING, "stream: %s arrays hold wrong results\n", cache_name);
+    }
+
+    for (stream_bench_kernel_t kernel = STREAM_BENCH_COPY; kernel <= STREAM_BENCH_TRIAD; kernel++)
+    {
+        debug("BENCH stream cache=%s kernel=%s bytes=%ld cycles=%ld mb_per_sec=%ld\n", cache_name,
+              kernel_names[kernel], kernel_array_counts[kernel] * array_bytes, best_cycles[kernel],
+              stream_bench_mb_per_sec(kernel, best_cycles[kernel]));
+    }
+
+    vfree(a);
+    vfree(b);
+    vfree(c);
+
+    return true;
+}
+
+// run one kernel over the whole arrays and return the TSC cycles it took
+uint64_t stream_bench_kernel(stream_bench_kernel_t kernel, uint64_t *a, uint64_t *b, uint64_t *c)
+{
+    uint64_t start = asm_rdtsc();
+
+    switch (kernel)
+    {
+        case STREAM_BENCH_COPY:
+            for (size_t i = 0; i < STREAM_BENCH_ARRAY_SIZE; i++)
+            {
+                c[i] = a[i];
+            }
+            break;
+
+        case STREAM_BENCH_SCALE:
+            for (size_t i = 0; i < STREAM_BENCH_ARRAY_SIZE; i++)
+            {
+                b[i] = STREAM_BENCH_SCALAR * c[i];
+            }
+            break;
+
+        case STREAM_BENCH_ADD:
+            for (size_t i = 0; i < STREAM_BENCH_ARRAY_SIZE; i++)
+            {
+                c[i] = a[i] + b[i];
+            }
+            break;
+
+        case STREAM_BENCH_TRIAD:
+            for (size_t i = 0; i < STREAM_BENCH_ARRAY_SIZE; i++)
+            {
+                a[i] = b[i] + STREAM_BENCH_SCALAR * c[i];
+            }
+            break;
+    }
+
+    return asm_rdtsc() - start;
+}
+
+// replay the kernels on single values and compare them with every element
+bool stream_bench_check(uint64_t *a, uint64_t *b, uint64_t *c)
+{
+    uint64_t expected_a = 1;
+    uint64_t expected_b = 2;
+    uint64_t expected_c = 0;
+
+    for (size_t i = 0; i < STREAM_BENCH_REPEAT_COUNT; i++)
+    {
+        expected_c = expected_a;
+        expected_b = STREAM_BENCH_SCALAR * expected_c;
+        expected_c = expected_a + expected_b;
+        expected_a = expected_b + STREAM_BENCH_SCALAR * expected_c;
+    }
+
+    for (size_t i = 0; i < STREAM_BENCH_ARRAY_SIZE; i++)
+    {
+        if (a[i] != expected_a || b[i] != expected_b || c[i] != expected_c)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// bandwidth in MB (10^6 bytes) per second, counted like STREAM does
+uint64_t stream_bench_mb_per_sec(stream_bench_kernel_t kernel, uint64_t cycles)
+{
+    uint64_t bytes = kernel_array_counts[kernel] * STREAM_BENCH_ARRAY_SIZE * sizeof(uint64_t);
+
+    return cycles ? bytes * (tsc_frequency / 1000000) / cycles : 0;
+}
@@ -0,0 +1,41 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef STREAM_BENCHMARK_H
+#define STREAM_BENCHMARK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STREAM_BENCH_ARRAY_SIZE	    (256 * 1024) // elements per array (2 MiB)
+#define STREAM_BENCH_REPEAT_COUNT   5		 // the best run is reported
+#define STREAM_BENCH_SCALAR	    3
+
+typedef enum
+{
+    STREAM_BENCH_COPY,	// c = a
+    STREAM_BENCH_SCALE, // b = q * c
+    STREAM_BENCH_ADD,	// c = a + b
+    STREAM_BENCH_TRIAD	// a = b + q * c
+} stream_bench_kernel_t;
+
+void stream_benchmark_run_all(void);
+
+#endif
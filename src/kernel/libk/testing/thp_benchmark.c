@@ -0,0 +1,142 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+
+    Brief file description:
+    TLB reach of anonymous memory: a THP_BENCH_SIZE region of a fresh space
+    is written page by page and then read at THP_BENCH_ACCESSES random pages,
+    which misses the TLB nearly every time with 4 KiB pages. This runs with
+    4 KiB pages only, with huge pages mapped by the faults and with 4 KiB
+    pages which are collapsed into huge pages afterwards (synchronously, the
+    worker does the same in the background):
+	BENCH thp mode=small populate_cycles=... collapse_cycles=0
+	access_cycles=... cycles_per_access=... huge_bytes=0 table_pages=...
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/thp_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+void thp_bench_run(const char *mode, bool fault_huge, bool collapse);
+
+/* core functions */
+
+// compare random access over 4 KiB, faulted huge and collapsed huge pages
+void thp_benchmark_run_all(void)
+{
+    thp_reset_stats();
+
+    thp_bench_run("small", false, false);
+    thp_bench_run("huge", true, false);
+    thp_bench_run("collapsed", false, true);
+
+    thp_set_enabled(true);
+    thp_dump_stats();
+}
+
+/* utility functions */
+
+// populate, optionally collapse and randomly read the region of a new space
+void thp_bench_run(const char *mode, bool fault_huge, bool collapse)
+{
+    vmm_space_t *space = vmm_space_create();
+
+    if (!space || !vmm_region_map(space, THP_BENCH_ADDR, THP_BENCH_SIZE, KERNEL_READ_WRITE, PAT_WRITE_BACK,
+                                  MEM_TAG_BENCHMARK))
+    {
+        log(WARNING, "thp: %s space creation failed - skipped\n", mode);
+
+        if (space)
+        {
+            vmm_space_destroy(space);
+        }
+
+        return;
+    }
+
+    vmm_switch_space(space);
+    thp_set_enabled(fault_huge);
+
+    uint64_t start = asm_rdtsc();
+
+    for (uint64_t address = THP_BENCH_ADDR; address < THP_BENCH_ADDR + THP_BENCH_SIZE; address += PAGE_SIZE)
+    {
+        *(volatile uint64_t *)address = address;
+    }
+
+    uint64_t populate_cycles = asm_rdtsc() - start;
+    uint64_t collapse_cycles = 0;
+
+    if (collapse)
+    {
+        thp_set_enabled(true);
+
+        start = asm_rdtsc();
+        thp_collapse_space(space, THP_BENCH_SIZE / LARGE_PAGE_SIZE);
+        collapse_cycles = asm_rdtsc() - start;
+    }
+
+    // xorshift, so that neither the prefetcher nor the TLB can guess the next page
+    uint64_t state = 0x9E3779B97F4A7C15;
+    uint64_t sum = 0;
+
+    start = asm_rdtsc();
+
+    for (uint64_t i = 0; i < THP_BENCH_ACCESSES; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        uint64_t page = state % (THP_BENCH_SIZE / PAGE_SIZE);
+
+        sum += *(volatile uint64_t *)(THP_BENCH_ADDR + page * PAGE_SIZE);
+    }
+
+    uint64_t access_cycles = asm_rdtsc() - start;
+
+    // every page still holds its own address after collapsing
+    uint64_t last_page = THP_BENCH_ADDR + THP_BENCH_SIZE - PAGE_SIZE;
+
+    if (*(volatile uint64_t *)last_page != last_page)
+    {
+        log(WARNING, "thp: %s contents were not preserved\n", mode);
+    }
+
+    debug("BENCH thp mode=%s populate_cycles=%ld collapse_cycles=%ld access_cycles=%ld cycles_per_access=%ld "
+          "huge_bytes=%ld table_pages=%ld checksum=%lx\n",
+          mode, populate_cycles, collapse_cycles, access_cycles, access_cycles / THP_BENCH_ACCESSES,
+          vmm_get_huge_page_count(space) * LARGE_PAGE_SIZE, vmm_get_page_table_count(space), sum);
+
+    vmm_switch_space(vmm_get_kernel_space());
+    vmm_space_destroy(space);
+}
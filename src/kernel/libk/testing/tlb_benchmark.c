@@ -0,0 +1,188 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Cost of mapping and unmapping 1 GiB with 4 KiB pages in the active page
+    table, once flushing the TLB after every entry (what the VMM used to do)
+    and once batched through a tlb_gather_t. Every page points to the same
+    frame, so only page table pages are needed. One line per mode and
+    operation is printed over COM1:
+	BENCH tlb mode=batched op=unmap pages=262144 cycles=... cycles_per_page=...
+    Unmapping frees the page tables again, so both modes pay for creating
+    them on map.
+    Afterwards the latency of unmapping a single page is measured, which
+    includes the shootdown to all other (idle) CPUs:
+	BENCH tlb_shootdown cpus=4 rounds=1000 min_cycles=... avg_cycles=... max_cycles=...
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/tlb_benchmark.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <proc/smp/smp.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+uint64_t tlb_bench_map_eager(uint64_t frame);
+uint64_t tlb_bench_unmap_eager(void);
+uint64_t tlb_bench_map_batched(uint64_t frame);
+uint64_t tlb_bench_unmap_batched(void);
+uint64_t tlb_bench_shootdown_round(uint64_t frame);
+void tlb_bench_shootdown(uint64_t frame);
+void tlb_bench_report(const char *mode, const char *op, uint64_t cycles);
+
+/* core functions */
+
+// map and unmap TLB_BENCH_SIZE with and without batching
+void tlb_benchmark_run_all(void)
+{
+    void *frame = pmm_allocz(1, MEM_TAG_BENCHMARK);
+
+    if (!frame)
+    {
+        log(WARNING, "tlb: frame allocation failed - skipped\n");
+
+        return;
+    }
+
+    // warm up the caches
+    tlb_bench_map_batched((uint64_t)frame);
+    tlb_bench_unmap_batched();
+
+    tlb_bench_report("eager", "map", tlb_bench_map_eager((uint64_t)frame));
+    tlb_bench_report("eager", "unmap", tlb_bench_unmap_eager());
+
+    tlb_bench_report("batched", "map", tlb_bench_map_batched((uint64_t)frame));
+    tlb_bench_report("batched", "unmap", tlb_bench_unmap_batched());
+
+    tlb_bench_shootdown((uint64_t)frame);
+
+    pmm_free(frame, 1, MEM_TAG_BENCHMARK);
+}
+
+/* utility functions */
+
+// one invlpg after every new entry, like before batching existed
+uint64_t tlb_bench_map_eager(uint64_t frame)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+    uint64_t start = asm_rdtsc();
+
+    for (uint64_t offset = 0; offset < TLB_BENCH_SIZE; offset += PAGE_SIZE)
+    {
+        vmm_map_page(space, frame, TLB_BENCH_START_ADDR + offset, KERNEL_READ, PAT_WRITE_BACK);
+        tlb_flush_page(TLB_BENCH_START_ADDR + offset);
+    }
+
+    return asm_rdtsc() - start;
+}
+
+// one invlpg after every removed entry
+uint64_t tlb_bench_unmap_eager(void)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+    uint64_t start = asm_rdtsc();
+
+    for (uint64_t offset = 0; offset < TLB_BENCH_SIZE; offset += PAGE_SIZE)
+    {
+        vmm_unmap_page(space, TLB_BENCH_START_ADDR + offset);
+    }
+
+    return asm_rdtsc() - start;
+}
+
+// non-present to present needs no flush at all
+uint64_t tlb_bench_map_batched(uint64_t frame)
+{
+    tlb_gather_t gather;
+    uint64_t start = asm_rdtsc();
+
+    tlb_gather_init(&gather, vmm_get_kernel_space());
+
+    for (uint64_t offset = 0; offset < TLB_BENCH_SIZE; offset += PAGE_SIZE)
+    {
+        vmm_map_page_gather(&gather, frame, TLB_BENCH_START_ADDR + offset, KERNEL_READ, PAT_WRITE_BACK);
+    }
+
+    tlb_gather_finish(&gather);
+
+    return asm_rdtsc() - start;
+}
+
+// one CR3 reload at the end
+uint64_t tlb_bench_unmap_batched(void)
+{
+    uint64_t start = asm_rdtsc();
+
+    vmm_unmap_range(vmm_get_kernel_space(), TLB_BENCH_START_ADDR, TLB_BENCH_START_ADDR + TLB_BENCH_SIZE);
+
+    return asm_rdtsc() - start;
+}
+
+// map a page without flushing, unmap it again and take the time of the unmap
+uint64_t tlb_bench_shootdown_round(uint64_t frame)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+
+    vmm_map_page(space, frame, TLB_BENCH_START_ADDR, KERNEL_READ, PAT_WRITE_BACK);
+
+    uint64_t start = asm_rdtsc();
+    vmm_unmap_page(space, TLB_BENCH_START_ADDR);
+
+    return asm_rdtsc() - start;
+}
+
+// latency of a single page unmap while all CPUs have the kernel space loaded
+void tlb_bench_shootdown(uint64_t frame)
+{
+    uint64_t min_cycles = UINT64_MAX;
+    uint64_t max_cycles = 0;
+    uint64_t total_cycles = 0;
+
+    for (size_t i = 0; i < TLB_BENCH_SHOOTDOWN_COUNT; i++)
+    {
+        uint64_t cycles = tlb_bench_shootdown_round(frame);
+
+        min_cycles = cycles < min_cycles ? cycles : min_cycles;
+        max_cycles = cycles > max_cycles ? cycles : max_cycles;
+        total_cycles += cycles;
+    }
+
+    debug("BENCH tlb_shootdown cpus=%ld rounds=%d min_cycles=%ld avg_cycles=%ld max_cycles=%ld\n",
+          smp_get_cpu_count(), TLB_BENCH_SHOOTDOWN_COUNT, min_cycles,
+          total_cycles / TLB_BENCH_SHOOTDOWN_COUNT, max_cycles);
+}
+
+// print one result line
+void tlb_bench_report(const char *mode, const char *op, uint64_t cycles)
+{
+    uint64_t page_count = TLB_BENCH_SIZE / PAGE_SIZE;
+
+    debug("BENCH tlb mode=%s op=%s pages=%ld cycles=%ld cycles_per_page=%ld\n",
+          mode, op, page_count, cycles, cycles / page_count);
+}
@@ -0,0 +1,128 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    A large sparse buffer: a ZERO_BENCH_SIZE region of the kernel space is
+    read completely (like a scan over freshly reserved memory), afterwards
+    one page per ZERO_BENCH_WRITE_STRIDE is written. This runs once with read
+    faults mapping the shared zero page and once with a zeroed frame for
+    every fault. The frames and page tables the region ends up with are
+    printed, followed by how many frames the zero page spared:
+	BENCH zero_page mode=zero_page pages=65536 written_pages=1024 frames=...
+	table_pages=... cycles=... zero_pages=... zero_large_pages=... zero_replaced=...
+	BENCH zero_page_saved frames=... bytes=...
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/zero_page_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+int64_t zero_bench_run(const char *mode, bool zero_page);
+
+/* core functions */
+
+// read and sparsely write a region with and without the zero page
+void zero_page_benchmark_run_all(void)
+{
+    int64_t zero_page_frames = zero_bench_run("zero_page", true);
+    int64_t zeroed_frames = zero_bench_run("zeroed_frames", false);
+
+    page_fault_set_zero_page(true);
+    page_fault_reset_stats();
+
+    if (zero_page_frames < 0 || zeroed_frames < 0)
+    {
+        return;
+    }
+
+    debug("BENCH zero_page_saved frames=%ld bytes=%ld\n", zeroed_frames - zero_page_frames,
+          (zeroed_frames - zero_page_frames) * PAGE_SIZE);
+}
+
+/* utility functions */
+
+// returns how many frames (page tables included) the region took - -1 if it
+// couldn't be created
+int64_t zero_bench_run(const char *mode, bool zero_page)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+
+    if (!vmm_region_map(space, ZERO_BENCH_ADDR, ZERO_BENCH_SIZE, KERNEL_READ_WRITE, PAT_WRITE_BACK,
+                        MEM_TAG_BENCHMARK))
+    {
+        log(WARNING, "zero_page: region creation failed - skipped\n");
+
+        return -1;
+    }
+
+    page_fault_set_zero_page(zero_page);
+    page_fault_reset_stats();
+
+    int64_t frames_before = mem_tag_get_page_count(MEM_TAG_BENCHMARK);
+    int64_t tables_before = mem_tag_get_page_count(MEM_TAG_PAGE_TABLE);
+
+    uint64_t sum = 0;
+    uint64_t start = asm_rdtsc();
+
+    for (uint64_t offset = 0; offset < ZERO_BENCH_SIZE; offset += PAGE_SIZE)
+    {
+        sum += *(volatile uint8_t *)(ZERO_BENCH_ADDR + offset);
+    }
+
+    for (uint64_t offset = 0; offset < ZERO_BENCH_SIZE; offset += ZERO_BENCH_WRITE_STRIDE)
+    {
+        *(volatile uint8_t *)(ZERO_BENCH_ADDR + offset) = 1;
+    }
+
+    uint64_t cycles = asm_rdtsc() - start;
+
+    int64_t frames = mem_tag_get_page_count(MEM_TAG_BENCHMARK) - frames_before;
+    int64_t table_pages = mem_tag_get_page_count(MEM_TAG_PAGE_TABLE) - tables_before;
+
+    vmm_region_unmap(space, ZERO_BENCH_ADDR, ZERO_BENCH_SIZE);
+
+    page_fault_stats_t stats;
+    page_fault_get_stats(&stats);
+
+    debug("BENCH zero_page mode=%s pages=%ld written_pages=%ld frames=%ld table_pages=%ld cycles=%ld "
+          "zero_pages=%ld zero_large_pages=%ld zero_replaced=%ld\n",
+          mode, ZERO_BENCH_SIZE / PAGE_SIZE, ZERO_BENCH_SIZE / ZERO_BENCH_WRITE_STRIDE, frames, table_pages,
+          cycles, stats.zero_pages, stats.zero_large_pages, stats.zero_replaced);
+
+    // nothing but zeros was ever read
+    if (sum != 0)
+    {
+        log(WARNING, "zero_page: read back non-zero memory\n");
+    }
+
+    return frames + table_pages;
+}
@@ -0,0 +1,368 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+
+    Brief file description:
+    Evicting cold memory into the compressed store: ZSTORE_BENCH_SIZE is
+    filled with a mix of text-like data, same-filled pages (zeros and a
+    pattern), tables of counters and random data, which doesn't compress.
+    The first pass over the space only clears the accessed bits, the hot
+    part at the start is used again before the second pass evicts the rest.
+    Filling maps huge pages, the cold ones are split by the second pass (the
+    hot one stays). A clone shares the evicted pages, both spaces fault all
+    of them back in and check their contents:
+	BENCH zstore pages=4096 huge_split=7 evicted=... same_filled=... rejected=...
+	hot_resident=512/512 pool_kib=... ratio=... freed_frames=...
+	evict_cycles_per_page=... fault_in_avg_cycles=... fault_in_max_cycles=...
+    Afterwards the pool has to be empty again.
+    With a swap device the same runs again as swapping benchmark: only
+    ZSTORE_BENCH_SWAP_SIZE of random data is filled in and the pool is
+    limited to nothing, so every page is written to the device. The swap
+    cache is emptied, then a clone faults all pages back in - mostly from
+    readahead - and the space itself finds them in the swap cache, as the
+    clone shares them:
+	BENCH swap pages=2048 written=... writes=... avg_cluster=...
+	write_cycles_per_page=... clone_reads=... clone_readahead_hits=...
+	space_reads=... space_cache_hits=... fault_avg_cycles=...
+    Afterwards no slot may be used anymore.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <libk/testing/zstore_benchmark.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/swap.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+#include <memory/virtual/zstore.h>
+#include <utility/utils.h>
+
+#define ZSTORE_BENCH_PAGES	(ZSTORE_BENCH_SIZE / PAGE_SIZE)
+#define ZSTORE_BENCH_HOT_PAGES	(ZSTORE_BENCH_HOT_SIZE / PAGE_SIZE)
+#define ZSTORE_BENCH_SWAP_PAGES	(ZSTORE_BENCH_SWAP_SIZE / PAGE_SIZE)
+#define ZSTORE_BENCH_WORDS	(PAGE_SIZE / sizeof(uint64_t))
+
+// what text-like pages are made of
+static const char *zstore_bench_tokens[8] =
+{
+    "address ", "space   ", "region  ", "page    ", "frame   ", "table   ", "fault   ", "store   "
+};
+
+/* utility function prototypes */
+
+void zstore_bench_with_space(size_t size, void (*run)(vmm_space_t *space));
+void zstore_bench_run(vmm_space_t *space);
+void zstore_bench_swap_run(vmm_space_t *space);
+void zstore_bench_fill(size_t page_count, bool random);
+void zstore_bench_touch_hot(void);
+size_t zstore_bench_count_hot_resident(vmm_space_t *space);
+bool zstore_bench_check(size_t page_count, bool random);
+uint64_t zstore_bench_expected(size_t page, size_t word, bool random);
+uint64_t zstore_bench_mix(uint64_t value);
+
+/* core functions */
+
+// evict a space into the store and fault it back in, then the same through the
+// swap device
+void zstore_benchmark_run_all(void)
+{
+    zstore_bench_with_space(ZSTORE_BENCH_SIZE, zstore_bench_run);
+
+    zstore_dump_stats();
+
+    zstore_stats_t stats;
+    zstore_get_stats(&stats);
+
+    if (stats.stored_blobs || stats.same_filled_entries || stats.pool_pages)
+    {
+        log(WARNING, "zstore: %ld blobs, %ld same-filled entries and %ld pool frames left over\n",
+            stats.stored_blobs, stats.same_filled_entries, stats.pool_pages);
+    }
+
+    if (!swap_available())
+    {
+        log(INFO, "swap: no swap device - skipped\n");
+
+        return;
+    }
+
+    // without room in the pool every evicted page goes to the device
+    zstore_set_pool_limit(0);
+    zstore_bench_with_space(ZSTORE_BENCH_SWAP_SIZE, zstore_bench_swap_run);
+    zstore_set_pool_limit(ZSTORE_DEFAULT_POOL_LIMIT);
+
+    swap_dump_stats();
+
+    swap_stats_t swap_stats;
+    swap_get_stats(&swap_stats);
+
+    if (swap_stats.slots_used || swap_stats.cache_pages)
+    {
+        log(WARNING, "swap: %ld slots and %ld cached frames left over\n", swap_stats.slots_used,
+            swap_stats.cache_pages);
+    }
+}
+
+/* utility functions */
+
+// run a benchmark in a new space with size bytes mapped at ZSTORE_BENCH_ADDR
+void zstore_bench_with_space(size_t size, void (*run)(vmm_space_t *space))
+{
+    vmm_space_t *space = vmm_space_create();
+
+    if (space && vmm_region_map(space, ZSTORE_BENCH_ADDR, size, KERNEL_READ_WRITE, PAT_WRITE_BACK,
+                                MEM_TAG_BENCHMARK))
+    {
+        run(space);
+    }
+    else
+    {
+        log(WARNING, "zstore: space creation failed - skipped\n");
+    }
+
+    vmm_switch_space(vmm_get_kernel_space());
+
+    if (space)
+    {
+        vmm_space_destroy(space);
+    }
+}
+
+// fill, evict in two passes, then read everything back in a clone and the space itself
+void zstore_bench_run(vmm_space_t *space)
+{
+    vmm_switch_space(space);
+    zstore_bench_fill(ZSTORE_BENCH_PAGES, false);
+
+    zstore_reset_stats();
+
+    // the first pass finds every page accessed and only ages it
+    zstore_reclaim_space(space);
+    zstore_bench_touch_hot();
+
+    size_t used_before = pmm_get_used_page_count();
+    uint64_t start = asm_rdtsc();
+
+    size_t evicted_count = zstore_reclaim_space(space);
+
+    uint64_t evict_cycles = asm_rdtsc() - start;
+    size_t used_after = pmm_get_used_page_count();
+
+    zstore_stats_t stats;
+    zstore_get_stats(&stats);
+
+    size_t hot_count = zstore_bench_count_hot_resident(space);
+    vmm_space_t *clone = vmm_clone_space(space);
+
+    // every evicted page faults in once per space
+    vmm_switch_space(clone);
+    bool clone_intact = zstore_bench_check(ZSTORE_BENCH_PAGES, false);
+
+    vmm_switch_space(space);
+    bool intact = zstore_bench_check(ZSTORE_BENCH_PAGES, false);
+
+    zstore_stats_t loaded_stats;
+    zstore_get_stats(&loaded_stats);
+
+    uint64_t ratio = stats.pool_pages ? stats.stored_blobs * 100 / stats.pool_pages : 0;
+
+    debug("BENCH zstore pages=%ld huge_split=%ld evicted=%ld same_filled=%ld rejected=%ld hot_resident=%ld/%ld "
+          "pool_kib=%ld ratio=%ld.%.2ld freed_frames=%ld evict_cycles_per_page=%ld fault_in_avg_cycles=%ld "
+          "fault_in_max_cycles=%ld\n",
+          ZSTORE_BENCH_PAGES, stats.huge_pages_split, evicted_count, stats.pages_same_filled, stats.pages_rejected, hot_count,
+          ZSTORE_BENCH_HOT_PAGES, stats.pool_pages * (PAGE_SIZE / 1024), ratio / 100, ratio % 100,
+          used_before - used_after, evicted_count ? evict_cycles / evicted_count : 0,
+          loaded_stats.pages_loaded ? loaded_stats.load_cycles / loaded_stats.pages_loaded : 0,
+          loaded_stats.max_load_cycles);
+
+    if (!intact || !clone_intact)
+    {
+        log(WARNING, "zstore: contents changed by evicting (space %s, clone %s)\n",
+            intact ? "intact" : "changed", clone_intact ? "intact" : "changed");
+    }
+
+    vmm_switch_space(vmm_get_kernel_space());
+    vmm_space_destroy(clone);
+}
+
+// fill with random data, evict in two passes, drop the swap cache, then read
+// everything back in a clone and the space itself
+void zstore_bench_swap_run(vmm_space_t *space)
+{
+    vmm_switch_space(space);
+    zstore_bench_fill(ZSTORE_BENCH_SWAP_PAGES, true);
+
+    // the first pass finds every page accessed and only ages it
+    zstore_reclaim_space(space);
+
+    swap_reset_stats();
+    uint64_t start = asm_rdtsc();
+
+    size_t evicted_count = zstore_reclaim_space(space);
+
+    uint64_t write_cycles = asm_rdtsc() - start;
+
+    swap_stats_t written_stats;
+    swap_get_stats(&written_stats);
+
+    // the written frames would serve every fault
+    swap_cache_shrink(SIZE_MAX);
+
+    vmm_space_t *clone = vmm_clone_space(space);
+
+    swap_reset_stats();
+    vmm_switch_space(clone);
+    bool clone_intact = zstore_bench_check(ZSTORE_BENCH_SWAP_PAGES, true);
+
+    swap_stats_t clone_stats;
+    swap_get_stats(&clone_stats);
+
+    swap_reset_stats();
+    vmm_switch_space(space);
+    bool intact = zstore_bench_check(ZSTORE_BENCH_SWAP_PAGES, true);
+
+    swap_stats_t space_stats;
+    swap_get_stats(&space_stats);
+
+    uint64_t faults = clone_stats.faults + space_stats.faults;
+
+    debug("BENCH swap pages=%ld written=%ld writes=%ld avg_cluster=%ld write_cycles_per_page=%ld clone_reads=%ld "
+          "clone_readahead_hits=%ld space_reads=%ld space_cache_hits=%ld fault_avg_cycles=%ld\n",
+          ZSTORE_BENCH_SWAP_PAGES, written_stats.pages_written, written_stats.write_requests,
+          written_stats.write_requests ? written_stats.pages_written / written_stats.write_requests : 0,
+          evicted_count ? write_cycles / evicted_count : 0, clone_stats.read_requests, clone_stats.readahead_hits,
+          space_stats.read_requests, space_stats.cache_hits,
+          faults ? (clone_stats.fault_cycles + space_stats.fault_cycles) / faults : 0);
+
+    if (!intact || !clone_intact)
+    {
+        log(WARNING, "swap: contents changed by swapping (space %s, clone %s)\n",
+            intact ? "intact" : "changed", clone_intact ? "intact" : "changed");
+    }
+
+    vmm_switch_space(vmm_get_kernel_space());
+    vmm_space_destroy(clone);
+}
+
+// write the first page_count pages of the loaded space (only random data if random is set)
+void zstore_bench_fill(size_t page_count, bool random)
+{
+    for (size_t page = 0; page < page_count; page++)
+    {
+        volatile uint64_t *words = (volatile uint64_t *)(ZSTORE_BENCH_ADDR + page * PAGE_SIZE);
+
+        for (size_t word = 0; word < ZSTORE_BENCH_WORDS; word++)
+        {
+            words[word] = zstore_bench_expected(page, word, random);
+        }
+    }
+}
+
+// access the hot part, which sets the accessed bits again
+void zstore_bench_touch_hot(void)
+{
+    for (size_t page = 0; page < ZSTORE_BENCH_HOT_PAGES; page++)
+    {
+        (void)*(volatile uint64_t *)(ZSTORE_BENCH_ADDR + page * PAGE_SIZE);
+    }
+}
+
+// how many pages of the hot part weren't evicted
+size_t zstore_bench_count_hot_resident(vmm_space_t *space)
+{
+    size_t resident_count = 0;
+
+    for (size_t page = 0; page < ZSTORE_BENCH_HOT_PAGES; page++)
+    {
+        vmm_walk_entry_t leaf;
+
+        if (vmm_walk_lookup(space, ZSTORE_BENCH_ADDR + page * PAGE_SIZE, &leaf))
+        {
+            resident_count++;
+        }
+    }
+
+    return resident_count;
+}
+
+// whether the loaded space still has the contents zstore_bench_fill() wrote
+bool zstore_bench_check(size_t page_count, bool random)
+{
+    for (size_t page = 0; page < page_count; page++)
+    {
+        volatile uint64_t *words = (volatile uint64_t *)(ZSTORE_BENCH_ADDR + page * PAGE_SIZE);
+
+        for (size_t word = 0; word < ZSTORE_BENCH_WORDS; word++)
+        {
+            if (words[word] != zstore_bench_expected(page, word, random))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// contents of a word: text, same-filled, counters or random, depending on the
+// page - always random if random is set
+uint64_t zstore_bench_expected(size_t page, size_t word, bool random)
+{
+    uint64_t value = 0;
+
+    switch (random ? 3 : page % 8)
+    {
+        case 0:
+        case 4:
+            __builtin_memcpy(&value, zstore_bench_tokens[zstore_bench_mix(page * ZSTORE_BENCH_WORDS + word) % 8],
+                             sizeof(value));
+
+            return value;
+
+        case 1:
+            return 0;
+
+        case 5:
+            return 0x5A5A5A5A5A5A5A5A;
+
+        case 2:
+        case 6:
+            return (page << 32) | word;
+
+        default:
+            return zstore_bench_mix(page * ZSTORE_BENCH_WORDS + word);
+    }
+}
+
+// splitmix64 finalizer - random looking and different for every input
+uint64_t zstore_bench_mix(uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EB;
+
+    return value ^ (value >> 31);
+}
@@ -25,6 +25,9 @@
     Though this allocator does only work for small slab sizes (sizeof(bufctl) <= x <= 512), as this is the
     best for keeping the same slab layout for every size. It also doesn't make use of slab states (free,
     used and partial) for the sake of simplicity.
+    Every CPU keeps a few free bufctls per cache (like the magazines of Bonwick's later vmem paper).
+    Allocating and freeing only disable interrupts and work on that list; the cache lock is only
+    taken to refill it from the slabs or to give a batch back once it's full.
 
 */
 
@@ -36,24 +39,43 @@
 #include <memory/dynamic/slab.h>
 #include <memory/physical/pmm.h>
 #include <memory/mem.h>
+#include <proc/smp/smp.h>
+
+// stands in for cache->current as long as a cache has no slab with free bufctls,
+// so that slab_find_free() never has to check for NULL
+static slab_t slab_empty = { 0 };
 
 /* utility function prototypes */
 
-slab_bufctl_t *slab_create_bufctl_buffer(void);
+void slab_grow(slab_cache_t *cache, size_t count, slab_flags_t flags);
+slab_bufctl_t *slab_create_bufctl_buffer(slab_cache_t *cache);
 void slab_create_slab(slab_cache_t *cache, slab_bufctl_t *bufctl);
 void slab_init_bufctls(slab_cache_t *cache, slab_bufctl_t *bufctl, size_t index, slab_flags_t flags);
 bool is_power_of_two(int num);
+slab_t *slab_pointer_to_slab(void *pointer);
+slab_t *slab_find_free(slab_cache_t *cache, slab_flags_t flags);
+void slab_refill(slab_cache_t *cache, slab_cpu_cache_t *cpu_cache, slab_flags_t flags);
+void slab_flush(slab_cache_t *cache, slab_cpu_cache_t *cpu_cache, size_t count);
 
 /* core functions */
 
-// create a cache and grow one slab - only power of two's between 16 and 512
-slab_cache_t *slab_cache_create(const char *name, size_t slab_size, slab_flags_t flags)
+// create a cache and grow one slab - only power of two's between 16 and 512,
+// the slabs are accounted to tag
+slab_cache_t *slab_cache_create(const char *name, size_t slab_size, mem_tag_t tag, slab_flags_t flags)
 {
     assert(slab_size <= 512);
     assert(slab_size >= sizeof(slab_bufctl_t));
     assert(is_power_of_two(slab_size));
+    assert(SMP_MAX_CPU_COUNT * sizeof(slab_cpu_cache_t) <= PAGE_SIZE);
+
+    slab_cache_t *cache = (slab_cache_t *)pmm_allocz(1, MEM_TAG_SLAB);
+    slab_cpu_cache_t *cpu_caches = cache ? (slab_cpu_cache_t *)pmm_allocz(1, MEM_TAG_SLAB) : NULL;
 
-    slab_cache_t *cache = (slab_cache_t *)pmm_allocz(1);
+    if (cache && !cpu_caches)
+    {
+        pmm_free((void *)cache, 1, MEM_TAG_SLAB);
+        cache = NULL;
+    }
 
     if (!cache && (flags & SLAB_PANIC))
     {
@@ -65,11 +87,17 @@ slab_cache_t *slab_cache_create(const char *name, size_t slab_size, slab_flags_t
         return NULL;
     }
 
+    cache->cpu_caches = cpu_caches;
+
     cache->name = name;
     cache->slab_size = slab_size;
-    cache->bufctl_count_max = (PAGE_SIZE - sizeof(slab_cache_t)) / cache->slab_size;
+    cache->bufctl_count_max = (PAGE_SIZE - sizeof(slab_t)) / cache->slab_size;
+
+    cache->flags = flags;
+    cache->tag = tag;
 
     cache->slabs = NULL;
+    cache->current = &slab_empty;
 
     slab_cache_grow(cache, 1, flags);
 
@@ -89,6 +117,14 @@ void slab_cache_destroy(slab_cache_t *cache, slab_flags_t flags)
         return;
     }
 
+    spinlock_acquire(&cache->lock);
+
+    // nothing may use the cache anymore, so the CPU caches can be emptied from here
+    for (size_t i = 0; i < SMP_MAX_CPU_COUNT; i++)
+    {
+        slab_flush(cache, &cache->cpu_caches[i], cache->cpu_caches[i].bufctl_count);
+    }
+
     cache->slabs = cache->slabs_head;
 
     for (;;)
@@ -105,16 +141,23 @@ void slab_cache_destroy(slab_cache_t *cache, slab_flags_t flags)
 
         if (cache->slabs->bufctl_count != cache->bufctl_count_max)
         {
+            spinlock_release(&cache->lock);
+
             return;
         }
 
-        pmm_free((void *)cache->slabs->freelist_head, 1);
+        slab_t *next = cache->slabs->next;
 
-        cache->slabs = cache->slabs->next;
+        pmm_free((void *)cache->slabs->bufctl_addr, 1, cache->tag);
+
+        cache->slabs = next;
     }
 
+    spinlock_release(&cache->lock);
+
+    pmm_free((void *)cache->cpu_caches, 1, MEM_TAG_SLAB);
     memset(cache, 0, sizeof(slab_cache_t));
-    pmm_free((void *)cache, 1);
+    pmm_free((void *)cache, 1, MEM_TAG_SLAB);
 }
 
 // allocate one page, put bufctls + slab into it (per count)
@@ -130,34 +173,15 @@ void slab_cache_grow(slab_cache_t *cache, size_t count, slab_flags_t flags)
         return;
     }
 
-    cache->slabs = cache->slabs_head;
+    spinlock_acquire(&cache->lock);
 
-    for (size_t i = 0; i < count; i++)
-    {
-        slab_bufctl_t *bufctl = slab_create_bufctl_buffer();
+    slab_grow(cache, count, flags);
 
-        if (!bufctl && (flags & SLAB_PANIC))
-        {
-            log(PANIC, "Slab cache grow ('%s'): Couldn't create bufctl\n", cache->name);
-        }
-
-        if (!bufctl)
-        {
-            return;
-        }
-
-        slab_create_slab(cache, bufctl);
-
-        size_t max_const = cache->bufctl_count_max; // shouldn't be checked each iteration as it might change
-
-        for (size_t j = 0; j < max_const; j++)
-        {
-            slab_init_bufctls(cache, bufctl, j, flags);
-        }
-    }
+    spinlock_release(&cache->lock);
 }
 
-// find and delete all unused slabs
+// find and delete all unused slabs - the bufctls in the CPU caches of other CPUs
+// keep their slabs, see slab_cache_drain()
 void slab_cache_reap(slab_cache_t *cache, slab_flags_t flags)
 {
     if (!cache && (flags & SLAB_PANIC))
@@ -170,39 +194,67 @@ void slab_cache_reap(slab_cache_t *cache, slab_flags_t flags)
         return;
     }
 
+    spinlock_acquire(&cache->lock);
+
+    slab_cpu_cache_t *cpu_cache = slab_this_cpu_cache(cache);
+    slab_flush(cache, cpu_cache, cpu_cache->bufctl_count);
+
     cache->slabs = cache->slabs_head;
 
-    slab_t *prev = cache->slabs_head;
+    slab_t *prev = NULL;
 
     for (;;)
     {
         if (!cache->slabs)
         {
+            spinlock_release(&cache->lock);
+
             return;
         }
 
+        slab_t *next = cache->slabs->next;
+
         if (cache->slabs->bufctl_count == cache->bufctl_count_max)
         {
-            if (cache->slabs == cache->slabs_head)
+            if (!prev)
             {
-                cache->slabs_head = cache->slabs->next;
+                cache->slabs_head = next;
+            }
+            else
+            {
+                prev->next = next;
             }
 
-            prev->next = cache->slabs->next;
-
-            pmm_free((void *)cache->slabs, 1);
-
-            cache->slabs = prev->next;
+            if (cache->current == cache->slabs)
+            {
+                cache->current = &slab_empty;
+            }
 
-            continue;
+            pmm_free((void *)cache->slabs, 1, cache->tag);
+        }
+        else
+        {
+            prev = cache->slabs;
         }
 
-        prev = cache->slabs;
-        cache->slabs = cache->slabs->next;
+        cache->slabs = next;
     }
 }
 
-// find a slab with a freelist, remove bufctl from freelist, return address
+// give the bufctls the calling CPU keeps in its CPU cache back to their slabs,
+// e.g. so that slab_cache_reap() can free them
+void slab_cache_drain(slab_cache_t *cache)
+{
+    spinlock_acquire(&cache->lock);
+
+    slab_cpu_cache_t *cpu_cache = slab_this_cpu_cache(cache);
+    slab_flush(cache, cpu_cache, cpu_cache->bufctl_count);
+
+    spinlock_release(&cache->lock);
+}
+
+// take a bufctl from the CPU cache of this CPU, refill it from the slabs first if
+// it is empty (slow path of slab_cache_alloc_fast())
 void *slab_cache_alloc(slab_cache_t *cache, slab_flags_t flags)
 {
     if (!cache && (flags & SLAB_PANIC))
@@ -215,45 +267,45 @@ void *slab_cache_alloc(slab_cache_t *cache, slab_flags_t flags)
         return NULL;
     }
 
-    cache->slabs = cache->slabs_head;
+    flags |= cache->flags;
 
-    for (;;)
-    {
-        if (!cache->slabs && (flags & SLAB_AUTO_GROW))
-        {
-            slab_cache_grow(cache, 1, flags);
+    bool interrupts = asm_get_interrupt_flag();
+    asm volatile("cli");
 
-            return slab_cache_alloc(cache, flags);
-        }
+    slab_cpu_cache_t *cpu_cache = slab_this_cpu_cache(cache);
 
-        if (!cache->slabs && (flags & SLAB_PANIC))
-        {
-            log(PANIC, "Slab cache alloc ('%s'): Couldn't find allocatable memory\n", cache->name);
-        }
+    if (!cpu_cache->freelist_head)
+    {
+        spinlock_acquire(&cache->lock);
 
-        if (!cache->slabs)
-        {
-            return NULL;
-        }
+        slab_refill(cache, cpu_cache, flags);
 
-        if (cache->slabs->freelist_head)
-        {
-            break;
-        }
+        spinlock_release(&cache->lock);
+    }
 
-        cache->slabs = cache->slabs->next;
+    slab_bufctl_t *bufctl = cpu_cache->freelist_head;
+
+    if (bufctl)
+    {
+        cpu_cache->freelist_head = bufctl->next;
+        cpu_cache->bufctl_count--;
     }
 
-    void *pointer = cache->slabs->freelist_head;
+    if (interrupts)
+    {
+        asm volatile("sti");
+    }
 
-    cache->slabs->freelist_head = cache->slabs->freelist_head->next;
-    cache->slabs->bufctl_count--;
+    if (!bufctl && (flags & SLAB_PANIC))
+    {
+        log(PANIC, "Slab cache alloc ('%s'): Couldn't find allocatable memory\n", cache->name);
+    }
 
-    return pointer;
+    return bufctl;
 }
 
-// find slab with open spot (slab->bufctl_count < bufctl_count_max), insert new
-// bufctl at beginning of freelist
+// put bufctl at the beginning of the CPU cache of this CPU - a full one gives
+// the bufctls freed longest ago back to their slabs
 void slab_cache_free(slab_cache_t *cache, void *pointer, slab_flags_t flags)
 {
     if (!cache && (flags & SLAB_PANIC))
@@ -266,40 +318,49 @@ void slab_cache_free(slab_cache_t *cache, void *pointer, slab_flags_t flags)
         return;
     }
 
-    cache->slabs = cache->slabs_head;
+    slab_t *slab = slab_pointer_to_slab(pointer);
 
-    for (;;)
+    if (slab->cache != cache && (flags & SLAB_PANIC))
     {
-        if (!cache->slabs && (flags & SLAB_PANIC))
-        {
-            log(PANIC, "Slab cache free ('%s'): Couldn't find a slab for the to be freed pointer\n", cache->name);
-        }
-
-        if (!cache->slabs)
-        {
-            return;
-        }
-
-        if (cache->slabs->bufctl_count < cache->bufctl_count_max)
-        {
-            break;
-        }
+        log(PANIC, "Slab cache free ('%s'): Pointer 0x%p doesn't belong to this cache\n", cache->name, pointer);
+    }
 
-        cache->slabs = cache->slabs->next;
+    if (slab->cache != cache)
+    {
+        return;
     }
 
+    bool interrupts = asm_get_interrupt_flag();
+    asm volatile("cli");
+
+    slab_cpu_cache_t *cpu_cache = slab_this_cpu_cache(cache);
     slab_bufctl_t *new_bufctl = (slab_bufctl_t *)pointer;
 
-    new_bufctl->next = cache->slabs->freelist_head;
-    new_bufctl->index = ((uintptr_t)new_bufctl - (uintptr_t)cache->slabs->bufctl_addr) / cache->slab_size;
+    new_bufctl->next = cpu_cache->freelist_head;
+
+    cpu_cache->freelist_head = new_bufctl;
+    cpu_cache->bufctl_count++;
 
-    cache->slabs->freelist_head = new_bufctl;
-    cache->slabs->bufctl_count++;
+    if (cpu_cache->bufctl_count > SLAB_CPU_MAX)
+    {
+        spinlock_acquire(&cache->lock);
+
+        slab_flush(cache, cpu_cache, SLAB_CPU_BATCH);
+
+        spinlock_release(&cache->lock);
+    }
+
+    if (interrupts)
+    {
+        asm volatile("sti");
+    }
 }
 
 // print hierarchy of cache (including slabs + bufctls + it's addresses)
 void slab_cache_dump(slab_cache_t *cache, slab_flags_t flags)
 {
+    spinlock_acquire(&cache->lock);
+
     cache->slabs = cache->slabs_head;
 
     if (!cache->slabs && (flags & SLAB_PANIC))
@@ -309,11 +370,22 @@ void slab_cache_dump(slab_cache_t *cache, slab_flags_t flags)
 
     if (!cache->slabs)
     {
+        spinlock_release(&cache->lock);
+
         return;
     }
 
     debug("Dump for cache with name '%s'\n", cache->name);
 
+    size_t cpu_bufctl_count = 0;
+
+    for (size_t i = 0; i < SMP_MAX_CPU_COUNT; i++)
+    {
+        cpu_bufctl_count += __atomic_load_n(&cache->cpu_caches[i].bufctl_count, __ATOMIC_RELAXED);
+    }
+
+    debug("\tCPU caches hold %ld free bufctls (not listed)\n", cpu_bufctl_count);
+
     for (int slab_count = 0;; slab_count++)
     {
         if (!cache->slabs)
@@ -342,14 +414,58 @@ void slab_cache_dump(slab_cache_t *cache, slab_flags_t flags)
 done:
         cache->slabs = cache->slabs->next;
     }
+
+    spinlock_release(&cache->lock);
+}
+
+// return the cache an allocated pointer belongs to
+slab_cache_t *slab_pointer_to_cache(void *pointer)
+{
+    return slab_pointer_to_slab(pointer)->cache;
 }
 
 /* utility functions */
 
+// slab structure is always at the end of the page holding the bufctls
+slab_t *slab_pointer_to_slab(void *pointer)
+{
+    return (slab_t *)((ALIGN_DOWN((uintptr_t)pointer, PAGE_SIZE) + PAGE_SIZE) - sizeof(slab_t));
+}
+
+// grow without taking the cache lock (the caller holds it)
+void slab_grow(slab_cache_t *cache, size_t count, slab_flags_t flags)
+{
+    cache->slabs = cache->slabs_head;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        slab_bufctl_t *bufctl = slab_create_bufctl_buffer(cache);
+
+        if (!bufctl && (flags & SLAB_PANIC))
+        {
+            log(PANIC, "Slab cache grow ('%s'): Couldn't create bufctl\n", cache->name);
+        }
+
+        if (!bufctl)
+        {
+            return;
+        }
+
+        slab_create_slab(cache, bufctl);
+
+        size_t max_const = cache->bufctl_count_max; // shouldn't be checked each iteration as it might change
+
+        for (size_t j = 0; j < max_const; j++)
+        {
+            slab_init_bufctls(cache, bufctl, j, flags);
+        }
+    }
+}
+
 // allocate one page for all bufctls in that slab + slab structure itself
-slab_bufctl_t *slab_create_bufctl_buffer(void)
+slab_bufctl_t *slab_create_bufctl_buffer(slab_cache_t *cache)
 {
-    slab_bufctl_t *bufctl = (slab_bufctl_t *)pmm_allocz(1);
+    slab_bufctl_t *bufctl = (slab_bufctl_t *)pmm_allocz(1, cache->tag);
 
     if (!bufctl)
     {
@@ -361,12 +477,12 @@ slab_bufctl_t *slab_create_bufctl_buffer(void)
     return bufctl;
 }
 
-// put slab structure at end of bufctl buffer, add to linked list of slabs
+// put slab structure at end of bufctl buffer, add to front of linked list of slabs
 void slab_create_slab(slab_cache_t *cache, slab_bufctl_t *bufctl)
 {
     slab_t *slab = (slab_t *)(((uintptr_t)bufctl + PAGE_SIZE) - sizeof(slab_t));
 
-    slab->next = NULL;
+    slab->cache = cache;
 
     slab->bufctl_count = cache->bufctl_count_max;
 
@@ -375,16 +491,11 @@ void slab_create_slab(slab_cache_t *cache, slab_bufctl_t *bufctl)
     slab->freelist_head = NULL;
     slab->freelist = NULL;
 
-    if (!cache->slabs)
-    {
-        cache->slabs_head = slab;
-        cache->slabs = slab;
-    }
-    else
-    {
-        cache->slabs->next = slab;
-        cache->slabs = cache->slabs->next;
-    }
+    // new slabs go to the front, as they are the ones with free bufctls
+    slab->next = cache->slabs_head;
+    cache->slabs_head = slab;
+    cache->slabs = slab;
+    cache->current = slab;
 }
 
 // position bufctl at index in bufctl buffer, add it to freelist
@@ -420,3 +531,102 @@ bool is_power_of_two(int num)
 {
     return (num > 0) && ((num & (num - 1)) == 0);
 }
+
+// return a slab with free bufctls and make it the current one - NULL if there is
+// none and the cache can't grow (the caller holds the lock)
+slab_t *slab_find_free(slab_cache_t *cache, slab_flags_t flags)
+{
+    if (cache->current->freelist_head)
+    {
+        return cache->current;
+    }
+
+    for (slab_t *slab = cache->slabs_head; slab; slab = slab->next)
+    {
+        if (slab->freelist_head)
+        {
+            cache->current = slab;
+
+            return slab;
+        }
+    }
+
+    if (!(flags & SLAB_AUTO_GROW))
+    {
+        return NULL;
+    }
+
+    // a successful grow makes the new slab the current one
+    slab_grow(cache, 1, flags);
+
+    return cache->current->freelist_head ? cache->current : NULL;
+}
+
+// move up to SLAB_CPU_BATCH bufctls from the slabs to an empty CPU cache, the
+// cache only grows if there are none at all (the caller holds the lock)
+void slab_refill(slab_cache_t *cache, slab_cpu_cache_t *cpu_cache, slab_flags_t flags)
+{
+    while (cpu_cache->bufctl_count < SLAB_CPU_BATCH)
+    {
+        slab_t *slab = slab_find_free(cache, cpu_cache->bufctl_count ? flags & ~SLAB_AUTO_GROW : flags);
+
+        if (!slab)
+        {
+            return;
+        }
+
+        slab_bufctl_t *bufctl = slab->freelist_head;
+
+        slab->freelist_head = bufctl->next;
+        slab->bufctl_count--;
+
+        bufctl->next = cpu_cache->freelist_head;
+
+        cpu_cache->freelist_head = bufctl;
+        cpu_cache->bufctl_count++;
+    }
+}
+
+// give the last count bufctls of a CPU cache (the ones freed longest ago) back to
+// their slabs (the caller holds the lock)
+void slab_flush(slab_cache_t *cache, slab_cpu_cache_t *cpu_cache, size_t count)
+{
+    slab_bufctl_t *bufctl = cpu_cache->freelist_head;
+    slab_bufctl_t *last_kept = NULL;
+
+    for (size_t i = count; i < cpu_cache->bufctl_count; i++)
+    {
+        last_kept = bufctl;
+        bufctl = bufctl->next;
+    }
+
+    if (last_kept)
+    {
+        last_kept->next = NULL;
+    }
+    else
+    {
+        cpu_cache->freelist_head = NULL;
+    }
+
+    cpu_cache->bufctl_count -= count;
+
+    while (bufctl)
+    {
+        slab_bufctl_t *next = bufctl->next;
+        slab_t *slab = slab_pointer_to_slab(bufctl);
+
+        bufctl->next = slab->freelist_head;
+        bufctl->index = ((uintptr_t)bufctl - (uintptr_t)slab->bufctl_addr) / cache->slab_size;
+
+        slab->freelist_head = bufctl;
+        slab->bufctl_count++;
+
+        if (!cache->current->freelist_head)
+        {
+            cache->current = slab;
+        }
+
+        bufctl = next;
+    }
+}
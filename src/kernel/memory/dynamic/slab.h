@@ -21,6 +21,14 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include <libk/lock/spinlock.h>
+#include <memory/mem_tag.h>
+#include <utility/utils.h>
+
+#define SLAB_CPU_BATCH	16		    // bufctls moved between a CPU cache and the slabs at once
+#define SLAB_CPU_MAX	(2 * SLAB_CPU_BATCH) // a CPU cache gives a batch back beyond that
 
 typedef struct __attribute__((__packed__)) slab_bufctl
 {
@@ -33,6 +41,8 @@ typedef struct slab
 {
     struct slab *next;
 
+    struct slab_cache *cache;
+
     size_t bufctl_count;
 
     void *bufctl_addr;
@@ -41,29 +51,84 @@ typedef struct slab
     slab_bufctl_t *freelist;
 } slab_t;
 
-typedef struct
+typedef enum
+{
+    SLAB_PANIC	    = (1 << 0),
+    SLAB_AUTO_GROW  = (1 << 1),
+    SLAB_NO_ALIGN   = (1 << 2)
+} slab_flags_t;
+
+// free bufctls which a CPU keeps for itself, so that allocating and freeing get
+// by without the cache lock - only its own CPU touches it, with interrupts off
+typedef struct __attribute__((aligned(64))) slab_cpu_cache
+{
+    slab_bufctl_t *freelist_head;
+    size_t bufctl_count;
+} slab_cpu_cache_t;
+
+typedef struct slab_cache
 {
+    slab_cpu_cache_t *cpu_caches; // indexed by CPU number, one page
+    slab_t *current; // slab refills take bufctls from first
+    spinlock_t lock;
+
     const char *name;
     size_t slab_size;
     size_t bufctl_count_max;
+    slab_flags_t flags;
+    mem_tag_t tag; // slabs are accounted to it
 
     slab_t *slabs_head;
     slab_t *slabs;
 } slab_cache_t;
 
-typedef enum
-{
-    SLAB_PANIC	    = (1 << 0),
-    SLAB_AUTO_GROW  = (1 << 1),
-    SLAB_NO_ALIGN   = (1 << 2)
-} slab_flags_t;
-
-slab_cache_t *slab_cache_create(const char *name, size_t slab_size, slab_flags_t flags);
+slab_cache_t *slab_cache_create(const char *name, size_t slab_size, mem_tag_t tag, slab_flags_t flags);
 void slab_cache_destroy(slab_cache_t *cache, slab_flags_t flags);
 void *slab_cache_alloc(slab_cache_t *cache, slab_flags_t flags);
 void slab_cache_free(slab_cache_t *cache, void *pointer, slab_flags_t flags);
 void slab_cache_grow(slab_cache_t *cache, size_t count, slab_flags_t flags);
 void slab_cache_reap(slab_cache_t *cache, slab_flags_t flags);
+void slab_cache_drain(slab_cache_t *cache);
 void slab_cache_dump(slab_cache_t *cache, slab_flags_t flags);
+slab_cache_t *slab_pointer_to_cache(void *pointer);
+
+// CPU cache of the calling CPU, interrupts have to be off - the CPU number is
+// read like this_cpu() does, as smp.h can't be included here (cpu.h includes malloc.h)
+static inline slab_cpu_cache_t *slab_this_cpu_cache(slab_cache_t *cache)
+{
+    uint64_t cpu_number;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu_number));
+
+    return &cache->cpu_caches[cpu_number];
+}
+
+// pop a bufctl off the CPU cache of this CPU, only if it is empty the slow path
+// has to take the cache lock and refill it
+static inline void *slab_cache_alloc_fast(slab_cache_t *cache)
+{
+    bool interrupts = asm_get_interrupt_flag();
+    asm volatile("cli");
+
+    slab_cpu_cache_t *cpu_cache = slab_this_cpu_cache(cache);
+    slab_bufctl_t *bufctl = cpu_cache->freelist_head;
+
+    if (__builtin_expect(bufctl != NULL, 1))
+    {
+        cpu_cache->freelist_head = bufctl->next;
+        cpu_cache->bufctl_count--;
+    }
+
+    if (interrupts)
+    {
+        asm volatile("sti");
+    }
+
+    if (__builtin_expect(bufctl != NULL, 1))
+    {
+        return bufctl;
+    }
+
+    return slab_cache_alloc(cache, 0);
+}
 
 #endif
@@ -30,7 +30,18 @@
 #define HEAP_MAX_SIZE	(4 * GiB)
 #define HEAP_START_ADDR	0xFFFF900000000000
 
+#define VMALLOC_MAX_SIZE    (512 * GiB)
+#define VMALLOC_START_ADDR  0xFFFFA00000000000
+#define VMALLOC_END_ADDR    (VMALLOC_START_ADDR + VMALLOC_MAX_SIZE)
+
+#define IOREMAP_MAX_SIZE    (64 * GiB)
+#define IOREMAP_START_ADDR  0xFFFFC00000000000
+#define IOREMAP_END_ADDR    (IOREMAP_START_ADDR + IOREMAP_MAX_SIZE)
+
 #define PAGE_SIZE 4096
+#define LARGE_PAGE_SIZE 0x200000UL  // 2 MiB - mapped by a page directory entry
+#define HUGE_PAGE_SIZE	GiB	    // 1 GiB - mapped by a page directory pointer table entry
+#define CACHE_LINE_SIZE 64
 
 #define KB_TO_PAGES(kb)		    (((kb) * 1024) / PAGE_SIZE)
 #define ALIGN_DOWN(address, align)  ((address) & ~((align)-1))
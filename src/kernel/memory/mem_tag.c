@@ -0,0 +1,111 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    Memory accounting per subsystem. Every PMM allocation carries a tag, the
+    page count is added to a per-CPU counter of that tag (in the CPU local
+    structure, so no lock and no shared cache line is involved) and the
+    counters of all CPUs are summed up on read. A counter of a single CPU can
+    go negative, if memory is freed on another CPU than it was allocated on.
+    Accounting is page granular - e.g. a slab cache is charged for whole slabs.
+
+*/
+
+#include <stddef.h>
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/debug.h>
+#include <libk/serial/log.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <proc/smp/smp.h>
+
+static const char *mem_tag_names[MEM_TAG_COUNT] =
+{
+    "kernel",
+    "page tables",
+    "slab",
+    "heap",
+    "vmalloc",
+    "stacks",
+    "zstore",
+    "swap",
+    "benchmark"
+};
+
+/* core functions */
+
+// add page_count (negative for frees) to the counter of tag on the calling CPU
+void mem_tag_account(mem_tag_t tag, int64_t page_count)
+{
+    size_t offset = offsetof(cpu_local_t, mem_tag_pages) + tag * sizeof(int64_t);
+
+    // a single add relative to GS can't be torn by an interrupt and doesn't
+    // need a lock prefix, as no other CPU writes this counter
+    asm volatile("addq %1, %%gs:(%0)" : : "r"(offset), "r"(page_count) : "memory");
+}
+
+// sum up the counters of tag of all CPUs
+int64_t mem_tag_get_page_count(mem_tag_t tag)
+{
+    int64_t page_count = 0;
+
+    for (uint64_t i = 0; i < smp_get_cpu_count(); i++)
+    {
+        page_count += __atomic_load_n(&cpu_locals[i].mem_tag_pages[tag], __ATOMIC_RELAXED);
+    }
+
+    return page_count;
+}
+
+// return a readable name for tag
+const char *mem_tag_get_name(mem_tag_t tag)
+{
+    if (tag >= MEM_TAG_COUNT)
+    {
+        return "unknown";
+    }
+
+    return mem_tag_names[tag];
+}
+
+// print how the used memory splits between the subsystems
+void mem_tag_dump(void)
+{
+    int64_t tagged_page_count = 0;
+
+    log(INFO, "Memory breakdown by subsystem:\n");
+
+    for (mem_tag_t tag = 0; tag < MEM_TAG_COUNT; tag++)
+    {
+        int64_t page_count = mem_tag_get_page_count(tag);
+        tagged_page_count += page_count;
+
+        debug("\t%-12s %8ld pages %10ld KiB\n", mem_tag_names[tag], page_count, page_count * (PAGE_SIZE / 1024));
+    }
+
+    // memory taken before the PMM existed (kernel image, bitmap, reserved holes)
+    int64_t untagged_page_count = pmm_get_used_page_count() - tagged_page_count;
+
+    debug("\t%-12s %8ld pages %10ld KiB\n", "untagged", untagged_page_count,
+          untagged_page_count * (PAGE_SIZE / 1024));
+}
@@ -0,0 +1,45 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEM_TAG_H
+#define MEM_TAG_H
+
+#include <stdint.h>
+
+// the subsystem a page of memory was allocated for
+typedef enum
+{
+    MEM_TAG_KERNEL,	// everything without a more specific tag
+    MEM_TAG_PAGE_TABLE,
+    MEM_TAG_SLAB,	// slab cache descriptors
+    MEM_TAG_HEAP,	// malloc() (slabs of the heap caches and vmalloc backed allocations)
+    MEM_TAG_VMALLOC,	// direct vmalloc() users
+    MEM_TAG_STACK,
+    MEM_TAG_ZSTORE,	// pool of the compressed page store
+    MEM_TAG_SWAP,	// slot map and cache descriptors of the swap device
+    MEM_TAG_BENCHMARK,
+
+    MEM_TAG_COUNT
+} mem_tag_t;
+
+void mem_tag_account(mem_tag_t tag, int64_t page_count);
+int64_t mem_tag_get_page_count(mem_tag_t tag);
+const char *mem_tag_get_name(mem_tag_t tag);
+void mem_tag_dump(void);
+
+#endif
@@ -23,12 +23,17 @@
     Basic concept: Each bit in the bitmap corresponds to a page (block of memory)
     through a mapping system. A bit only says if the corresponding page
     is free or used.
+    Pages can be shared (e.g. copy-on-write after vmm_clone_space()), so every
+    page also has a count of its additional references, which is stored right
+    after the bitmap. pmm_free() drops a reference of a shared page instead of
+    freeing it.
 
 */
 
 #include <boot/stivale2.h>
 #include <boot/stivale2_boot.h>
 #include <libk/data_structs/bitmap.h>
+#include <libk/lock/spinlock.h>
 #include <libk/serial/debug.h>
 #include <libk/serial/log.h>
 #include <libk/string/string.h>
@@ -36,14 +41,20 @@
 #include <memory/mem.h>
 #include <memory/physical/pmm.h>
 
+static spinlock_t pmm_lock;
+
 bitmap_t pmm_bitmap;
 static size_t highest_page_top = 0;
 static size_t used_pages_count = 0;
+static size_t first_free_bit_hint = 0; // no free page exists below this bit
+static uint32_t *ref_counts;		// references besides the first one, per page
 
 /* utility function prototypes */
 
 const char *get_memmap_entry_type_string(uint32_t type);
-void *pmm_find_first_free_page_range(size_t page_count);
+void *pmm_find_first_free_page_range(size_t page_count, size_t alignment);
+void pmm_free_range(uint64_t index, size_t page_count);
+bool pmm_drop_ref(uint64_t index);
 
 /* core functions */
 
@@ -84,9 +95,10 @@ void pmm_init(struct stivale2_struct *stivale2_struct)
         }
     }
 
-    used_pages_count = KB_TO_PAGES(highest_page_top);
+    used_pages_count = PAGE_TO_BIT(highest_page_top);
 
     pmm_bitmap.size = ALIGN_UP(ALIGN_DOWN(highest_page_top, PAGE_SIZE) / PAGE_SIZE / 8, PAGE_SIZE);
+    size_t ref_counts_size = ALIGN_UP(PAGE_TO_BIT(highest_page_top) * sizeof(uint32_t), PAGE_SIZE);
 
     /* host bitmap for allocator */
 
@@ -99,16 +111,17 @@ void pmm_init(struct stivale2_struct *stivale2_struct)
             continue;
         }
 
-        if (current_entry->length >= pmm_bitmap.size)
+        if (current_entry->length >= pmm_bitmap.size + ref_counts_size)
         {
-            log(INFO, "Found big enough memory map entry to host the PMM bitmap\n");
+            log(INFO, "Found big enough memory map entry to host the PMM bitmap and reference counts\n");
             log(INFO, "PMM bitmap stored between 0x%.8lx and 0x%.8lx\n",
                 current_entry->base, current_entry->base + current_entry->length - 1);
 
             pmm_bitmap.map = (uint8_t *)PHYS_TO_HIGHER_HALF_DATA(current_entry->base);
+            ref_counts = (uint32_t *)PHYS_TO_HIGHER_HALF_DATA(current_entry->base + pmm_bitmap.size);
 
-            current_entry->base += pmm_bitmap.size;
-            current_entry->length -= pmm_bitmap.size;
+            current_entry->base += pmm_bitmap.size + ref_counts_size;
+            current_entry->length -= pmm_bitmap.size + ref_counts_size;
 
             break;
         }
@@ -118,6 +131,7 @@ void pmm_init(struct stivale2_struct *stivale2_struct)
 
     // set everything to used state as default
     memset((void *)pmm_bitmap.map, 0xFF, pmm_bitmap.size);
+    memset(ref_counts, 0, ref_counts_size);
 
     // set all usable entries to free
     for (uint64_t i = 0; i < memory_map->entries; i++)
@@ -126,7 +140,7 @@ void pmm_init(struct stivale2_struct *stivale2_struct)
 
         if (current_entry->type == STIVALE2_MMAP_USABLE)
         {
-            pmm_free((void *)current_entry->base, current_entry->length / PAGE_SIZE);
+            pmm_free_range(PAGE_TO_BIT(current_entry->base), current_entry->length / PAGE_SIZE);
         }
     }
 
@@ -136,18 +150,30 @@ void pmm_init(struct stivale2_struct *stivale2_struct)
     log(INFO, "PMM initialized\n");
 }
 
-// set free memory range to used and return base pointer
-void *pmm_alloc(size_t page_count)
+// set free memory range to used and return base pointer - the pages are
+// accounted to tag until they are freed
+void *pmm_alloc(size_t page_count, mem_tag_t tag)
+{
+    return pmm_alloc_aligned(page_count, PAGE_SIZE, tag);
+}
+
+// same as pmm_alloc(), but the range starts at a multiple of alignment (power
+// of two, e.g. LARGE_PAGE_SIZE for frames of large pages)
+void *pmm_alloc_aligned(size_t page_count, size_t alignment, mem_tag_t tag)
 {
     if (used_pages_count <= 0)
     {
         return NULL;
     }
 
-    void *pointer = pmm_find_first_free_page_range(page_count);
+    spinlock_acquire(&pmm_lock);
+
+    void *pointer = pmm_find_first_free_page_range(page_count, PAGE_TO_BIT(alignment));
 
     if (pointer == NULL)
     {
+        spinlock_release(&pmm_lock);
+
         return NULL;
     }
 
@@ -158,32 +184,86 @@ void *pmm_alloc(size_t page_count)
         bitmap_set_bit(&pmm_bitmap, index + i);
     }
 
+    // a single unaligned page is always taken from the first free bit, bigger
+    // or aligned ranges might have skipped smaller holes
+    if (page_count == 1 && alignment == PAGE_SIZE)
+    {
+        first_free_bit_hint = index + 1;
+    }
+
     used_pages_count += page_count;
 
+    spinlock_release(&pmm_lock);
+
+    mem_tag_account(tag, page_count);
+
     return (void *)BIT_TO_PAGE(index);
 }
 
 // set free memory range to used and return base pointer
-// AND fill range with zeros
-void *pmm_allocz(size_t page_count)
+// AND fill range with zeros (through the higher half, which covers all of RAM)
+void *pmm_allocz(size_t page_count, mem_tag_t tag)
 {
-    void *pointer = pmm_alloc(page_count);
-    memset(pointer, 0, PAGE_SIZE * page_count);
+    void *pointer = pmm_alloc(page_count, tag);
+
+    if (pointer == NULL)
+    {
+        return NULL;
+    }
+
+    memset((void *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)pointer), 0, PAGE_SIZE * page_count);
 
     return pointer;
 }
 
-// set status of n pages to unused
-void pmm_free(void *pointer, size_t page_count)
+// set status of n pages to unused - tag has to be the one they were allocated with
+// (shared pages only lose a reference, see pmm_ref())
+void pmm_free(void *pointer, size_t page_count, mem_tag_t tag)
 {
     uint64_t index = PAGE_TO_BIT(pointer);
+    size_t freed_count = 0;
+
+    spinlock_acquire(&pmm_lock);
 
     for (size_t i = 0; i < page_count; i++)
     {
-        bitmap_unset_bit(&pmm_bitmap, index + i);
+        if (!pmm_drop_ref(index + i))
+        {
+            pmm_free_range(index + i, 1);
+            freed_count++;
+        }
     }
 
-    used_pages_count -= page_count;
+    spinlock_release(&pmm_lock);
+
+    mem_tag_account(tag, -(int64_t)freed_count);
+}
+
+// add a reference to an allocated page, which makes it shared - only the
+// pmm_free() of the last reference frees it
+void pmm_ref(void *pointer)
+{
+    assert(PAGE_TO_BIT(pointer) < PAGE_TO_BIT(highest_page_top));
+
+    __atomic_fetch_add(&ref_counts[PAGE_TO_BIT(pointer)], 1, __ATOMIC_RELAXED);
+}
+
+// return how many references an allocated page has (1 = not shared)
+size_t pmm_get_ref_count(void *pointer)
+{
+    return __atomic_load_n(&ref_counts[PAGE_TO_BIT(pointer)], __ATOMIC_ACQUIRE) + 1;
+}
+
+// return how many pages are in use (including the ones never handed out by the PMM)
+size_t pmm_get_used_page_count(void)
+{
+    return used_pages_count;
+}
+
+// return how many pages the PMM could still hand out
+size_t pmm_get_free_page_count(void)
+{
+    return PAGE_TO_BIT(highest_page_top) - used_pages_count;
 }
 
 /* utility functions */
@@ -222,23 +302,64 @@ const char *get_memmap_entry_type_string(uint32_t type)
     }
 }
 
-// search bitmap for contiguous unused bits -> free pages
-void *pmm_find_first_free_page_range(size_t page_count)
+// set the bits of a range to free (the caller holds the lock)
+void pmm_free_range(uint64_t index, size_t page_count)
+{
+    for (size_t i = 0; i < page_count; i++)
+    {
+        bitmap_unset_bit(&pmm_bitmap, index + i);
+    }
+
+    if (index < first_free_bit_hint)
+    {
+        first_free_bit_hint = index;
+    }
+
+    used_pages_count -= page_count;
+}
+
+// drop an additional reference of a page - false if there is none, so the
+// caller held the last one and the page has to be freed
+bool pmm_drop_ref(uint64_t index)
+{
+    uint32_t count = __atomic_load_n(&ref_counts[index], __ATOMIC_RELAXED);
+
+    do
+    {
+        if (count == 0)
+        {
+            return false;
+        }
+    }
+    while (!__atomic_compare_exchange_n(&ref_counts[index], &count, count - 1, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+// search bitmap for contiguous unused bits -> free pages, starting at a
+// multiple of alignment (in pages)
+void *pmm_find_first_free_page_range(size_t page_count, size_t alignment)
 {
-    for (size_t all_bits_i = 0; all_bits_i < PAGE_TO_BIT(highest_page_top); all_bits_i++)
+    size_t bit_count = PAGE_TO_BIT(highest_page_top);
+    size_t all_bits_i = ALIGN_UP(first_free_bit_hint, alignment);
+
+    while (all_bits_i + page_count <= bit_count)
     {
-        for (size_t page_count_i = 0; page_count_i < page_count; page_count_i++)
+        size_t page_count_i = 0;
+
+        while (page_count_i < page_count && !bitmap_check_bit(&pmm_bitmap, all_bits_i + page_count_i))
         {
-            if (bitmap_check_bit(&pmm_bitmap, all_bits_i + PAGE_TO_BIT(page_count_i)))
-            {
-                break;
-            }
-
-            if (page_count_i == page_count - 1)
-            {
-                return (void *)BIT_TO_PAGE(all_bits_i);
-            }
+            page_count_i++;
         }
+
+        if (page_count_i == page_count)
+        {
+            return (void *)BIT_TO_PAGE(all_bits_i);
+        }
+
+        // no range can start before the used page, so skip past it
+        all_bits_i = ALIGN_UP(all_bits_i + page_count_i + 1, alignment);
     }
 
     return NULL;
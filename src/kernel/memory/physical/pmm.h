@@ -19,12 +19,20 @@
 #ifndef PMM_H
 #define PMM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include <memory/mem_tag.h>
+
 void pmm_init(struct stivale2_struct *stivale2_struct);
-void *pmm_alloc(size_t page_count);
-void *pmm_allocz(size_t page_count);
-void pmm_free(void *pointer, size_t page_count);
+void *pmm_alloc(size_t page_count, mem_tag_t tag);
+void *pmm_allocz(size_t page_count, mem_tag_t tag);
+void *pmm_alloc_aligned(size_t page_count, size_t alignment, mem_tag_t tag);
+void pmm_free(void *pointer, size_t page_count, mem_tag_t tag);
+void pmm_ref(void *pointer);
+size_t pmm_get_ref_count(void *pointer);
+size_t pmm_get_used_page_count(void);
+size_t pmm_get_free_page_count(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,580 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Page fault handler. A fault on a missing page inside of a region (see
+    region.c) is resolved by mapping a zeroed frame, afterwards the faulting
+    instruction is executed again. A write to a page shared copy-on-write by
+    vmm_clone_space() maps a copy of the frame - or, if no other space refers
+    to the frame anymore, makes it writable without copying. Every other fault
+    (protection violations, reserved bits, addresses outside of regions) is
+    left to isr_handler(), which halts the CPU.
+    Fault-around maps the missing pages of the aligned window around the
+    faulting page as well (FAULT_AROUND_DEFAULT_PAGES), so sequential access
+    only faults once per window. Those pages are marked with PTE_PREFAULTED,
+    which allows counting how many of them were actually used (their accessed
+    bit is set when they are unmapped).
+    A read of a missing page maps the shared zero page (see zero_page.c)
+    read-only instead, or the 2 MiB one if the whole aligned 2 MiB block is
+    part of the region and has no page table yet. Writing to it faults again
+    and maps a zeroed frame in its place, so memory which is only read never
+    takes frames.
+    In user spaces, the other faults try to map a whole 2 MiB frame first
+    (transparent huge pages, see thp.c) - writing to a 2 MiB zero page
+    replaces it by one as well.
+    A page which was evicted into the compressed store (see zstore.c) is
+    decompressed into a new frame, one which went to the swap device is read
+    back (see swap.c) - a major fault. Fault-around leaves the
+    evicted pages of the window alone, they only come back when accessed.
+    Faults of a space are serialized by its region lock, so two CPUs faulting
+    on the same page don't both map a frame for it.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <libk/testing/assert.h>
+#include <memory/mem.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+#include <memory/virtual/zero_page.h>
+#include <memory/virtual/zstore.h>
+#include <proc/smp/smp.h>
+#include <utility/utils.h>
+
+static page_fault_stats_t fault_stats;
+static size_t fault_around_window = FAULT_AROUND_DEFAULT_PAGES;
+static bool zero_page_enabled = true;
+
+/* utility function prototypes */
+
+vmm_space_t *page_fault_get_space(uint64_t address);
+bool page_fault_access_allowed(vmm_region_t *region, uint64_t error_code);
+bool page_fault_map_anonymous(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page,
+                              uint64_t extra_flags, bool zero_page);
+bool page_fault_map_large_zero(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page);
+bool page_fault_zero_page_allowed(vmm_region_t *region, uint64_t error_code);
+size_t page_fault_around(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, bool zero_page);
+page_fault_result_t page_fault_resolve_missing(vmm_space_t *space, vmm_region_t *region, uint64_t virt_page,
+        uint64_t error_code);
+page_fault_result_t page_fault_resolve_present(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page, uint64_t error_code);
+page_fault_result_t page_fault_resolve_cow(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page);
+page_fault_result_t page_fault_resolve_zero(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page);
+page_fault_result_t page_fault_resolve_swapped(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page, uint64_t error_code);
+void page_fault_account_cycles(uint64_t cycles);
+
+/* core functions */
+
+// try to resolve a page fault - false if it can't be, which is fatal
+bool page_fault_handle(cpu_interrupt_state_t *cpu)
+{
+    uint64_t start_cycles = asm_rdtsc();
+    uint64_t address = asm_read_cr(2);
+    uint64_t error_code = cpu->error_code;
+
+    // the paging structures are corrupted
+    if (error_code & PF_ERROR_RESERVED)
+    {
+        __atomic_fetch_add(&fault_stats.invalid_faults, 1, __ATOMIC_RELAXED);
+
+        return false;
+    }
+
+    vmm_space_t *space = page_fault_get_space(address);
+    uint64_t virt_page = ALIGN_DOWN(address, PAGE_SIZE);
+
+    spinlock_acquire(&space->region_lock);
+
+    vmm_region_t *region = vmm_region_find(space, address);
+    page_fault_result_t result = PAGE_FAULT_INVALID;
+
+    if (region && page_fault_access_allowed(region, error_code))
+    {
+        uint64_t *pte = vmm_get_pte(space, virt_page);
+
+        if (pte && (*pte & PTE_PRESENT))
+        {
+            result = page_fault_resolve_present(space, region, pte, virt_page, error_code);
+        }
+        else if (pte && zstore_is_entry(*pte))
+        {
+            result = page_fault_resolve_swapped(space, region, pte, virt_page, error_code);
+        }
+        else
+        {
+            result = page_fault_resolve_missing(space, region, virt_page, error_code);
+        }
+    }
+
+    spinlock_release(&space->region_lock);
+
+    switch (result)
+    {
+        case PAGE_FAULT_RESOLVED:
+            page_fault_account_cycles(asm_rdtsc() - start_cycles);
+
+            return true;
+
+        case PAGE_FAULT_SPURIOUS:
+            __atomic_fetch_add(&fault_stats.spurious_faults, 1, __ATOMIC_RELAXED);
+
+            return true;
+
+        case PAGE_FAULT_OUT_OF_MEMORY:
+            log(WARNING, "Page fault at 0x%.16llx: out of memory\n", address);
+
+            break;
+
+        case PAGE_FAULT_INVALID:
+            break;
+    }
+
+    __atomic_fetch_add(&fault_stats.invalid_faults, 1, __ATOMIC_RELAXED);
+
+    return false;
+}
+
+// set how many pages (power of two) around a faulting page get mapped - 1 disables fault-around
+void page_fault_set_around_pages(size_t page_count)
+{
+    assert(page_count && (page_count & (page_count - 1)) == 0);
+
+    __atomic_store_n(&fault_around_window, page_count, __ATOMIC_RELAXED);
+}
+
+// whether read faults map the zero page (instead of a zeroed frame)
+void page_fault_set_zero_page(bool enabled)
+{
+    __atomic_store_n(&zero_page_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+// count a page table entry of a region that gets unmapped - a page mapped by
+// fault-around was worth it, if it was accessed
+void page_fault_account_unmap(uint64_t entry)
+{
+    if ((entry & PTE_PREFAULTED) && (entry & PTE_ACCESSED))
+    {
+        __atomic_fetch_add(&fault_stats.fault_around_hits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// copy the counters of all CPUs
+void page_fault_get_stats(page_fault_stats_t *stats)
+{
+    stats->minor_faults = __atomic_load_n(&fault_stats.minor_faults, __ATOMIC_RELAXED);
+    stats->major_faults = __atomic_load_n(&fault_stats.major_faults, __ATOMIC_RELAXED);
+    stats->spurious_faults = __atomic_load_n(&fault_stats.spurious_faults, __ATOMIC_RELAXED);
+    stats->invalid_faults = __atomic_load_n(&fault_stats.invalid_faults, __ATOMIC_RELAXED);
+    stats->fault_around_pages = __atomic_load_n(&fault_stats.fault_around_pages, __ATOMIC_RELAXED);
+    stats->fault_around_hits = __atomic_load_n(&fault_stats.fault_around_hits, __ATOMIC_RELAXED);
+    stats->cow_copies = __atomic_load_n(&fault_stats.cow_copies, __ATOMIC_RELAXED);
+    stats->cow_reuses = __atomic_load_n(&fault_stats.cow_reuses, __ATOMIC_RELAXED);
+    stats->zero_pages = __atomic_load_n(&fault_stats.zero_pages, __ATOMIC_RELAXED);
+    stats->zero_large_pages = __atomic_load_n(&fault_stats.zero_large_pages, __ATOMIC_RELAXED);
+    stats->zero_replaced = __atomic_load_n(&fault_stats.zero_replaced, __ATOMIC_RELAXED);
+    stats->total_cycles = __atomic_load_n(&fault_stats.total_cycles, __ATOMIC_RELAXED);
+    stats->max_cycles = __atomic_load_n(&fault_stats.max_cycles, __ATOMIC_RELAXED);
+}
+
+// set all counters back to zero
+void page_fault_reset_stats(void)
+{
+    __atomic_store_n(&fault_stats.minor_faults, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.major_faults, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.spurious_faults, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.invalid_faults, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.fault_around_pages, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.fault_around_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.cow_copies, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.cow_reuses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.zero_pages, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.zero_large_pages, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.zero_replaced, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.total_cycles, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fault_stats.max_cycles, 0, __ATOMIC_RELAXED);
+}
+
+// print the counters
+void page_fault_dump_stats(void)
+{
+    page_fault_stats_t stats;
+    page_fault_get_stats(&stats);
+
+    uint64_t resolved_count = stats.minor_faults + stats.major_faults + stats.cow_copies + stats.cow_reuses
+                              + stats.zero_replaced;
+
+    log(INFO, "Page faults: minor=%llu major=%llu cow_copies=%llu cow_reuses=%llu spurious=%llu invalid=%llu "
+        "fault_around_pages=%llu fault_around_hits=%llu avg_cycles=%llu max_cycles=%llu\n",
+        stats.minor_faults, stats.major_faults, stats.cow_copies, stats.cow_reuses, stats.spurious_faults,
+        stats.invalid_faults, stats.fault_around_pages, stats.fault_around_hits,
+        resolved_count ? stats.total_cycles / resolved_count : 0, stats.max_cycles);
+
+    // every zero page mapping that wasn't written to spared a frame
+    log(INFO, "Zero pages: 4k=%llu 2m=%llu replaced=%llu (up to %llu frames spared)\n",
+        stats.zero_pages, stats.zero_large_pages, stats.zero_replaced,
+        stats.zero_pages + stats.zero_large_pages * (LARGE_PAGE_SIZE / PAGE_SIZE) - stats.zero_replaced);
+}
+
+/* utility functions */
+
+// the higher half belongs to the kernel space, the lower half to the loaded one
+vmm_space_t *page_fault_get_space(uint64_t address)
+{
+    vmm_space_t *space = this_cpu()->space;
+
+    if (address >= HIGHER_HALF_DATA || !space)
+    {
+        return vmm_get_kernel_space();
+    }
+
+    return space;
+}
+
+// whether the region permits the access that faulted
+bool page_fault_access_allowed(vmm_region_t *region, uint64_t error_code)
+{
+    if ((error_code & PF_ERROR_WRITE) && !(region->flags & PTE_READ_WRITE))
+    {
+        return false;
+    }
+
+    if ((error_code & PF_ERROR_USER) && !(region->flags & PTE_USER_SUPERVISOR))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// map a zeroed frame (and the missing pages around it) - or the zero page for
+// reads - only non-present entries become present, so nothing needs to be flushed
+page_fault_result_t page_fault_resolve_missing(vmm_space_t *space, vmm_region_t *region, uint64_t virt_page,
+        uint64_t error_code)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    bool zero_page = page_fault_zero_page_allowed(region, error_code);
+
+    if (zero_page && page_fault_map_large_zero(&gather, region, virt_page))
+    {
+        tlb_gather_finish(&gather);
+
+        __atomic_fetch_add(&fault_stats.minor_faults, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&fault_stats.zero_large_pages, 1, __ATOMIC_RELAXED);
+
+        return PAGE_FAULT_RESOLVED;
+    }
+
+    if (!zero_page && thp_map_on_fault(&gather, region, virt_page))
+    {
+        tlb_gather_finish(&gather);
+
+        __atomic_fetch_add(&fault_stats.minor_faults, 1, __ATOMIC_RELAXED);
+        zstore_note_alloc();
+
+        return PAGE_FAULT_RESOLVED;
+    }
+
+    if (!page_fault_map_anonymous(&gather, region, virt_page, 0, zero_page))
+    {
+        return PAGE_FAULT_OUT_OF_MEMORY;
+    }
+
+    size_t around_count = page_fault_around(&gather, region, virt_page, zero_page);
+
+    tlb_gather_finish(&gather);
+
+    // the collapse worker might be able to merge the pages later on
+    if (!zero_page)
+    {
+        thp_note_small_fault(space, region);
+        zstore_note_alloc();
+    }
+
+    __atomic_fetch_add(&fault_stats.minor_faults, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fault_stats.fault_around_pages, around_count, __ATOMIC_RELAXED);
+
+    return PAGE_FAULT_RESOLVED;
+}
+
+// a fault on a page which is mapped - either a write to a copy-on-write page,
+// or another CPU resolved the same fault while this one waited for the lock
+page_fault_result_t page_fault_resolve_present(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page, uint64_t error_code)
+{
+    uint64_t entry = *pte;
+
+    if (!(error_code & PF_ERROR_WRITE))
+    {
+        // reads of present pages only fault if they weren't present back then
+        return (error_code & PF_ERROR_PRESENT) ? PAGE_FAULT_INVALID : PAGE_FAULT_SPURIOUS;
+    }
+
+    if (entry & PTE_READ_WRITE)
+    {
+        return PAGE_FAULT_SPURIOUS;
+    }
+
+    if (entry & PTE_COW)
+    {
+        return page_fault_resolve_cow(space, region, pte, virt_page);
+    }
+
+    vmm_walk_entry_t leaf;
+
+    if (vmm_walk_lookup(space, virt_page, &leaf) && zero_page_contains(leaf.phys))
+    {
+        return page_fault_resolve_zero(space, region, pte, virt_page);
+    }
+
+    return PAGE_FAULT_INVALID;
+}
+
+// give the space its own copy of a shared frame - if the other spaces dropped
+// theirs already, the frame is simply made writable again
+page_fault_result_t page_fault_resolve_cow(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page)
+{
+    uint64_t entry = *pte;
+    void *frame = (void *)(entry & PTE_ADDRESS_MASK);
+
+    // nobody can add a reference meanwhile, cloning needs the region lock - and
+    // more rights need no shootdown, a CPU with the read-only translation
+    // faults once more, which drops it
+    if (pmm_get_ref_count(frame) == 1)
+    {
+        *pte = (entry | PTE_READ_WRITE) & ~(uint64_t)(PTE_COW | PTE_KSM);
+        tlb_flush_page(virt_page);
+
+        __atomic_fetch_add(&fault_stats.cow_reuses, 1, __ATOMIC_RELAXED);
+
+        return PAGE_FAULT_RESOLVED;
+    }
+
+    void *copy = pmm_alloc(1, region->tag);
+
+    if (!copy)
+    {
+        return PAGE_FAULT_OUT_OF_MEMORY;
+    }
+
+    memcpy((void *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)copy),
+           (void *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)frame), PAGE_SIZE);
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    vmm_map_page_gather(&gather, (uint64_t)copy, virt_page, region->flags | (entry & PTE_PREFAULTED),
+                        region->pat_type);
+
+    // other CPUs might still read the shared frame until the flush
+    tlb_gather_free_frames(&gather, frame, 1, region->tag);
+    tlb_gather_finish(&gather);
+
+    __atomic_fetch_add(&fault_stats.cow_copies, 1, __ATOMIC_RELAXED);
+
+    return PAGE_FAULT_RESOLVED;
+}
+
+// map a zeroed frame where the zero page was mapped - a 2 MiB zero page is
+// replaced by a 2 MiB frame if possible, split otherwise (its other pages
+// keep pointing to the zero frame)
+page_fault_result_t page_fault_resolve_zero(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page)
+{
+    uint64_t entry = *pte;
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    if (thp_replace_zero(&gather, region, virt_page))
+    {
+        tlb_gather_finish(&gather);
+
+        __atomic_fetch_add(&fault_stats.zero_replaced, 1, __ATOMIC_RELAXED);
+
+        return PAGE_FAULT_RESOLVED;
+    }
+
+    void *frame = pmm_allocz(1, region->tag);
+
+    if (!frame)
+    {
+        return PAGE_FAULT_OUT_OF_MEMORY;
+    }
+
+    // mapping a 4 KiB page inside of a large one splits it
+    vmm_map_page_gather(&gather, (uint64_t)frame, virt_page, region->flags | (entry & PTE_PREFAULTED),
+                        region->pat_type);
+
+    tlb_gather_finish(&gather);
+
+    __atomic_fetch_add(&fault_stats.zero_replaced, 1, __ATOMIC_RELAXED);
+
+    return PAGE_FAULT_RESOLVED;
+}
+
+// bring an evicted page back from the compressed store or the swap device - a
+// zero-filled one is only mapped to the zero page, if reads may be served by it
+page_fault_result_t page_fault_resolve_swapped(vmm_space_t *space, vmm_region_t *region, uint64_t *pte,
+        uint64_t virt_page, uint64_t error_code)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    if (!zstore_fault_in(&gather, region, virt_page, pte, page_fault_zero_page_allowed(region, error_code)))
+    {
+        return PAGE_FAULT_OUT_OF_MEMORY;
+    }
+
+    tlb_gather_finish(&gather);
+
+    __atomic_fetch_add(&fault_stats.major_faults, 1, __ATOMIC_RELAXED);
+
+    zstore_note_alloc();
+
+    return PAGE_FAULT_RESOLVED;
+}
+
+// reads of write-back memory can be served by the zero page
+bool page_fault_zero_page_allowed(vmm_region_t *region, uint64_t error_code)
+{
+    return __atomic_load_n(&zero_page_enabled, __ATOMIC_RELAXED) && !(error_code & PF_ERROR_WRITE)
+           && region->pat_type == PAT_WRITE_BACK;
+}
+
+// map the 2 MiB zero page over the aligned block around virt_page - only if
+// the block is inside of the region and nothing of it is mapped yet
+bool page_fault_map_large_zero(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page)
+{
+    uint64_t block = ALIGN_DOWN(virt_page, LARGE_PAGE_SIZE);
+
+    if (block < region->start || block + LARGE_PAGE_SIZE > region->end)
+    {
+        return false;
+    }
+
+    // no page table below the block (a large page would have been present)
+    if (vmm_get_pte(gather->space, block) != NULL)
+    {
+        return false;
+    }
+
+    vmm_map_large_page_gather(gather, zero_page_get_large(), block,
+                              region->flags & ~(uint64_t)PTE_READ_WRITE, region->pat_type);
+
+    return true;
+}
+
+// back a page of an anonymous region with a zeroed frame - or with the zero
+// page (read-only) if zero_page is set
+bool page_fault_map_anonymous(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page,
+                              uint64_t extra_flags, bool zero_page)
+{
+    if (zero_page)
+    {
+        vmm_map_page_gather(gather, zero_page_get(), virt_page,
+                            (region->flags & ~(uint64_t)PTE_READ_WRITE) | extra_flags, region->pat_type);
+
+        __atomic_fetch_add(&fault_stats.zero_pages, 1, __ATOMIC_RELAXED);
+
+        return true;
+    }
+
+    void *frame = pmm_allocz(1, region->tag);
+
+    if (!frame)
+    {
+        return false;
+    }
+
+    vmm_map_page_gather(gather, (uint64_t)frame, virt_page, region->flags | extra_flags, region->pat_type);
+
+    return true;
+}
+
+// map the missing pages of the aligned window around virt_page (within the
+// region) - returns how many were mapped, running out of memory just stops it
+size_t page_fault_around(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, bool zero_page)
+{
+    size_t page_count = __atomic_load_n(&fault_around_window, __ATOMIC_RELAXED);
+    uint64_t window_size = page_count * PAGE_SIZE;
+
+    uint64_t start = ALIGN_DOWN(virt_page, window_size);
+    uint64_t end = start + window_size;
+
+    start = start < region->start ? region->start : start;
+    end = end > region->end ? region->end : end;
+
+    size_t mapped_count = 0;
+
+    for (uint64_t address = start; address < end; address += PAGE_SIZE)
+    {
+        if (address == virt_page)
+        {
+            continue;
+        }
+
+        uint64_t *pte = vmm_get_pte(gather->space, address);
+
+        // swapped out pages only come back when they are accessed
+        if (pte && *pte)
+        {
+            continue;
+        }
+
+        if (!page_fault_map_anonymous(gather, region, address, PTE_PREFAULTED, zero_page))
+        {
+            break;
+        }
+
+        mapped_count++;
+    }
+
+    return mapped_count;
+}
+
+// add the latency of a resolved fault
+void page_fault_account_cycles(uint64_t cycles)
+{
+    __atomic_fetch_add(&fault_stats.total_cycles, cycles, __ATOMIC_RELAXED);
+
+    uint64_t max_cycles = __atomic_load_n(&fault_stats.max_cycles, __ATOMIC_RELAXED);
+
+    while (cycles > max_cycles
+            && !__atomic_compare_exchange_n(&fault_stats.max_cycles, &max_cycles, cycles, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
@@ -0,0 +1,71 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/cpu.h>
+
+// bits of the page fault error code
+#define PF_ERROR_PRESENT	(1 << 0) // protection violation, not a missing page
+#define PF_ERROR_WRITE		(1 << 1)
+#define PF_ERROR_USER		(1 << 2)
+#define PF_ERROR_RESERVED	(1 << 3) // reserved bit set in a paging structure
+#define PF_ERROR_FETCH		(1 << 4) // instruction fetch
+
+#define FAULT_AROUND_DEFAULT_PAGES  16 // 64 KiB window around a faulting page
+
+typedef enum
+{
+    PAGE_FAULT_RESOLVED,
+    PAGE_FAULT_SPURIOUS,	    // nothing to do (anymore), just retry
+    PAGE_FAULT_INVALID,
+    PAGE_FAULT_OUT_OF_MEMORY
+} page_fault_result_t;
+
+typedef struct
+{
+    uint64_t minor_faults;	    // resolved by mapping a zeroed frame
+    uint64_t major_faults;	    // resolved by bringing a page back from the compressed store
+    uint64_t cow_copies;	    // writes to shared frames which were copied
+    uint64_t cow_reuses;	    // writes to frames which weren't shared anymore
+    uint64_t zero_pages;	    // reads served by the 4 KiB zero page (fault-around included)
+    uint64_t zero_large_pages;	    // reads served by the 2 MiB zero page
+    uint64_t zero_replaced;	    // writes which replaced a zero page by a frame
+    uint64_t spurious_faults;	    // another CPU mapped the page in the meantime
+    uint64_t invalid_faults;	    // not resolvable - the CPU is halted
+    uint64_t fault_around_pages;    // mapped in advance by fault-around
+    uint64_t fault_around_hits;	    // of those, accessed before they were unmapped again
+    uint64_t total_cycles;	    // spent in resolved faults
+    uint64_t max_cycles;
+} page_fault_stats_t;
+
+bool page_fault_handle(cpu_interrupt_state_t *cpu);
+void page_fault_set_around_pages(size_t page_count);
+void page_fault_set_zero_page(bool enabled);
+void page_fault_account_unmap(uint64_t entry);
+void page_fault_get_stats(page_fault_stats_t *stats);
+void page_fault_reset_stats(void);
+void page_fault_dump_stats(void);
+
+#endif
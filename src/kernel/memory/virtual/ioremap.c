@@ -0,0 +1,298 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Mappings of device memory (MMIO registers, framebuffers) in a dedicated
+    kernel address range (IOREMAP_START_ADDR - IOREMAP_END_ADDR), each with
+    its own caching type - usually PAT_UNCACHEABLE for registers and
+    PAT_WRITE_COMBINING for framebuffers - instead of the one of the RAM
+    around it in the HHDM.
+    Areas are kept in a list sorted by address, each followed by an unmapped
+    guard page. A request for frames which an area with the same caching type
+    maps already gets that area (with the offset into it) and only takes a
+    reference, iounmap() unmaps once the last one is dropped. A request with
+    another caching type for the same frames is refused, as the CPU doesn't
+    handle one frame with different types well. The same goes for frames
+    which the HHDM maps with another type than the requested one (the first
+    4 GiB and every memory map entry, see vmm_map_memmap_entry()).
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/testing/assert.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+#include <memory/virtual/ioremap.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+
+static spinlock_t ioremap_lock;
+static slab_cache_t *ioremap_area_cache;
+static ioremap_area_t *ioremap_areas_head = NULL;
+
+/* utility function prototypes */
+
+ioremap_area_t *ioremap_find_phys(uint64_t phys, size_t page_count, ioremap_area_t **overlap);
+ioremap_area_t *ioremap_find_virt(uintptr_t address, ioremap_area_t **prev_area);
+uintptr_t ioremap_find_free_range(size_t page_count, ioremap_area_t **prev_area);
+uintptr_t ioremap_area_end(ioremap_area_t *area);
+bool ioremap_alias_matches(uint64_t phys, size_t page_count, pat_cache_t pat_type);
+
+/* core functions */
+
+// create the cache that holds the area descriptors
+void ioremap_init(void)
+{
+    assert(sizeof(ioremap_area_t) <= 64);
+
+    ioremap_area_cache = slab_cache_create("ioremap areas", 64, MEM_TAG_KERNEL, SLAB_PANIC | SLAB_AUTO_GROW);
+
+    log(INFO, "ioremap initialized - 0x%.16llx to 0x%.16llx\n", IOREMAP_START_ADDR, IOREMAP_END_ADDR);
+}
+
+// map size bytes of device memory at phys with a caching type and return the
+// virtual address of phys - NULL if there is no room or the frames are mapped
+// with another caching type already
+void *ioremap(uint64_t phys, size_t size, pat_cache_t pat_type)
+{
+    if (!size)
+    {
+        return NULL;
+    }
+
+    uint64_t phys_page = ALIGN_DOWN(phys, PAGE_SIZE);
+    size_t page_count = (ALIGN_UP(phys + size, PAGE_SIZE) - phys_page) / PAGE_SIZE;
+
+    spinlock_acquire(&ioremap_lock);
+
+    ioremap_area_t *overlap;
+    ioremap_area_t *area = ioremap_find_phys(phys_page, page_count, &overlap);
+
+    if (area && area->pat_type == pat_type)
+    {
+        area->ref_count++;
+
+        spinlock_release(&ioremap_lock);
+
+        return (void *)(area->start + (phys - area->phys));
+    }
+
+    // an area with another type conflicts whether it holds all or some of the frames
+    if ((area && area->pat_type != pat_type) || (overlap && overlap->pat_type != pat_type))
+    {
+        spinlock_release(&ioremap_lock);
+
+        log(WARNING, "ioremap: 0x%.16llx is mapped with another caching type already\n", phys);
+
+        return NULL;
+    }
+
+    if (!ioremap_alias_matches(phys_page, page_count, pat_type))
+    {
+        spinlock_release(&ioremap_lock);
+
+        log(WARNING, "ioremap: 0x%.16llx has another caching type in the HHDM\n", phys);
+
+        return NULL;
+    }
+
+    ioremap_area_t *prev_area;
+    uintptr_t start = ioremap_find_free_range(page_count + 1, &prev_area);
+
+    if (!start)
+    {
+        spinlock_release(&ioremap_lock);
+
+        return NULL;
+    }
+
+    area = slab_cache_alloc(ioremap_area_cache, SLAB_PANIC);
+
+    area->start = start;
+    area->phys = phys_page;
+    area->page_count = page_count;
+    area->pat_type = pat_type;
+    area->ref_count = 1;
+
+    vmm_map_range(vmm_get_kernel_space(), phys_page, phys_page + page_count * PAGE_SIZE, start - phys_page,
+                  KERNEL_READ_WRITE, pat_type);
+
+    if (!prev_area)
+    {
+        area->next = ioremap_areas_head;
+        ioremap_areas_head = area;
+    }
+    else
+    {
+        area->next = prev_area->next;
+        prev_area->next = area;
+    }
+
+    spinlock_release(&ioremap_lock);
+
+    return (void *)(start + (phys - phys_page));
+}
+
+// drop a mapping returned by ioremap(), the last one unmaps the area
+void iounmap(void *pointer)
+{
+    spinlock_acquire(&ioremap_lock);
+
+    ioremap_area_t *prev_area;
+    ioremap_area_t *area = ioremap_find_virt((uintptr_t)pointer, &prev_area);
+
+    if (!area)
+    {
+        spinlock_release(&ioremap_lock);
+
+        log(WARNING, "iounmap: 0x%p is not mapped\n", pointer);
+
+        return;
+    }
+
+    if (--area->ref_count > 0)
+    {
+        spinlock_release(&ioremap_lock);
+
+        return;
+    }
+
+    if (!prev_area)
+    {
+        ioremap_areas_head = area->next;
+    }
+    else
+    {
+        prev_area->next = area->next;
+    }
+
+    vmm_unmap_range(vmm_get_kernel_space(), area->start, area->start + area->page_count * PAGE_SIZE);
+
+    slab_cache_free(ioremap_area_cache, area, SLAB_PANIC);
+
+    spinlock_release(&ioremap_lock);
+}
+
+// return if an address lies in the ioremap range
+bool is_ioremap_address(void *pointer)
+{
+    return (uintptr_t)pointer >= IOREMAP_START_ADDR && (uintptr_t)pointer < IOREMAP_END_ADDR;
+}
+
+/* utility functions */
+
+// find an area which maps all of the frames - overlap is set to any area
+// which maps some of them (or NULL)
+ioremap_area_t *ioremap_find_phys(uint64_t phys, size_t page_count, ioremap_area_t **overlap)
+{
+    uint64_t phys_end = phys + page_count * PAGE_SIZE;
+
+    *overlap = NULL;
+
+    for (ioremap_area_t *area = ioremap_areas_head; area; area = area->next)
+    {
+        uint64_t area_phys_end = area->phys + area->page_count * PAGE_SIZE;
+
+        if (area->phys <= phys && area_phys_end >= phys_end)
+        {
+            return area;
+        }
+
+        if (area->phys < phys_end && area_phys_end > phys)
+        {
+            *overlap = area;
+        }
+    }
+
+    return NULL;
+}
+
+// find the area an address points into and its predecessor in the list
+ioremap_area_t *ioremap_find_virt(uintptr_t address, ioremap_area_t **prev_area)
+{
+    *prev_area = NULL;
+
+    for (ioremap_area_t *area = ioremap_areas_head; area; area = area->next)
+    {
+        if (address >= area->start && address < area->start + area->page_count * PAGE_SIZE)
+        {
+            return area;
+        }
+
+        if (area->start > address)
+        {
+            break;
+        }
+
+        *prev_area = area;
+    }
+
+    return NULL;
+}
+
+// first fit search for a gap of page_count pages between the areas - return 0
+// if there is none, otherwise the start and the area the gap follows
+uintptr_t ioremap_find_free_range(size_t page_count, ioremap_area_t **prev_area)
+{
+    uintptr_t candidate = IOREMAP_START_ADDR;
+    size_t size = page_count * PAGE_SIZE;
+
+    *prev_area = NULL;
+
+    for (ioremap_area_t *area = ioremap_areas_head; area; area = area->next)
+    {
+        if (area->start >= candidate && area->start - candidate >= size)
+        {
+            break;
+        }
+
+        candidate = ioremap_area_end(area);
+        *prev_area = area;
+    }
+
+    if (candidate >= IOREMAP_END_ADDR || size > IOREMAP_END_ADDR - candidate)
+    {
+        return 0;
+    }
+
+    return candidate;
+}
+
+// return the first address after an area, including its guard page
+uintptr_t ioremap_area_end(ioremap_area_t *area)
+{
+    return area->start + (area->page_count + 1) * PAGE_SIZE;
+}
+
+// return if the HHDM doesn't map the frames or maps all of them with pat_type -
+// the other kernel windows of a frame always use the same type as the HHDM
+bool ioremap_alias_matches(uint64_t phys, size_t page_count, pat_cache_t pat_type)
+{
+    vmm_range_info_t info;
+
+    vmm_query_range(vmm_get_kernel_space(), PHYS_TO_HIGHER_HALF_DATA(phys),
+                    PHYS_TO_HIGHER_HALF_DATA(phys + page_count * PAGE_SIZE), &info);
+
+    return info.mapped_size == 0 || (info.pat_type == pat_type && !info.mixed_pat);
+}
@@ -0,0 +1,47 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef IOREMAP_H
+#define IOREMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/cpu.h>
+
+typedef struct ioremap_area
+{
+    struct ioremap_area *next;
+
+    uintptr_t start;
+    uint64_t phys;		// first mapped frame
+    size_t page_count;		// mapped pages, followed by an unmapped guard page
+
+    pat_cache_t pat_type;
+    size_t ref_count;		// ioremap() calls which returned this area
+} ioremap_area_t;
+
+void ioremap_init(void);
+void *ioremap(uint64_t phys, size_t size, pat_cache_t pat_type);
+void iounmap(void *pointer);
+bool is_ioremap_address(void *pointer);
+
+#endif
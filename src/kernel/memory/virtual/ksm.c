@@ -0,0 +1,661 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+
+    Brief file description:
+    Same-page merging: spaces which opted in (ksm_set_mergeable()) are
+    scanned page by page, and pages with identical contents are merged into
+    one frame which all of them map copy-on-write (PTE_COW | PTE_KSM). The
+    first write to a merged page copies it again (see fault.c). Zero-filled
+    pages are mapped to the zero page instead (see zero_page.c).
+    Pages are found by a 64 bit hash of their contents. Merged frames are
+    kept in the stable tree - they can't change, as nobody may write to
+    them. Pages which were scanned but didn't match anything yet go into
+    the unstable tree, which is thrown away after every full pass, as their
+    contents might change at any time. Two pages are only merged after both
+    were made read-only and compared completely, so neither hash collisions
+    nor concurrent writes merge different contents. The stable tree holds a
+    reference of each of its frames, a frame which nobody else maps anymore
+    is dropped after a pass.
+    Merging works on 4 KiB pages: no huge pages are created in a mergeable
+    space (see thp.c), the ones it had before opting in are split when the
+    scanner reaches them.
+    The scanner runs as idle work of an AP (see smp.c) once enabled: every
+    run scans pages_per_run pages, then waits sleep_us on the HPET (giving
+    way to other work) before it kicks itself again.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <hardware/hpet/hpet.h>
+#include <libk/data_structs/rbtree.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <libk/testing/assert.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/ksm.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+#include <memory/virtual/zero_page.h>
+#include <proc/smp/smp.h>
+#include <utility/utils.h>
+
+#define KSM_SLEEP_STEP_US   100 // how often the pause between two runs checks for other work
+
+// what both trees are ordered by
+typedef struct
+{
+    rbtree_node_t node;
+    uint64_t hash;
+} ksm_tree_node_t;
+
+// a merged frame, mapped read-only by every page with its contents
+typedef struct
+{
+    ksm_tree_node_t tree_node;
+    uint64_t frame;
+    mem_tag_t tag;
+} ksm_stable_node_t;
+
+// a page of the current pass which didn't match anything yet
+typedef struct
+{
+    ksm_tree_node_t tree_node;
+    vmm_space_t *space;		// might be gone already, see vmm_space_try_lock()
+    uint64_t virt;
+    uint64_t frame;
+} ksm_unstable_item_t;
+
+static slab_cache_t *stable_cache;
+static slab_cache_t *unstable_cache;
+
+// the trees and the cursor belong to whoever holds the scan lock
+static spinlock_t scan_lock;
+static rbtree_t stable_tree;
+static rbtree_t unstable_tree;
+static size_t scan_space_index = 0;
+static uint64_t scan_address = 0;
+
+static bool ksm_enabled = false;
+static size_t ksm_pages_per_run = KSM_DEFAULT_PAGES_PER_RUN;
+static uint64_t ksm_sleep_us = KSM_DEFAULT_SLEEP_US;
+static size_t ksm_work;
+static uint64_t zero_hash;
+
+static ksm_stats_t ksm_stats;
+
+/* utility function prototypes */
+
+size_t ksm_scan_space(vmm_space_t *space, size_t budget);
+void ksm_scan_page(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf);
+bool ksm_page_candidate(vmm_region_t *region, vmm_walk_entry_t *leaf);
+bool ksm_merge_zero(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf);
+bool ksm_merge_stable(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf,
+                      ksm_stable_node_t *stable);
+bool ksm_merge_unstable(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf,
+                        ksm_unstable_item_t *item);
+bool ksm_write_protect(vmm_space_t *space, uint64_t virt_page, uint64_t *pte);
+void ksm_remap(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf, uint64_t frame,
+               uint64_t extra_flags);
+bool ksm_same_contents(uint64_t frame1, uint64_t frame2);
+uint64_t ksm_hash_frame(uint64_t frame);
+ksm_tree_node_t *ksm_tree_find(rbtree_t *tree, uint64_t hash);
+void ksm_tree_insert(rbtree_t *tree, ksm_tree_node_t *tree_node);
+void ksm_end_pass(void);
+void ksm_worker(void *argument);
+
+/* core functions */
+
+// create the caches for the tree nodes and register the scanner as idle work
+void ksm_init(void)
+{
+    assert(sizeof(ksm_stable_node_t) <= 64 && sizeof(ksm_unstable_item_t) <= 64);
+
+    stable_cache = slab_cache_create("ksm stable nodes", 64, MEM_TAG_KERNEL, SLAB_PANIC | SLAB_AUTO_GROW);
+    unstable_cache = slab_cache_create("ksm unstable items", 64, MEM_TAG_KERNEL, SLAB_PANIC | SLAB_AUTO_GROW);
+
+    zero_hash = ksm_hash_frame(zero_page_get());
+    ksm_work = smp_add_idle_work(ksm_worker);
+
+    log(INFO, "Same-page merging initialized (disabled until ksm_set_enabled())\n");
+}
+
+// opt a space in (or out) - pages which were merged already stay merged
+void ksm_set_mergeable(vmm_space_t *space, bool mergeable)
+{
+    __atomic_store_n(&space->mergeable, mergeable, __ATOMIC_RELAXED);
+}
+
+// start or stop the background scanner
+void ksm_set_enabled(bool enabled)
+{
+    __atomic_store_n(&ksm_enabled, enabled, __ATOMIC_RELAXED);
+
+    if (enabled)
+    {
+        smp_kick_idle_work(ksm_work);
+    }
+}
+
+// set how many pages every run of the scanner looks at and how long it waits
+// in between
+void ksm_set_scan_rate(size_t pages_per_run, uint64_t sleep_us)
+{
+    assert(pages_per_run > 0);
+
+    __atomic_store_n(&ksm_pages_per_run, pages_per_run, __ATOMIC_RELAXED);
+    __atomic_store_n(&ksm_sleep_us, sleep_us, __ATOMIC_RELAXED);
+}
+
+// scan up to page_count pages of the mergeable spaces, continuing where the
+// last scan stopped - returns how many were scanned (fewer once a pass ended
+// twice, i.e. there is not enough to scan)
+size_t ksm_scan(size_t page_count)
+{
+    uint64_t start = asm_rdtsc();
+    size_t scanned_count = 0;
+    bool wrapped = false;
+
+    spinlock_acquire(&scan_lock);
+
+    while (scanned_count < page_count)
+    {
+        bool exists;
+        vmm_space_t *space = vmm_space_try_lock_nth(scan_space_index, &exists);
+
+        if (!exists)
+        {
+            ksm_end_pass();
+
+            if (wrapped)
+            {
+                break;
+            }
+
+            wrapped = true;
+
+            continue;
+        }
+
+        // a busy space is left for the next pass
+        if (space && __atomic_load_n(&space->mergeable, __ATOMIC_RELAXED))
+        {
+            scanned_count += ksm_scan_space(space, page_count - scanned_count);
+        }
+        else
+        {
+            scan_space_index++;
+            scan_address = 0;
+        }
+
+        if (space)
+        {
+            spinlock_release(&space->region_lock);
+        }
+    }
+
+    spinlock_release(&scan_lock);
+
+    __atomic_fetch_add(&ksm_stats.pages_scanned, scanned_count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ksm_stats.scan_cycles, asm_rdtsc() - start, __ATOMIC_RELAXED);
+
+    return scanned_count;
+}
+
+// copy the counters and count what the stable tree shares right now
+void ksm_get_stats(ksm_stats_t *stats)
+{
+    stats->pages_scanned = __atomic_load_n(&ksm_stats.pages_scanned, __ATOMIC_RELAXED);
+    stats->full_scans = __atomic_load_n(&ksm_stats.full_scans, __ATOMIC_RELAXED);
+    stats->pages_merged = __atomic_load_n(&ksm_stats.pages_merged, __ATOMIC_RELAXED);
+    stats->pages_zeroed = __atomic_load_n(&ksm_stats.pages_zeroed, __ATOMIC_RELAXED);
+    stats->huge_pages_split = __atomic_load_n(&ksm_stats.huge_pages_split, __ATOMIC_RELAXED);
+    stats->scan_cycles = __atomic_load_n(&ksm_stats.scan_cycles, __ATOMIC_RELAXED);
+    stats->frames_shared = 0;
+    stats->pages_sharing = 0;
+    stats->frames_saved = 0;
+
+    spinlock_acquire(&scan_lock);
+
+    for (rbtree_node_t *node = rbtree_first(&stable_tree); node; node = rbtree_next(node))
+    {
+        ksm_stable_node_t *stable = RBTREE_ENTRY(node, ksm_stable_node_t, tree_node.node);
+
+        // the tree's own reference doesn't count
+        size_t mapping_count = pmm_get_ref_count((void *)stable->frame) - 1;
+
+        stats->frames_shared++;
+        stats->pages_sharing += mapping_count;
+        stats->frames_saved += mapping_count > 1 ? mapping_count - 1 : 0;
+    }
+
+    spinlock_release(&scan_lock);
+}
+
+// set the counters back to zero (the ones of the stable tree aren't counters)
+void ksm_reset_stats(void)
+{
+    __atomic_store_n(&ksm_stats.pages_scanned, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ksm_stats.full_scans, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ksm_stats.pages_merged, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ksm_stats.pages_zeroed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ksm_stats.huge_pages_split, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ksm_stats.scan_cycles, 0, __ATOMIC_RELAXED);
+}
+
+// print the counters and what the scanning costs per page
+void ksm_dump_stats(void)
+{
+    ksm_stats_t stats;
+    ksm_get_stats(&stats);
+
+    log(INFO, "KSM: scanned=%llu full_scans=%llu huge_split=%llu merged=%llu zeroed=%llu shared=%llu "
+        "sharing=%llu frames_saved=%llu cycles_per_page=%llu\n",
+        stats.pages_scanned, stats.full_scans, stats.huge_pages_split, stats.pages_merged, stats.pages_zeroed,
+        stats.frames_shared, stats.pages_sharing, stats.frames_saved,
+        stats.pages_scanned ? stats.scan_cycles / stats.pages_scanned : 0);
+}
+
+/* utility functions */
+
+// scan the pages of a space from the cursor on, until the budget is used up
+// or the space is done (then the cursor moves on to the next one)
+size_t ksm_scan_space(vmm_space_t *space, size_t budget)
+{
+    size_t scanned_count = 0;
+
+    for (vmm_region_t *region = vmm_region_first(space); region; region = vmm_region_next(region))
+    {
+        if (region->end <= scan_address)
+        {
+            continue;
+        }
+
+        vmm_walker_t walker;
+        vmm_walk_entry_t leaf;
+
+        vmm_walk_init(&walker, space, region->start > scan_address ? region->start : scan_address, region->end);
+
+        while (vmm_walk_next(&walker, &leaf))
+        {
+            // the 4 KiB pages of a split one are scanned next
+            if (leaf.size == LARGE_PAGE_SIZE && ksm_page_candidate(region, &leaf))
+            {
+                thp_split(space, leaf.virt);
+                vmm_walk_init(&walker, space, leaf.virt, region->end);
+
+                __atomic_fetch_add(&ksm_stats.huge_pages_split, 1, __ATOMIC_RELAXED);
+
+                continue;
+            }
+
+            // zero pages and 1 GiB pages are never merged, but count as scanned
+            if (leaf.size == PAGE_SIZE)
+            {
+                ksm_scan_page(space, region, &leaf);
+            }
+
+            if (++scanned_count == budget)
+            {
+                scan_address = leaf.virt + leaf.size;
+
+                return scanned_count;
+            }
+        }
+    }
+
+    scan_space_index++;
+    scan_address = 0;
+
+    return scanned_count;
+}
+
+// merge a page with the zero page, a stable frame or a page of the unstable
+// tree - or remember it in the unstable tree
+void ksm_scan_page(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf)
+{
+    if (!ksm_page_candidate(region, leaf))
+    {
+        return;
+    }
+
+    uint64_t hash = ksm_hash_frame(leaf->phys);
+
+    if (hash == zero_hash && ksm_merge_zero(space, region, leaf))
+    {
+        return;
+    }
+
+    ksm_tree_node_t *found = ksm_tree_find(&stable_tree, hash);
+
+    if (found && ksm_merge_stable(space, region, leaf, RBTREE_ENTRY(found, ksm_stable_node_t, tree_node)))
+    {
+        return;
+    }
+
+    found = ksm_tree_find(&unstable_tree, hash);
+
+    if (found && ksm_merge_unstable(space, region, leaf, RBTREE_ENTRY(found, ksm_unstable_item_t, tree_node)))
+    {
+        return;
+    }
+
+    ksm_unstable_item_t *item = slab_cache_alloc(unstable_cache, SLAB_PANIC);
+
+    item->tree_node.hash = hash;
+    item->space = space;
+    item->virt = leaf->virt;
+    item->frame = leaf->phys;
+
+    ksm_tree_insert(&unstable_tree, &item->tree_node);
+}
+
+// only private frames of anonymous write-back memory are merged
+bool ksm_page_candidate(vmm_region_t *region, vmm_walk_entry_t *leaf)
+{
+    if (region->type != VMM_REGION_ANONYMOUS || region->pat_type != PAT_WRITE_BACK)
+    {
+        return false;
+    }
+
+    if ((*leaf->pte & (PTE_COW | PTE_KSM)) || zero_page_contains(leaf->phys))
+    {
+        return false;
+    }
+
+    return pmm_get_ref_count((void *)leaf->phys) == 1;
+}
+
+// map the zero page in place of a zero-filled page
+bool ksm_merge_zero(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf)
+{
+    bool writable = ksm_write_protect(space, leaf->virt, leaf->pte);
+
+    if (!ksm_same_contents(leaf->phys, zero_page_get()))
+    {
+        *leaf->pte |= writable ? PTE_READ_WRITE : 0;
+
+        return false;
+    }
+
+    // a write faults and maps a zeroed frame again, like for any zero page
+    ksm_remap(space, region, leaf, zero_page_get(), 0);
+
+    __atomic_fetch_add(&ksm_stats.pages_zeroed, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// map the frame of the stable tree with the same contents in place of a page
+bool ksm_merge_stable(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf,
+                      ksm_stable_node_t *stable)
+{
+    bool writable = ksm_write_protect(space, leaf->virt, leaf->pte);
+
+    if (!ksm_same_contents(leaf->phys, stable->frame))
+    {
+        *leaf->pte |= writable ? PTE_READ_WRITE : 0;
+
+        return false;
+    }
+
+    pmm_ref((void *)stable->frame);
+    ksm_remap(space, region, leaf, stable->frame, PTE_COW | PTE_KSM);
+
+    __atomic_fetch_add(&ksm_stats.pages_merged, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// merge a page with one of the unstable tree, whose frame moves to the stable
+// tree - false if the other page changed or its space can't be locked
+bool ksm_merge_unstable(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf,
+                        ksm_unstable_item_t *item)
+{
+    vmm_space_t *other = item->space;
+
+    if (item->frame == leaf->phys || (other != space && !vmm_space_try_lock(other)))
+    {
+        return false;
+    }
+
+    // the other page might have been unmapped, replaced or shared since
+    vmm_region_t *other_region = vmm_region_find(other, item->virt);
+    vmm_walk_entry_t other_leaf;
+
+    bool valid = other_region && vmm_walk_lookup(other, item->virt, &other_leaf)
+                 && other_leaf.size == PAGE_SIZE && other_leaf.phys == item->frame
+                 && ksm_page_candidate(other_region, &other_leaf);
+
+    bool merged = false;
+
+    if (valid)
+    {
+        bool writable = ksm_write_protect(space, leaf->virt, leaf->pte);
+        bool other_writable = ksm_write_protect(other, other_leaf.virt, other_leaf.pte);
+
+        merged = ksm_same_contents(leaf->phys, item->frame);
+
+        if (merged)
+        {
+            ksm_stable_node_t *stable = slab_cache_alloc(stable_cache, SLAB_PANIC);
+
+            stable->tree_node.hash = item->tree_node.hash;
+            stable->frame = item->frame;
+            stable->tag = other_region->tag;
+
+            ksm_tree_insert(&stable_tree, &stable->tree_node);
+
+            // one reference for the tree, one for the page that gets merged
+            pmm_ref((void *)item->frame);
+            pmm_ref((void *)item->frame);
+
+            // read-only and flushed already
+            *other_leaf.pte |= PTE_COW | PTE_KSM;
+
+            ksm_remap(space, region, leaf, item->frame, PTE_COW | PTE_KSM);
+
+            __atomic_fetch_add(&ksm_stats.pages_merged, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            *leaf->pte |= writable ? PTE_READ_WRITE : 0;
+            *other_leaf.pte |= other_writable ? PTE_READ_WRITE : 0;
+        }
+    }
+
+    if (other != space)
+    {
+        spinlock_release(&other->region_lock);
+    }
+
+    // the item is either stable now or outdated
+    if (merged || !valid)
+    {
+        rbtree_remove(&unstable_tree, &item->tree_node.node);
+        slab_cache_free(unstable_cache, item, SLAB_PANIC);
+    }
+
+    return merged;
+}
+
+// make a page read-only, so its contents can be compared without changing
+// meanwhile - a write faults and waits for the region lock, which is held;
+// returns whether it was writable (more rights need no flush to restore)
+bool ksm_write_protect(vmm_space_t *space, uint64_t virt_page, uint64_t *pte)
+{
+    uint64_t entry = *pte;
+
+    if (!(entry & PTE_READ_WRITE))
+    {
+        return false;
+    }
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    *pte = entry & ~(uint64_t)PTE_READ_WRITE;
+    tlb_gather_add_page(&gather, virt_page, entry);
+
+    tlb_gather_finish(&gather);
+
+    return true;
+}
+
+// point a read-only page to another frame with the same contents, its own
+// frame is freed after the flush
+void ksm_remap(vmm_space_t *space, vmm_region_t *region, vmm_walk_entry_t *leaf, uint64_t frame,
+               uint64_t extra_flags)
+{
+    uint64_t entry = *leaf->pte;
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    *leaf->pte = frame | (entry & PTE_FLAGS_MASK & ~(uint64_t)PTE_READ_WRITE) | extra_flags;
+    tlb_gather_add_page(&gather, leaf->virt, entry);
+
+    tlb_gather_free_frames(&gather, (void *)leaf->phys, 1, region->tag);
+    tlb_gather_finish(&gather);
+}
+
+// compare two frames completely
+bool ksm_same_contents(uint64_t frame1, uint64_t frame2)
+{
+    return memcmp((void *)PHYS_TO_HIGHER_HALF_DATA(frame1), (void *)PHYS_TO_HIGHER_HALF_DATA(frame2),
+                  PAGE_SIZE) == 0;
+}
+
+// FNV-1a over the 64 bit words of a frame, with a final mix of the high bits
+uint64_t ksm_hash_frame(uint64_t frame)
+{
+    const uint64_t *words = (const uint64_t *)PHYS_TO_HIGHER_HALF_DATA(frame);
+    uint64_t hash = 0xCBF29CE484222325;
+
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+    {
+        hash = (hash ^ words[i]) * 0x100000001B3;
+    }
+
+    return hash ^ (hash >> 32);
+}
+
+// return a node with the hash - equal hashes don't mean equal contents
+ksm_tree_node_t *ksm_tree_find(rbtree_t *tree, uint64_t hash)
+{
+    rbtree_node_t *node = tree->root;
+
+    while (node)
+    {
+        ksm_tree_node_t *tree_node = RBTREE_ENTRY(node, ksm_tree_node_t, node);
+
+        if (hash == tree_node->hash)
+        {
+            return tree_node;
+        }
+
+        node = hash < tree_node->hash ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+// add a node ordered by its hash (equal ones go to the right)
+void ksm_tree_insert(rbtree_t *tree, ksm_tree_node_t *tree_node)
+{
+    rbtree_node_t **link = &tree->root;
+    rbtree_node_t *parent = NULL;
+
+    while (*link)
+    {
+        parent = *link;
+        link = tree_node->hash < RBTREE_ENTRY(parent, ksm_tree_node_t, node)->hash ? &parent->left : &parent->right;
+    }
+
+    rbtree_insert(tree, &tree_node->node, parent, link);
+}
+
+// start the next pass at the first space - the unstable tree is forgotten and
+// the stable frames which nobody maps anymore are dropped
+void ksm_end_pass(void)
+{
+    rbtree_node_t *node;
+
+    scan_space_index = 0;
+    scan_address = 0;
+
+    while ((node = rbtree_first(&unstable_tree)))
+    {
+        rbtree_remove(&unstable_tree, node);
+        slab_cache_free(unstable_cache, RBTREE_ENTRY(node, ksm_unstable_item_t, tree_node.node), SLAB_PANIC);
+    }
+
+    for (node = rbtree_first(&stable_tree); node;)
+    {
+        ksm_stable_node_t *stable = RBTREE_ENTRY(node, ksm_stable_node_t, tree_node.node);
+
+        node = rbtree_next(node);
+
+        // nobody can add a mapping meanwhile, that's only done by the scanner
+        if (pmm_get_ref_count((void *)stable->frame) == 1)
+        {
+            rbtree_remove(&stable_tree, &stable->tree_node.node);
+            pmm_free((void *)stable->frame, 1, stable->tag);
+            slab_cache_free(stable_cache, stable, SLAB_PANIC);
+        }
+    }
+
+    __atomic_fetch_add(&ksm_stats.full_scans, 1, __ATOMIC_RELAXED);
+}
+
+// idle work of an AP: scan a batch, pause and let the next batch follow
+void ksm_worker(void *argument)
+{
+    (void)argument;
+
+    if (!__atomic_load_n(&ksm_enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    ksm_scan(__atomic_load_n(&ksm_pages_per_run, __ATOMIC_RELAXED));
+
+    // there is no timer to wake up from hlt, so the pause is polled - and cut
+    // short if a call or another idle work is waiting
+    uint64_t sleep_us = __atomic_load_n(&ksm_sleep_us, __ATOMIC_RELAXED);
+
+    for (uint64_t waited = 0; waited < sleep_us && !smp_work_pending(); waited += KSM_SLEEP_STEP_US)
+    {
+        hpet_usleep(KSM_SLEEP_STEP_US);
+    }
+
+    if (__atomic_load_n(&ksm_enabled, __ATOMIC_RELAXED))
+    {
+        smp_kick_idle_work(ksm_work);
+    }
+}
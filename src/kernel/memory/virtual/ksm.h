@@ -0,0 +1,55 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef KSM_H
+#define KSM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory/virtual/vmm.h>
+
+#define KSM_DEFAULT_PAGES_PER_RUN   256	    // pages one run of the worker scans
+#define KSM_DEFAULT_SLEEP_US	    20000   // pause between two runs
+
+typedef struct
+{
+    uint64_t pages_scanned;
+    uint64_t full_scans;	// passes over all mergeable spaces
+    uint64_t pages_merged;	// mapped to a frame of the stable tree instead of their own
+    uint64_t pages_zeroed;	// zero-filled, mapped to the zero page instead of their own (so far)
+    uint64_t huge_pages_split;	// 2 MiB pages of mergeable spaces split to scan their 4 KiB pages
+    uint64_t scan_cycles;	// spent scanning (merging included)
+    uint64_t frames_shared;	// frames in the stable tree right now
+    uint64_t pages_sharing;	// mappings of those frames right now
+    uint64_t frames_saved;	// by the stable tree right now (the zeroed pages aren't tracked)
+} ksm_stats_t;
+
+void ksm_init(void);
+void ksm_set_mergeable(vmm_space_t *space, bool mergeable);
+void ksm_set_enabled(bool enabled);
+void ksm_set_scan_rate(size_t pages_per_run, uint64_t sleep_us);
+size_t ksm_scan(size_t page_count);
+void ksm_get_stats(ksm_stats_t *stats);
+void ksm_reset_stats(void);
+void ksm_dump_stats(void);
+
+#endif
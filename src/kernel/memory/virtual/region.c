@@ -0,0 +1,580 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Regions of an address space which are reserved, but only backed by frames
+    once they are accessed. The first access faults and the page fault handler
+    (see fault.c) maps a zeroed frame. When a space is cloned, the frames of
+    its regions are shared copy-on-write.
+    Every space keeps its regions in a red-black tree ordered by address
+    (they never overlap), protected by the region lock of the space. Finding,
+    inserting, splitting and merging regions takes O(log n); the region found
+    last is cached, as faults and queries tend to hit the same one repeatedly.
+    Unmapping or protecting part of a region splits it, neighbouring regions
+    with the same attributes are merged again. A huge page (see thp.c) which
+    is only partially affected is split into 4 KiB pages first. Pages which
+    were swapped out (see zstore.c) come back with the privileges their
+    region has by then.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/data_structs/rbtree.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/testing/assert.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+#include <memory/virtual/zero_page.h>
+#include <memory/virtual/zstore.h>
+
+static slab_cache_t *region_cache;
+
+/* utility function prototypes */
+
+vmm_region_t *vmm_region_alloc(uint64_t start, uint64_t end, uint64_t flags, pat_cache_t pat_type,
+                               vmm_region_type_t type, mem_tag_t tag);
+void vmm_region_insert(vmm_space_t *space, vmm_region_t *region);
+void vmm_region_remove(vmm_space_t *space, vmm_region_t *region);
+vmm_region_t *vmm_region_find_first_ending_after(vmm_space_t *space, uint64_t address);
+vmm_region_t *vmm_region_split(vmm_space_t *space, vmm_region_t *region, uint64_t address);
+bool vmm_region_try_merge(vmm_space_t *space, vmm_region_t *left, vmm_region_t *right);
+void vmm_region_free_pages(tlb_gather_t *gather, vmm_region_t *region);
+void vmm_region_free_page(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t phys_page);
+void vmm_region_protect_pages(tlb_gather_t *gather, vmm_region_t *region);
+void vmm_region_protect_page(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t *pte);
+bool vmm_region_split_huge_page(tlb_gather_t *gather, vmm_region_t *region, vmm_walk_entry_t *leaf,
+                                uint64_t *start, uint64_t *end);
+
+/* core functions */
+
+// create the cache that holds the region descriptors
+void vmm_region_init(void)
+{
+    assert(sizeof(vmm_region_t) <= 64);
+
+    region_cache = slab_cache_create("vmm regions", 64, MEM_TAG_KERNEL, SLAB_PANIC | SLAB_AUTO_GROW);
+}
+
+// reserve [start, start + size) in a space, merged with neighbouring regions
+// of the same kind - false if it overlaps another region
+bool vmm_region_map(vmm_space_t *space, uint64_t start, size_t size, uint64_t flags,
+                    pat_cache_t pat_type, mem_tag_t tag)
+{
+    uint64_t end = ALIGN_UP(start + size, PAGE_SIZE);
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+
+    if (!size || end <= start)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&space->region_lock);
+
+    vmm_region_t *next = vmm_region_find_first_ending_after(space, start);
+
+    if (next && next->start < end)
+    {
+        spinlock_release(&space->region_lock);
+
+        return false;
+    }
+
+    vmm_region_t *region = vmm_region_alloc(start, end, flags, pat_type, VMM_REGION_ANONYMOUS, tag);
+    vmm_region_insert(space, region);
+
+    rbtree_node_t *prev = rbtree_prev(&region->node);
+
+    if (prev && vmm_region_try_merge(space, RBTREE_ENTRY(prev, vmm_region_t, node), region))
+    {
+        region = RBTREE_ENTRY(prev, vmm_region_t, node);
+    }
+
+    if (next)
+    {
+        vmm_region_try_merge(space, region, next);
+    }
+
+    spinlock_release(&space->region_lock);
+
+    return true;
+}
+
+// remove [start, start + size) from the regions of a space (splitting the ones
+// that are only partially in it) and free the frames that were mapped there
+void vmm_region_unmap(vmm_space_t *space, uint64_t start, size_t size)
+{
+    uint64_t end = ALIGN_UP(start + size, PAGE_SIZE);
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    spinlock_acquire(&space->region_lock);
+
+    vmm_region_t *region = vmm_region_find_first_ending_after(space, start);
+
+    while (region && region->start < end)
+    {
+        if (region->start < start)
+        {
+            region = vmm_region_split(space, region, start);
+        }
+
+        if (region->end > end)
+        {
+            vmm_region_split(space, region, end);
+        }
+
+        vmm_region_t *next = vmm_region_next(region);
+
+        vmm_region_free_pages(&gather, region);
+        vmm_region_remove(space, region);
+        slab_cache_free(region_cache, region, SLAB_PANIC);
+
+        region = next;
+    }
+
+    // a fault in the range either finished before or won't find a region anymore
+    tlb_gather_finish(&gather);
+
+    spinlock_release(&space->region_lock);
+}
+
+// remove all regions of a space and free their frames
+void vmm_region_unmap_all(vmm_space_t *space)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    spinlock_acquire(&space->region_lock);
+
+    vmm_region_t *region;
+
+    while ((region = vmm_region_first(space)))
+    {
+        vmm_region_free_pages(&gather, region);
+        vmm_region_remove(space, region);
+        slab_cache_free(region_cache, region, SLAB_PANIC);
+    }
+
+    tlb_gather_finish(&gather);
+
+    spinlock_release(&space->region_lock);
+}
+
+// change the privileges of [start, start + size), which has to be covered by
+// regions completely - false (and nothing changed) otherwise
+bool vmm_region_protect(vmm_space_t *space, uint64_t start, size_t size, uint64_t flags)
+{
+    uint64_t end = ALIGN_UP(start + size, PAGE_SIZE);
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+
+    if (!size || end <= start)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&space->region_lock);
+
+    vmm_region_t *region = vmm_region_find(space, start);
+    uint64_t covered_end = region ? region->end : start;
+
+    for (vmm_region_t *next = region ? vmm_region_next(region) : NULL;
+            next && next->start == covered_end && covered_end < end; next = vmm_region_next(next))
+    {
+        covered_end = next->end;
+    }
+
+    if (covered_end < end)
+    {
+        spinlock_release(&space->region_lock);
+
+        return false;
+    }
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    if (region->start < start)
+    {
+        region = vmm_region_split(space, region, start);
+    }
+
+    vmm_region_t *first = region;
+    vmm_region_t *last = region;
+
+    while (region && region->start < end)
+    {
+        if (region->end > end)
+        {
+            vmm_region_split(space, region, end);
+        }
+
+        region->flags = flags;
+        vmm_region_protect_pages(&gather, region);
+
+        last = region;
+        region = vmm_region_next(region);
+    }
+
+    // merge what's possible from the predecessor of the range up to its successor
+    rbtree_node_t *prev = rbtree_prev(&first->node);
+    vmm_region_t *stop = vmm_region_next(last);
+
+    region = prev ? RBTREE_ENTRY(prev, vmm_region_t, node) : first;
+
+    while (region != stop)
+    {
+        vmm_region_t *right = vmm_region_next(region);
+
+        if (right && vmm_region_try_merge(space, region, right))
+        {
+            if (right == stop)
+            {
+                break;
+            }
+
+            // the new right neighbour might fit as well
+            continue;
+        }
+
+        region = right;
+    }
+
+    tlb_gather_finish(&gather);
+
+    spinlock_release(&space->region_lock);
+
+    return true;
+}
+
+// return the region which contains address - the caller holds the region lock
+vmm_region_t *vmm_region_find(vmm_space_t *space, uint64_t address)
+{
+    vmm_region_t *cached = space->region_cache;
+
+    if (cached && cached->start <= address && address < cached->end)
+    {
+        return cached;
+    }
+
+    rbtree_node_t *node = space->regions.root;
+
+    while (node)
+    {
+        vmm_region_t *region = RBTREE_ENTRY(node, vmm_region_t, node);
+
+        if (address < region->start)
+        {
+            node = node->left;
+        }
+        else if (address >= region->end)
+        {
+            node = node->right;
+        }
+        else
+        {
+            space->region_cache = region;
+
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+// return the region with the lowest address - the caller holds the region lock
+vmm_region_t *vmm_region_first(vmm_space_t *space)
+{
+    rbtree_node_t *node = rbtree_first(&space->regions);
+
+    return node ? RBTREE_ENTRY(node, vmm_region_t, node) : NULL;
+}
+
+// return the region after another one - the caller holds the region lock
+vmm_region_t *vmm_region_next(vmm_region_t *region)
+{
+    rbtree_node_t *node = rbtree_next(&region->node);
+
+    return node ? RBTREE_ENTRY(node, vmm_region_t, node) : NULL;
+}
+
+// give a new space copies of all regions of another space - the caller holds
+// the region lock of the other one
+void vmm_region_clone_all(vmm_space_t *clone, vmm_space_t *space)
+{
+    spinlock_acquire(&clone->region_lock);
+
+    assert(clone->regions.root == NULL);
+
+    for (vmm_region_t *region = vmm_region_first(space); region; region = vmm_region_next(region))
+    {
+        vmm_region_insert(clone, vmm_region_alloc(region->start, region->end, region->flags,
+                          region->pat_type, region->type, region->tag));
+    }
+
+    spinlock_release(&clone->region_lock);
+}
+
+/* utility functions */
+
+// allocate and fill a region descriptor
+vmm_region_t *vmm_region_alloc(uint64_t start, uint64_t end, uint64_t flags, pat_cache_t pat_type,
+                               vmm_region_type_t type, mem_tag_t tag)
+{
+    vmm_region_t *region = slab_cache_alloc(region_cache, SLAB_PANIC);
+
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->pat_type = pat_type;
+    region->type = type;
+    region->tag = tag;
+
+    return region;
+}
+
+// add a region which doesn't overlap any other one to the tree
+void vmm_region_insert(vmm_space_t *space, vmm_region_t *region)
+{
+    rbtree_node_t **link = &space->regions.root;
+    rbtree_node_t *parent = NULL;
+
+    while (*link)
+    {
+        parent = *link;
+        link = region->start < RBTREE_ENTRY(parent, vmm_region_t, node)->start ? &parent->left : &parent->right;
+    }
+
+    rbtree_insert(&space->regions, &region->node, parent, link);
+}
+
+// take a region out of the tree (it isn't freed)
+void vmm_region_remove(vmm_space_t *space, vmm_region_t *region)
+{
+    if (space->region_cache == region)
+    {
+        space->region_cache = NULL;
+    }
+
+    rbtree_remove(&space->regions, &region->node);
+}
+
+// return the lowest region which ends after address (and might contain it)
+vmm_region_t *vmm_region_find_first_ending_after(vmm_space_t *space, uint64_t address)
+{
+    rbtree_node_t *node = space->regions.root;
+    vmm_region_t *found = NULL;
+
+    // the ends are in the same order as the starts, as nothing overlaps
+    while (node)
+    {
+        vmm_region_t *region = RBTREE_ENTRY(node, vmm_region_t, node);
+
+        if (region->end > address)
+        {
+            found = region;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+
+    return found;
+}
+
+// cut a region in two at address (page aligned, inside of it) - returns the upper part
+vmm_region_t *vmm_region_split(vmm_space_t *space, vmm_region_t *region, uint64_t address)
+{
+    vmm_region_t *upper = vmm_region_alloc(address, region->end, region->flags, region->pat_type,
+                                           region->type, region->tag);
+
+    region->end = address;
+    vmm_region_insert(space, upper);
+
+    return upper;
+}
+
+// join two regions if right directly follows left and both are the same except
+// for their range - right is freed then
+bool vmm_region_try_merge(vmm_space_t *space, vmm_region_t *left, vmm_region_t *right)
+{
+    if (left->end != right->start || left->flags != right->flags || left->pat_type != right->pat_type
+            || left->type != right->type || left->tag != right->tag)
+    {
+        return false;
+    }
+
+    vmm_region_remove(space, right);
+    left->end = right->end;
+
+    slab_cache_free(region_cache, right, SLAB_PANIC);
+
+    return true;
+}
+
+// unmap every page of a region that was faulted in, the frames are freed after
+// the flush (shared ones only lose a reference, zero pages are just unmapped) -
+// swapped out pages are dropped from the compressed store
+void vmm_region_free_pages(tlb_gather_t *gather, vmm_region_t *region)
+{
+    vmm_walker_t walker;
+    vmm_walk_entry_t leaf;
+
+    vmm_walk_init(&walker, gather->space, region->start, region->end);
+    vmm_walk_include_swapped(&walker);
+
+    while (vmm_walk_next(&walker, &leaf))
+    {
+        uint64_t start;
+        uint64_t end;
+
+        if (zstore_is_entry(*leaf.pte))
+        {
+            zstore_free_entry(*leaf.pte);
+            vmm_unmap_page_gather(gather, leaf.virt);
+        }
+        else if (leaf.size == PAGE_SIZE)
+        {
+            page_fault_account_unmap(*leaf.pte);
+            vmm_region_free_page(gather, region, leaf.virt, leaf.phys);
+        }
+        else if (zero_page_contains(leaf.phys))
+        {
+            // dropping all of a 2 MiB zero page is fine, the rest of it faults
+            // in again as zeros
+            vmm_unmap_large_page_gather(gather, leaf.virt);
+        }
+        else if (vmm_region_split_huge_page(gather, region, &leaf, &start, &end))
+        {
+            for (uint64_t address = start; address < end; address += PAGE_SIZE)
+            {
+                uint64_t *pte = vmm_get_pte(gather->space, address);
+
+                page_fault_account_unmap(*pte);
+                vmm_region_free_page(gather, region, address, *pte & PTE_ADDRESS_MASK);
+            }
+        }
+        else
+        {
+            thp_unmap(gather, region, &leaf);
+        }
+    }
+}
+
+// unmap a 4 KiB page of a region, its frame is freed after the flush (a zero
+// page is just unmapped)
+void vmm_region_free_page(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t phys_page)
+{
+    vmm_unmap_page_gather(gather, virt_page);
+
+    if (!zero_page_contains(phys_page))
+    {
+        tlb_gather_free_frames(gather, (void *)phys_page, 1, region->tag);
+    }
+}
+
+// apply the privileges of a region to the pages that were faulted in - shared
+// pages and zero pages stay read-only until they are replaced
+void vmm_region_protect_pages(tlb_gather_t *gather, vmm_region_t *region)
+{
+    vmm_walker_t walker;
+    vmm_walk_entry_t leaf;
+
+    vmm_walk_init(&walker, gather->space, region->start, region->end);
+
+    while (vmm_walk_next(&walker, &leaf))
+    {
+        uint64_t start;
+        uint64_t end;
+
+        if (leaf.size == PAGE_SIZE)
+        {
+            vmm_region_protect_page(gather, region, leaf.virt, leaf.pte);
+        }
+        else if (zero_page_contains(leaf.phys))
+        {
+            // a 2 MiB zero page might reach beyond the region now, so it's
+            // dropped instead and faults in again with the right privileges
+            vmm_unmap_large_page_gather(gather, leaf.virt);
+        }
+        else if (vmm_region_split_huge_page(gather, region, &leaf, &start, &end))
+        {
+            for (uint64_t address = start; address < end; address += PAGE_SIZE)
+            {
+                vmm_region_protect_page(gather, region, address, vmm_get_pte(gather->space, address));
+            }
+        }
+        else
+        {
+            // the privilege bits are at the same place in a 2 MiB entry
+            vmm_region_protect_page(gather, region, leaf.virt, leaf.pte);
+        }
+    }
+}
+
+// apply the privileges of a region to one present entry
+void vmm_region_protect_page(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t *pte)
+{
+    uint64_t privileges = PTE_READ_WRITE | PTE_USER_SUPERVISOR;
+
+    uint64_t entry = *pte;
+    uint64_t new_entry = (entry & ~privileges) | (region->flags & privileges);
+
+    if ((entry & PTE_COW) || zero_page_contains(entry & PTE_ADDRESS_MASK))
+    {
+        new_entry &= ~(uint64_t)PTE_READ_WRITE;
+    }
+
+    if (new_entry != entry)
+    {
+        *pte = new_entry;
+        tlb_gather_add_page(gather, virt_page, entry);
+    }
+}
+
+// split a huge page which reaches beyond the region - false if the region
+// covers all of it, otherwise [start, end) is the part inside of the region
+bool vmm_region_split_huge_page(tlb_gather_t *gather, vmm_region_t *region, vmm_walk_entry_t *leaf,
+                                uint64_t *start, uint64_t *end)
+{
+    if (leaf->virt >= region->start && leaf->virt + leaf->size <= region->end)
+    {
+        return false;
+    }
+
+    thp_split(gather->space, leaf->virt);
+
+    *start = leaf->virt < region->start ? region->start : leaf->virt;
+    *end = leaf->virt + leaf->size > region->end ? region->end : leaf->virt + leaf->size;
+
+    return true;
+}
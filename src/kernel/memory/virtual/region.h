@@ -0,0 +1,62 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libk/data_structs/rbtree.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/vmm.h>
+
+// what backs the pages of a region
+typedef enum
+{
+    VMM_REGION_ANONYMOUS	// zeroed frames, allocated on the first access
+} vmm_region_type_t;
+
+// a virtual range of an address space which is mapped on demand by the page fault handler
+typedef struct vmm_region
+{
+    rbtree_node_t node;		// in the region tree of the space, ordered by address
+
+    uint64_t start;
+    uint64_t end;		// exclusive
+
+    uint64_t flags;		// vmm_map_privilege_t of every page
+    pat_cache_t pat_type;
+    vmm_region_type_t type;
+    mem_tag_t tag;		// the frames are accounted to it
+} vmm_region_t;
+
+void vmm_region_init(void);
+bool vmm_region_map(vmm_space_t *space, uint64_t start, size_t size, uint64_t flags,
+	pat_cache_t pat_type, mem_tag_t tag);
+void vmm_region_unmap(vmm_space_t *space, uint64_t start, size_t size);
+void vmm_region_unmap_all(vmm_space_t *space);
+bool vmm_region_protect(vmm_space_t *space, uint64_t start, size_t size, uint64_t flags);
+vmm_region_t *vmm_region_find(vmm_space_t *space, uint64_t address);
+vmm_region_t *vmm_region_first(vmm_space_t *space);
+vmm_region_t *vmm_region_next(vmm_region_t *region);
+void vmm_region_clone_all(vmm_space_t *clone, vmm_space_t *space);
+
+#endif
@@ -0,0 +1,731 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    Swapping anonymous pages to a virtio block device, the tier behind the
+    compressed store (see zstore.c): the pages it doesn't take (they don't
+    compress, or the pool reached its limit) are written to slots of the
+    device and their entries point to the slot (ZSTORE_ENTRY_SWAP).
+    Slots are handed out next-fit in runs of contiguous free slots, so the
+    pages of one eviction batch go to the device as a single sequential
+    write (a cluster) - and the next batch continues behind it.
+    A fault reads the slot back together with its used neighbours inside
+    of an aligned window of SWAP_READAHEAD_PAGES (one request), as the pages
+    around it were likely evicted together and are needed together.
+    The swap cache keeps frames with the contents of slots: the pages read
+    ahead, the written pages (from before their write on until the memory is
+    needed, so readahead never reads a slot which isn't written yet) and the
+    frames of slots which more than one entry refers to (cloned spaces). A fault
+    which finds its slot cached causes no IO at all. The last entry of a
+    slot takes the frame over and frees the slot, the others map the frame
+    copy-on-write. Cached frames nobody maps are given back, oldest first,
+    when the cache grows beyond SWAP_CACHE_MAX_PAGES or memory runs low.
+    The swap lock protects the slot map and the cache, but isn't held during
+    IO: the slots of a read are marked in the map until their frames are
+    cached, so nobody reads them twice or hands them out again meanwhile -
+    and a fault on one of them waits for the read.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <hardware/virtio/virtio_blk.h>
+#include <libk/data_structs/rbtree.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/testing/assert.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/swap.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <utility/utils.h>
+
+// a frame which holds the contents of a slot
+typedef struct swap_cache_node
+{
+    rbtree_node_t node;		// ordered by the slot
+    struct swap_cache_node *next; // in the order they were cached, oldest first
+    struct swap_cache_node *prev;
+    uint64_t slot;
+    uint64_t frame;
+    mem_tag_t tag;
+    bool readahead;		// read along with another page and not faulted on yet
+} swap_cache_node_t;
+
+static spinlock_t swap_lock;
+static bool swap_enabled = false;
+static uint16_t *swap_map;	// entries which refer to every slot (and SWAP_MAP_READING), 0 if it is free
+static size_t slot_count;
+static size_t slot_cursor = 0;	// where the next search for free slots starts
+
+static slab_cache_t *cache_node_cache;
+static rbtree_t cache_tree;
+static swap_cache_node_t *cache_oldest = NULL;
+static swap_cache_node_t *cache_newest = NULL;
+
+static swap_stats_t swap_stats;
+
+/* utility function prototypes */
+
+size_t swap_alloc_slots(size_t count, size_t *first);
+void swap_release_slot(size_t slot);
+swap_cache_node_t *swap_read_cluster(size_t slot, mem_tag_t tag);
+swap_cache_node_t *swap_cache_find(size_t slot);
+swap_cache_node_t *swap_cache_insert(size_t slot, uint64_t frame, mem_tag_t tag, bool readahead);
+void swap_cache_remove(swap_cache_node_t *cache_node);
+void swap_cache_make_room(size_t page_count);
+size_t swap_cache_drop_unmapped(size_t page_count);
+
+/* core functions */
+
+// use the virtio block device for swap, if there is one (see virtio_blk_init())
+void swap_init(void)
+{
+    assert(sizeof(swap_cache_node_t) <= 64);
+
+    slot_count = virtio_blk_get_capacity() / SWAP_SECTORS_PER_SLOT;
+
+    if (slot_count == 0)
+    {
+        log(INFO, "No swap device, pages which don't go into the compressed store stay in memory\n");
+
+        return;
+    }
+
+    void *map = pmm_allocz(ALIGN_UP(slot_count * sizeof(uint16_t), PAGE_SIZE) / PAGE_SIZE, MEM_TAG_SWAP);
+
+    if (!map)
+    {
+        log(WARNING, "Out of memory for the swap map, swap disabled\n");
+
+        return;
+    }
+
+    swap_map = (uint16_t *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)map);
+    cache_node_cache = slab_cache_create("swap cache", 64, MEM_TAG_SWAP, SLAB_PANIC | SLAB_AUTO_GROW);
+    cache_tree.root = NULL;
+
+    __atomic_store_n(&swap_enabled, true, __ATOMIC_RELEASE);
+
+    log(INFO, "Swap initialized with %llu slots (%llu MiB)\n", slot_count, slot_count * PAGE_SIZE / (1024 * 1024));
+}
+
+// whether pages can be written to a swap device
+bool swap_available(void)
+{
+    return __atomic_load_n(&swap_enabled, __ATOMIC_ACQUIRE);
+}
+
+// write the frames to free slots, as few sequential writes as possible -
+// returns how many were written (the first ones, their entries are set), the
+// rest didn't fit or failed; the written frames stay in the swap cache, which
+// takes its own reference (the caller still drops the one of its mapping)
+size_t swap_out(const uint64_t *frames, const mem_tag_t *tags, size_t count, uint64_t *entries)
+{
+    size_t written_count = 0;
+
+    if (!swap_available())
+    {
+        return 0;
+    }
+
+    while (written_count < count)
+    {
+        size_t first;
+
+        spinlock_acquire(&swap_lock);
+
+        size_t run = swap_alloc_slots(count - written_count, &first);
+
+        // cached right away: a fault reading ahead skips the slots, so nobody
+        // reads them before the write is done - and the frame stays mapped
+        // (with a reference of its own) until then, so it isn't dropped
+        swap_cache_make_room(run);
+
+        for (size_t i = 0; i < run; i++)
+        {
+            pmm_ref((void *)frames[written_count + i]);
+            swap_cache_insert(first + i, frames[written_count + i], tags[written_count + i], false);
+        }
+
+        spinlock_release(&swap_lock);
+
+        if (run == 0)
+        {
+            break;
+        }
+
+        if (!virtio_blk_write(first * SWAP_SECTORS_PER_SLOT, frames + written_count, run))
+        {
+            spinlock_acquire(&swap_lock);
+
+            for (size_t i = 0; i < run; i++)
+            {
+                swap_cache_remove(swap_cache_find(first + i));
+                pmm_free((void *)frames[written_count + i], 1, tags[written_count + i]);
+                swap_release_slot(first + i);
+            }
+
+            spinlock_release(&swap_lock);
+
+            __atomic_fetch_add(&swap_stats.io_errors, 1, __ATOMIC_RELAXED);
+
+            break;
+        }
+
+        for (size_t i = 0; i < run; i++)
+        {
+            entries[written_count + i] = swap_slot_to_entry(first + i);
+        }
+
+        written_count += run;
+
+        __atomic_fetch_add(&swap_stats.pages_written, run, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&swap_stats.write_requests, 1, __ATOMIC_RELAXED);
+    }
+
+    return written_count;
+}
+
+// map the page of a swapped out entry with the privileges of its region (read
+// from the device with its neighbours, if it isn't cached), the TLB is only
+// flushed by tlb_gather_finish() - false if out of memory or the read failed
+bool swap_fault_in(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t *pte)
+{
+    uint64_t start = asm_rdtsc();
+    size_t slot = swap_entry_to_slot(*pte);
+
+    spinlock_acquire(&swap_lock);
+
+    swap_cache_node_t *cache_node = swap_cache_find(slot);
+
+    // another fault reads the slot right now, it is cached once that is done
+    while (!cache_node && (swap_map[slot] & SWAP_MAP_READING))
+    {
+        spinlock_release(&swap_lock);
+        asm volatile("pause");
+        spinlock_acquire(&swap_lock);
+
+        cache_node = swap_cache_find(slot);
+    }
+
+    if (cache_node)
+    {
+        __atomic_fetch_add(cache_node->readahead ? &swap_stats.readahead_hits : &swap_stats.cache_hits, 1,
+                           __ATOMIC_RELAXED);
+
+        cache_node->readahead = false;
+    }
+    else
+    {
+        cache_node = swap_read_cluster(slot, region->tag);
+
+        if (!cache_node)
+        {
+            spinlock_release(&swap_lock);
+
+            return false;
+        }
+    }
+
+    uint64_t frame = cache_node->frame;
+    bool last = swap_map[slot] == 1;
+
+    // the last entry takes the reference of the cache over
+    if (last)
+    {
+        swap_cache_remove(cache_node);
+        swap_release_slot(slot);
+    }
+    else
+    {
+        pmm_ref((void *)frame);
+        swap_map[slot]--;
+    }
+
+    // the frame is shared with the cache or with earlier faults on the slot
+    bool exclusive = last && pmm_get_ref_count((void *)frame) == 1;
+
+    spinlock_release(&swap_lock);
+
+    uint64_t flags = region->flags;
+
+    if (!exclusive && (flags & PTE_READ_WRITE))
+    {
+        flags = (flags & ~(uint64_t)PTE_READ_WRITE) | PTE_COW;
+    }
+
+    vmm_map_page_gather(gather, frame, virt_page, flags, region->pat_type);
+
+    __atomic_fetch_add(&swap_stats.faults, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&swap_stats.fault_cycles, asm_rdtsc() - start, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// the entry of a swapped out page was copied into another space
+void swap_ref_entry(uint64_t entry)
+{
+    size_t slot = swap_entry_to_slot(entry);
+
+    spinlock_acquire(&swap_lock);
+
+    assert((swap_map[slot] & SWAP_MAP_MAX) > 0 && (swap_map[slot] & SWAP_MAP_MAX) < SWAP_MAP_MAX);
+    swap_map[slot]++;
+
+    spinlock_release(&swap_lock);
+}
+
+// the entry of a swapped out page is gone - the last one frees the slot and
+// drops its cached frame (the read does that, if the slot is being read)
+void swap_free_entry(uint64_t entry)
+{
+    size_t slot = swap_entry_to_slot(entry);
+
+    spinlock_acquire(&swap_lock);
+
+    assert((swap_map[slot] & SWAP_MAP_MAX) > 0);
+
+    if ((swap_map[slot] & SWAP_MAP_MAX) > 1 || (swap_map[slot] & SWAP_MAP_READING))
+    {
+        swap_map[slot]--;
+        spinlock_release(&swap_lock);
+
+        return;
+    }
+
+    swap_cache_node_t *cache_node = swap_cache_find(slot);
+
+    if (cache_node)
+    {
+        uint64_t frame = cache_node->frame;
+        mem_tag_t tag = cache_node->tag;
+
+        swap_cache_remove(cache_node);
+        pmm_free((void *)frame, 1, tag);
+    }
+
+    swap_release_slot(slot);
+
+    spinlock_release(&swap_lock);
+}
+
+// give up to page_count cached frames nobody maps back (their slots stay
+// valid) - returns how many were freed
+size_t swap_cache_shrink(size_t page_count)
+{
+    if (!swap_available())
+    {
+        return 0;
+    }
+
+    spinlock_acquire(&swap_lock);
+    size_t freed_count = swap_cache_drop_unmapped(page_count);
+    spinlock_release(&swap_lock);
+
+    return freed_count;
+}
+
+// copy the counters
+void swap_get_stats(swap_stats_t *stats)
+{
+    stats->pages_written = __atomic_load_n(&swap_stats.pages_written, __ATOMIC_RELAXED);
+    stats->write_requests = __atomic_load_n(&swap_stats.write_requests, __ATOMIC_RELAXED);
+    stats->pages_read = __atomic_load_n(&swap_stats.pages_read, __ATOMIC_RELAXED);
+    stats->read_requests = __atomic_load_n(&swap_stats.read_requests, __ATOMIC_RELAXED);
+    stats->readahead_pages = __atomic_load_n(&swap_stats.readahead_pages, __ATOMIC_RELAXED);
+    stats->readahead_hits = __atomic_load_n(&swap_stats.readahead_hits, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&swap_stats.cache_hits, __ATOMIC_RELAXED);
+    stats->faults = __atomic_load_n(&swap_stats.faults, __ATOMIC_RELAXED);
+    stats->fault_cycles = __atomic_load_n(&swap_stats.fault_cycles, __ATOMIC_RELAXED);
+    stats->io_errors = __atomic_load_n(&swap_stats.io_errors, __ATOMIC_RELAXED);
+    stats->slots_used = __atomic_load_n(&swap_stats.slots_used, __ATOMIC_RELAXED);
+    stats->cache_pages = __atomic_load_n(&swap_stats.cache_pages, __ATOMIC_RELAXED);
+}
+
+// set the counters back to zero (used slots and cached pages aren't counters)
+void swap_reset_stats(void)
+{
+    __atomic_store_n(&swap_stats.pages_written, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.write_requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.pages_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.read_requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.readahead_pages, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.readahead_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.cache_hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.faults, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.fault_cycles, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&swap_stats.io_errors, 0, __ATOMIC_RELAXED);
+}
+
+// print the counters, how long the writes were and what is on the device
+void swap_dump_stats(void)
+{
+    swap_stats_t stats;
+    swap_get_stats(&stats);
+
+    log(INFO, "Swap: written=%llu (%llu writes, avg_cluster=%llu) read=%llu (%llu reads, readahead=%llu) "
+        "readahead_hits=%llu cache_hits=%llu faults=%llu avg_fault_cycles=%llu io_errors=%llu\n",
+        stats.pages_written, stats.write_requests,
+        stats.write_requests ? stats.pages_written / stats.write_requests : 0, stats.pages_read,
+        stats.read_requests, stats.readahead_pages, stats.readahead_hits, stats.cache_hits, stats.faults,
+        stats.faults ? stats.fault_cycles / stats.faults : 0, stats.io_errors);
+
+    log(INFO, "Swap device: slots=%llu used=%llu cached=%llu\n", slot_count, stats.slots_used,
+        stats.cache_pages);
+}
+
+/* utility functions */
+
+// reserve a run of up to count contiguous free slots for a write - the first
+// run of count slots from the cursor on, the longest shorter one if there is
+// none; returns its length (0 if the device is full)
+size_t swap_alloc_slots(size_t count, size_t *first)
+{
+    size_t best_first = 0;
+    size_t best_run = 0;
+    size_t slot = slot_cursor;
+
+    if (count > virtio_blk_get_max_segments())
+    {
+        count = virtio_blk_get_max_segments();
+    }
+
+    for (size_t scanned_count = 0; scanned_count < slot_count && best_run < count;)
+    {
+        // runs don't wrap around the end of the device
+        if (slot == slot_count)
+        {
+            slot = 0;
+        }
+
+        if (swap_map[slot])
+        {
+            slot++;
+            scanned_count++;
+
+            continue;
+        }
+
+        size_t run = 1;
+
+        while (run < count && slot + run < slot_count && !swap_map[slot + run])
+        {
+            run++;
+        }
+
+        if (run > best_run)
+        {
+            best_first = slot;
+            best_run = run;
+        }
+
+        slot += run;
+        scanned_count += run;
+    }
+
+    if (best_run == 0)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < best_run; i++)
+    {
+        swap_map[best_first + i] = 1;
+    }
+
+    slot_cursor = (best_first + best_run) % slot_count;
+    *first = best_first;
+
+    __atomic_fetch_add(&swap_stats.slots_used, best_run, __ATOMIC_RELAXED);
+
+    return best_run;
+}
+
+// the last entry of a slot is gone (or went while the slot was read)
+void swap_release_slot(size_t slot)
+{
+    assert(swap_map[slot] <= 1);
+
+    swap_map[slot] = 0;
+
+    __atomic_fetch_sub(&swap_stats.slots_used, 1, __ATOMIC_RELAXED);
+}
+
+// read a slot into the cache, with the used slots next to it which aren't
+// cached or being read yet (inside of its readahead window) - called with the
+// swap lock held, which is dropped for the allocation and the read; returns
+// the node of the slot, NULL if out of memory or the read failed
+swap_cache_node_t *swap_read_cluster(size_t slot, mem_tag_t tag)
+{
+    size_t window = slot & ~(size_t)(SWAP_READAHEAD_PAGES - 1);
+    size_t first = slot;
+    size_t last = slot;
+
+    while (first > window && swap_map[first - 1] && !(swap_map[first - 1] & SWAP_MAP_READING)
+            && !swap_cache_find(first - 1))
+    {
+        first--;
+    }
+
+    while (last + 1 < window + SWAP_READAHEAD_PAGES && last + 1 < slot_count && swap_map[last + 1]
+            && !(swap_map[last + 1] & SWAP_MAP_READING) && !swap_cache_find(last + 1))
+    {
+        last++;
+    }
+
+    while (last - first + 1 > virtio_blk_get_max_segments())
+    {
+        if (last > slot)
+        {
+            last--;
+        }
+        else
+        {
+            first++;
+        }
+    }
+
+    size_t marked_first = first;
+    size_t marked_count = last - first + 1;
+
+    for (size_t i = 0; i < marked_count; i++)
+    {
+        swap_map[marked_first + i] |= SWAP_MAP_READING;
+    }
+
+    spinlock_release(&swap_lock);
+
+    uint64_t frames[SWAP_READAHEAD_PAGES];
+    size_t count = marked_count;
+    size_t allocated_count = 0;
+
+    for (; allocated_count < count; allocated_count++)
+    {
+        frames[allocated_count] = (uint64_t)pmm_alloc(1, tag);
+
+        if (!frames[allocated_count])
+        {
+            break;
+        }
+    }
+
+    // no memory to read ahead - only the page which is needed
+    if (allocated_count < count)
+    {
+        for (size_t i = 0; i < allocated_count; i++)
+        {
+            pmm_free((void *)frames[i], 1, tag);
+        }
+
+        frames[0] = (uint64_t)pmm_alloc(1, tag);
+        first = slot;
+        count = frames[0] ? 1 : 0;
+    }
+
+    if (count && !virtio_blk_read(first * SWAP_SECTORS_PER_SLOT, frames, count))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            pmm_free((void *)frames[i], 1, tag);
+        }
+
+        count = 0;
+
+        __atomic_fetch_add(&swap_stats.io_errors, 1, __ATOMIC_RELAXED);
+    }
+    else if (count)
+    {
+        __atomic_fetch_add(&swap_stats.pages_read, count, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&swap_stats.read_requests, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&swap_stats.readahead_pages, count - 1, __ATOMIC_RELAXED);
+    }
+
+    spinlock_acquire(&swap_lock);
+
+    swap_cache_make_room(count);
+
+    swap_cache_node_t *slot_node = NULL;
+
+    // the read slots are cached, unless their last entry went meanwhile
+    for (size_t i = 0; i < marked_count; i++)
+    {
+        size_t marked_slot = marked_first + i;
+        bool read = marked_slot >= first && marked_slot < first + count;
+
+        swap_map[marked_slot] &= ~SWAP_MAP_READING;
+
+        if (!swap_map[marked_slot])
+        {
+            if (read)
+            {
+                pmm_free((void *)frames[marked_slot - first], 1, tag);
+            }
+
+            swap_release_slot(marked_slot);
+        }
+        else if (read)
+        {
+            swap_cache_node_t *cache_node = swap_cache_insert(marked_slot, frames[marked_slot - first], tag,
+                                                              marked_slot != slot);
+
+            if (marked_slot == slot)
+            {
+                slot_node = cache_node;
+            }
+        }
+    }
+
+    return slot_node;
+}
+
+// return the cached frame of a slot, NULL if it isn't cached
+swap_cache_node_t *swap_cache_find(size_t slot)
+{
+    rbtree_node_t *node = cache_tree.root;
+
+    while (node)
+    {
+        swap_cache_node_t *cache_node = RBTREE_ENTRY(node, swap_cache_node_t, node);
+
+        if (slot == cache_node->slot)
+        {
+            return cache_node;
+        }
+
+        node = slot < cache_node->slot ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+// cache a frame with the contents of a slot (which isn't cached yet), the
+// cache owns one reference of the frame
+swap_cache_node_t *swap_cache_insert(size_t slot, uint64_t frame, mem_tag_t tag, bool readahead)
+{
+    assert(!swap_cache_find(slot));
+
+    swap_cache_node_t *cache_node = slab_cache_alloc(cache_node_cache, SLAB_PANIC);
+    rbtree_node_t **link = &cache_tree.root;
+    rbtree_node_t *parent = NULL;
+
+    cache_node->slot = slot;
+    cache_node->frame = frame;
+    cache_node->tag = tag;
+    cache_node->readahead = readahead;
+
+    while (*link)
+    {
+        parent = *link;
+        link = slot < RBTREE_ENTRY(parent, swap_cache_node_t, node)->slot ? &parent->left : &parent->right;
+    }
+
+    rbtree_insert(&cache_tree, &cache_node->node, parent, link);
+
+    cache_node->next = NULL;
+    cache_node->prev = cache_newest;
+
+    if (cache_newest)
+    {
+        cache_newest->next = cache_node;
+    }
+    else
+    {
+        cache_oldest = cache_node;
+    }
+
+    cache_newest = cache_node;
+
+    __atomic_fetch_add(&swap_stats.cache_pages, 1, __ATOMIC_RELAXED);
+
+    return cache_node;
+}
+
+// forget a cached frame, its reference belongs to the caller now
+void swap_cache_remove(swap_cache_node_t *cache_node)
+{
+    rbtree_remove(&cache_tree, &cache_node->node);
+
+    if (cache_node->prev)
+    {
+        cache_node->prev->next = cache_node->next;
+    }
+    else
+    {
+        cache_oldest = cache_node->next;
+    }
+
+    if (cache_node->next)
+    {
+        cache_node->next->prev = cache_node->prev;
+    }
+    else
+    {
+        cache_newest = cache_node->prev;
+    }
+
+    slab_cache_free(cache_node_cache, cache_node, SLAB_PANIC);
+
+    __atomic_fetch_sub(&swap_stats.cache_pages, 1, __ATOMIC_RELAXED);
+}
+
+// drop the oldest cached frames until page_count more fit below
+// SWAP_CACHE_MAX_PAGES (as far as they aren't mapped)
+void swap_cache_make_room(size_t page_count)
+{
+    size_t cached_count = __atomic_load_n(&swap_stats.cache_pages, __ATOMIC_RELAXED);
+
+    if (cached_count + page_count > SWAP_CACHE_MAX_PAGES)
+    {
+        swap_cache_drop_unmapped(cached_count + page_count - SWAP_CACHE_MAX_PAGES);
+    }
+}
+
+// free up to page_count cached frames nobody maps, oldest first - returns how
+// many were freed
+size_t swap_cache_drop_unmapped(size_t page_count)
+{
+    size_t freed_count = 0;
+    swap_cache_node_t *cache_node = cache_oldest;
+
+    while (cache_node && freed_count < page_count)
+    {
+        swap_cache_node_t *next = cache_node->next;
+
+        if (pmm_get_ref_count((void *)cache_node->frame) == 1)
+        {
+            uint64_t frame = cache_node->frame;
+            mem_tag_t tag = cache_node->tag;
+
+            swap_cache_remove(cache_node);
+            pmm_free((void *)frame, 1, tag);
+
+            freed_count++;
+        }
+
+        cache_node = next;
+    }
+
+    return freed_count;
+}
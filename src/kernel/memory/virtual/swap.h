@@ -0,0 +1,78 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/virtio/virtio_blk.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/zstore.h>
+
+#define SWAP_SLOT_SHIFT		12	// the slot of a ZSTORE_ENTRY_SWAP entry is in its address bits
+#define SWAP_SECTORS_PER_SLOT	(PAGE_SIZE / VIRTIO_BLK_SECTOR_SIZE)
+#define SWAP_MAP_READING	0x8000	// flag in the slot map: the slot is being read
+#define SWAP_MAP_MAX		(SWAP_MAP_READING - 1) // entries which can refer to one slot
+#define SWAP_READAHEAD_PAGES	8	// aligned window of slots a fault reads at once
+#define SWAP_CACHE_MAX_PAGES	1024	// frames the cache keeps, unless they are mapped as well
+
+typedef struct
+{
+    uint64_t pages_written;
+    uint64_t write_requests;	// one per cluster of contiguous slots
+    uint64_t pages_read;
+    uint64_t read_requests;
+    uint64_t readahead_pages;	// read along with the page a fault wanted
+    uint64_t readahead_hits;	// faults served by one of them
+    uint64_t cache_hits;	// other faults served by the cache (shared or re-faulted pages)
+    uint64_t faults;
+    uint64_t fault_cycles;	// spent on them (IO included)
+    uint64_t io_errors;
+    uint64_t slots_used;	// right now
+    uint64_t cache_pages;	// right now
+} swap_stats_t;
+
+// the entry which replaces the mapping of a page written to a slot
+static inline uint64_t swap_slot_to_entry(size_t slot)
+{
+    return ((uint64_t)slot << SWAP_SLOT_SHIFT) | ZSTORE_ENTRY_SWAP;
+}
+
+static inline size_t swap_entry_to_slot(uint64_t entry)
+{
+    return entry >> SWAP_SLOT_SHIFT;
+}
+
+void swap_init(void);
+bool swap_available(void);
+size_t swap_out(const uint64_t *frames, const mem_tag_t *tags, size_t count, uint64_t *entries);
+bool swap_fault_in(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t *pte);
+void swap_ref_entry(uint64_t entry);
+void swap_free_entry(uint64_t entry);
+size_t swap_cache_shrink(size_t page_count);
+void swap_get_stats(swap_stats_t *stats);
+void swap_reset_stats(void);
+void swap_dump_stats(void);
+
+#endif
@@ -0,0 +1,433 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+
+    Brief file description:
+    Transparent huge pages: anonymous regions of user spaces are backed by
+    2 MiB frames where they can be, which needs a single TLB entry instead of
+    512. The first fault (which isn't served by a zero page) in an aligned
+    2 MiB block that is part of the region and has no page table yet maps a
+    whole zeroed 2 MiB frame. If no aligned frame is free, the fault falls
+    back to 4 KiB pages.
+    Blocks which got populated page by page (because they were partially
+    mapped before or memory was short) are merged later by the collapse
+    worker: once all 512 pages are present and owned by the space alone, they
+    are copied into a 2 MiB frame which replaces the page table. The worker
+    is idle work of an AP (see smp.c), kicked every THP_COLLAPSE_KICK_FAULTS
+    4 KiB faults.
+    A huge page only stays one while it's used as a whole: unmapping or
+    protecting part of it, or sharing it copy-on-write, splits it into 4 KiB
+    pages first. Mergeable spaces (see ksm.c) get no huge pages at all, and
+    cold ones are split to evict them (see zstore.c). The huge_page_count of
+    a space says how many 2 MiB frames back it.
+    Everything here runs with the region lock of the space held.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <libk/testing/assert.h>
+#include <memory/mem.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+#include <memory/virtual/zero_page.h>
+#include <proc/smp/smp.h>
+#include <utility/utils.h>
+
+#define THP_PAGE_COUNT	(LARGE_PAGE_SIZE / PAGE_SIZE)
+
+static thp_stats_t thp_stats;
+static bool thp_enabled = true;
+static uint64_t small_fault_count = 0;
+static size_t collapse_work;
+
+/* utility function prototypes */
+
+bool thp_block_allowed(vmm_space_t *space, vmm_region_t *region, uint64_t block);
+bool thp_map_block(tlb_gather_t *gather, vmm_region_t *region, uint64_t block);
+size_t thp_collapse_locked(vmm_space_t *space, size_t budget);
+bool thp_collapse_block(vmm_space_t *space, vmm_region_t *region, uint64_t block);
+void thp_collapse_worker(void *argument);
+
+/* core functions */
+
+// let an idle AP run the collapse worker
+void thp_init(void)
+{
+    collapse_work = smp_add_idle_work(thp_collapse_worker);
+
+    log(INFO, "Transparent huge pages initialized\n");
+}
+
+// whether faults map 2 MiB frames and the worker collapses 4 KiB pages
+void thp_set_enabled(bool enabled)
+{
+    __atomic_store_n(&thp_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+// map a zeroed 2 MiB frame over the aligned block around virt_page - only if
+// the block is inside of the region and nothing of it is mapped yet
+bool thp_map_on_fault(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page)
+{
+    uint64_t block = ALIGN_DOWN(virt_page, LARGE_PAGE_SIZE);
+
+    if (!thp_block_allowed(gather->space, region, block))
+    {
+        return false;
+    }
+
+    // no page table below the block (a large page would have been present)
+    if (vmm_get_pte(gather->space, block) != NULL)
+    {
+        return false;
+    }
+
+    return thp_map_block(gather, region, block);
+}
+
+// map a zeroed 2 MiB frame where the 2 MiB zero page is mapped - false if
+// virt_page isn't part of one or the block can't be huge
+bool thp_replace_zero(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page)
+{
+    uint64_t block = ALIGN_DOWN(virt_page, LARGE_PAGE_SIZE);
+    vmm_walk_entry_t leaf;
+
+    if (!vmm_walk_lookup(gather->space, block, &leaf) || leaf.size != LARGE_PAGE_SIZE
+            || !zero_page_contains(leaf.phys))
+    {
+        return false;
+    }
+
+    if (!thp_block_allowed(gather->space, region, block))
+    {
+        return false;
+    }
+
+    return thp_map_block(gather, region, block);
+}
+
+// count a fault which mapped 4 KiB pages where a huge page would have been
+// possible - every THP_COLLAPSE_KICK_FAULTS of them let the worker run
+void thp_note_small_fault(vmm_space_t *space, vmm_region_t *region)
+{
+    if (space == vmm_get_kernel_space() || region->pat_type != PAT_WRITE_BACK
+            || region->end - region->start < LARGE_PAGE_SIZE || !__atomic_load_n(&thp_enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    if ((__atomic_add_fetch(&small_fault_count, 1, __ATOMIC_RELAXED) % THP_COLLAPSE_KICK_FAULTS) == 0)
+    {
+        smp_kick_idle_work(collapse_work);
+    }
+}
+
+// remove a huge page (found by the walker) which is part of region as a
+// whole - the frame is freed after the flush
+void thp_unmap(tlb_gather_t *gather, vmm_region_t *region, vmm_walk_entry_t *leaf)
+{
+    assert(leaf->size == LARGE_PAGE_SIZE);
+
+    page_fault_account_unmap(*leaf->pte);
+    vmm_unmap_large_page_gather(gather, leaf->virt);
+
+    tlb_gather_free_frames(gather, (void *)leaf->phys, THP_PAGE_COUNT, region->tag);
+    __atomic_fetch_sub(&gather->space->huge_page_count, 1, __ATOMIC_RELAXED);
+}
+
+// turn the huge page at an aligned address into 512 pages of 4 KiB, which
+// keep its frame (each page is freed on its own from now on)
+void thp_split(vmm_space_t *space, uint64_t virt_page)
+{
+    vmm_split_large_page(space, virt_page);
+
+    __atomic_fetch_sub(&space->huge_page_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&thp_stats.splits, 1, __ATOMIC_RELAXED);
+}
+
+// split every huge page of a region (2 MiB zero pages stay as they are)
+void thp_split_region(vmm_space_t *space, vmm_region_t *region)
+{
+    vmm_walker_t walker;
+    vmm_walk_entry_t leaf;
+
+    vmm_walk_init(&walker, space, region->start, region->end);
+
+    while (vmm_walk_next(&walker, &leaf))
+    {
+        if (leaf.size == LARGE_PAGE_SIZE && !zero_page_contains(leaf.phys))
+        {
+            thp_split(space, leaf.virt);
+        }
+    }
+}
+
+// merge up to budget fully populated blocks of a space into huge pages -
+// returns how many were merged
+size_t thp_collapse_space(vmm_space_t *space, size_t budget)
+{
+    spinlock_acquire(&space->region_lock);
+
+    size_t collapsed_count = thp_collapse_locked(space, budget);
+
+    spinlock_release(&space->region_lock);
+
+    return collapsed_count;
+}
+
+// same as thp_collapse_space(), for all spaces one after another - spaces
+// whose region lock is taken are skipped
+size_t thp_collapse_all(size_t budget)
+{
+    size_t collapsed_count = 0;
+    bool exists = true;
+
+    for (size_t index = 0; exists && collapsed_count < budget; index++)
+    {
+        vmm_space_t *space = vmm_space_try_lock_nth(index, &exists);
+
+        if (!space)
+        {
+            continue;
+        }
+
+        collapsed_count += thp_collapse_locked(space, budget - collapsed_count);
+
+        spinlock_release(&space->region_lock);
+    }
+
+    return collapsed_count;
+}
+
+// copy the counters
+void thp_get_stats(thp_stats_t *stats)
+{
+    stats->fault_pages = __atomic_load_n(&thp_stats.fault_pages, __ATOMIC_RELAXED);
+    stats->fault_fallbacks = __atomic_load_n(&thp_stats.fault_fallbacks, __ATOMIC_RELAXED);
+    stats->collapses = __atomic_load_n(&thp_stats.collapses, __ATOMIC_RELAXED);
+    stats->splits = __atomic_load_n(&thp_stats.splits, __ATOMIC_RELAXED);
+    stats->worker_runs = __atomic_load_n(&thp_stats.worker_runs, __ATOMIC_RELAXED);
+}
+
+// set all counters back to zero
+void thp_reset_stats(void)
+{
+    __atomic_store_n(&thp_stats.fault_pages, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&thp_stats.fault_fallbacks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&thp_stats.collapses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&thp_stats.splits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&thp_stats.worker_runs, 0, __ATOMIC_RELAXED);
+}
+
+// print the counters
+void thp_dump_stats(void)
+{
+    thp_stats_t stats;
+    thp_get_stats(&stats);
+
+    log(INFO, "Huge pages: faults=%llu fallbacks=%llu collapses=%llu splits=%llu worker_runs=%llu\n",
+        stats.fault_pages, stats.fault_fallbacks, stats.collapses, stats.splits, stats.worker_runs);
+}
+
+/* utility functions */
+
+// whether an aligned block of a region may become a huge page: only anonymous
+// write-back memory of user spaces, and the region has to cover the block
+bool thp_block_allowed(vmm_space_t *space, vmm_region_t *region, uint64_t block)
+{
+    if (!__atomic_load_n(&thp_enabled, __ATOMIC_RELAXED) || space == vmm_get_kernel_space())
+    {
+        return false;
+    }
+
+    // merging needs 4 KiB pages, see ksm.c
+    if (__atomic_load_n(&space->mergeable, __ATOMIC_RELAXED))
+    {
+        return false;
+    }
+
+    if (region->type != VMM_REGION_ANONYMOUS || region->pat_type != PAT_WRITE_BACK)
+    {
+        return false;
+    }
+
+    return block >= region->start && block + LARGE_PAGE_SIZE <= region->end;
+}
+
+// map a zeroed 2 MiB frame at block - false if there is no aligned one
+bool thp_map_block(tlb_gather_t *gather, vmm_region_t *region, uint64_t block)
+{
+    void *frame = pmm_alloc_aligned(THP_PAGE_COUNT, LARGE_PAGE_SIZE, region->tag);
+
+    if (!frame)
+    {
+        __atomic_fetch_add(&thp_stats.fault_fallbacks, 1, __ATOMIC_RELAXED);
+
+        return false;
+    }
+
+    memset((void *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)frame), 0, LARGE_PAGE_SIZE);
+
+    vmm_map_large_page_gather(gather, (uint64_t)frame, block, region->flags, region->pat_type);
+
+    __atomic_fetch_add(&gather->space->huge_page_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&thp_stats.fault_pages, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// collapse the blocks of all regions of a space whose region lock is held
+size_t thp_collapse_locked(vmm_space_t *space, size_t budget)
+{
+    size_t collapsed_count = 0;
+
+    for (vmm_region_t *region = vmm_region_first(space); region && collapsed_count < budget;
+            region = vmm_region_next(region))
+    {
+        uint64_t block = ALIGN_UP(region->start, LARGE_PAGE_SIZE);
+
+        for (; block + LARGE_PAGE_SIZE <= region->end && collapsed_count < budget; block += LARGE_PAGE_SIZE)
+        {
+            if (thp_block_allowed(space, region, block) && thp_collapse_block(space, region, block))
+            {
+                collapsed_count++;
+            }
+        }
+    }
+
+    return collapsed_count;
+}
+
+// replace the 512 pages of a block by a copy in a 2 MiB frame - all of them
+// have to be present, and neither shared nor zero pages
+bool thp_collapse_block(vmm_space_t *space, vmm_region_t *region, uint64_t block)
+{
+    vmm_walk_entry_t leaf;
+
+    // a missing first page or a large page already
+    if (!vmm_walk_lookup(space, block, &leaf) || leaf.size != PAGE_SIZE)
+    {
+        return false;
+    }
+
+    // the block is aligned, so its entries are the whole page table
+    uint64_t *pt = leaf.pte;
+
+    for (size_t i = 0; i < THP_PAGE_COUNT; i++)
+    {
+        uint64_t frame = pt[i] & PTE_ADDRESS_MASK;
+
+        if (!(pt[i] & PTE_PRESENT) || (pt[i] & PTE_COW) || zero_page_contains(frame)
+                || pmm_get_ref_count((void *)frame) != 1)
+        {
+            return false;
+        }
+    }
+
+    // the page table is gone before the old frames may be freed, so their
+    // addresses are kept in a page of their own
+    void *huge_frame = pmm_alloc_aligned(THP_PAGE_COUNT, LARGE_PAGE_SIZE, region->tag);
+    void *list_frame = pmm_alloc(1, MEM_TAG_KERNEL);
+
+    if (!huge_frame || !list_frame)
+    {
+        if (huge_frame)
+        {
+            pmm_free(huge_frame, THP_PAGE_COUNT, region->tag);
+        }
+
+        if (list_frame)
+        {
+            pmm_free(list_frame, 1, MEM_TAG_KERNEL);
+        }
+
+        return false;
+    }
+
+    uint64_t *old_frames = PHYS_TO_HIGHER_HALF_DATA(list_frame);
+
+    // writes through other CPUs' TLBs would get lost while copying, so the
+    // pages become read-only first - a write faults and waits for the lock
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    for (size_t i = 0; i < THP_PAGE_COUNT; i++)
+    {
+        uint64_t entry = pt[i];
+
+        if (entry & PTE_READ_WRITE)
+        {
+            pt[i] = entry & ~(uint64_t)PTE_READ_WRITE;
+            tlb_gather_add_page(&gather, block + i * PAGE_SIZE, entry);
+        }
+    }
+
+    tlb_gather_finish(&gather);
+
+    for (size_t i = 0; i < THP_PAGE_COUNT; i++)
+    {
+        old_frames[i] = pt[i] & PTE_ADDRESS_MASK;
+
+        memcpy((void *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)huge_frame + i * PAGE_SIZE),
+               (void *)PHYS_TO_HIGHER_HALF_DATA(old_frames[i]), PAGE_SIZE);
+
+        page_fault_account_unmap(pt[i]);
+    }
+
+    // frees the page table as well
+    vmm_map_large_page_gather(&gather, (uint64_t)huge_frame, block, region->flags, region->pat_type);
+    tlb_gather_finish(&gather);
+
+    for (size_t i = 0; i < THP_PAGE_COUNT; i++)
+    {
+        pmm_free((void *)old_frames[i], 1, region->tag);
+    }
+
+    pmm_free(list_frame, 1, MEM_TAG_KERNEL);
+
+    __atomic_fetch_add(&space->huge_page_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&thp_stats.collapses, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// idle work of an AP: collapse what the budget allows
+void thp_collapse_worker(void *argument)
+{
+    (void)argument;
+
+    if (!__atomic_load_n(&thp_enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    __atomic_fetch_add(&thp_stats.worker_runs, 1, __ATOMIC_RELAXED);
+
+    thp_collapse_all(THP_COLLAPSE_BUDGET);
+}
@@ -0,0 +1,58 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef THP_H
+#define THP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory/virtual/region.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+
+#define THP_COLLAPSE_KICK_FAULTS    512	// 4 KiB faults in huge page capable regions between two worker runs
+#define THP_COLLAPSE_BUDGET	    16	// huge pages one run of the worker creates at most
+
+typedef struct
+{
+    uint64_t fault_pages;	// 2 MiB frames mapped by faults (zero pages replaced included)
+    uint64_t fault_fallbacks;	// no aligned 2 MiB frame was free, 4 KiB pages were used
+    uint64_t collapses;		// 512 populated 4 KiB pages merged into one 2 MiB frame
+    uint64_t splits;		// 2 MiB pages turned back into 4 KiB pages
+    uint64_t worker_runs;
+} thp_stats_t;
+
+void thp_init(void);
+void thp_set_enabled(bool enabled);
+bool thp_map_on_fault(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page);
+bool thp_replace_zero(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page);
+void thp_note_small_fault(vmm_space_t *space, vmm_region_t *region);
+void thp_unmap(tlb_gather_t *gather, vmm_region_t *region, vmm_walk_entry_t *leaf);
+void thp_split(vmm_space_t *space, uint64_t virt_page);
+void thp_split_region(vmm_space_t *space, vmm_region_t *region);
+size_t thp_collapse_space(vmm_space_t *space, size_t budget);
+size_t thp_collapse_all(size_t budget);
+void thp_get_stats(thp_stats_t *stats);
+void thp_reset_stats(void);
+void thp_dump_stats(void);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Batched TLB invalidation. Page table changes record what they invalidate in
+    a tlb_gather_t and tlb_gather_finish() then executes a few invlpg's or, past
+    TLB_GATHER_MAX_PAGES, one CR3 reload. Nothing is recorded for entries that
+    weren't present before (the TLB never caches non-present entries) and
+    only CPUs which have the address space loaded are flushed (the others
+    notice the incremented TLB generation of the space when they load it). Frames (and page
+    table pages) that were reachable through the old entries are only freed
+    after the flush, so they can't be reused while stale translations exist.
+    Other CPUs are reached by a shootdown: the initiator lists the same pages
+    as for its own flush (or asks for a full one) in its CPU local
+    tlb_shootdown_t, sets its bit in the tlb_requests mask of
+    every target and sends one IPI_TLB_INT per target (none if the target has
+    requests pending already, it will see the new one too). Every target
+    flushes and clears its bit in the pending mask of the request, which the
+    initiator waits for. There is no global lock - while waiting, the
+    initiator handles requests for itself, so that two CPUs shooting at each
+    other can't deadlock. A CPU spinning on a lock does the same (see
+    spinlock_acquire()), as the holder might be waiting for it.
+    Kernel mappings are global: invlpg drops them in every PCID and a full
+    flush toggles CR4.PGE, as reloading CR3 keeps them.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/apic/apic.h>
+#include <hardware/cpu.h>
+#include <memory/mem.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <proc/smp/smp.h>
+#include <tables/isr.h>
+#include <utility/utils.h>
+
+/* utility function prototypes */
+
+void tlb_gather_flush(tlb_gather_t *gather);
+void tlb_flush_request(tlb_shootdown_t *request);
+
+/* core functions */
+
+// start a batch of changes to an address space
+void tlb_gather_init(tlb_gather_t *gather, vmm_space_t *space)
+{
+    gather->space = space;
+    gather->global = space == vmm_get_kernel_space() && vmm_global_pages_enabled();
+    gather->tables_freed = false;
+
+    gather->flush_all = false;
+    gather->page_count = 0;
+    gather->frame_count = 0;
+}
+
+// a page table entry was changed from old_entry - only a present entry can be cached
+void tlb_gather_add_page(tlb_gather_t *gather, uint64_t virt_page, uint64_t old_entry)
+{
+    if (!(old_entry & PTE_PRESENT) || gather->flush_all)
+    {
+        return;
+    }
+
+    if (gather->page_count == TLB_GATHER_MAX_PAGES)
+    {
+        gather->flush_all = true;
+
+        return;
+    }
+
+    gather->pages[gather->page_count++] = virt_page;
+}
+
+// a whole range might be cached with different translations (e.g. a table was
+// replaced by a large page)
+void tlb_gather_add_range(tlb_gather_t *gather, uint64_t virt_start, size_t length)
+{
+    if (gather->flush_all)
+    {
+        return;
+    }
+
+    if (gather->page_count + length / PAGE_SIZE > TLB_GATHER_MAX_PAGES)
+    {
+        gather->flush_all = true;
+
+        return;
+    }
+
+    for (uint64_t virt_page = virt_start; virt_page < virt_start + length; virt_page += PAGE_SIZE)
+    {
+        gather->pages[gather->page_count++] = virt_page;
+    }
+}
+
+// give frames back to the PMM once nothing can reach them through the TLB anymore
+void tlb_gather_free_frames(tlb_gather_t *gather, void *frame, size_t count, mem_tag_t tag)
+{
+    if (tag == MEM_TAG_PAGE_TABLE)
+    {
+        gather->tables_freed = true;
+    }
+
+    if (gather->frame_count == TLB_GATHER_MAX_FRAMES)
+    {
+        tlb_gather_flush(gather);
+    }
+
+    gather->frames[gather->frame_count++] = (tlb_gather_frame_t)
+    {
+        .frame = frame,
+        .count = count,
+        .tag = tag
+    };
+}
+
+// execute everything that was recorded - the gather can be reused afterwards
+void tlb_gather_finish(tlb_gather_t *gather)
+{
+    tlb_gather_flush(gather);
+}
+
+// flush page_count pages (everything if pages is NULL) on all CPUs in cpu_mask
+// except this one and wait until they are done
+void tlb_shootdown(uint64_t cpu_mask, const uint64_t *pages, size_t page_count, bool global)
+{
+    // the request in the CPU local structure must not be reused by an
+    // interrupt handler until all targets acknowledged it
+    bool interrupts = asm_get_interrupt_flag();
+    asm volatile("cli");
+
+    cpu_local_t *cpu = this_cpu();
+    uint64_t cpu_bit = 1UL << cpu->cpu_number;
+
+    cpu_mask &= ~cpu_bit;
+
+    if (cpu_mask)
+    {
+        tlb_shootdown_t *request = &cpu->tlb_shootdown;
+
+        request->flush_all = !pages || page_count > TLB_GATHER_MAX_PAGES;
+        request->page_count = request->flush_all ? 0 : page_count;
+        request->global = global;
+
+        for (size_t i = 0; i < request->page_count; i++)
+        {
+            request->pages[i] = pages[i];
+        }
+
+        __atomic_store_n(&request->pending_mask, cpu_mask, __ATOMIC_RELEASE);
+
+        for (uint64_t targets = cpu_mask; targets; targets &= targets - 1)
+        {
+            cpu_local_t *target = &cpu_locals[__builtin_ctzll(targets)];
+
+            // only the first request needs to wake the target up
+            if (!__atomic_fetch_or(&target->tlb_requests, cpu_bit, __ATOMIC_ACQ_REL))
+            {
+                lapic_send_ipi(target->lapic_id, IPI_TLB_INT);
+            }
+        }
+
+        while (__atomic_load_n(&request->pending_mask, __ATOMIC_ACQUIRE))
+        {
+            tlb_shootdown_handle();
+
+            asm volatile("pause");
+        }
+    }
+
+    if (interrupts)
+    {
+        asm volatile("sti");
+    }
+}
+
+// execute the requests other CPUs sent to this one and acknowledge them
+void tlb_shootdown_handle(void)
+{
+    cpu_local_t *cpu = this_cpu();
+    uint64_t cpu_bit = 1UL << cpu->cpu_number;
+
+    uint64_t requests = __atomic_exchange_n(&cpu->tlb_requests, 0, __ATOMIC_ACQ_REL);
+
+    for (; requests; requests &= requests - 1)
+    {
+        tlb_shootdown_t *request = &cpu_locals[__builtin_ctzll(requests)].tlb_shootdown;
+
+        tlb_flush_request(request);
+
+        __atomic_fetch_and(&request->pending_mask, ~cpu_bit, __ATOMIC_RELEASE);
+    }
+}
+
+// invalidate the translation of a single page on this CPU
+void tlb_flush_page(uint64_t virt_page)
+{
+    asm_invlpg((uint64_t *)virt_page);
+}
+
+// invalidate all non-global translations of the current PCID on this CPU
+void tlb_flush_all(void)
+{
+    asm_write_cr(3, asm_read_cr(3));
+}
+
+// invalidate all translations of all PCIDs on this CPU, including global ones
+void tlb_flush_all_global(void)
+{
+    uint64_t cr4 = asm_read_cr(4);
+
+    if (!(cr4 & CR4_PGE))
+    {
+        tlb_flush_all();
+
+        return;
+    }
+
+    asm_write_cr(4, cr4 & ~CR4_PGE);
+    asm_write_cr(4, cr4);
+}
+
+/* utility functions */
+
+// invalidate the recorded pages on every CPU that uses the address space,
+// free the recorded frames and start over
+void tlb_gather_flush(tlb_gather_t *gather)
+{
+    // CPUs that load the space (with a PCID that might still hold old entries)
+    // after the mask was read see the new generation and flush on their own -
+    // global entries are gone from all PCIDs anyway, only the paging-structure
+    // caches of other PCIDs can still point to freed tables
+    if (gather->tables_freed || (!gather->global && (gather->flush_all || gather->page_count)))
+    {
+        __atomic_fetch_add(&gather->space->tlb_generation, 1, __ATOMIC_SEQ_CST);
+    }
+
+    uint64_t cpu_mask = __atomic_load_n(&gather->space->cpu_mask, __ATOMIC_SEQ_CST);
+
+    if (cpu_mask & (1UL << this_cpu()->cpu_number))
+    {
+        if (gather->flush_all)
+        {
+            gather->global ? tlb_flush_all_global() : tlb_flush_all();
+        }
+        else
+        {
+            for (size_t i = 0; i < gather->page_count; i++)
+            {
+                tlb_flush_page(gather->pages[i]);
+            }
+        }
+    }
+
+    if (gather->flush_all || gather->page_count)
+    {
+        // the targets invalidate the same pages as this CPU
+        tlb_shootdown(cpu_mask, gather->flush_all ? NULL : gather->pages, gather->page_count, gather->global);
+    }
+
+    for (size_t i = 0; i < gather->frame_count; i++)
+    {
+        pmm_free(gather->frames[i].frame, gather->frames[i].count, gather->frames[i].tag);
+    }
+
+    gather->flush_all = false;
+    gather->tables_freed = false;
+    gather->page_count = 0;
+    gather->frame_count = 0;
+}
+
+// invalidate the pages of a shootdown request on this CPU (or everything, including
+// global entries if the request says so)
+void tlb_flush_request(tlb_shootdown_t *request)
+{
+    if (request->flush_all)
+    {
+        request->global ? tlb_flush_all_global() : tlb_flush_all();
+
+        return;
+    }
+
+    for (size_t i = 0; i < request->page_count; i++)
+    {
+        tlb_flush_page(request->pages[i]);
+    }
+}
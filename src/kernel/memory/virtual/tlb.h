@@ -0,0 +1,78 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory/mem_tag.h>
+
+#define TLB_GATHER_MAX_PAGES	32 // more invalidations than that reload CR3 instead
+#define TLB_GATHER_MAX_FRAMES	16 // frames waiting for their translations to go away
+
+struct vmm_space;
+
+// request of one CPU to flush pages on others, acknowledged per CPU
+typedef struct
+{
+    bool flush_all;		// pages are ignored then
+    size_t page_count;
+    uint64_t pages[TLB_GATHER_MAX_PAGES];
+    bool global;		// global entries might be affected
+    uint64_t pending_mask;	// CPUs that didn't flush yet (bit = cpu_number)
+} tlb_shootdown_t;
+
+typedef struct
+{
+    void *frame;
+    size_t count;
+    mem_tag_t tag;
+} tlb_gather_frame_t;
+
+// collects the invalidations of a batch of page table changes, so that they
+// can be done at once at the end (mmu_gather style)
+typedef struct
+{
+    struct vmm_space *space;	// CPUs which don't have it loaded need no flush
+    bool global;		// the space maps global pages (the kernel space)
+    bool tables_freed;		// paging-structure caches might point to freed tables
+
+    bool flush_all;
+    size_t page_count;
+    uint64_t pages[TLB_GATHER_MAX_PAGES];
+
+    size_t frame_count;
+    tlb_gather_frame_t frames[TLB_GATHER_MAX_FRAMES];
+} tlb_gather_t;
+
+void tlb_gather_init(tlb_gather_t *gather, struct vmm_space *space);
+void tlb_gather_add_page(tlb_gather_t *gather, uint64_t virt_page, uint64_t old_entry);
+void tlb_gather_add_range(tlb_gather_t *gather, uint64_t virt_start, size_t length);
+void tlb_gather_free_frames(tlb_gather_t *gather, void *frame, size_t count, mem_tag_t tag);
+void tlb_gather_finish(tlb_gather_t *gather);
+void tlb_shootdown(uint64_t cpu_mask, const uint64_t *pages, size_t page_count, bool global);
+void tlb_shootdown_handle(void);
+void tlb_flush_page(uint64_t virt_page);
+void tlb_flush_all(void);
+void tlb_flush_all_global(void);
+
+#endif
@@ -0,0 +1,468 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+
+    Brief file description:
+    Allocator for virtually contiguous memory in a dedicated kernel address range
+    (VMALLOC_START_ADDR - VMALLOC_END_ADDR). Each page is backed by its own frame,
+    so big allocations neither need physically contiguous memory nor are they
+    limited to the first 4 GiB of RAM.
+    Allocated ranges are kept in a list of areas sorted by address. An area can
+    optionally be followed by an unmapped guard page, so that overflows fault.
+    Frames are only zeroed if VMALLOC_ZERO is requested. They are mapped
+    write-back, unless VMALLOC_UNCACHED is requested.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/testing/assert.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmalloc.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+
+#define VMALLOC_MAP_BATCH   64 // frames mapped at once by vmalloc_populate()
+
+static spinlock_t vmalloc_lock;
+static slab_cache_t *vmalloc_area_cache;
+static vmalloc_area_t *vmalloc_areas_head = NULL;
+
+/* utility function prototypes */
+
+vmalloc_area_t *vmalloc_find_area(uintptr_t start, vmalloc_area_t **prev_area);
+uintptr_t vmalloc_find_free_range(size_t page_count, size_t alignment, vmalloc_area_t **prev_area);
+void vmalloc_insert_area(vmalloc_area_t *area, vmalloc_area_t *prev_area);
+void vmalloc_remove_area(vmalloc_area_t *area, vmalloc_area_t *prev_area);
+uintptr_t vmalloc_area_end(vmalloc_area_t *area);
+bool vmalloc_populate(uintptr_t start, size_t page_count, mem_tag_t tag, vmalloc_flags_t flags);
+void vmalloc_depopulate(uintptr_t start, size_t page_count, mem_tag_t tag);
+pat_cache_t vmalloc_get_pat_type(vmalloc_flags_t flags);
+
+/* core functions */
+
+// create the cache that holds the area descriptors
+void vmalloc_init(void)
+{
+    assert(sizeof(vmalloc_area_t) <= 64);
+
+    vmalloc_area_cache = slab_cache_create("vmalloc areas", 64, MEM_TAG_VMALLOC, SLAB_PANIC | SLAB_AUTO_GROW);
+
+    log(INFO, "vmalloc initialized - 0x%.16llx to 0x%.16llx\n", VMALLOC_START_ADDR, VMALLOC_END_ADDR);
+}
+
+// reserve a virtual range and back every page of it with a frame (accounted to tag)
+void *vmalloc(size_t size, mem_tag_t tag, vmalloc_flags_t flags)
+{
+    return vmalloc_aligned(size, PAGE_SIZE, tag, flags);
+}
+
+// same as vmalloc(), but the range starts at a multiple of alignment (power of two)
+void *vmalloc_aligned(size_t size, size_t alignment, mem_tag_t tag, vmalloc_flags_t flags)
+{
+    if (!size)
+    {
+        return NULL;
+    }
+
+    if (alignment < PAGE_SIZE)
+    {
+        alignment = PAGE_SIZE;
+    }
+
+    size_t page_count = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    size_t guard_count = (flags & VMALLOC_GUARD) ? 1 : 0;
+
+    spinlock_acquire(&vmalloc_lock);
+
+    vmalloc_area_t *prev_area;
+    uintptr_t start = vmalloc_find_free_range(page_count + guard_count, alignment, &prev_area);
+
+    if (!start)
+    {
+        spinlock_release(&vmalloc_lock);
+
+        return NULL;
+    }
+
+    vmalloc_area_t *area = slab_cache_alloc(vmalloc_area_cache, SLAB_PANIC);
+
+    area->start = start;
+    area->page_count = page_count;
+    area->guard_count = guard_count;
+    area->flags = flags;
+    area->tag = tag;
+
+    if (!vmalloc_populate(start, page_count, tag, flags))
+    {
+        slab_cache_free(vmalloc_area_cache, area, SLAB_PANIC);
+
+        spinlock_release(&vmalloc_lock);
+
+        return NULL;
+    }
+
+    vmalloc_insert_area(area, prev_area);
+
+    spinlock_release(&vmalloc_lock);
+
+    return (void *)start;
+}
+
+// resize an area - shrinking and growing into a free virtual range directly
+// after it is done in place, otherwise the frames are remapped to a new range
+// (nothing gets copied either way)
+void *vrealloc(void *pointer, size_t size)
+{
+    if (!pointer)
+    {
+        return vmalloc(size, MEM_TAG_VMALLOC, 0);
+    }
+
+    if (!size)
+    {
+        vfree(pointer);
+
+        return NULL;
+    }
+
+    spinlock_acquire(&vmalloc_lock);
+
+    vmalloc_area_t *prev_area;
+    vmalloc_area_t *area = vmalloc_find_area((uintptr_t)pointer, &prev_area);
+
+    if (!area)
+    {
+        log(WARNING, "vrealloc: 0x%p wasn't allocated by vmalloc\n", pointer);
+
+        spinlock_release(&vmalloc_lock);
+
+        return NULL;
+    }
+
+    size_t old_page_count = area->page_count;
+    size_t new_page_count = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+
+    if (new_page_count == old_page_count)
+    {
+        spinlock_release(&vmalloc_lock);
+
+        return pointer;
+    }
+
+    if (new_page_count < old_page_count)
+    {
+        vmalloc_depopulate(area->start + new_page_count * PAGE_SIZE, old_page_count - new_page_count,
+                           area->tag);
+        area->page_count = new_page_count;
+
+        spinlock_release(&vmalloc_lock);
+
+        return pointer;
+    }
+
+    // grow in place if the following virtual range is free
+    uintptr_t limit = area->next ? area->next->start : VMALLOC_END_ADDR;
+
+    if (area->start + (new_page_count + area->guard_count) * PAGE_SIZE <= limit)
+    {
+        if (!vmalloc_populate(area->start + old_page_count * PAGE_SIZE, new_page_count - old_page_count,
+                              area->tag, area->flags))
+        {
+            spinlock_release(&vmalloc_lock);
+
+            return NULL;
+        }
+
+        area->page_count = new_page_count;
+
+        spinlock_release(&vmalloc_lock);
+
+        return pointer;
+    }
+
+    // move the frames over to a big enough range
+    vmalloc_area_t *new_prev_area;
+    uintptr_t new_start = vmalloc_find_free_range(new_page_count + area->guard_count, PAGE_SIZE,
+                          &new_prev_area);
+
+    if (!new_start)
+    {
+        spinlock_release(&vmalloc_lock);
+
+        return NULL;
+    }
+
+    if (!vmalloc_populate(new_start + old_page_count * PAGE_SIZE, new_page_count - old_page_count,
+                          area->tag, area->flags))
+    {
+        spinlock_release(&vmalloc_lock);
+
+        return NULL;
+    }
+
+    vmm_space_t *space = vmm_get_kernel_space();
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    vmm_walker_t walker;
+    vmm_walk_entry_t entry;
+
+    vmm_walk_init(&walker, space, area->start, area->start + old_page_count * PAGE_SIZE);
+
+    while (vmm_walk_next(&walker, &entry))
+    {
+        vmm_map_page_gather(&gather, entry.phys, new_start + (entry.virt - area->start),
+                            KERNEL_READ_WRITE, vmalloc_get_pat_type(area->flags));
+        vmm_unmap_page_gather(&gather, entry.virt);
+    }
+
+    tlb_gather_finish(&gather);
+
+    vmalloc_remove_area(area, prev_area);
+
+    // the removal might have changed the predecessor of the new range
+    if (new_prev_area == area)
+    {
+        new_prev_area = prev_area;
+    }
+
+    area->start = new_start;
+    area->page_count = new_page_count;
+
+    vmalloc_insert_area(area, new_prev_area);
+
+    spinlock_release(&vmalloc_lock);
+
+    return (void *)new_start;
+}
+
+// unmap an area, give its frames back to the PMM and release the virtual range
+void vfree(void *pointer)
+{
+    if (!pointer)
+    {
+        return;
+    }
+
+    spinlock_acquire(&vmalloc_lock);
+
+    vmalloc_area_t *prev_area;
+    vmalloc_area_t *area = vmalloc_find_area((uintptr_t)pointer, &prev_area);
+
+    if (!area)
+    {
+        log(WARNING, "vfree: 0x%p wasn't allocated by vmalloc\n", pointer);
+
+        spinlock_release(&vmalloc_lock);
+
+        return;
+    }
+
+    vmalloc_depopulate(area->start, area->page_count, area->tag);
+    vmalloc_remove_area(area, prev_area);
+
+    slab_cache_free(vmalloc_area_cache, area, SLAB_PANIC);
+
+    spinlock_release(&vmalloc_lock);
+}
+
+// return the usable size of an allocation
+size_t vmalloc_size(void *pointer)
+{
+    spinlock_acquire(&vmalloc_lock);
+
+    vmalloc_area_t *prev_area;
+    vmalloc_area_t *area = vmalloc_find_area((uintptr_t)pointer, &prev_area);
+    size_t size = area ? area->page_count * PAGE_SIZE : 0;
+
+    spinlock_release(&vmalloc_lock);
+
+    return size;
+}
+
+// return if an address lies in the vmalloc range
+bool is_vmalloc_address(void *pointer)
+{
+    return (uintptr_t)pointer >= VMALLOC_START_ADDR && (uintptr_t)pointer < VMALLOC_END_ADDR;
+}
+
+/* utility functions */
+
+// find the area starting at an address and its predecessor in the list
+vmalloc_area_t *vmalloc_find_area(uintptr_t start, vmalloc_area_t **prev_area)
+{
+    *prev_area = NULL;
+
+    for (vmalloc_area_t *area = vmalloc_areas_head; area; area = area->next)
+    {
+        if (area->start == start)
+        {
+            return area;
+        }
+
+        if (area->start > start)
+        {
+            break;
+        }
+
+        *prev_area = area;
+    }
+
+    return NULL;
+}
+
+// first fit search for an aligned gap of page_count pages between the areas - return
+// 0 if there is none, otherwise the start and the area the gap follows
+uintptr_t vmalloc_find_free_range(size_t page_count, size_t alignment, vmalloc_area_t **prev_area)
+{
+    uintptr_t candidate = VMALLOC_START_ADDR;
+    size_t size = page_count * PAGE_SIZE;
+
+    *prev_area = NULL;
+
+    for (vmalloc_area_t *area = vmalloc_areas_head; area; area = area->next)
+    {
+        if (area->start >= candidate && area->start - candidate >= size)
+        {
+            break;
+        }
+
+        candidate = ALIGN_UP(vmalloc_area_end(area), alignment);
+        *prev_area = area;
+    }
+
+    if (candidate >= VMALLOC_END_ADDR || size > VMALLOC_END_ADDR - candidate)
+    {
+        return 0;
+    }
+
+    return candidate;
+}
+
+// link an area in after prev_area (or as new head if NULL)
+void vmalloc_insert_area(vmalloc_area_t *area, vmalloc_area_t *prev_area)
+{
+    if (!prev_area)
+    {
+        area->next = vmalloc_areas_head;
+        vmalloc_areas_head = area;
+    }
+    else
+    {
+        area->next = prev_area->next;
+        prev_area->next = area;
+    }
+}
+
+// unlink an area from the list
+void vmalloc_remove_area(vmalloc_area_t *area, vmalloc_area_t *prev_area)
+{
+    if (!prev_area)
+    {
+        vmalloc_areas_head = area->next;
+    }
+    else
+    {
+        prev_area->next = area->next;
+    }
+
+    area->next = NULL;
+}
+
+// return the first address after an area, including its guard pages
+uintptr_t vmalloc_area_end(vmalloc_area_t *area)
+{
+    return area->start + (area->page_count + area->guard_count) * PAGE_SIZE;
+}
+
+// map (zeroed) frames to a range, undo everything if the PMM runs out of memory
+bool vmalloc_populate(uintptr_t start, size_t page_count, mem_tag_t tag, vmalloc_flags_t flags)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, vmm_get_kernel_space());
+
+    // frames are mapped in batches, which walks the upper levels less often
+    uint64_t frames[VMALLOC_MAP_BATCH];
+    size_t frame_count = 0;
+
+    for (size_t i = 0; i < page_count; i++)
+    {
+        void *frame = (flags & VMALLOC_ZERO) ? pmm_allocz(1, tag) : pmm_alloc(1, tag);
+
+        if (!frame)
+        {
+            vmm_map_pages_gather(&gather, start + (i - frame_count) * PAGE_SIZE, frames, frame_count,
+                                 KERNEL_READ_WRITE, vmalloc_get_pat_type(flags));
+            tlb_gather_finish(&gather);
+            vmalloc_depopulate(start, i, tag);
+
+            return false;
+        }
+
+        frames[frame_count++] = (uint64_t)frame;
+
+        if (frame_count == VMALLOC_MAP_BATCH || i == page_count - 1)
+        {
+            vmm_map_pages_gather(&gather, start + (i + 1 - frame_count) * PAGE_SIZE, frames, frame_count,
+                                 KERNEL_READ_WRITE, vmalloc_get_pat_type(flags));
+            frame_count = 0;
+        }
+    }
+
+    tlb_gather_finish(&gather);
+
+    return true;
+}
+
+// unmap a range and give its frames back to the PMM
+void vmalloc_depopulate(uintptr_t start, size_t page_count, mem_tag_t tag)
+{
+    vmm_space_t *space = vmm_get_kernel_space();
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    // only visits what is mapped (vmalloc maps 4 KiB pages only)
+    vmm_walker_t walker;
+    vmm_walk_entry_t entry;
+
+    vmm_walk_init(&walker, space, start, start + page_count * PAGE_SIZE);
+
+    while (vmm_walk_next(&walker, &entry))
+    {
+        // the frame may only be reused once no TLB translates to it anymore
+        tlb_gather_free_frames(&gather, (void *)entry.phys, 1, tag);
+        vmm_unmap_page_gather(&gather, entry.virt);
+    }
+
+    tlb_gather_finish(&gather);
+}
+
+// caching type the frames of an area are mapped with
+pat_cache_t vmalloc_get_pat_type(vmalloc_flags_t flags)
+{
+    return (flags & VMALLOC_UNCACHED) ? PAT_UNCACHEABLE : PAT_WRITE_BACK;
+}
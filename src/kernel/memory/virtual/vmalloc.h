@@ -0,0 +1,55 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory/mem_tag.h>
+
+typedef enum
+{
+    VMALLOC_GUARD    = (1 << 0),
+    VMALLOC_ZERO     = (1 << 1),
+    VMALLOC_UNCACHED = (1 << 2)  // map uncacheable instead of write-back
+} vmalloc_flags_t;
+
+typedef struct vmalloc_area
+{
+    struct vmalloc_area *next;
+
+    uintptr_t start;
+    size_t page_count;	// mapped pages
+    size_t guard_count; // unmapped pages directly after the mapped ones
+
+    vmalloc_flags_t flags;
+    mem_tag_t tag;	// the frames are accounted to it
+} vmalloc_area_t;
+
+void vmalloc_init(void);
+void *vmalloc(size_t size, mem_tag_t tag, vmalloc_flags_t flags);
+void *vmalloc_aligned(size_t size, size_t alignment, mem_tag_t tag, vmalloc_flags_t flags);
+void *vrealloc(void *pointer, size_t size);
+void vfree(void *pointer);
+size_t vmalloc_size(void *pointer);
+bool is_vmalloc_address(void *pointer);
+
+#endif
@@ -20,6 +20,29 @@
 
     Brief file description:
     Virtual memory management through 4 level paging.
+    Ranges are mapped with the biggest pages that fit (1 GiB if the CPU supports
+    it, 2 MiB, 4 KiB at the unaligned edges). Mapping a single page inside of
+    a large page splits it into a table with the same translations first.
+    TLB invalidations are collected in a tlb_gather_t and done once per
+    operation (see tlb.c) instead of after every single entry.
+    Address spaces share the kernel's root page table entries. If PCIDs are
+    supported, every space gets one per CPU, so switching between them keeps
+    the TLB. Generations decide when a PCID has to be flushed nevertheless.
+    Every entry which points to a table counts the used entries of that
+    table in its ignored bits (present ones, and in page tables also the
+    ones of swapped out pages, see zstore.c). A table whose count drops to zero is freed on
+    unmap (except for the PDPTs below the kernel's root entries, which every
+    space shares), so mapping and unmapping doesn't leak page tables.
+    vmm_clone_space() copies the page tables of a space, but shares the frames
+    of its regions copy-on-write (see fault.c) instead of copying them. The
+    transparent huge pages of the space (see thp.c) are split into 4 KiB pages
+    first, as copy-on-write works per page.
+    Everything mapped in the kernel space is global, so kernel translations
+    survive switches in every PCID and without PCIDs.
+    The caching type of the kernel windows follows the memory map: RAM is
+    write-back, the framebuffer write-combining and everything else (LAPIC,
+    IOAPIC, HPET and other MMIO) stays uncacheable. Every alias of a physical
+    page gets the same type, as mixing them is undefined.
 
 */
 
@@ -28,21 +51,55 @@
 #include <boot/stivale2_boot.h>
 #include <hardware/cpu.h>
 #include <libk/serial/log.h>
+#include <libk/lock/spinlock.h>
+#include <libk/malloc/malloc.h>
 #include <libk/string/string.h>
 #include <libk/testing/assert.h>
 #include <memory/mem.h>
+#include <memory/mem_tag.h>
 #include <memory/physical/pmm.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/tlb.h>
 #include <memory/virtual/vmm.h>
+#include <memory/virtual/zero_page.h>
+#include <memory/virtual/zstore.h>
+#include <proc/smp/smp.h>
 
-static uint64_t *root_page_table;
+static vmm_space_t kernel_space;
+static vmm_space_t *space_list = NULL;
+static spinlock_t space_lock;
+
+static bool huge_pages_supported = false;
+static bool pcid_enabled = false;
+static bool global_pages_enabled = false;
 
 /* utility function prototypes */
 
-uint64_t *vmm_get_or_create_pml(uint64_t *pml, size_t pml_index, uint64_t flags);
-void vmm_set_pt_value(uint64_t *page_table, uint64_t virt_page, uint64_t pt_value,
-                      uint64_t flags, pat_cache_t pat_type);
+uint64_t *vmm_get_or_create_pml(vmm_space_t *space, uint64_t *pml, size_t pml_index, uint64_t *pml_entry,
+                                uint64_t flags, size_t entry_size);
+uint64_t *vmm_get_or_create_pt(vmm_space_t *space, uint64_t virt_page, uint64_t flags, uint64_t **pde);
+void vmm_set_pt_value(tlb_gather_t *gather, uint64_t virt_page, uint64_t pt_value,
+                      uint64_t flags, pat_cache_t pat_type, size_t page_size);
+void vmm_set_large_entry(tlb_gather_t *gather, uint64_t *pml, size_t pml_index, uint64_t *pml_entry,
+                         uint64_t virt_page, uint64_t phys_page, uint64_t flags, pat_cache_t pat_type,
+                         size_t entry_size);
+void vmm_split_large_entry(vmm_space_t *space, uint64_t *pml, size_t pml_index, size_t entry_size);
+void vmm_free_table(tlb_gather_t *gather, uint64_t *table, size_t entry_size);
+void vmm_free_empty_tables(tlb_gather_t *gather, uint64_t virt_page, uint64_t *pde, uint64_t *pdpte,
+                           uint64_t *pml4e);
+void vmm_count_entries(uint64_t *entry, int64_t delta);
+uint64_t vmm_get_entry_count(uint64_t entry);
+uint64_t *vmm_copy_table(vmm_space_t *space, uint64_t *table, size_t entry_size);
+void vmm_share_region_cow(tlb_gather_t *gather, vmm_space_t *clone, vmm_region_t *region);
+size_t vmm_get_best_page_size(uint64_t phys_page, uint64_t virt_page, uint64_t length);
+void vmm_sync_kernel_entry(size_t pml4_index);
+bool vmm_space_needs_flush(vmm_space_t *space, cpu_local_t *cpu);
+bool vmm_space_try_lock_held(vmm_space_t *space);
+void vmm_map_memmap_entry(struct stivale2_mmap_entry *entry);
+pat_cache_t vmm_memmap_type_to_pat_cache(uint64_t type);
 uint64_t vmm_pat_cache_to_flags(pat_cache_t type);
-void vmm_flush_tlb(void *address);
+uint64_t vmm_pat_cache_to_large_flags(pat_cache_t type);
 
 /* core functions */
 
@@ -55,69 +112,269 @@ void vmm_init(struct stivale2_struct *stivale2_struct)
 
     enable_pat();
 
-    root_page_table = PHYS_TO_HIGHER_HALF_DATA(pmm_allocz(1));
-    assert(root_page_table != NULL);
+    cpuid_registers_t regs = { .leaf = CPUID_GET_EXTENDED_FEATURES };
+
+    if (cpuid(&regs) && (regs.edx & CPUID_FEAT_EXT_EDX_PDPE1GB))
+    {
+        huge_pages_supported = true;
+    }
+
+    uint64_t start_tsc = asm_rdtsc();
+
+    kernel_space.page_table = PHYS_TO_HIGHER_HALF_DATA(pmm_allocz(1, MEM_TAG_PAGE_TABLE));
+    assert(kernel_space.page_table != NULL);
+    kernel_space.page_table_count = 1;
+
+    // everything starts out uncacheable, the memory map entries below refine that
 
     // identity map 0x0 - 0x100000000
-    vmm_map_range(root_page_table, 0, 4 * GiB, 0, KERNEL_READ_WRITE, PAT_UNCACHEABLE);
+    vmm_map_range(&kernel_space, 0, 4 * GiB, 0, KERNEL_READ_WRITE, PAT_UNCACHEABLE);
 
     // map 0xFFFF800000000000 - 0xFFFF800100000000 to 0x0 - 0x100000000
-    vmm_map_range(root_page_table, 0, 4 * GiB, HIGHER_HALF_DATA, KERNEL_READ_WRITE, PAT_UNCACHEABLE);
+    vmm_map_range(&kernel_space, 0, 4 * GiB, HIGHER_HALF_DATA, KERNEL_READ_WRITE, PAT_UNCACHEABLE);
 
     // map 0xFFFF900000000000 - 0xFFFF900100000000 to 0x0 - 0x100000000
-    vmm_map_range(root_page_table, 0, HEAP_MAX_SIZE, HEAP_START_ADDR, KERNEL_READ_WRITE, PAT_UNCACHEABLE);
+    vmm_map_range(&kernel_space, 0, HEAP_MAX_SIZE, HEAP_START_ADDR, KERNEL_READ_WRITE, PAT_UNCACHEABLE);
 
     // map 0xFFFFFFFF80000000 - 0x0001000000000000 0x0 - 0x80000000
-    vmm_map_range(root_page_table, 0, 2 * GiB, HIGHER_HALF_CODE, KERNEL_READ, PAT_UNCACHEABLE);
+    vmm_map_range(&kernel_space, 0, 2 * GiB, HIGHER_HALF_CODE, KERNEL_READ, PAT_UNCACHEABLE);
 
-    // map at 0xFFFF800000000000 to all entries in memory map
+    // map at 0xFFFF800000000000 to all entries in memory map (also above 4 GiB)
+    // and give them the caching type of their memory type
     for (uint64_t i = 0; i < memory_map->entries; i++)
     {
         current_entry = &memory_map->memmap[i];
 
-        vmm_map_range(root_page_table, 0, current_entry->length, HIGHER_HALF_DATA, KERNEL_READ_WRITE,
-                      PAT_UNCACHEABLE);
+        vmm_map_memmap_entry(current_entry);
     }
 
+    log(INFO, "Kernel address space mapped in %ld TSC cycles with %ld page table pages (largest pages: %s)\n",
+        asm_rdtsc() - start_tsc, kernel_space.page_table_count,
+        huge_pages_supported ? "1 GiB" : "2 MiB");
+
     log(INFO, "Replaced bootloader page table at 0x%.16llx\n", asm_read_cr(3));
-    vmm_load_page_table(root_page_table);
+    vmm_switch_space(&kernel_space);
     log(INFO, "Now using kernel page table at 0x%.16llx\n", asm_read_cr(3));
 
+    // decided once, every CPU only programs its own CR4 (see vmm_init_cpu())
+    pcid_enabled = cpu_supports_pcid();
+    global_pages_enabled = cpu_supports_global_pages();
+
+    vmm_init_cpu();
+    log(INFO, "PCIDs: %s, global pages: %s\n", pcid_enabled ? "enabled" : "not supported",
+        global_pages_enabled ? "enabled" : "not supported");
+
     log(INFO, "VMM initialized\n");
 }
 
 // set a page table entry for a new virtual memory address, which will be mapped to a physical frame
-void vmm_map_page(uint64_t *page_table, uint64_t phys_page, uint64_t virt_page,
+void vmm_map_page(vmm_space_t *space, uint64_t phys_page, uint64_t virt_page,
                   uint64_t flags, pat_cache_t pat_type)
 {
-    uint64_t pt_value = phys_page;
-    vmm_set_pt_value(page_table, ALIGN_DOWN(virt_page, PAGE_SIZE), pt_value, flags, pat_type);
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    vmm_map_page_gather(&gather, phys_page, virt_page, flags, pat_type);
+
+    tlb_gather_finish(&gather);
 }
 
 // set a page table entry to zero, in order to "forget" a virtual memory address
-void vmm_unmap_page(uint64_t *page_table, uint64_t virt_page)
+void vmm_unmap_page(vmm_space_t *space, uint64_t virt_page)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    vmm_unmap_page_gather(&gather, virt_page);
+
+    tlb_gather_finish(&gather);
+}
+
+// same as vmm_map_page(), but the TLB is only flushed by tlb_gather_finish()
+void vmm_map_page_gather(tlb_gather_t *gather, uint64_t phys_page, uint64_t virt_page,
+                         uint64_t flags, pat_cache_t pat_type)
+{
+    uint64_t pt_value = phys_page;
+    vmm_set_pt_value(gather, ALIGN_DOWN(virt_page, PAGE_SIZE), pt_value, flags, pat_type, PAGE_SIZE);
+}
+
+// same as vmm_unmap_page(), but the TLB is only flushed by tlb_gather_finish()
+void vmm_unmap_page_gather(tlb_gather_t *gather, uint64_t virt_page)
 {
     uint64_t pt_value = 0;
-    vmm_set_pt_value(page_table, ALIGN_DOWN(virt_page, PAGE_SIZE), pt_value, 0, 0);
+    vmm_set_pt_value(gather, ALIGN_DOWN(virt_page, PAGE_SIZE), pt_value, 0, 0, PAGE_SIZE);
 }
 
-// map a whole physical memory region with custom offset
-void vmm_map_range(uint64_t *page_table, uint64_t start, uint64_t end, uint64_t offset,
+// map an array of frames (physical addresses, not necessarily contiguous) to
+// consecutive virtual pages starting at virt_start
+void vmm_map_pages(vmm_space_t *space, uint64_t virt_start, const uint64_t *frames, size_t count,
                    uint64_t flags, pat_cache_t pat_type)
 {
-    for (uint64_t i = ALIGN_DOWN(start, PAGE_SIZE); i < ALIGN_UP(end, PAGE_SIZE); i += PAGE_SIZE)
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    vmm_map_pages_gather(&gather, virt_start, frames, count, flags, pat_type);
+
+    tlb_gather_finish(&gather);
+}
+
+// same as vmm_map_pages(), but the TLB is only flushed by tlb_gather_finish() -
+// the upper levels are walked once per page table, whose entries are then
+// filled one after another
+void vmm_map_pages_gather(tlb_gather_t *gather, uint64_t virt_start, const uint64_t *frames, size_t count,
+                          uint64_t flags, pat_cache_t pat_type)
+{
+    assert(flags & PTE_PRESENT);
+
+    vmm_space_t *space = gather->space;
+    uint64_t global = (space == &kernel_space) ? PTE_GLOBAL : 0;
+    uint64_t entry_flags = flags | global | vmm_pat_cache_to_flags(pat_type);
+    uint64_t virt_page = ALIGN_DOWN(virt_start, PAGE_SIZE);
+
+    for (size_t i = 0; i < count;)
     {
-        vmm_map_page(page_table, i, i + offset, flags, pat_type);
+        uint64_t *pde;
+        uint64_t *pt = vmm_get_or_create_pt(space, virt_page, flags, &pde);
+
+        size_t pt_index = (virt_page >> 12) & 0x1ff;
+        size_t batch_count = 512 - pt_index;
+
+        if (batch_count > count - i)
+        {
+            batch_count = count - i;
+        }
+
+        int64_t new_count = 0;
+
+        for (size_t j = 0; j < batch_count; j++)
+        {
+            uint64_t old_entry = pt[pt_index + j];
+
+            pt[pt_index + j] = frames[i + j] | entry_flags;
+            new_count += old_entry ? 0 : 1;
+
+            tlb_gather_add_page(gather, virt_page + j * PAGE_SIZE, old_entry);
+        }
+
+        vmm_count_entries(pde, new_count);
+
+        i += batch_count;
+        virt_page += batch_count * PAGE_SIZE;
     }
 }
 
-// unmap a whole physical memory region
-void vmm_unmap_range(uint64_t *page_table, uint64_t start, uint64_t end)
+// map a 2 MiB page, the TLB is only flushed by tlb_gather_finish() - both
+// addresses have to be aligned
+void vmm_map_large_page_gather(tlb_gather_t *gather, uint64_t phys_page, uint64_t virt_page,
+                               uint64_t flags, pat_cache_t pat_type)
 {
-    for (uint64_t i = ALIGN_DOWN(start, PAGE_SIZE); i < ALIGN_UP(end, PAGE_SIZE); i += PAGE_SIZE)
+    vmm_set_pt_value(gather, virt_page, phys_page, flags, pat_type, LARGE_PAGE_SIZE);
+}
+
+// remove the 2 MiB page (or all 4 KiB pages and their table) at an aligned
+// address, the TLB is only flushed by tlb_gather_finish()
+void vmm_unmap_large_page_gather(tlb_gather_t *gather, uint64_t virt_page)
+{
+    vmm_set_pt_value(gather, virt_page, 0, 0, 0, LARGE_PAGE_SIZE);
+}
+
+// replace the 2 MiB page at an aligned address by a page table with the same
+// translations - nothing has to be flushed, as they don't change
+void vmm_split_large_page(vmm_space_t *space, uint64_t virt_page)
+{
+    uint64_t *pde;
+
+    // no level is missing above a large page, so nothing is created
+    vmm_get_or_create_pt(space, virt_page, PTE_PRESENT, &pde);
+}
+
+// map a whole physical memory region with custom offset - every step uses the
+// biggest page that alignment and remaining length allow
+void vmm_map_range(vmm_space_t *space, uint64_t start, uint64_t end, uint64_t offset,
+                   uint64_t flags, pat_cache_t pat_type)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    end = ALIGN_UP(end, PAGE_SIZE);
+
+    for (uint64_t i = ALIGN_DOWN(start, PAGE_SIZE); i < end;)
     {
-        vmm_unmap_page(page_table, i);
+        size_t page_size = vmm_get_best_page_size(i, i + offset, end - i);
+
+        vmm_set_pt_value(&gather, i + offset, i, flags, pat_type, page_size);
+
+        i += page_size;
     }
+
+    tlb_gather_finish(&gather);
+}
+
+// unmap a whole virtual memory region - aligned 2 MiB and 1 GiB blocks go at
+// once, together with all tables below them
+void vmm_unmap_range(vmm_space_t *space, uint64_t start, uint64_t end)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    end = ALIGN_UP(end, PAGE_SIZE);
+
+    for (uint64_t i = ALIGN_DOWN(start, PAGE_SIZE); i < end;)
+    {
+        size_t block_size = vmm_get_best_page_size(i, i, end - i);
+
+        vmm_set_pt_value(&gather, i, 0, 0, 0, block_size);
+
+        i += block_size;
+    }
+
+    tlb_gather_finish(&gather);
+}
+
+// return a pointer to the page table entry of a virtual address without creating
+// any page map levels - NULL if one of them doesn't exist (if the address is
+// mapped by a large page, that's the page directory (pointer table) entry)
+uint64_t *vmm_get_pte(vmm_space_t *space, uint64_t virt_page)
+{
+    uint64_t *page_table = space->page_table;
+
+    size_t pml4_index	= (virt_page & ((uintptr_t)0x1ff << 39)) >> 39;
+    size_t pdpt_index	= (virt_page & ((uintptr_t)0x1ff << 30)) >> 30;
+    size_t pd_index	= (virt_page & ((uintptr_t)0x1ff << 21)) >> 21;
+    size_t pt_index	= (virt_page & ((uintptr_t)0x1ff << 12)) >> 12;
+
+    if (!(page_table[pml4_index] & PTE_PRESENT))
+    {
+        return NULL;
+    }
+
+    uint64_t *pdpt = vmm_entry_to_table(page_table[pml4_index]);
+
+    if (!(pdpt[pdpt_index] & PTE_PRESENT))
+    {
+        return NULL;
+    }
+
+    if (pdpt[pdpt_index] & PTE_LARGE)
+    {
+        return &pdpt[pdpt_index];
+    }
+
+    uint64_t *pd = vmm_entry_to_table(pdpt[pdpt_index]);
+
+    if (!(pd[pd_index] & PTE_PRESENT))
+    {
+        return NULL;
+    }
+
+    if (pd[pd_index] & PTE_LARGE)
+    {
+        return &pd[pd_index];
+    }
+
+    uint64_t *pt = vmm_entry_to_table(pd[pd_index]);
+
+    return &pt[pt_index];
 }
 
 // load a page table into cr3 to be used
@@ -126,29 +383,357 @@ void vmm_load_page_table(uint64_t *page_table)
     asm_write_cr(3, HIGHER_HALF_DATA_TO_PHYS((uint64_t)page_table));
 }
 
-// return the root, aka kernel, page table
-uint64_t *vmm_get_root_page_table(void)
+// enable the paging features the BSP chose on the calling CPU - an AP needs
+// this before its first vmm_switch_space(), with the kernel page table loaded
+// as PCID 0
+void vmm_init_cpu(void)
+{
+    if (pcid_enabled)
+    {
+        enable_pcid();
+    }
+
+    if (global_pages_enabled)
+    {
+        enable_global_pages();
+    }
+}
+
+// create an address space which shares the kernel's mappings
+vmm_space_t *vmm_space_create(void)
+{
+    vmm_space_t *space = malloc_flags(sizeof(vmm_space_t), MALLOC_ZERO | MALLOC_TAG(MEM_TAG_KERNEL));
+
+    if (!space)
+    {
+        return NULL;
+    }
+
+    void *page_table = pmm_allocz(1, MEM_TAG_PAGE_TABLE);
+
+    if (!page_table)
+    {
+        free(space);
+
+        return NULL;
+    }
+
+    space->page_table = PHYS_TO_HIGHER_HALF_DATA(page_table);
+    space->page_table_count = 1;
+
+    spinlock_acquire(&space_lock);
+
+    memcpy(space->page_table, kernel_space.page_table, PAGE_SIZE);
+
+    space->next = space_list;
+    space_list = space;
+
+    spinlock_release(&space_lock);
+
+    return space;
+}
+
+// free an address space which isn't loaded anywhere anymore, including its page
+// tables and regions (but not the other frames it maps)
+void vmm_space_destroy(vmm_space_t *space)
 {
-    return root_page_table;
+    assert(space != &kernel_space && __atomic_load_n(&space->cpu_mask, __ATOMIC_SEQ_CST) == 0);
+
+    spinlock_acquire(&space_lock);
+
+    vmm_space_t **link = &space_list;
+
+    while (*link != space)
+    {
+        link = &(*link)->next;
+    }
+
+    *link = space->next;
+
+    spinlock_release(&space_lock);
+
+    vmm_region_unmap_all(space);
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        uint64_t entry = space->page_table[i];
+
+        // shared with the kernel
+        if (!(entry & PTE_PRESENT) || entry == kernel_space.page_table[i])
+        {
+            continue;
+        }
+
+        vmm_free_table(&gather, vmm_entry_to_table(entry), HUGE_PAGE_SIZE);
+    }
+
+    tlb_gather_free_frames(&gather, (void *)HIGHER_HALF_DATA_TO_PHYS((uint64_t)space->page_table), 1,
+                           MEM_TAG_PAGE_TABLE);
+    tlb_gather_finish(&gather);
+
+    free(space);
+}
+
+// create a copy of a space - the frames of its regions are shared read-only and
+// copied by the page fault handler on the first write (copy-on-write), everything
+// else it maps (e.g. MMIO) is shared as it is
+vmm_space_t *vmm_clone_space(vmm_space_t *space)
+{
+    assert(space != &kernel_space);
+
+    vmm_space_t *clone = vmm_space_create();
+
+    if (!clone)
+    {
+        return NULL;
+    }
+
+    // no fault may change the space in the meantime
+    spinlock_acquire(&space->region_lock);
+
+    for (vmm_region_t *region = vmm_region_first(space); region; region = vmm_region_next(region))
+    {
+        thp_split_region(space, region);
+    }
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        uint64_t entry = space->page_table[i];
+
+        // shared with the kernel
+        if (!(entry & PTE_PRESENT) || entry == kernel_space.page_table[i])
+        {
+            continue;
+        }
+
+        uint64_t *table = vmm_copy_table(clone, vmm_entry_to_table(entry), HUGE_PAGE_SIZE);
+
+        // no frame has another reference yet, freeing the copied tables is enough
+        if (!table)
+        {
+            spinlock_release(&space->region_lock);
+            vmm_space_destroy(clone);
+
+            return NULL;
+        }
+
+        clone->page_table[i] = HIGHER_HALF_DATA_TO_PHYS((uint64_t)table) | (entry & PTE_FLAGS_MASK);
+    }
+
+    vmm_region_clone_all(clone, space);
+
+    // the writable translations of the space become read-only
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    for (vmm_region_t *region = vmm_region_first(space); region; region = vmm_region_next(region))
+    {
+        vmm_share_region_cow(&gather, clone, region);
+    }
+
+    tlb_gather_finish(&gather);
+
+    spinlock_release(&space->region_lock);
+
+    return clone;
+}
+
+// take the region lock of the index-th space (the kernel space not counted) if
+// it's free - it keeps the space from being destroyed until it's released;
+// exists is false if there are no more spaces
+vmm_space_t *vmm_space_try_lock_nth(size_t index, bool *exists)
+{
+    spinlock_acquire(&space_lock);
+
+    vmm_space_t *space = space_list;
+
+    for (size_t i = 0; space && i < index; i++)
+    {
+        space = space->next;
+    }
+
+    *exists = space != NULL;
+
+    // the lock order elsewhere is region lock, then space lock (cloning)
+    if (space && !vmm_space_try_lock_held(space))
+    {
+        space = NULL;
+    }
+
+    spinlock_release(&space_lock);
+
+    return space;
+}
+
+// same as vmm_space_try_lock_nth() for a space which might have been destroyed
+// already - false if it's gone or its region lock is taken
+bool vmm_space_try_lock(vmm_space_t *space)
+{
+    spinlock_acquire(&space_lock);
+
+    vmm_space_t *current = space_list;
+
+    while (current && current != space)
+    {
+        current = current->next;
+    }
+
+    bool locked = current && vmm_space_try_lock_held(space);
+
+    spinlock_release(&space_lock);
+
+    return locked;
+}
+
+// load an address space on this CPU and note that, so that TLB shootdowns reach it -
+// with PCIDs the TLB entries of the space are kept, unless the PCID was assigned
+// anew (per CPU, recycled with a new generation once all are used up) or the
+// space (or the kernel half) changed since it was loaded on this CPU last
+void vmm_switch_space(vmm_space_t *space)
+{
+    cpu_local_t *cpu = this_cpu();
+    uint64_t cpu_bit = 1UL << cpu->cpu_number;
+
+    if (cpu->space == space)
+    {
+        return;
+    }
+
+    // the kernel half is in every space, so every CPU stays in the kernel's mask
+    if (cpu->space && cpu->space != &kernel_space)
+    {
+        __atomic_fetch_and(&cpu->space->cpu_mask, ~cpu_bit, __ATOMIC_SEQ_CST);
+    }
+
+    // set before the generations are checked, a flush either sees this CPU or
+    // increments a generation this CPU sees
+    __atomic_fetch_or(&space->cpu_mask, cpu_bit, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&kernel_space.cpu_mask, cpu_bit, __ATOMIC_SEQ_CST);
+    cpu->space = space;
+
+    uint64_t cr3 = HIGHER_HALF_DATA_TO_PHYS((uint64_t)space->page_table);
+
+    if (pcid_enabled)
+    {
+        cr3 |= space->cpus[cpu->cpu_number].pcid;
+
+        if (!vmm_space_needs_flush(space, cpu))
+        {
+            cr3 |= CR3_NO_FLUSH;
+        }
+
+        asm_write_cr(3, cr3);
+    }
+    else if ((asm_read_cr(3) & PTE_ADDRESS_MASK) != cr3)
+    {
+        vmm_load_page_table(space->page_table);
+    }
+}
+
+// return the kernel address space, whose mappings are part of every space
+vmm_space_t *vmm_get_kernel_space(void)
+{
+    return &kernel_space;
+}
+
+// return how many pages the page tables of a space take (the root included)
+size_t vmm_get_page_table_count(vmm_space_t *space)
+{
+    return __atomic_load_n(&space->page_table_count, __ATOMIC_RELAXED);
+}
+
+// return how many 2 MiB frames back the regions of a space (transparent huge pages)
+size_t vmm_get_huge_page_count(vmm_space_t *space)
+{
+    return __atomic_load_n(&space->huge_page_count, __ATOMIC_RELAXED);
+}
+
+// print the page table memory of every space and how much of it is huge-backed
+void vmm_dump_page_tables(void)
+{
+    log(INFO, "Page tables of the kernel space: %ld KiB\n", vmm_get_page_table_count(&kernel_space) * 4);
+
+    spinlock_acquire(&space_lock);
+
+    for (vmm_space_t *space = space_list; space; space = space->next)
+    {
+        log(INFO, "Page tables of space 0x%.16llx: %ld KiB, huge-backed: %ld MiB\n", (uint64_t)space,
+            vmm_get_page_table_count(space) * 4, vmm_get_huge_page_count(space) * 2);
+    }
+
+    spinlock_release(&space_lock);
+}
+
+// whether the (global) kernel translations survive CR3 loads
+bool vmm_global_pages_enabled(void)
+{
+    return global_pages_enabled;
 }
 
 /* utility functions */
 
-// make use (and if needed alloacte for that) a custom page map level
-uint64_t *vmm_get_or_create_pml(uint64_t *pml, size_t pml_index, uint64_t flags)
+// make use (and if needed alloacte for that) a custom page map level - entry_size
+// is how much memory an entry of pml maps, to be able to split large pages, and
+// pml_entry the entry which points to pml (NULL if it isn't counted)
+uint64_t *vmm_get_or_create_pml(vmm_space_t *space, uint64_t *pml, size_t pml_index, uint64_t *pml_entry,
+                                uint64_t flags, size_t entry_size)
 {
     // check present flag
-    if (!(pml[pml_index] & 1))
+    if (!(pml[pml_index] & PTE_PRESENT))
+    {
+        // the leaf entries decide about writes, a read-only page (like the
+        // zero page) may share its table with writable ones
+        pml[pml_index] = (uint64_t)pmm_allocz(1, MEM_TAG_PAGE_TABLE) | flags | PTE_READ_WRITE;
+        __atomic_fetch_add(&space->page_table_count, 1, __ATOMIC_RELAXED);
+
+        vmm_count_entries(pml_entry, 1);
+    }
+    else if (pml[pml_index] & PTE_LARGE)
+    {
+        vmm_split_large_entry(space, pml, pml_index, entry_size);
+    }
+
+    return vmm_entry_to_table(pml[pml_index]);
+}
+
+// walk down to the page table of virt_page, creating the missing levels (and
+// splitting large pages) on the way - pde is set to the entry pointing to it
+uint64_t *vmm_get_or_create_pt(vmm_space_t *space, uint64_t virt_page, uint64_t flags, uint64_t **pde)
+{
+    size_t pml4_index	= (virt_page & ((uintptr_t)0x1ff << 39)) >> 39;
+    size_t pdpt_index	= (virt_page & ((uintptr_t)0x1ff << 30)) >> 30;
+    size_t pd_index	= (virt_page & ((uintptr_t)0x1ff << 21)) >> 21;
+
+    uint64_t *pml4 = space->page_table;
+    uint64_t pml4_entry = pml4[pml4_index];
+
+    uint64_t *pdpt = vmm_get_or_create_pml(space, pml4, pml4_index, NULL, flags, 512 * HUGE_PAGE_SIZE);
+
+    // see vmm_set_pt_value()
+    if (space == &kernel_space && pml4[pml4_index] != pml4_entry)
     {
-        pml[pml_index] = (uint64_t)pmm_allocz(1) | flags;
+        vmm_sync_kernel_entry(pml4_index);
     }
 
-    return (uint64_t *)(pml[pml_index] & ~(511));
+    bool private_root = space != &kernel_space && pml4[pml4_index] != kernel_space.page_table[pml4_index];
+
+    uint64_t *pd = vmm_get_or_create_pml(space, pdpt, pdpt_index, private_root ? &pml4[pml4_index] : NULL,
+                                         flags, HUGE_PAGE_SIZE);
+    uint64_t *pt = vmm_get_or_create_pml(space, pd, pd_index, &pdpt[pdpt_index], flags, LARGE_PAGE_SIZE);
+
+    *pde = &pd[pd_index];
+
+    return pt;
 }
 
-// set a value in a page table entry and flush translation lookaside buffer
-void vmm_set_pt_value(uint64_t *page_table, uint64_t virt_page, uint64_t pt_value,
-                      uint64_t flags, pat_cache_t pat_type)
+// set a value in a page table entry and record the needed TLB flush - page_size decides
+// in which level the entry lives (PAGE_SIZE, LARGE_PAGE_SIZE or HUGE_PAGE_SIZE); without
+// PTE_PRESENT in flags the entry is cleared and tables which become empty are freed
+void vmm_set_pt_value(tlb_gather_t *gather, uint64_t virt_page, uint64_t pt_value,
+                      uint64_t flags, pat_cache_t pat_type, size_t page_size)
 {
     // index for page mapping level 4
     size_t pml4_index	= (virt_page & ((uintptr_t)0x1ff << 39)) >> 39;
@@ -159,20 +744,479 @@ void vmm_set_pt_value(uint64_t *page_table, uint64_t virt_page, uint64_t pt_valu
     // index for page table
     size_t pt_index	= (virt_page & ((uintptr_t)0x1ff << 12)) >> 12;
 
+    vmm_space_t *space = gather->space;
+    bool map = flags & PTE_PRESENT;
+
+    // kernel mappings are shared by all spaces - the flag is ignored without CR4.PGE
+    uint64_t global = (space == &kernel_space && map) ? PTE_GLOBAL : 0;
+
     // page mapping level 4 = pml4
-    uint64_t *pml4  = page_table;
+    uint64_t *pml4  = space->page_table;
+    uint64_t pml4_entry = pml4[pml4_index];
+
+    // nothing to unmap below a missing entry
+    if (!map && !(pml4_entry & PTE_PRESENT))
+    {
+        return;
+    }
+
     // page directory table = pml3
-    uint64_t *pdpt  = vmm_get_or_create_pml(pml4, pml4_index, flags);
+    uint64_t *pdpt  = vmm_get_or_create_pml(space, pml4, pml4_index, NULL, flags, 512 * HUGE_PAGE_SIZE);
+
+    // other spaces only copied the kernel's root entries that existed back then
+    if (space == &kernel_space && pml4[pml4_index] != pml4_entry)
+    {
+        vmm_sync_kernel_entry(pml4_index);
+    }
+
+    // every space has the root entries of the kernel, so they never change and
+    // the PDPTs below them stay - the kernel space frees the tables below those,
+    // the other spaces only free tables below their own root entries
+    bool private_root = space != &kernel_space && pml4[pml4_index] != kernel_space.page_table[pml4_index];
+    bool free_tables = !map && (private_root || space == &kernel_space);
+    uint64_t *pml4e = private_root ? &pml4[pml4_index] : NULL;
+
+    if (page_size == HUGE_PAGE_SIZE)
+    {
+        vmm_set_large_entry(gather, pdpt, pdpt_index, pml4e, virt_page, pt_value, flags | global, pat_type,
+                            HUGE_PAGE_SIZE);
+
+        if (free_tables)
+        {
+            vmm_free_empty_tables(gather, virt_page, NULL, NULL, pml4e);
+        }
+
+        return;
+    }
+
+    uint64_t *pdpte = &pdpt[pdpt_index];
+
+    if (!map && !(*pdpte & PTE_PRESENT))
+    {
+        return;
+    }
+
     // page directory	    = pml2
-    uint64_t *pd    = vmm_get_or_create_pml(pdpt, pdpt_index, flags);
+    uint64_t *pd    = vmm_get_or_create_pml(space, pdpt, pdpt_index, pml4e, flags, HUGE_PAGE_SIZE);
+
+    if (page_size == LARGE_PAGE_SIZE)
+    {
+        vmm_set_large_entry(gather, pd, pd_index, pdpte, virt_page, pt_value, flags | global, pat_type,
+                            LARGE_PAGE_SIZE);
+
+        if (free_tables)
+        {
+            vmm_free_empty_tables(gather, virt_page, NULL, pdpte, pml4e);
+        }
+
+        return;
+    }
+
+    uint64_t *pde = &pd[pd_index];
+
+    if (!map && !(*pde & PTE_PRESENT))
+    {
+        return;
+    }
+
     // page table	    = pml1
-    uint64_t *pt    = vmm_get_or_create_pml(pd, pd_index, flags);
+    uint64_t *pt    = vmm_get_or_create_pml(space, pd, pd_index, pdpte, flags, LARGE_PAGE_SIZE);
+
+    uint64_t old_entry = pt[pt_index];
 
     // actual mapped value (either physical frame address or 0)
-    pt[pt_index]    = pt_value | flags | vmm_pat_cache_to_flags(pat_type);
+    pt[pt_index]    = map ? pt_value | flags | global | vmm_pat_cache_to_flags(pat_type) : 0;
+
+    // an entry which isn't empty counts, swapped out pages too - so this is -1, 0 or 1
+    vmm_count_entries(pde, (int64_t)(pt[pt_index] != 0) - (int64_t)(old_entry != 0));
 
     // for changes to apply, the translation lookaside buffers need to be flushed
-    vmm_flush_tlb((void *)virt_page);
+    tlb_gather_add_page(gather, virt_page, old_entry);
+
+    if (free_tables)
+    {
+        vmm_free_empty_tables(gather, virt_page, pde, pdpte, pml4e);
+    }
+}
+
+// map a 2 MiB or 1 GiB page directly through a page directory (pointer table) entry
+// (or clear it without PTE_PRESENT in flags) - a table that was there before is
+// freed (the whole range is replaced anyway), pml_entry points to pml
+void vmm_set_large_entry(tlb_gather_t *gather, uint64_t *pml, size_t pml_index, uint64_t *pml_entry,
+                         uint64_t virt_page, uint64_t phys_page, uint64_t flags, pat_cache_t pat_type,
+                         size_t entry_size)
+{
+    uint64_t old_entry = pml[pml_index];
+
+    if (flags & PTE_PRESENT)
+    {
+        pml[pml_index] = phys_page | flags | PTE_LARGE | vmm_pat_cache_to_large_flags(pat_type);
+    }
+    else
+    {
+        pml[pml_index] = 0;
+    }
+
+    vmm_count_entries(pml_entry, (int64_t)(pml[pml_index] & PTE_PRESENT) - (int64_t)(old_entry & PTE_PRESENT));
+
+    if ((old_entry & PTE_PRESENT) && !(old_entry & PTE_LARGE))
+    {
+        // any page of the range might be cached
+        tlb_gather_add_range(gather, virt_page, entry_size);
+        vmm_free_table(gather, vmm_entry_to_table(old_entry), entry_size / 512);
+    }
+    else
+    {
+        tlb_gather_add_page(gather, virt_page, old_entry);
+    }
+}
+
+// replace a large page by a table of 512 entries of the next smaller size,
+// which translate to the same memory with the same flags and caching type
+void vmm_split_large_entry(vmm_space_t *space, uint64_t *pml, size_t pml_index, size_t entry_size)
+{
+    uint64_t entry = pml[pml_index];
+    uint64_t phys_page = entry & PTE_ADDRESS_MASK & ~(uint64_t)PTE_LARGE_PAT;
+    uint64_t large_flags = entry & PTE_FLAGS_MASK;
+    bool pat = entry & PTE_LARGE_PAT;
+
+    size_t child_size = entry_size / 512;
+    uint64_t child_flags;
+
+    if (child_size == PAGE_SIZE)
+    {
+        // page table entries have the PAT bit where the large bit was
+        child_flags = (large_flags & ~(uint64_t)PTE_LARGE) | (pat ? PTE_PAT : 0);
+    }
+    else
+    {
+        child_flags = large_flags | (pat ? PTE_LARGE_PAT : 0);
+    }
+
+    void *table_frame = pmm_alloc(1, MEM_TAG_PAGE_TABLE);
+    assert(table_frame != NULL);
+
+    uint64_t *table = PHYS_TO_HIGHER_HALF_DATA(table_frame);
+
+    __atomic_fetch_add(&space->page_table_count, 1, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        table[i] = (phys_page + i * child_size) | child_flags;
+    }
+
+    // the TLB might still hold the large translation, which is fine as the
+    // table translates the same - the entry that changes next is flushed
+    // anyway and invlpg also drops a large translation containing the address
+    pml[pml_index] = (uint64_t)table_frame | PTE_READ_WRITE | (large_flags & (PTE_PRESENT | PTE_USER_SUPERVISOR));
+    vmm_count_entries(&pml[pml_index], 512);
+}
+
+// give a page table and all tables below it back to the PMM after the flush -
+// entry_size is what one entry of table maps
+void vmm_free_table(tlb_gather_t *gather, uint64_t *table, size_t entry_size)
+{
+    if (entry_size > PAGE_SIZE)
+    {
+        for (size_t i = 0; i < 512; i++)
+        {
+            if ((table[i] & PTE_PRESENT) && !(table[i] & PTE_LARGE))
+            {
+                vmm_free_table(gather, vmm_entry_to_table(table[i]), entry_size / 512);
+            }
+        }
+    }
+
+    tlb_gather_free_frames(gather, (void *)HIGHER_HALF_DATA_TO_PHYS((uint64_t)table), 1, MEM_TAG_PAGE_TABLE);
+    __atomic_fetch_sub(&gather->space->page_table_count, 1, __ATOMIC_RELAXED);
+}
+
+// free the tables on the path to virt_page which have no present entry anymore,
+// from the bottom up - the arguments are the entries which point to the page
+// table, page directory and PDPT (NULL for the levels that aren't involved or
+// whose table has to stay)
+void vmm_free_empty_tables(tlb_gather_t *gather, uint64_t virt_page, uint64_t *pde, uint64_t *pdpte,
+                           uint64_t *pml4e)
+{
+    uint64_t *entries[3] = { pde, pdpte, pml4e };
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        if (!entries[i])
+        {
+            continue;
+        }
+
+        if (vmm_get_entry_count(*entries[i]) > 0)
+        {
+            return;
+        }
+
+        void *table_frame = (void *)(*entries[i] & PTE_ADDRESS_MASK);
+
+        *entries[i] = 0;
+
+        // paging-structure caches might still point to the table - invlpg of
+        // any address drops them
+        tlb_gather_add_range(gather, virt_page, PAGE_SIZE);
+        tlb_gather_free_frames(gather, table_frame, 1, MEM_TAG_PAGE_TABLE);
+        __atomic_fetch_sub(&gather->space->page_table_count, 1, __ATOMIC_RELAXED);
+
+        if (i < 2)
+        {
+            vmm_count_entries(entries[i + 1], -1);
+        }
+    }
+}
+
+// change the number of used entries of the table an entry points to, which
+// is kept in ignored bits of the entry - nothing if entry is NULL
+void vmm_count_entries(uint64_t *entry, int64_t delta)
+{
+    if (!entry || !delta)
+    {
+        return;
+    }
+
+    uint64_t count = vmm_get_entry_count(*entry) + delta;
+    assert(count <= 512);
+
+    *entry = (*entry & ~PTE_TABLE_COUNT_MASK) | (count << PTE_TABLE_COUNT_SHIFT);
+}
+
+// return the number of used entries of the table an entry points to
+uint64_t vmm_get_entry_count(uint64_t entry)
+{
+    return (entry & PTE_TABLE_COUNT_MASK) >> PTE_TABLE_COUNT_SHIFT;
+}
+
+// allocate a copy of a page table and of all tables below it for space - the
+// entries still point to the same frames; NULL (and nothing copied) if the PMM
+// runs out of memory
+uint64_t *vmm_copy_table(vmm_space_t *space, uint64_t *table, size_t entry_size)
+{
+    void *copy_frame = pmm_alloc(1, MEM_TAG_PAGE_TABLE);
+
+    if (!copy_frame)
+    {
+        return NULL;
+    }
+
+    uint64_t *copy = PHYS_TO_HIGHER_HALF_DATA(copy_frame);
+
+    __atomic_fetch_add(&space->page_table_count, 1, __ATOMIC_RELAXED);
+
+    memcpy(copy, table, PAGE_SIZE);
+
+    if (entry_size > PAGE_SIZE)
+    {
+        for (size_t i = 0; i < 512; i++)
+        {
+            if ((table[i] & PTE_PRESENT) && !(table[i] & PTE_LARGE))
+            {
+                uint64_t *child = vmm_copy_table(space, vmm_entry_to_table(table[i]), entry_size / 512);
+
+                if (!child)
+                {
+                    // the entries from here on still point to the tables of the original
+                    memset(&copy[i], 0, (512 - i) * sizeof(uint64_t));
+
+                    tlb_gather_t gather;
+                    tlb_gather_init(&gather, space);
+                    vmm_free_table(&gather, copy, entry_size);
+                    tlb_gather_finish(&gather);
+
+                    return NULL;
+                }
+
+                copy[i] = HIGHER_HALF_DATA_TO_PHYS((uint64_t)child) | (table[i] & PTE_FLAGS_MASK);
+            }
+        }
+    }
+
+    return copy;
+}
+
+// share the frames of a region between a space and its (table by table) copy:
+// each gets another reference and writable entries become read-only in both -
+// swapped out pages are shared by reference as well
+void vmm_share_region_cow(tlb_gather_t *gather, vmm_space_t *clone, vmm_region_t *region)
+{
+    for (uint64_t address = region->start; address < region->end;)
+    {
+        uint64_t table_end = ALIGN_DOWN(address, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+        uint64_t *pte = vmm_get_pte(gather->space, address);
+
+        // a large page of a region is a zero page now (huge pages were
+        // split), the copied table has it
+        if (!pte || (*pte & PTE_LARGE))
+        {
+            address = table_end;
+
+            continue;
+        }
+
+        // the entries up to the end of the page table are next to each other
+        uint64_t *clone_pte = vmm_get_pte(clone, address);
+
+        for (; address < table_end && address < region->end; address += PAGE_SIZE, pte++, clone_pte++)
+        {
+            uint64_t entry = *pte;
+
+            if (zstore_is_entry(entry))
+            {
+                zstore_ref_entry(entry);
+
+                continue;
+            }
+
+            // zero pages are read-only already and have no owner
+            if (!(entry & PTE_PRESENT) || zero_page_contains(entry & PTE_ADDRESS_MASK))
+            {
+                continue;
+            }
+
+            pmm_ref((void *)(entry & PTE_ADDRESS_MASK));
+
+            if (entry & PTE_READ_WRITE)
+            {
+                *pte = (entry & ~(uint64_t)PTE_READ_WRITE) | PTE_COW;
+                *clone_pte = *pte;
+
+                tlb_gather_add_page(gather, address, entry);
+            }
+        }
+    }
+}
+
+// biggest page size which both addresses are aligned to and which fits into length
+size_t vmm_get_best_page_size(uint64_t phys_page, uint64_t virt_page, uint64_t length)
+{
+    uint64_t alignment = phys_page | virt_page;
+
+    if (huge_pages_supported && length >= HUGE_PAGE_SIZE && !(alignment & (HUGE_PAGE_SIZE - 1)))
+    {
+        return HUGE_PAGE_SIZE;
+    }
+
+    if (length >= LARGE_PAGE_SIZE && !(alignment & (LARGE_PAGE_SIZE - 1)))
+    {
+        return LARGE_PAGE_SIZE;
+    }
+
+    return PAGE_SIZE;
+}
+
+// copy a (new) root entry of the kernel space into all other spaces
+void vmm_sync_kernel_entry(size_t pml4_index)
+{
+    spinlock_acquire(&space_lock);
+
+    for (vmm_space_t *space = space_list; space; space = space->next)
+    {
+        space->page_table[pml4_index] = kernel_space.page_table[pml4_index];
+    }
+
+    spinlock_release(&space_lock);
+}
+
+// decide whether the PCID of a space has to be flushed when loading it, and
+// assign one first if it has none in the current generation of this CPU
+bool vmm_space_needs_flush(vmm_space_t *space, cpu_local_t *cpu)
+{
+    vmm_space_cpu_t *space_cpu = &space->cpus[cpu->cpu_number];
+    bool flush = false;
+
+    // the kernel space always has PCID 0
+    if (space != &kernel_space && (space_cpu->pcid_generation != cpu->pcid_generation || !space_cpu->pcid))
+    {
+        if (!cpu->next_pcid || cpu->next_pcid == PCID_COUNT)
+        {
+            cpu->pcid_generation++;
+            cpu->next_pcid = 1;
+        }
+
+        space_cpu->pcid = cpu->next_pcid++;
+        space_cpu->pcid_generation = cpu->pcid_generation;
+
+        // the PCID might hold entries of whatever space had it before
+        flush = true;
+    }
+
+    uint64_t tlb_generation = __atomic_load_n(&space->tlb_generation, __ATOMIC_SEQ_CST);
+    uint64_t kernel_tlb_generation = __atomic_load_n(&kernel_space.tlb_generation, __ATOMIC_SEQ_CST);
+
+    if (space_cpu->tlb_generation != tlb_generation || space_cpu->kernel_tlb_generation != kernel_tlb_generation)
+    {
+        flush = true;
+    }
+
+    space_cpu->tlb_generation = tlb_generation;
+    space_cpu->kernel_tlb_generation = kernel_tlb_generation;
+
+    return flush;
+}
+
+// try to take the region lock of a space while the space lock is held - the
+// region lock is released last, so it gets the interrupt state to restore
+bool vmm_space_try_lock_held(vmm_space_t *space)
+{
+    if (!spinlock_try_acquire(&space->region_lock))
+    {
+        return false;
+    }
+
+    space->region_lock.interrupts = space_lock.interrupts;
+    space_lock.interrupts = false;
+
+    return true;
+}
+
+// map a memory map entry into every kernel window that covers it, always with
+// the same caching type, so that there are no conflicting aliases
+void vmm_map_memmap_entry(struct stivale2_mmap_entry *entry)
+{
+    pat_cache_t pat_type = vmm_memmap_type_to_pat_cache(entry->type);
+
+    uint64_t start = entry->base;
+    uint64_t end = entry->base + entry->length;
+
+    vmm_map_range(&kernel_space, start, end, HIGHER_HALF_DATA, KERNEL_READ_WRITE, pat_type);
+
+    if (start < 4 * GiB)
+    {
+        uint64_t low_end = end < 4 * GiB ? end : 4 * GiB;
+
+        vmm_map_range(&kernel_space, start, low_end, 0, KERNEL_READ_WRITE, pat_type);
+        vmm_map_range(&kernel_space, start, low_end, HEAP_START_ADDR, KERNEL_READ_WRITE, pat_type);
+    }
+
+    if (start < 2 * GiB)
+    {
+        uint64_t code_end = end < 2 * GiB ? end : 2 * GiB;
+
+        vmm_map_range(&kernel_space, start, code_end, HIGHER_HALF_CODE, KERNEL_READ, pat_type);
+    }
+}
+
+// RAM is write-back, the framebuffer write-combining, anything else uncacheable
+pat_cache_t vmm_memmap_type_to_pat_cache(uint64_t type)
+{
+    switch (type)
+    {
+        case STIVALE2_MMAP_USABLE:
+        case STIVALE2_MMAP_ACPI_RECLAIMABLE:
+        case STIVALE2_MMAP_ACPI_NVS:
+        case STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE:
+        case STIVALE2_MMAP_KERNEL_AND_MODULES:
+            return PAT_WRITE_BACK;
+
+        case STIVALE2_MMAP_FRAMEBUFFER:
+            return PAT_WRITE_COMBINING;
+
+        default:
+            return PAT_UNCACHEABLE;
+    }
 }
 
 // combine PAT, PCD and PWT according to custom_pat_config (in PAT MSR),
@@ -221,8 +1265,42 @@ uint64_t vmm_pat_cache_to_flags(pat_cache_t type)
     return flags;
 }
 
-// flush/reload translation lookaside buffer
-void vmm_flush_tlb(void *address)
+// reverse of vmm_pat_cache_to_flags() - which caching type the PAT, PCD and PWT
+// bits of a 4 KiB entry select
+pat_cache_t vmm_flags_to_pat_cache(uint64_t flags)
 {
-    asm_invlpg(address);
+    switch (flags & (PTE_PAT | PTE_CACHE_DISABLED | PTE_WRITE_THROUGH))
+    {
+        case PTE_WRITE_THROUGH:
+            return PAT_WRITE_COMBINING;
+
+        case PTE_PAT:
+            return PAT_WRITE_THROUGH;
+
+        case PTE_PAT | PTE_WRITE_THROUGH:
+            return PAT_WRITE_PROTECTED;
+
+        case PTE_PAT | PTE_CACHE_DISABLED:
+            return PAT_WRITE_BACK;
+
+        case PTE_PAT | PTE_CACHE_DISABLED | PTE_WRITE_THROUGH:
+            return PAT_UNCACHED;
+
+        // PCD without PAT isn't used by custom_pat_config
+        default:
+            return PAT_UNCACHEABLE;
+    }
+}
+
+// same as vmm_pat_cache_to_flags(), but for 2 MiB and 1 GiB entries
+uint64_t vmm_pat_cache_to_large_flags(pat_cache_t type)
+{
+    uint64_t flags = vmm_pat_cache_to_flags(type);
+
+    if (flags & PTE_PAT)
+    {
+        flags = (flags & ~(uint64_t)PTE_PAT) | PTE_LARGE_PAT;
+    }
+
+    return flags;
 }
@@ -22,6 +22,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <libk/data_structs/rbtree.h>
+#include <libk/lock/spinlock.h>
+#include <memory/mem.h>
+#include <memory/virtual/tlb.h>
+#include <proc/smp/smp.h>
+
 // privilege of a page table entry (PTE)
 #define PTE_PRESENT	    (1 << 0)
 #define PTE_READ_WRITE	    (1 << 1)
@@ -33,6 +39,60 @@
 #define PTE_PAT		    (1 << 7)
 #define PTE_GLOBAL	    (1 << 8)
 
+// ignored by the CPU, free for the kernel
+#define PTE_PREFAULTED	    (1 << 9)  // mapped by fault-around, not by a fault on it
+#define PTE_COW		    (1 << 10) // writable, but the frame is shared until the first write
+#define PTE_KSM		    (1 << 11) // the frame was merged with identical ones, see ksm.c
+
+// page directory (pointer table) entries which map 2 MiB (1 GiB) directly
+#define PTE_LARGE	    (1 << 7)
+#define PTE_LARGE_PAT	    (1 << 12) // PAT bit moves here, as bit 7 is taken
+
+// CR4 bit which enables global pages
+#define CR4_PGE		    (1 << 7)
+
+// CR3 bit which keeps the TLB entries of the loaded PCID
+#define CR3_NO_FLUSH	    (1UL << 63)
+#define PCID_COUNT	    4096
+
+// ignored bits of an entry which points to a table - they count its used entries
+#define PTE_TABLE_COUNT_SHIFT 52
+#define PTE_TABLE_COUNT_MASK  (0x3FFUL << PTE_TABLE_COUNT_SHIFT)
+
+// physical address part of a page table entry
+#define PTE_ADDRESS_MASK    0x000FFFFFFFFFF000UL
+#define PTE_FLAGS_MASK	    (~PTE_ADDRESS_MASK)
+
+// what a CPU knows about an address space, see vmm_switch_space()
+typedef struct
+{
+    uint16_t pcid;
+    uint64_t pcid_generation;		// of the CPU when the PCID was assigned
+    uint64_t tlb_generation;		// of the space when it was loaded last
+    uint64_t kernel_tlb_generation;	// same for the kernel half, which all spaces share
+} vmm_space_cpu_t;
+
+struct vmm_region;
+
+// an address space - which CPUs have it loaded decides where TLB shootdowns go
+typedef struct vmm_space
+{
+    struct vmm_space *next;		// list of all spaces except the kernel one
+
+    rbtree_t regions;			// demand paged ranges, see region.c
+    struct vmm_region *region_cache;	// the one found last, accesses tend to stay in it
+    spinlock_t region_lock;		// also serializes the page faults of the space
+
+    uint64_t *page_table;		// root page table (higher half address)
+    size_t page_table_count;		// pages of page tables, the root included
+    size_t huge_page_count;		// 2 MiB frames backing regions, see thp.c
+    bool mergeable;			// identical pages may be merged, see ksm.c
+    uint64_t cpu_mask;			// bit n = CPU n has it in CR3 (so at most 64 CPUs)
+    uint64_t tlb_generation;		// incremented by every flush
+
+    vmm_space_cpu_t cpus[SMP_MAX_CPU_COUNT];
+} vmm_space_t;
+
 // types of virtual memory mapping privileges
 typedef enum
 {
@@ -42,14 +102,45 @@ typedef enum
     USER_READ_WRITE	= PTE_PRESENT | PTE_READ_WRITE | PTE_USER_SUPERVISOR
 } vmm_map_privilege_t;
 
+// the page table an entry points to - through the higher half, as the identity
+// map only covers the first 4 GiB and page tables can be anywhere
+static inline uint64_t *vmm_entry_to_table(uint64_t entry)
+{
+    return (uint64_t *)PHYS_TO_HIGHER_HALF_DATA(entry & PTE_ADDRESS_MASK);
+}
+
 void vmm_init(struct stivale2_struct *stivale2_struct);
-void vmm_map_page(uint64_t *page_table, uint64_t phys_page, uint64_t virt_page,
+void vmm_map_page(vmm_space_t *space, uint64_t phys_page, uint64_t virt_page,
+	uint64_t flags, pat_cache_t pat_type);
+void vmm_unmap_page(vmm_space_t *space, uint64_t virt_page);
+void vmm_map_page_gather(tlb_gather_t *gather, uint64_t phys_page, uint64_t virt_page,
+	uint64_t flags, pat_cache_t pat_type);
+void vmm_unmap_page_gather(tlb_gather_t *gather, uint64_t virt_page);
+void vmm_map_pages(vmm_space_t *space, uint64_t virt_start, const uint64_t *frames, size_t count,
+	uint64_t flags, pat_cache_t pat_type);
+void vmm_map_pages_gather(tlb_gather_t *gather, uint64_t virt_start, const uint64_t *frames, size_t count,
+	uint64_t flags, pat_cache_t pat_type);
+void vmm_map_large_page_gather(tlb_gather_t *gather, uint64_t phys_page, uint64_t virt_page,
 	uint64_t flags, pat_cache_t pat_type);
-void vmm_unmap_page(uint64_t *page_table, uint64_t virt_page);
-void vmm_map_range(uint64_t *page_table, uint64_t start, uint64_t end, uint64_t offset,
+void vmm_unmap_large_page_gather(tlb_gather_t *gather, uint64_t virt_page);
+void vmm_split_large_page(vmm_space_t *space, uint64_t virt_page);
+void vmm_map_range(vmm_space_t *space, uint64_t start, uint64_t end, uint64_t offset,
 	uint64_t flags, pat_cache_t pat_type);
-void vmm_unmap_range(uint64_t *page_table, uint64_t start, uint64_t end);
+void vmm_unmap_range(vmm_space_t *space, uint64_t start, uint64_t end);
+uint64_t *vmm_get_pte(vmm_space_t *space, uint64_t virt_page);
 void vmm_load_page_table(uint64_t *page_table);
-uint64_t *vmm_get_root_page_table(void);
+void vmm_init_cpu(void);
+vmm_space_t *vmm_space_create(void);
+void vmm_space_destroy(vmm_space_t *space);
+vmm_space_t *vmm_clone_space(vmm_space_t *space);
+vmm_space_t *vmm_space_try_lock_nth(size_t index, bool *exists);
+bool vmm_space_try_lock(vmm_space_t *space);
+void vmm_switch_space(vmm_space_t *space);
+vmm_space_t *vmm_get_kernel_space(void);
+bool vmm_global_pages_enabled(void);
+pat_cache_t vmm_flags_to_pat_cache(uint64_t flags);
+size_t vmm_get_page_table_count(vmm_space_t *space);
+size_t vmm_get_huge_page_count(vmm_space_t *space);
+void vmm_dump_page_tables(void);
 
 #endif
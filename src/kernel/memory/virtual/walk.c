@@ -0,0 +1,300 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Reading the page tables back. The walker visits the present translations
+    of a virtual range in order, one level after the other: a missing entry
+    of a higher level skips everything it would map (up to 512 GiB) at once,
+    a large page is returned as one entry of its size. It keeps the tables on
+    the path to its position and moves on within the lowest one, only at the
+    end of a table it goes up a level. Callers may unmap what they got before
+    the next step, so each step first checks that the kept tables are still
+    where they were found. Non-present entries which aren't empty hold a
+    swapped out page (see zstore.c), the walker only returns those if asked
+    to. vmm_virt_to_phys() and vmm_query_range() are built on top of it.
+    Nothing is locked - the caller has to keep the range from being changed
+    (or live with a result that might be outdated right away).
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <memory/mem.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+
+// first address after the lower half, the higher half (HIGHER_HALF_DATA) follows it
+#define CANONICAL_LOWER_END	0x0000800000000000
+
+/* utility function prototypes */
+
+bool vmm_walk_find(vmm_space_t *space, uint64_t virt, vmm_walk_entry_t *entry);
+bool vmm_walk_leaf(vmm_walk_entry_t *entry, uint64_t *pte, uint64_t virt, size_t shift, bool swapped);
+size_t vmm_walk_resume(vmm_walker_t *walker);
+size_t vmm_walk_skip(vmm_walker_t *walker, uint64_t address, size_t level);
+
+/* core functions */
+
+// prepare a walk over the translations of [start, end)
+void vmm_walk_init(vmm_walker_t *walker, vmm_space_t *space, uint64_t start, uint64_t end)
+{
+    walker->space = space;
+    walker->tables[0] = space->page_table;
+    walker->tables[1] = NULL;
+    walker->address = ALIGN_DOWN(start, PAGE_SIZE);
+    walker->end = end;
+    walker->swapped = false;
+    walker->done = walker->address >= end;
+}
+
+// let the walk return the 4 KiB entries of swapped out pages as well - they
+// have no frame (phys is 0) and flags holds the whole entry
+void vmm_walk_include_swapped(vmm_walker_t *walker)
+{
+    walker->swapped = true;
+}
+
+// get the next present translation of the range - false when there is none left
+// (the first one may begin before and the last one end after the range, if
+// they are large pages)
+bool vmm_walk_next(vmm_walker_t *walker, vmm_walk_entry_t *entry)
+{
+    size_t level = vmm_walk_resume(walker);
+
+    while (!walker->done)
+    {
+        uint64_t address = walker->address;
+        size_t shift = 39 - level * 9;
+        uint64_t *pte = &walker->tables[level][(address >> shift) & 0x1ff];
+
+        if (level < 3 && (*pte & PTE_PRESENT) && !(*pte & PTE_LARGE))
+        {
+            walker->tables[++level] = vmm_entry_to_table(*pte);
+
+            continue;
+        }
+
+        bool found = vmm_walk_leaf(entry, pte, address, shift, walker->swapped);
+
+        level = vmm_walk_skip(walker, address, level);
+
+        if (found)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// get the translation which contains virt - false if it isn't mapped
+bool vmm_walk_lookup(vmm_space_t *space, uint64_t virt, vmm_walk_entry_t *entry)
+{
+    return vmm_walk_find(space, virt, entry);
+}
+
+// translate a virtual address of a space to the physical one, large pages included
+bool vmm_virt_to_phys(vmm_space_t *space, uint64_t virt, uint64_t *phys)
+{
+    vmm_walk_entry_t entry;
+
+    if (!vmm_walk_find(space, virt, &entry))
+    {
+        return false;
+    }
+
+    *phys = entry.phys + (virt - entry.virt);
+
+    return true;
+}
+
+// collect the flags and caching types of [start, end) - true if all of it is mapped
+bool vmm_query_range(vmm_space_t *space, uint64_t start, uint64_t end, vmm_range_info_t *info)
+{
+    vmm_walker_t walker;
+    vmm_walk_entry_t entry;
+
+    info->mapped_size = 0;
+    info->flags = 0;
+    info->any_flags = 0;
+    info->pat_type = PAT_UNCACHEABLE;
+    info->mixed_pat = false;
+
+    start = ALIGN_DOWN(start, PAGE_SIZE);
+    end = ALIGN_UP(end, PAGE_SIZE);
+
+    vmm_walk_init(&walker, space, start, end);
+
+    while (vmm_walk_next(&walker, &entry))
+    {
+        if (info->mapped_size == 0)
+        {
+            info->flags = entry.flags;
+            info->pat_type = entry.pat_type;
+        }
+        else if (entry.pat_type != info->pat_type)
+        {
+            info->mixed_pat = true;
+        }
+
+        info->flags &= entry.flags;
+        info->any_flags |= entry.flags;
+
+        // only count the part inside the range (the last byte can't overflow)
+        uint64_t page_first = entry.virt < start ? start : entry.virt;
+        uint64_t page_last = entry.virt + entry.size - 1;
+
+        if (page_last > end - 1)
+        {
+            page_last = end - 1;
+        }
+
+        info->mapped_size += page_last - page_first + 1;
+    }
+
+    return info->mapped_size == end - start;
+}
+
+/* utility functions */
+
+// walk down from the top to the leaf entry of virt - false if there is none
+bool vmm_walk_find(vmm_space_t *space, uint64_t virt, vmm_walk_entry_t *entry)
+{
+    uint64_t *table = space->page_table;
+
+    for (size_t shift = 39; ; shift -= 9)
+    {
+        uint64_t *pte = &table[(virt >> shift) & 0x1ff];
+
+        if (shift == 12 || !(*pte & PTE_PRESENT) || (*pte & PTE_LARGE))
+        {
+            return vmm_walk_leaf(entry, pte, virt, shift, false);
+        }
+
+        table = vmm_entry_to_table(*pte);
+    }
+}
+
+// describe the translation of virt by the entry pte of the level at shift - false
+// if it maps nothing; swapped out pages count if swapped is set
+bool vmm_walk_leaf(vmm_walk_entry_t *entry, uint64_t *pte, uint64_t virt, size_t shift, bool swapped)
+{
+    size_t entry_size = (size_t)1 << shift;
+
+    if (shift == 12 && swapped && *pte && !(*pte & PTE_PRESENT))
+    {
+        entry->virt = ALIGN_DOWN(virt, PAGE_SIZE);
+        entry->phys = 0;
+        entry->size = PAGE_SIZE;
+        entry->flags = *pte;
+        entry->pat_type = PAT_WRITE_BACK;
+        entry->pte = pte;
+
+        return true;
+    }
+
+    if (!(*pte & PTE_PRESENT))
+    {
+        return false;
+    }
+
+    entry->virt = ALIGN_DOWN(virt, entry_size);
+    entry->size = entry_size;
+    entry->pte = pte;
+
+    if (shift == 12)
+    {
+        entry->phys = *pte & PTE_ADDRESS_MASK;
+        entry->flags = *pte & PTE_FLAGS_MASK;
+    }
+    else
+    {
+        // PTE_LARGE is where the PAT bit of a 4 KiB entry is
+        entry->phys = *pte & PTE_ADDRESS_MASK & ~(uint64_t)PTE_LARGE_PAT;
+        entry->flags = (*pte & PTE_FLAGS_MASK & ~(uint64_t)PTE_LARGE) |
+                       ((*pte & PTE_LARGE_PAT) ? PTE_PAT : 0);
+    }
+
+    entry->pat_type = vmm_flags_to_pat_cache(entry->flags);
+
+    return true;
+}
+
+// return the lowest level whose kept table still hangs where it was found - with
+// the kept pointers the loads of the entries don't depend on each other, unlike
+// the ones of a walk down from the top
+size_t vmm_walk_resume(vmm_walker_t *walker)
+{
+    size_t level = 0;
+
+    while (level < 3 && walker->tables[level + 1])
+    {
+        size_t shift = 39 - level * 9;
+        uint64_t pte = walker->tables[level][(walker->address >> shift) & 0x1ff];
+
+        if (!(pte & PTE_PRESENT) || (pte & PTE_LARGE) ||
+                vmm_entry_to_table(pte) != walker->tables[level + 1])
+        {
+            break;
+        }
+
+        level++;
+    }
+
+    // the tables below might be freed already
+    if (level < 3)
+    {
+        walker->tables[level + 1] = NULL;
+    }
+
+    return level;
+}
+
+// continue the walk after the block which the entry of level maps at address -
+// return the level whose table holds the entry for the new address
+size_t vmm_walk_skip(vmm_walker_t *walker, uint64_t address, size_t level)
+{
+    size_t size = (size_t)1 << (39 - level * 9);
+    uint64_t next = ALIGN_DOWN(address, size) + size;
+
+    // the non-canonical hole in the middle isn't mapped by anything
+    if (next == CANONICAL_LOWER_END)
+    {
+        next = HIGHER_HALF_DATA;
+    }
+
+    // wrapped around at the top of the address space
+    if (next <= address || next >= walker->end)
+    {
+        walker->done = true;
+    }
+
+    walker->address = next;
+
+    // past the last entry of a table, go up to its parent
+    while (level > 0 && (next & (size * 512 - 1)) == 0)
+    {
+        level--;
+        size *= 512;
+    }
+
+    return level;
+}
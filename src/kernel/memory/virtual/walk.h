@@ -0,0 +1,70 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/cpu.h>
+#include <memory/virtual/vmm.h>
+
+// one present translation (4 KiB, 2 MiB or 1 GiB page) found by the walker
+typedef struct
+{
+    uint64_t virt;		// start of the page, aligned to size
+    uint64_t phys;		// start of the frame
+    size_t size;		// PAGE_SIZE, LARGE_PAGE_SIZE or HUGE_PAGE_SIZE
+    uint64_t flags;		// entry flags, in the 4 KiB layout (PTE_PAT, no PTE_LARGE)
+    pat_cache_t pat_type;
+    uint64_t *pte;		// the entry itself
+} vmm_walk_entry_t;
+
+// iterates over the present translations of a virtual range
+typedef struct
+{
+    vmm_space_t *space;
+    uint64_t *tables[4];	// PML4, PDPT, PD and PT on the path to address (as far as known)
+    uint64_t address;		// where the next lookup starts
+    uint64_t end;		// exclusive
+    bool swapped;		// also return swapped out pages, see vmm_walk_include_swapped()
+    bool done;
+} vmm_walker_t;
+
+// what the translations of a virtual range have in common
+typedef struct
+{
+    size_t mapped_size;		// bytes of the range which are mapped
+    uint64_t flags;		// flags which every mapped page has
+    uint64_t any_flags;		// flags which at least one mapped page has
+    pat_cache_t pat_type;	// caching type of the first mapped page
+    bool mixed_pat;		// other pages use another caching type
+} vmm_range_info_t;
+
+void vmm_walk_init(vmm_walker_t *walker, vmm_space_t *space, uint64_t start, uint64_t end);
+void vmm_walk_include_swapped(vmm_walker_t *walker);
+bool vmm_walk_next(vmm_walker_t *walker, vmm_walk_entry_t *entry);
+bool vmm_walk_lookup(vmm_space_t *space, uint64_t virt, vmm_walk_entry_t *entry);
+bool vmm_virt_to_phys(vmm_space_t *space, uint64_t virt, uint64_t *phys);
+bool vmm_query_range(vmm_space_t *space, uint64_t start, uint64_t end, vmm_range_info_t *info);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+
+    Brief file description:
+    Frames which are only ever read as zeros: one 4 KiB frame and one 2 MiB
+    aligned frame for large mappings. Read faults on anonymous memory map
+    them read-only instead of allocating and clearing a frame (see fault.c),
+    the first write maps a fresh frame in place of the zero page.
+    They belong to no space and are never freed, so every place which frees
+    or references the frames of a region skips them (zero_page_contains()).
+    Each is mapped with PAT_WRITE_BACK only, to keep the caching type of all
+    mappings of a frame the same.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <libk/testing/assert.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/zero_page.h>
+
+static uint64_t zero_frame;
+static uint64_t zero_large_frame;
+
+/* core functions */
+
+// allocate and clear both zero frames
+void zero_page_init(void)
+{
+    void *frame = pmm_allocz(1, MEM_TAG_KERNEL);
+    assert(frame != NULL);
+
+    zero_frame = (uint64_t)frame;
+
+    zero_large_frame = (uint64_t)pmm_alloc_aligned(LARGE_PAGE_SIZE / PAGE_SIZE, LARGE_PAGE_SIZE, MEM_TAG_KERNEL);
+    assert(zero_large_frame != 0);
+
+    memset((void *)PHYS_TO_HIGHER_HALF_DATA(zero_large_frame), 0, LARGE_PAGE_SIZE);
+
+    log(INFO, "Zero pages at 0x%.16llx (4 KiB) and 0x%.16llx (2 MiB)\n", zero_frame, zero_large_frame);
+}
+
+// physical address of the 4 KiB zero frame
+uint64_t zero_page_get(void)
+{
+    return zero_frame;
+}
+
+// physical address of the 2 MiB zero frame
+uint64_t zero_page_get_large(void)
+{
+    return zero_large_frame;
+}
+
+// whether a frame is (part of) one of the zero frames
+bool zero_page_contains(uint64_t phys)
+{
+    return phys == zero_frame || (phys >= zero_large_frame && phys < zero_large_frame + LARGE_PAGE_SIZE);
+}
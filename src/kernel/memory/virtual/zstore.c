@@ -0,0 +1,1022 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+/*
+
+    Brief file description:
+    In-memory compressed store for cold anonymous pages. Once free memory
+    drops below the low watermark, a worker evicts pages of the user spaces
+    until it is above the high watermark again: every page is looked at, a
+    page which was accessed since the last look only loses its accessed bit
+    (second chance), a cold one is compressed (LZ4, see lz4.c) into the pool
+    and its frame is freed. The page table entry becomes non-present and
+    points to the blob (ZSTORE_ENTRY_BLOB) - a page filled with one 32 bit
+    pattern (zeros most of the time) takes no memory at all, the pattern is
+    kept in the entry itself (ZSTORE_ENTRY_SAME). The next access faults and
+    the page is decompressed into a new frame (see fault.c).
+    Only private frames of anonymous write-back regions are evicted, pages
+    which compress to more than ZSTORE_MAX_BLOB_SIZE stay where they are.
+    A huge page (see thp.c) is aged like a small one, a cold one is split
+    and its 4 KiB pages are evicted one by one - the collapse worker merges
+    them again once they are all back.
+    Evicted pages are write-protected first (a batch with one flush), so a
+    write can't get lost while they are compressed - it faults and waits
+    for the region lock, which is held.
+    The pool hands out slots of ZSTORE_CLASS_COUNT size classes (multiples
+    of ZSTORE_CLASS_SIZE). Each class carves chunks of contiguous frames
+    into slots, the chunk size leaves the least of them unused. A blob knows
+    its chunk, an empty chunk is given back right away. Blobs are reference
+    counted, as vmm_clone_space() shares them like frames.
+    Pages which aren't stored - they don't compress or the pool has reached
+    its limit - are written to the swap device instead, if there is one
+    (see swap.c), the entry points to their slot (ZSTORE_ENTRY_SWAP).
+    The worker runs as idle work of an AP (see smp.c) once enabled, with
+    zstore_reclaim_space() a space can be evicted directly as well. Before
+    evicting, it frees the frames of the swap cache nobody maps.
+
+*/
+
+#include <boot/stivale2.h>
+#include <hardware/cpu.h>
+#include <libk/compress/lz4.h>
+#include <libk/lock/spinlock.h>
+#include <libk/serial/log.h>
+#include <libk/string/string.h>
+#include <libk/testing/assert.h>
+#include <memory/dynamic/slab.h>
+#include <memory/mem.h>
+#include <memory/mem_tag.h>
+#include <memory/physical/pmm.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/swap.h>
+#include <memory/virtual/thp.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+#include <memory/virtual/walk.h>
+#include <memory/virtual/zero_page.h>
+#include <memory/virtual/zstore.h>
+#include <proc/smp/smp.h>
+#include <utility/utils.h>
+
+#define ZSTORE_EVICT_BATCH  32 // pages which are write-protected with one flush
+
+// a piece of contiguous frames of the pool, cut into the slots of one class
+typedef struct zstore_chunk
+{
+    struct zstore_chunk *next;	// in the list of its class, while it has a free slot
+    struct zstore_chunk *prev;
+    uint8_t *base;		// first slot
+    void *free_slots;		// linked through their first bytes
+    uint16_t used_count;
+    uint8_t class_index;
+} zstore_chunk_t;
+
+// a compressed page in a slot, referred to by the entries of swapped out pages
+typedef struct
+{
+    zstore_chunk_t *chunk;
+    uint32_t ref_count;		// entries which point to it (cloned spaces share it)
+    uint16_t size;		// of the compressed data
+    uint8_t data[];
+} zstore_blob_t;
+
+typedef struct
+{
+    zstore_chunk_t *partial;	// chunks with a free slot
+    size_t slot_size;
+    size_t chunk_pages;
+    size_t slot_count;		// per chunk
+} zstore_class_t;
+
+// cold pages of the space which is being scanned, evicted together
+typedef struct
+{
+    vmm_region_t *regions[ZSTORE_EVICT_BATCH];
+    uint64_t virt_pages[ZSTORE_EVICT_BATCH];
+    uint64_t *ptes[ZSTORE_EVICT_BATCH];
+    bool writable[ZSTORE_EVICT_BATCH];
+    size_t count;
+
+    // the ones which go to the swap device
+    size_t swap_indices[ZSTORE_EVICT_BATCH];
+    uint64_t swap_frames[ZSTORE_EVICT_BATCH];
+    mem_tag_t swap_tags[ZSTORE_EVICT_BATCH];
+    uint64_t swap_entries[ZSTORE_EVICT_BATCH];
+    size_t swap_count;
+} zstore_batch_t;
+
+static slab_cache_t *chunk_cache;
+static spinlock_t pool_lock;
+static zstore_class_t classes[ZSTORE_CLASS_COUNT];
+
+// the cursor, the batch and the buffers belong to whoever holds the reclaim lock
+static spinlock_t reclaim_lock;
+static size_t reclaim_space_index = 0;
+static uint64_t reclaim_address = 0;
+static zstore_batch_t batch;
+static uint8_t compress_buffer[ZSTORE_MAX_BLOB_SIZE];
+static uint64_t compress_workspace[LZ4_WORKSPACE_SIZE / sizeof(uint64_t)];
+
+static bool zstore_enabled = false;
+static size_t low_watermark = ZSTORE_DEFAULT_LOW_WATERMARK;
+static size_t high_watermark = ZSTORE_DEFAULT_HIGH_WATERMARK;
+static size_t pool_limit = ZSTORE_DEFAULT_POOL_LIMIT;
+static bool reclaim_kicked = false;
+static size_t reclaim_work;
+
+static zstore_stats_t zstore_stats;
+
+/* utility function prototypes */
+
+uint64_t zstore_get_evicted_count(void);
+size_t zstore_scan_space(vmm_space_t *space, uint64_t start, size_t budget, uint64_t *next);
+void zstore_scan_region(tlb_gather_t *gather, vmm_region_t *region, uint64_t start, size_t budget,
+                        size_t *scanned_count, uint64_t *next);
+void zstore_scan_page(tlb_gather_t *gather, vmm_region_t *region, vmm_walk_entry_t *leaf);
+bool zstore_split_cold_huge_page(tlb_gather_t *gather, vmm_walk_entry_t *leaf);
+bool zstore_region_allowed(vmm_space_t *space, vmm_region_t *region);
+bool zstore_page_candidate(vmm_walk_entry_t *leaf);
+void zstore_evict_batch(vmm_space_t *space);
+void zstore_swap_out_batch(tlb_gather_t *gather);
+uint64_t zstore_store(uint64_t frame);
+void zstore_load(uint64_t entry, void *page);
+bool zstore_same_filled(const void *page, uint32_t *pattern);
+zstore_blob_t *zstore_entry_to_blob(uint64_t entry);
+zstore_blob_t *zstore_alloc_blob(size_t size);
+void zstore_free_blob(zstore_blob_t *blob);
+zstore_chunk_t *zstore_create_chunk(size_t class_index);
+void zstore_link_chunk(zstore_class_t *class, zstore_chunk_t *chunk);
+void zstore_unlink_chunk(zstore_class_t *class, zstore_chunk_t *chunk);
+void zstore_account_load(uint64_t cycles);
+void zstore_worker(void *argument);
+
+/* core functions */
+
+// choose the chunk size of every class and register the worker as idle work
+void zstore_init(void)
+{
+    assert(sizeof(zstore_chunk_t) <= 64);
+
+    chunk_cache = slab_cache_create("zstore chunks", 64, MEM_TAG_ZSTORE, SLAB_PANIC | SLAB_AUTO_GROW);
+
+    for (size_t i = 0; i < ZSTORE_CLASS_COUNT; i++)
+    {
+        zstore_class_t *class = &classes[i];
+
+        class->partial = NULL;
+        class->slot_size = (i + 1) * ZSTORE_CLASS_SIZE;
+        class->chunk_pages = 1;
+
+        // the chunk size which leaves the smallest share unused
+        for (size_t pages = 2; pages <= ZSTORE_MAX_CHUNK_PAGES; pages++)
+        {
+            size_t waste = (pages * PAGE_SIZE) % class->slot_size;
+            size_t best_waste = (class->chunk_pages * PAGE_SIZE) % class->slot_size;
+
+            if (waste * class->chunk_pages < best_waste * pages)
+            {
+                class->chunk_pages = pages;
+            }
+        }
+
+        class->slot_count = class->chunk_pages * PAGE_SIZE / class->slot_size;
+    }
+
+    reclaim_work = smp_add_idle_work(zstore_worker);
+
+    log(INFO, "Compressed page store initialized with %d size classes (eviction disabled until "
+        "zstore_set_enabled())\n", ZSTORE_CLASS_COUNT);
+}
+
+// start or stop evicting when memory runs low
+void zstore_set_enabled(bool enabled)
+{
+    __atomic_store_n(&zstore_enabled, enabled, __ATOMIC_RELAXED);
+
+    if (enabled)
+    {
+        zstore_note_alloc();
+    }
+}
+
+// set below how many free frames the worker starts and above how many it stops
+void zstore_set_watermarks(size_t low_pages, size_t high_pages)
+{
+    assert(low_pages <= high_pages);
+
+    __atomic_store_n(&low_watermark, low_pages, __ATOMIC_RELAXED);
+    __atomic_store_n(&high_watermark, high_pages, __ATOMIC_RELAXED);
+}
+
+// set how many frames the pool may take at most
+void zstore_set_pool_limit(size_t page_count)
+{
+    __atomic_store_n(&pool_limit, page_count, __ATOMIC_RELAXED);
+}
+
+// called after frames were allocated for a space - kicks the worker once
+// free memory is below the low watermark
+void zstore_note_alloc(void)
+{
+    if (!__atomic_load_n(&zstore_enabled, __ATOMIC_RELAXED)
+            || pmm_get_free_page_count() >= __atomic_load_n(&low_watermark, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    if (!__atomic_exchange_n(&reclaim_kicked, true, __ATOMIC_RELAXED))
+    {
+        smp_kick_idle_work(reclaim_work);
+    }
+}
+
+// look at up to page_count pages of the user spaces, continuing where the last
+// call stopped - returns how many of them were evicted
+size_t zstore_reclaim(size_t page_count)
+{
+    size_t scanned_count = 0;
+    bool wrapped = false;
+
+    spinlock_acquire(&reclaim_lock);
+
+    uint64_t evicted_before = zstore_get_evicted_count();
+
+    while (scanned_count < page_count)
+    {
+        bool exists;
+        vmm_space_t *space = vmm_space_try_lock_nth(reclaim_space_index, &exists);
+
+        if (!exists)
+        {
+            reclaim_space_index = 0;
+            reclaim_address = 0;
+
+            if (wrapped)
+            {
+                break;
+            }
+
+            wrapped = true;
+
+            continue;
+        }
+
+        // a busy space is left for the next pass
+        if (!space)
+        {
+            reclaim_space_index++;
+            reclaim_address = 0;
+
+            continue;
+        }
+
+        scanned_count += zstore_scan_space(space, reclaim_address, page_count - scanned_count, &reclaim_address);
+
+        if (reclaim_address == 0)
+        {
+            reclaim_space_index++;
+        }
+
+        spinlock_release(&space->region_lock);
+    }
+
+    size_t evicted_count = zstore_get_evicted_count() - evicted_before;
+
+    spinlock_release(&reclaim_lock);
+
+    __atomic_fetch_add(&zstore_stats.pages_scanned, scanned_count, __ATOMIC_RELAXED);
+
+    return evicted_count;
+}
+
+// look at every page of a space once - returns how many were evicted (the
+// accessed ones are evicted by the next call, if they aren't accessed again)
+size_t zstore_reclaim_space(vmm_space_t *space)
+{
+    uint64_t next;
+
+    spinlock_acquire(&reclaim_lock);
+    spinlock_acquire(&space->region_lock);
+
+    uint64_t evicted_before = zstore_get_evicted_count();
+    size_t scanned_count = zstore_scan_space(space, 0, SIZE_MAX, &next);
+    size_t evicted_count = zstore_get_evicted_count() - evicted_before;
+
+    spinlock_release(&space->region_lock);
+    spinlock_release(&reclaim_lock);
+
+    __atomic_fetch_add(&zstore_stats.pages_scanned, scanned_count, __ATOMIC_RELAXED);
+
+    return evicted_count;
+}
+
+// decompress an evicted page into a new frame (or read it from the swap
+// device) and map it with the privileges of its region, the TLB is only
+// flushed by tlb_gather_finish() - a zero-filled page is mapped to the zero
+// page if zero_page is set; false if out of memory
+bool zstore_fault_in(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t *pte,
+                     bool zero_page)
+{
+    uint64_t start = asm_rdtsc();
+    uint64_t entry = *pte;
+
+    // the slot is freed by swap_fault_in() already
+    if (entry & ZSTORE_ENTRY_SWAP)
+    {
+        return swap_fault_in(gather, region, virt_page, pte);
+    }
+
+    // the pattern bits are all zero
+    if (zero_page && entry == ZSTORE_ENTRY_SAME)
+    {
+        vmm_map_page_gather(gather, zero_page_get(), virt_page, region->flags & ~(uint64_t)PTE_READ_WRITE,
+                            region->pat_type);
+    }
+    else
+    {
+        void *frame = pmm_alloc(1, region->tag);
+
+        if (!frame)
+        {
+            return false;
+        }
+
+        zstore_load(entry, (void *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)frame));
+
+        vmm_map_page_gather(gather, (uint64_t)frame, virt_page, region->flags, region->pat_type);
+    }
+
+    zstore_free_entry(entry);
+
+    __atomic_fetch_add(&zstore_stats.pages_loaded, 1, __ATOMIC_RELAXED);
+    zstore_account_load(asm_rdtsc() - start);
+
+    return true;
+}
+
+// the entry of a swapped out page was copied into another space
+void zstore_ref_entry(uint64_t entry)
+{
+    if (entry & ZSTORE_ENTRY_SWAP)
+    {
+        swap_ref_entry(entry);
+
+        return;
+    }
+
+    if (entry & ZSTORE_ENTRY_SAME)
+    {
+        __atomic_fetch_add(&zstore_stats.same_filled_entries, 1, __ATOMIC_RELAXED);
+
+        return;
+    }
+
+    __atomic_fetch_add(&zstore_entry_to_blob(entry)->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+// the entry of a swapped out page is gone - the last one frees the blob
+void zstore_free_entry(uint64_t entry)
+{
+    if (entry & ZSTORE_ENTRY_SWAP)
+    {
+        swap_free_entry(entry);
+
+        return;
+    }
+
+    if (entry & ZSTORE_ENTRY_SAME)
+    {
+        __atomic_fetch_sub(&zstore_stats.same_filled_entries, 1, __ATOMIC_RELAXED);
+
+        return;
+    }
+
+    zstore_blob_t *blob = zstore_entry_to_blob(entry);
+
+    if (__atomic_sub_fetch(&blob->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        __atomic_fetch_sub(&zstore_stats.stored_blobs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&zstore_stats.compressed_bytes, sizeof(zstore_blob_t) + blob->size, __ATOMIC_RELAXED);
+
+        zstore_free_blob(blob);
+    }
+}
+
+// copy the counters
+void zstore_get_stats(zstore_stats_t *stats)
+{
+    stats->pages_scanned = __atomic_load_n(&zstore_stats.pages_scanned, __ATOMIC_RELAXED);
+    stats->pages_aged = __atomic_load_n(&zstore_stats.pages_aged, __ATOMIC_RELAXED);
+    stats->pages_stored = __atomic_load_n(&zstore_stats.pages_stored, __ATOMIC_RELAXED);
+    stats->pages_same_filled = __atomic_load_n(&zstore_stats.pages_same_filled, __ATOMIC_RELAXED);
+    stats->pages_rejected = __atomic_load_n(&zstore_stats.pages_rejected, __ATOMIC_RELAXED);
+    stats->pages_swapped = __atomic_load_n(&zstore_stats.pages_swapped, __ATOMIC_RELAXED);
+    stats->huge_pages_split = __atomic_load_n(&zstore_stats.huge_pages_split, __ATOMIC_RELAXED);
+    stats->pages_loaded = __atomic_load_n(&zstore_stats.pages_loaded, __ATOMIC_RELAXED);
+    stats->load_cycles = __atomic_load_n(&zstore_stats.load_cycles, __ATOMIC_RELAXED);
+    stats->max_load_cycles = __atomic_load_n(&zstore_stats.max_load_cycles, __ATOMIC_RELAXED);
+    stats->stored_blobs = __atomic_load_n(&zstore_stats.stored_blobs, __ATOMIC_RELAXED);
+    stats->same_filled_entries = __atomic_load_n(&zstore_stats.same_filled_entries, __ATOMIC_RELAXED);
+    stats->compressed_bytes = __atomic_load_n(&zstore_stats.compressed_bytes, __ATOMIC_RELAXED);
+    stats->pool_pages = __atomic_load_n(&zstore_stats.pool_pages, __ATOMIC_RELAXED);
+}
+
+// set the counters back to zero (the ones of the pool aren't counters)
+void zstore_reset_stats(void)
+{
+    __atomic_store_n(&zstore_stats.pages_scanned, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.pages_aged, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.pages_stored, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.pages_same_filled, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.pages_rejected, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.pages_swapped, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.huge_pages_split, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.pages_loaded, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.load_cycles, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&zstore_stats.max_load_cycles, 0, __ATOMIC_RELAXED);
+}
+
+// print the counters, what the pool holds and how well it is compressed
+void zstore_dump_stats(void)
+{
+    zstore_stats_t stats;
+    zstore_get_stats(&stats);
+
+    // pages kept per 100 frames of the pool
+    uint64_t ratio = stats.pool_pages ? stats.stored_blobs * 100 / stats.pool_pages : 0;
+
+    log(INFO, "Compressed store: scanned=%llu aged=%llu huge_split=%llu stored=%llu same_filled=%llu "
+        "rejected=%llu swapped=%llu loaded=%llu avg_load_cycles=%llu max_load_cycles=%llu\n",
+        stats.pages_scanned, stats.pages_aged, stats.huge_pages_split, stats.pages_stored,
+        stats.pages_same_filled, stats.pages_rejected, stats.pages_swapped, stats.pages_loaded,
+        stats.pages_loaded ? stats.load_cycles / stats.pages_loaded : 0, stats.max_load_cycles);
+
+    log(INFO, "Compressed store pool: blobs=%llu (%llu KiB) same_filled=%llu pool=%llu KiB ratio=%llu.%.2llu\n",
+        stats.stored_blobs, stats.compressed_bytes / 1024, stats.same_filled_entries,
+        stats.pool_pages * (PAGE_SIZE / 1024), ratio / 100, ratio % 100);
+}
+
+/* utility functions */
+
+// pages which went into the store (or to the swap device) so far
+uint64_t zstore_get_evicted_count(void)
+{
+    return __atomic_load_n(&zstore_stats.pages_stored, __ATOMIC_RELAXED)
+           + __atomic_load_n(&zstore_stats.pages_same_filled, __ATOMIC_RELAXED)
+           + __atomic_load_n(&zstore_stats.pages_swapped, __ATOMIC_RELAXED);
+}
+
+// look at the pages of a locked space from start on, until budget pages were
+// looked at - returns how many were, next is where to continue (0 once the
+// space is done)
+size_t zstore_scan_space(vmm_space_t *space, uint64_t start, size_t budget, uint64_t *next)
+{
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    size_t scanned_count = 0;
+    *next = 0;
+
+    for (vmm_region_t *region = vmm_region_first(space); region && !*next; region = vmm_region_next(region))
+    {
+        if (region->end > start && zstore_region_allowed(space, region))
+        {
+            zstore_scan_region(&gather, region, start, budget, &scanned_count, next);
+        }
+    }
+
+    zstore_evict_batch(space);
+
+    // the accessed bits which were cleared
+    tlb_gather_finish(&gather);
+
+    return scanned_count;
+}
+
+// look at the pages of a region from start on - next is set once the budget is
+// used up
+void zstore_scan_region(tlb_gather_t *gather, vmm_region_t *region, uint64_t start, size_t budget,
+                        size_t *scanned_count, uint64_t *next)
+{
+    vmm_walker_t walker;
+    vmm_walk_entry_t leaf;
+
+    vmm_walk_init(&walker, gather->space, region->start > start ? region->start : start, region->end);
+
+    while (vmm_walk_next(&walker, &leaf))
+    {
+        // the 4 KiB pages of a split one are looked at next, they are cold too
+        if (leaf.size == LARGE_PAGE_SIZE && zstore_split_cold_huge_page(gather, &leaf))
+        {
+            vmm_walk_init(&walker, gather->space, leaf.virt, region->end);
+
+            continue;
+        }
+
+        // 1 GiB pages are never evicted, but count as looked at
+        if (leaf.size == PAGE_SIZE)
+        {
+            zstore_scan_page(gather, region, &leaf);
+        }
+
+        if (++*scanned_count == budget)
+        {
+            *next = leaf.virt + leaf.size;
+
+            return;
+        }
+    }
+}
+
+// give an accessed page another chance, add a cold one to the batch
+void zstore_scan_page(tlb_gather_t *gather, vmm_region_t *region, vmm_walk_entry_t *leaf)
+{
+    if (!zstore_page_candidate(leaf))
+    {
+        return;
+    }
+
+    if (*leaf->pte & PTE_ACCESSED)
+    {
+        // the CPU only sets the bit again once the TLB forgot the entry
+        uint64_t entry = __atomic_fetch_and(leaf->pte, ~(uint64_t)PTE_ACCESSED, __ATOMIC_RELAXED);
+        tlb_gather_add_page(gather, leaf->virt, entry);
+
+        __atomic_fetch_add(&zstore_stats.pages_aged, 1, __ATOMIC_RELAXED);
+
+        return;
+    }
+
+    batch.regions[batch.count] = region;
+    batch.virt_pages[batch.count] = leaf->virt;
+    batch.ptes[batch.count] = leaf->pte;
+    batch.count++;
+
+    if (batch.count == ZSTORE_EVICT_BATCH)
+    {
+        zstore_evict_batch(gather->space);
+    }
+}
+
+// give an accessed huge page another chance, split a cold one - returns whether
+// it was split
+bool zstore_split_cold_huge_page(tlb_gather_t *gather, vmm_walk_entry_t *leaf)
+{
+    if (!zstore_page_candidate(leaf))
+    {
+        return false;
+    }
+
+    if (*leaf->pte & PTE_ACCESSED)
+    {
+        uint64_t entry = __atomic_fetch_and(leaf->pte, ~(uint64_t)PTE_ACCESSED, __ATOMIC_RELAXED);
+        tlb_gather_add_page(gather, leaf->virt, entry);
+
+        __atomic_fetch_add(&zstore_stats.pages_aged, 1, __ATOMIC_RELAXED);
+
+        return false;
+    }
+
+    // the pages get the flags of the huge page, so they aren't accessed either
+    thp_split(gather->space, leaf->virt);
+
+    __atomic_fetch_add(&zstore_stats.huge_pages_split, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// only anonymous write-back memory of user spaces is evicted
+bool zstore_region_allowed(vmm_space_t *space, vmm_region_t *region)
+{
+    return space != vmm_get_kernel_space() && region->type == VMM_REGION_ANONYMOUS
+           && region->pat_type == PAT_WRITE_BACK;
+}
+
+// only private frames are evicted - shared ones (copy-on-write, merged or zero
+// pages) wouldn't free anything
+bool zstore_page_candidate(vmm_walk_entry_t *leaf)
+{
+    if ((*leaf->pte & (PTE_COW | PTE_KSM)) || zero_page_contains(leaf->phys))
+    {
+        return false;
+    }
+
+    return pmm_get_ref_count((void *)leaf->phys) == 1;
+}
+
+// write-protect the pages of the batch (one flush for all of them), so their
+// contents can't change meanwhile, then put them into the store or write them
+// to the swap device - a page which can't be evicted gets its rights back
+// (which needs no flush)
+void zstore_evict_batch(vmm_space_t *space)
+{
+    if (batch.count == 0)
+    {
+        return;
+    }
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    for (size_t i = 0; i < batch.count; i++)
+    {
+        uint64_t entry = *batch.ptes[i];
+
+        batch.writable[i] = entry & PTE_READ_WRITE;
+
+        if (batch.writable[i])
+        {
+            *batch.ptes[i] = entry & ~(uint64_t)PTE_READ_WRITE;
+            tlb_gather_add_page(&gather, batch.virt_pages[i], entry);
+        }
+    }
+
+    tlb_gather_finish(&gather);
+    tlb_gather_init(&gather, space);
+
+    for (size_t i = 0; i < batch.count; i++)
+    {
+        uint64_t entry = *batch.ptes[i];
+        uint64_t frame = entry & PTE_ADDRESS_MASK;
+        uint64_t swap_entry = zstore_store(frame);
+
+        if (!swap_entry && swap_available())
+        {
+            batch.swap_indices[batch.swap_count] = i;
+            batch.swap_tags[batch.swap_count] = batch.regions[i]->tag;
+            batch.swap_frames[batch.swap_count++] = frame;
+
+            continue;
+        }
+
+        if (!swap_entry)
+        {
+            *batch.ptes[i] = entry | (batch.writable[i] ? PTE_READ_WRITE : 0);
+
+            continue;
+        }
+
+        page_fault_account_unmap(entry);
+
+        // still counted by the page table, see vmm_set_pt_value()
+        *batch.ptes[i] = swap_entry;
+        tlb_gather_add_page(&gather, batch.virt_pages[i], entry);
+        tlb_gather_free_frames(&gather, (void *)frame, 1, batch.regions[i]->tag);
+    }
+
+    zstore_swap_out_batch(&gather);
+    tlb_gather_finish(&gather);
+
+    batch.count = 0;
+    batch.swap_count = 0;
+}
+
+// write the pages of the batch the store didn't take to the swap device (as
+// few sequential writes as possible) and point their entries to the slots -
+// a page which didn't fit gets its rights back; the swap cache keeps the
+// written frames, the references of the mappings are dropped after the flush
+void zstore_swap_out_batch(tlb_gather_t *gather)
+{
+    size_t written_count = 0;
+
+    if (batch.swap_count)
+    {
+        written_count = swap_out(batch.swap_frames, batch.swap_tags, batch.swap_count, batch.swap_entries);
+    }
+
+    for (size_t i = 0; i < batch.swap_count; i++)
+    {
+        size_t index = batch.swap_indices[i];
+        uint64_t entry = *batch.ptes[index];
+
+        if (i >= written_count)
+        {
+            *batch.ptes[index] = entry | (batch.writable[index] ? PTE_READ_WRITE : 0);
+
+            continue;
+        }
+
+        page_fault_account_unmap(entry);
+
+        *batch.ptes[index] = batch.swap_entries[i];
+        tlb_gather_add_page(gather, batch.virt_pages[index], entry);
+        tlb_gather_free_frames(gather, (void *)batch.swap_frames[i], 1, batch.swap_tags[i]);
+    }
+
+    __atomic_fetch_add(&zstore_stats.pages_swapped, written_count, __ATOMIC_RELAXED);
+}
+
+// put the contents of a frame into the store - returns the entry which replaces
+// its mapping, or 0 if it doesn't compress well enough (or the pool can't grow)
+uint64_t zstore_store(uint64_t frame)
+{
+    const void *page = (const void *)PHYS_TO_HIGHER_HALF_DATA(frame);
+    uint32_t pattern;
+
+    if (zstore_same_filled(page, &pattern))
+    {
+        __atomic_fetch_add(&zstore_stats.pages_same_filled, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&zstore_stats.same_filled_entries, 1, __ATOMIC_RELAXED);
+
+        return ((uint64_t)pattern << ZSTORE_SAME_SHIFT) | ZSTORE_ENTRY_SAME;
+    }
+
+    if (__atomic_load_n(&zstore_stats.pool_pages, __ATOMIC_RELAXED)
+            >= __atomic_load_n(&pool_limit, __ATOMIC_RELAXED))
+    {
+        __atomic_fetch_add(&zstore_stats.pages_rejected, 1, __ATOMIC_RELAXED);
+
+        return 0;
+    }
+
+    size_t size = lz4_compress(page, PAGE_SIZE, compress_buffer, ZSTORE_MAX_BLOB_SIZE - sizeof(zstore_blob_t),
+                               compress_workspace);
+    zstore_blob_t *blob = size ? zstore_alloc_blob(sizeof(zstore_blob_t) + size) : NULL;
+
+    if (!blob)
+    {
+        __atomic_fetch_add(&zstore_stats.pages_rejected, 1, __ATOMIC_RELAXED);
+
+        return 0;
+    }
+
+    blob->ref_count = 1;
+    blob->size = (uint16_t)size;
+    memcpy(blob->data, compress_buffer, size);
+
+    __atomic_fetch_add(&zstore_stats.pages_stored, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zstore_stats.stored_blobs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zstore_stats.compressed_bytes, sizeof(zstore_blob_t) + size, __ATOMIC_RELAXED);
+
+    return HIGHER_HALF_DATA_TO_PHYS((uint64_t)blob) | ZSTORE_ENTRY_BLOB;
+}
+
+// write the contents an entry stands for into a page
+void zstore_load(uint64_t entry, void *page)
+{
+    if (entry & ZSTORE_ENTRY_SAME)
+    {
+        uint64_t *words = page;
+        uint64_t pattern = entry >> ZSTORE_SAME_SHIFT;
+
+        pattern |= pattern << 32;
+
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        {
+            words[i] = pattern;
+        }
+
+        return;
+    }
+
+    zstore_blob_t *blob = zstore_entry_to_blob(entry);
+    size_t size = lz4_decompress(blob->data, blob->size, page, PAGE_SIZE);
+
+    assert(size == PAGE_SIZE);
+}
+
+// whether a page consists of one repeated 32 bit pattern
+bool zstore_same_filled(const void *page, uint32_t *pattern)
+{
+    const uint64_t *words = page;
+    uint64_t first = words[0];
+
+    if ((uint32_t)first != (uint32_t)(first >> 32))
+    {
+        return false;
+    }
+
+    for (size_t i = 1; i < PAGE_SIZE / sizeof(uint64_t); i++)
+    {
+        if (words[i] != first)
+        {
+            return false;
+        }
+    }
+
+    *pattern = (uint32_t)first;
+
+    return true;
+}
+
+// the blob an entry of a swapped out page points to
+zstore_blob_t *zstore_entry_to_blob(uint64_t entry)
+{
+    assert(entry & ZSTORE_ENTRY_BLOB);
+
+    return (zstore_blob_t *)PHYS_TO_HIGHER_HALF_DATA(entry & ZSTORE_BLOB_ADDRESS_MASK);
+}
+
+// take a slot of the class which fits size bytes - NULL if the pool can't grow
+zstore_blob_t *zstore_alloc_blob(size_t size)
+{
+    size_t class_index = (size - 1) / ZSTORE_CLASS_SIZE;
+    zstore_class_t *class = &classes[class_index];
+
+    assert(class_index < ZSTORE_CLASS_COUNT);
+
+    spinlock_acquire(&pool_lock);
+
+    zstore_chunk_t *chunk = class->partial;
+
+    if (!chunk)
+    {
+        chunk = zstore_create_chunk(class_index);
+
+        if (!chunk)
+        {
+            spinlock_release(&pool_lock);
+
+            return NULL;
+        }
+
+        zstore_link_chunk(class, chunk);
+    }
+
+    void **slot = chunk->free_slots;
+
+    chunk->free_slots = *slot;
+    chunk->used_count++;
+
+    // a full chunk leaves the list until one of its slots is freed
+    if (!chunk->free_slots)
+    {
+        zstore_unlink_chunk(class, chunk);
+    }
+
+    spinlock_release(&pool_lock);
+
+    zstore_blob_t *blob = (zstore_blob_t *)slot;
+    blob->chunk = chunk;
+
+    return blob;
+}
+
+// give a slot back to its chunk - an empty chunk goes back to the PMM
+void zstore_free_blob(zstore_blob_t *blob)
+{
+    zstore_chunk_t *chunk = blob->chunk;
+    zstore_class_t *class = &classes[chunk->class_index];
+    void **slot = (void **)blob;
+
+    spinlock_acquire(&pool_lock);
+
+    if (!chunk->free_slots)
+    {
+        zstore_link_chunk(class, chunk);
+    }
+
+    *slot = chunk->free_slots;
+    chunk->free_slots = slot;
+    chunk->used_count--;
+
+    if (chunk->used_count == 0)
+    {
+        zstore_unlink_chunk(class, chunk);
+
+        pmm_free((void *)HIGHER_HALF_DATA_TO_PHYS((uint64_t)chunk->base), class->chunk_pages, MEM_TAG_ZSTORE);
+        slab_cache_free(chunk_cache, chunk, 0);
+
+        __atomic_fetch_sub(&zstore_stats.pool_pages, class->chunk_pages, __ATOMIC_RELAXED);
+    }
+
+    spinlock_release(&pool_lock);
+}
+
+// allocate the frames of a chunk and link all of its slots - NULL if out of memory
+zstore_chunk_t *zstore_create_chunk(size_t class_index)
+{
+    zstore_class_t *class = &classes[class_index];
+    void *frames = pmm_alloc(class->chunk_pages, MEM_TAG_ZSTORE);
+
+    if (!frames)
+    {
+        return NULL;
+    }
+
+    zstore_chunk_t *chunk = slab_cache_alloc(chunk_cache, 0);
+
+    if (!chunk)
+    {
+        pmm_free(frames, class->chunk_pages, MEM_TAG_ZSTORE);
+
+        return NULL;
+    }
+
+    chunk->base = (uint8_t *)PHYS_TO_HIGHER_HALF_DATA((uint64_t)frames);
+    chunk->free_slots = NULL;
+    chunk->used_count = 0;
+    chunk->class_index = (uint8_t)class_index;
+
+    // backwards, so that the first slot is handed out first
+    for (size_t i = class->slot_count; i-- > 0;)
+    {
+        void **slot = (void **)(chunk->base + i * class->slot_size);
+
+        *slot = chunk->free_slots;
+        chunk->free_slots = slot;
+    }
+
+    __atomic_fetch_add(&zstore_stats.pool_pages, class->chunk_pages, __ATOMIC_RELAXED);
+
+    return chunk;
+}
+
+// add a chunk to the front of the list of its class
+void zstore_link_chunk(zstore_class_t *class, zstore_chunk_t *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = class->partial;
+
+    if (class->partial)
+    {
+        class->partial->prev = chunk;
+    }
+
+    class->partial = chunk;
+}
+
+// remove a chunk from the list of its class
+void zstore_unlink_chunk(zstore_class_t *class, zstore_chunk_t *chunk)
+{
+    if (chunk->prev)
+    {
+        chunk->prev->next = chunk->next;
+    }
+    else
+    {
+        class->partial = chunk->next;
+    }
+
+    if (chunk->next)
+    {
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+// add the latency of a page that was faulted back in
+void zstore_account_load(uint64_t cycles)
+{
+    __atomic_fetch_add(&zstore_stats.load_cycles, cycles, __ATOMIC_RELAXED);
+
+    uint64_t max_cycles = __atomic_load_n(&zstore_stats.max_load_cycles, __ATOMIC_RELAXED);
+
+    while (cycles > max_cycles
+            && !__atomic_compare_exchange_n(&zstore_stats.max_load_cycles, &max_cycles, cycles, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+// idle work of an AP: evict a batch - the next one follows as long as memory
+// is short and pages still get evicted or aged, otherwise the next allocation
+// below the low watermark kicks it again
+void zstore_worker(void *argument)
+{
+    (void)argument;
+
+    uint64_t aged_before = __atomic_load_n(&zstore_stats.pages_aged, __ATOMIC_RELAXED);
+    size_t evicted_count = 0;
+
+    if (__atomic_load_n(&zstore_enabled, __ATOMIC_RELAXED)
+            && pmm_get_free_page_count() < __atomic_load_n(&high_watermark, __ATOMIC_RELAXED))
+    {
+        // cached swap pages nobody maps cost no IO to free
+        evicted_count = swap_cache_shrink(ZSTORE_RECLAIM_BATCH);
+
+        if (evicted_count == 0)
+        {
+            evicted_count = zstore_reclaim(ZSTORE_RECLAIM_BATCH);
+        }
+    }
+
+    bool progress = evicted_count > 0 || __atomic_load_n(&zstore_stats.pages_aged, __ATOMIC_RELAXED) != aged_before;
+
+    if (progress && __atomic_load_n(&zstore_enabled, __ATOMIC_RELAXED)
+            && pmm_get_free_page_count() < __atomic_load_n(&high_watermark, __ATOMIC_RELAXED))
+    {
+        smp_kick_idle_work(reclaim_work);
+
+        return;
+    }
+
+    __atomic_store_n(&reclaim_kicked, false, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,88 @@
+/*
+	This file is part of a modern x86_64 UNIX-like microkernel-based
+	operating system which is called apoptOS
+	Everything is openly developed on GitHub: https://github.com/Tix3Dev/apoptOS
+
+	Copyright (C) 2022  Yves Vollmeier <https://github.com/Tix3Dev>
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ZSTORE_H
+#define ZSTORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory/mem.h>
+#include <memory/virtual/region.h>
+#include <memory/virtual/tlb.h>
+#include <memory/virtual/vmm.h>
+
+// a page table entry which is neither present nor empty holds a swapped out page
+#define ZSTORE_ENTRY_SAME	    (1 << 1)	// same-filled, the 32 bit pattern is in the upper half
+#define ZSTORE_ENTRY_BLOB	    (1 << 2)	// compressed, the rest is the physical address of the blob
+#define ZSTORE_ENTRY_SWAP	    (1 << 3)	// on the swap device, the rest is the slot (see swap.c)
+#define ZSTORE_SAME_SHIFT	    32
+#define ZSTORE_BLOB_ADDRESS_MASK    0x000FFFFFFFFFFFC0UL
+
+#define ZSTORE_CLASS_SIZE	    64			// blob sizes are rounded up to this
+#define ZSTORE_MAX_BLOB_SIZE	    (PAGE_SIZE * 3 / 4)	// less compressible pages stay in memory
+#define ZSTORE_CLASS_COUNT	    (ZSTORE_MAX_BLOB_SIZE / ZSTORE_CLASS_SIZE)
+#define ZSTORE_MAX_CHUNK_PAGES	    4			// contiguous frames one chunk of slots takes at most
+
+#define ZSTORE_DEFAULT_LOW_WATERMARK	4096	// free frames below which the worker starts evicting
+#define ZSTORE_DEFAULT_HIGH_WATERMARK	8192	// and above which it stops again
+#define ZSTORE_RECLAIM_BATCH		256	// pages one run of the worker looks at
+#define ZSTORE_DEFAULT_POOL_LIMIT	16384	// frames of the pool, further pages go to the swap device
+
+typedef struct
+{
+    uint64_t pages_scanned;
+    uint64_t pages_aged;	// accessed since the last look, so they got another chance
+    uint64_t huge_pages_split;	// cold 2 MiB pages split to evict their 4 KiB pages
+    uint64_t pages_stored;	// compressed into the pool
+    uint64_t pages_same_filled;	// only kept in their page table entry
+    uint64_t pages_rejected;	// not compressible below ZSTORE_MAX_BLOB_SIZE, or the pool was full
+    uint64_t pages_swapped;	// rejected ones written to the swap device instead
+    uint64_t pages_loaded;	// faulted back in
+    uint64_t load_cycles;	// spent faulting them in (allocation and mapping included)
+    uint64_t max_load_cycles;
+    uint64_t stored_blobs;	// in the pool right now
+    uint64_t same_filled_entries; // right now
+    uint64_t compressed_bytes;	// of the blobs right now, headers included
+    uint64_t pool_pages;	// frames of the pool right now
+} zstore_stats_t;
+
+// whether a page table entry holds a swapped out page
+static inline bool zstore_is_entry(uint64_t entry)
+{
+    return entry && !(entry & PTE_PRESENT);
+}
+
+void zstore_init(void);
+void zstore_set_enabled(bool enabled);
+void zstore_set_watermarks(size_t low_pages, size_t high_pages);
+void zstore_set_pool_limit(size_t page_count);
+void zstore_note_alloc(void);
+size_t zstore_reclaim(size_t page_count);
+size_t zstore_reclaim_space(vmm_space_t *space);
+bool zstore_fault_in(tlb_gather_t *gather, vmm_region_t *region, uint64_t virt_page, uint64_t *pte,
+                     bool zero_page);
+void zstore_ref_entry(uint64_t entry);
+void zstore_free_entry(uint64_t entry);
+void zstore_get_stats(zstore_stats_t *stats);
+void zstore_reset_stats(void);
+void zstore_dump_stats(void);
+
+#endif
@@ -19,7 +19,14 @@
 /*
 
     Brief file description:
-    blah
+    Bring up all CPUs and set up their CPU local structures. The GS base of every
+    CPU points to its own structure (see this_cpu()).
+    Once initialized, the APs idle and wait for work: smp_call() hands a function
+    to a CPU and wakes it with an IPI, smp_call_wait() waits until it returned.
+    Background work without a deadline (e.g. collapsing huge pages) is added
+    with smp_add_idle_work() and runs on the last AP whenever
+    smp_kick_idle_work() woke it and no call is pending - there is no
+    scheduler to run it instead.
 
 */
 
@@ -43,28 +50,48 @@
 #include <proc/smp/smp.h>
 #include <tables/gdt.h>
 #include <tables/idt.h>
+#include <tables/isr.h>
 
 static spinlock_t smp_lock;
 
-cpu_local_t *cpu_locals;
-static uint32_t cpus_online = 0;
+// used by this_cpu() until smp_init() set up the real CPU local structures
+static cpu_local_t bsp_early_cpu_local = { 0 };
+
+cpu_local_t *cpu_locals = &bsp_early_cpu_local;
+static uint64_t cpu_count = 1;
+static volatile uint32_t cpus_online = 0;
+
+static smp_call_function_t idle_works[SMP_IDLE_WORK_MAX];
+static size_t idle_work_count = 0;
+static uint64_t idle_work_pending = 0;		// bit n = idle_works[n] was kicked
+static uint64_t idle_work_cpu = SMP_NO_CPU;	// the AP that came online last
 
 /* utility function prototypes */
 
 static void bsp_init(struct stivale2_smp_info *smp_entry);
 static void ap_init(struct stivale2_smp_info *smp_entry);
 static void generic_cpu_local_init(struct stivale2_smp_info *smp_entry);
+static void ap_idle(void);
 
 /* core functions */
 
+// point the GS base of the BSP to a placeholder, so that this_cpu() works before smp_init()
+void smp_early_init(void)
+{
+    asm_wrmsr(MSR_GS_BASE, (uintptr_t)&bsp_early_cpu_local);
+}
+
 void smp_init(struct stivale2_struct *stivale2_struct)
 {
     struct stivale2_struct_tag_smp *smp_tag = stivale2_get_tag(stivale2_struct,
             STIVALE2_STRUCT_TAG_SMP_ID);
 
     log(INFO, "Total CPU count: %d\n", smp_tag->cpu_count);
+    assert(smp_tag->cpu_count <= SMP_MAX_CPU_COUNT);
 
-    cpu_locals = malloc(smp_tag->cpu_count * sizeof(cpu_local_t));
+    cpu_locals = malloc_flags(smp_tag->cpu_count * sizeof(cpu_local_t),
+                              MALLOC_ZERO | MALLOC_CACHE_ALIGN | MALLOC_TAG(MEM_TAG_KERNEL));
+    cpu_count = smp_tag->cpu_count;
 
     for (uint64_t i = 0; i < smp_tag->cpu_count; i++)
     {
@@ -72,7 +99,7 @@ void smp_init(struct stivale2_struct *stivale2_struct)
 
         smp_tag->smp_info[i].extra_argument = i;
 
-        uint64_t stack = (uintptr_t)pmm_allocz(CPU_LOCALS_STACK_SIZE / PAGE_SIZE);
+        uint64_t stack = (uintptr_t)pmm_allocz(CPU_LOCALS_STACK_SIZE / PAGE_SIZE, MEM_TAG_STACK);
         assert(stack != 0);
         stack = PHYS_TO_HIGHER_HALF_DATA(stack + CPU_LOCALS_STACK_SIZE);
 
@@ -81,17 +108,21 @@ void smp_init(struct stivale2_struct *stivale2_struct)
         if (smp_tag->smp_info[i].lapic_id == smp_tag->bsp_lapic_id)
         {
             bsp_init((void *)&smp_tag->smp_info[i]);
-
-            spinlock_release(&smp_lock);
-
-            continue;
         }
 
-        smp_tag->smp_info[i].goto_address = (uint64_t)ap_init;
-
         spinlock_release(&smp_lock);
     }
 
+    // only start the APs now - before bsp_init() the BSP used the placeholder's
+    // CPU number 0, and per-CPU data (e.g. slab CPU caches) can't be shared
+    for (uint64_t i = 0; i < smp_tag->cpu_count; i++)
+    {
+        if (smp_tag->smp_info[i].lapic_id != smp_tag->bsp_lapic_id)
+        {
+            __atomic_store_n(&smp_tag->smp_info[i].goto_address, (uint64_t)ap_init, __ATOMIC_RELEASE);
+        }
+    }
+
     while (cpus_online != smp_tag->cpu_count)
     {
         asm volatile("pause");
@@ -100,31 +131,132 @@ void smp_init(struct stivale2_struct *stivale2_struct)
     log(INFO, "SMP initialized - All CPU's initialized\n");
 }
 
+// return how many CPUs there are (1 before smp_init())
+uint64_t smp_get_cpu_count(void)
+{
+    return cpu_count;
+}
+
+// let another CPU run function(argument) - returns as soon as the CPU was woken up,
+// a call to the calling CPU itself runs the function directly
+void smp_call(uint64_t cpu_number, smp_call_function_t function, void *argument)
+{
+    cpu_local_t *cpu = &cpu_locals[cpu_number];
+
+    if (cpu == this_cpu())
+    {
+        function(argument);
+
+        return;
+    }
+
+    // only one call can be pending per CPU
+    smp_call_wait(cpu_number);
+
+    cpu->call_argument = argument;
+    __atomic_store_n(&cpu->call_function, function, __ATOMIC_RELEASE);
+
+    lapic_send_ipi(cpu->lapic_id, IPI_CALL_INT);
+}
+
+// add a function which an idle AP runs after smp_kick_idle_work() - returns
+// the number to kick it with
+size_t smp_add_idle_work(smp_call_function_t function)
+{
+    spinlock_acquire(&smp_lock);
+
+    assert(idle_work_count < SMP_IDLE_WORK_MAX);
+
+    size_t work = idle_work_count;
+    idle_works[work] = function;
+
+    __atomic_store_n(&idle_work_count, work + 1, __ATOMIC_RELEASE);
+
+    spinlock_release(&smp_lock);
+
+    return work;
+}
+
+// let an idle work run once more - a kick while it runs makes it run again
+// afterwards, without an AP it never runs
+void smp_kick_idle_work(size_t work)
+{
+    uint64_t cpu_number = __atomic_load_n(&idle_work_cpu, __ATOMIC_ACQUIRE);
+
+    if (cpu_number == SMP_NO_CPU || __atomic_fetch_or(&idle_work_pending, 1UL << work, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    lapic_send_ipi(cpu_locals[cpu_number].lapic_id, IPI_CALL_INT);
+}
+
+// whether the calling CPU should stop a long idle work soon - a call or
+// another idle work is waiting
+bool smp_work_pending(void)
+{
+    return __atomic_load_n(&this_cpu()->call_function, __ATOMIC_ACQUIRE)
+           || __atomic_load_n(&idle_work_pending, __ATOMIC_ACQUIRE);
+}
+
+// wait until the function passed to a CPU through smp_call() returned
+void smp_call_wait(uint64_t cpu_number)
+{
+    while (__atomic_load_n(&cpu_locals[cpu_number].call_function, __ATOMIC_ACQUIRE))
+    {
+        asm volatile("pause");
+    }
+}
+
 /* utility functions */
 
 static void bsp_init(struct stivale2_smp_info *smp_entry)
 {
     generic_cpu_local_init(smp_entry);
 
+    // keep what was accounted before the real CPU local structure existed
+    for (size_t i = 0; i < MEM_TAG_COUNT; i++)
+    {
+        cpu_locals[smp_entry->extra_argument].mem_tag_pages[i] += bsp_early_cpu_local.mem_tag_pages[i];
+    }
+
+    // the placeholder had CPU number 0, which might belong to an AP
+    vmm_space_t *space = bsp_early_cpu_local.space;
+    __atomic_fetch_and(&space->cpu_mask, ~1UL, __ATOMIC_SEQ_CST);
+    vmm_switch_space(space);
+
     log(INFO, "CPU No. %ld: BSP fully initialized\n", smp_entry->extra_argument);
     cpus_online++;
 }
 
 static void ap_init(struct stivale2_smp_info *smp_entry)
 {
-    spinlock_acquire(&smp_lock);
+    // not spinlock_acquire(), which handles shootdowns through this_cpu() - that
+    // doesn't work yet, and no shootdown is sent here before vmm_switch_space()
+    while (!spinlock_try_acquire(&smp_lock))
+    {
+        asm volatile("pause");
+    }
 
     enable_pat();
-    vmm_load_page_table(vmm_get_root_page_table());
+    vmm_load_page_table(vmm_get_kernel_space()->page_table);
     gdt_load();
     idt_load();
 
     generic_cpu_local_init(smp_entry);
 
+    // CR4 has to match the PCID setting before vmm_switch_space() writes CR3
+    vmm_init_cpu();
+
+    // only now this_cpu() works, CR3 was needed before to reach the heap
+    vmm_switch_space(vmm_get_kernel_space());
+
     lapic_enable();
     // (lapic_timer_init) TODO: waiting for tasking
 
     log(INFO, "CPU No. %ld: AP fully initialized\n", smp_entry->extra_argument);
+
+    __atomic_store_n(&idle_work_cpu, smp_entry->extra_argument, __ATOMIC_RELEASE);
     cpus_online++;
 
     spinlock_release(&smp_lock);
@@ -134,10 +266,7 @@ static void ap_init(struct stivale2_smp_info *smp_entry)
     // state from before locking will be retrieved after
     // releasing the lock
 
-    for (;;)
-    {
-        asm volatile("hlt");
-    }
+    ap_idle();
 }
 
 static void generic_cpu_local_init(struct stivale2_smp_info *smp_entry)
@@ -153,9 +282,60 @@ static void generic_cpu_local_init(struct stivale2_smp_info *smp_entry)
     tss_create_segment(&cpu_locals[cpu_num].tss);
     tss_load();
 
-    // (set gsbase) TODO: waiting for tasking
+    asm_wrmsr(MSR_GS_BASE, (uintptr_t)&cpu_locals[cpu_num]);
 
     enable_sse();
 
     // TODO: if necessary add xsave enable code here
 }
+
+// sleep until smp_call() hands over a function, run it, repeat - the idle
+// work runs when there is nothing else to do
+static void ap_idle(void)
+{
+    cpu_local_t *cpu = this_cpu();
+
+    for (;;)
+    {
+        // the check and hlt mustn't be interrupted in between, otherwise the
+        // wakeup IPI could arrive before hlt - sti only takes effect after hlt
+        asm volatile("cli");
+
+        smp_call_function_t function = __atomic_load_n(&cpu->call_function, __ATOMIC_ACQUIRE);
+
+        uint64_t works = 0;
+
+        if (!function && cpu->cpu_number == __atomic_load_n(&idle_work_cpu, __ATOMIC_ACQUIRE))
+        {
+            works = __atomic_exchange_n(&idle_work_pending, 0, __ATOMIC_ACQ_REL);
+        }
+
+        if (works)
+        {
+            asm volatile("sti");
+
+            for (size_t i = 0; i < __atomic_load_n(&idle_work_count, __ATOMIC_ACQUIRE); i++)
+            {
+                if (works & (1UL << i))
+                {
+                    idle_works[i](NULL);
+                }
+            }
+
+            continue;
+        }
+
+        if (!function)
+        {
+            asm volatile("sti; hlt");
+
+            continue;
+        }
+
+        asm volatile("sti");
+
+        function(cpu->call_argument);
+
+        __atomic_store_n(&cpu->call_function, NULL, __ATOMIC_RELEASE);
+    }
+}
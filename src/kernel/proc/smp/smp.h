@@ -19,6 +19,38 @@
 #ifndef SMP_H
 #define SMP_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/cpu.h>
+
+#define MSR_GS_BASE 0xC0000101
+
+#define SMP_MAX_CPU_COUNT 64 // CPU masks (e.g. vmm_space_t) are 64 bit
+#define SMP_NO_CPU	  ((uint64_t)-1)
+#define SMP_IDLE_WORK_MAX 8
+
+typedef void (*smp_call_function_t)(void *argument);
+
+extern cpu_local_t *cpu_locals;
+
+void smp_early_init(void);
 void smp_init(struct stivale2_struct *stivale2_struct);
+uint64_t smp_get_cpu_count(void);
+void smp_call(uint64_t cpu_number, smp_call_function_t function, void *argument);
+void smp_call_wait(uint64_t cpu_number);
+size_t smp_add_idle_work(smp_call_function_t function);
+void smp_kick_idle_work(size_t work);
+bool smp_work_pending(void);
+
+// get the CPU local structure of the calling CPU - GS base points to it
+static inline cpu_local_t *this_cpu(void)
+{
+    uint64_t cpu_number;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu_number));
+
+    return &cpu_locals[cpu_number];
+}
 
 #endif
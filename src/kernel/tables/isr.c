@@ -19,6 +19,8 @@
 #include <hardware/apic/apic.h>
 #include <libk/serial/debug.h>
 #include <libk/serial/log.h>
+#include <memory/virtual/fault.h>
+#include <memory/virtual/tlb.h>
 #include <tables/isr.h>
 
 static const char *exceptions[] =
@@ -94,14 +96,25 @@ uint64_t isr_handler(uint64_t rsp)
     // handle exceptions
     if (cpu->isr_number < 32)
     {
-        // check for specific IRQ, like page fault, where kernel wouldn't have
-        // to be halted - otherwise continue here:
+        // a page fault in a demand paged region is resolved and the faulting
+        // instruction runs again - otherwise continue here:
+        if (cpu->isr_number == PAGE_FAULT_INT && page_fault_handle(cpu))
+        {
+            return rsp;
+        }
 
         debug_set_color(TERM_RED);
         debug("\n────────────────────────\n");
         debug("⚠ EXCEPTION OCCURRED! ⚠\n\n");
         debug("⤷ ISR-No. %d: %s\n", cpu->isr_number, exceptions[cpu->isr_number]);
-        debug("⤷ Error code: 0x%.16llx\n\n\n", cpu->error_code);
+        debug("⤷ Error code: 0x%.16llx\n", cpu->error_code);
+
+        if (cpu->isr_number == PAGE_FAULT_INT)
+        {
+            debug("⤷ Faulting address: 0x%.16llx\n", asm_read_cr(2));
+        }
+
+        debug("\n\n");
         debug_set_color(TERM_CYAN);
         isr_register_dump(cpu);
 
@@ -148,6 +161,19 @@ uint64_t isr_handler(uint64_t rsp)
 
         debug_set_color(TERM_COLOR_RESET);
     }
+    // handle wakeup IPI's sent by smp_call() - the woken up CPU finds the
+    // function in its CPU local structure
+    else if (cpu->isr_number == IPI_CALL_INT)
+    {
+        lapic_signal_eoi();
+    }
+    // handle TLB shootdown IPI's sent by tlb_shootdown()
+    else if (cpu->isr_number == IPI_TLB_INT)
+    {
+        tlb_shootdown_handle();
+
+        lapic_signal_eoi();
+    }
     // handle spurious interrupts
     else if (cpu->isr_number == SPURIOUS_INT)
     {
@@ -21,8 +21,11 @@
 
 #include <stdint.h>
 
+#define PAGE_FAULT_INT	14
 #define LAPIC_TIMER_INT	32
 #define SYSCALL_INT	128
+#define IPI_CALL_INT	240
+#define IPI_TLB_INT	241
 #define SPURIOUS_INT	255
 
 #endif
@@ -65,6 +65,34 @@ static inline uint8_t asm_io_inb(uint16_t port)
     return ret;
 }
 
+// send a word to a IO port
+static inline void asm_io_outw(uint16_t port, uint16_t value)
+{
+    asm volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// get a word from a IO port
+static inline uint16_t asm_io_inw(uint16_t port)
+{
+    uint16_t ret;
+    asm volatile("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// send a double word to a IO port
+static inline void asm_io_outl(uint16_t port, uint32_t value)
+{
+    asm volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// get a double word from a IO port
+static inline uint32_t asm_io_inl(uint16_t port)
+{
+    uint32_t ret;
+    asm volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
 // wait for one IO cycle
 static inline void asm_io_wait(void)
 {
@@ -77,6 +105,21 @@ static inline void asm_invlpg(uint64_t *address)
     asm volatile("invlpg (%0)" : : "r" (address));
 }
 
+// write back and invalidate all caches
+static inline void asm_wbinvd(void)
+{
+    asm volatile("wbinvd" : : : "memory");
+}
+
+// read the time stamp counter
+static inline uint64_t asm_rdtsc(void)
+{
+    uint32_t low;
+    uint32_t high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 // get the state (sti=1 and cli=0) of the interrupt flag in rflags
 static inline bool asm_get_interrupt_flag() {
     uint64_t rflags = 0;